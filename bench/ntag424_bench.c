@@ -0,0 +1,262 @@
+// libntag424 benchmark. Runs one workload in a loop and reports ops/s and
+// host CPU time per operation:
+//
+//   auth           SELECT + AuthenticateEV2First
+//   file-settings  auth + GetFileSettings in secure messaging
+//   change-key     auth + ChangeKey of --change-keyno to the same key
+//   provision      UID, auth, ChangeKey, SDM ChangeFileSettings, NDEF write
+//                  and a plain GetFileSettings, like --provision --sdm-setup
+//
+// Linked against PC/SC (ntag424_bench) it talks to a real tag and --record
+// saves the exchanges; linked against pcsc_replay.c (ntag424_bench_replay)
+// it replays such a trace. RndA is pinned with ntag424_context_set_random so
+// a replayed run sends the same commands as the recorded one. The change-key and
+// provision workloads write to the tag; use a development tag.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntag424.h"
+
+static const uint8_t k_bench_rnda[16] = {0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+                                         0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF};
+#define BENCH_SDM_URL "https://example.com/tap"
+
+typedef struct {
+    uint8_t key[16];
+    uint8_t key_no;
+    uint8_t change_key[16];
+    uint8_t change_key_no;
+    uint8_t file_no;
+    unsigned long iterations;
+} bench_options_t;
+
+typedef int (*bench_fn)(ntag424_card_t *card, ntag424_session_t *sess, const bench_options_t *opt);
+
+static unsigned long g_apdus = 0;
+
+static void bench_observer(void *user, const uint8_t *apdu, size_t apdu_len, uint16_t sw, uint64_t elapsed_us) {
+    (void)user;
+    (void)apdu;
+    (void)apdu_len;
+    (void)sw;
+    (void)elapsed_us;
+    g_apdus++;
+}
+
+static void bench_rnda(void *user, uint8_t *buf, size_t len) {
+    (void)user;
+    memcpy(buf, k_bench_rnda, len < sizeof(k_bench_rnda) ? len : sizeof(k_bench_rnda));
+}
+
+static void bench_trace(void *user, const uint8_t *apdu, size_t apdu_len, const uint8_t *resp, size_t resp_len,
+                        uint64_t elapsed_us) {
+    FILE *f = (FILE *)user;
+    for (size_t i = 0; i < apdu_len; i++) fprintf(f, "%02X", apdu[i]);
+    fputc(' ', f);
+    if (resp_len == 0) fputc('-', f);
+    for (size_t i = 0; i < resp_len; i++) fprintf(f, "%02X", resp[i]);
+    fprintf(f, " %llu\n", (unsigned long long)elapsed_us);
+}
+
+static double clock_us(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int parse_hex_key(const char *hex, uint8_t key[16]) {
+    if (strlen(hex) != 32) return 0;
+    for (int i = 0; i < 16; i++) {
+        unsigned int val = 0;
+        if (sscanf(hex + (i * 2), "%2x", &val) != 1) return 0;
+        key[i] = (uint8_t)val;
+    }
+    return 1;
+}
+
+static int bench_auth(ntag424_card_t *card, ntag424_session_t *sess, const bench_options_t *opt) {
+    uint16_t sw = 0;
+    return ntag424_select_ndef_app(card, &sw) && ntag424_authenticate_ev2_first(card, sess, opt->key, opt->key_no);
+}
+
+static int bench_file_settings(ntag424_card_t *card, ntag424_session_t *sess, const bench_options_t *opt) {
+    uint8_t fs[64];
+    size_t fs_len = sizeof(fs);
+    uint16_t sw = 0;
+    return bench_auth(card, sess, opt) && ntag424_get_file_settings(card, sess, opt->file_no, fs, &fs_len, &sw);
+}
+
+static int bench_change_key(ntag424_card_t *card, ntag424_session_t *sess, const bench_options_t *opt) {
+    uint16_t sw = 0;
+    return bench_auth(card, sess, opt) &&
+           ntag424_change_key(card, sess, opt->change_key_no, opt->change_key, opt->change_key, 0x01, &sw);
+}
+
+static int bench_provision(ntag424_card_t *card, ntag424_session_t *sess, const bench_options_t *opt) {
+    uint8_t uid[16];
+    size_t uid_len = sizeof(uid);
+    uint16_t sw = 0;
+    if (!ntag424_get_uid(card, uid, &uid_len) || !bench_change_key(card, sess, opt)) return 0;
+
+    ntag424_sdm_template_t tpl;
+    ntag424_sdm_template_default(&tpl);
+    uint8_t ndef_buf[NTAG424_SDM_NDEF_MAX];
+    ntag424_sdm_ndef_t sdm;
+    if (!ntag424_sdm_build_ndef(BENCH_SDM_URL, &tpl, ndef_buf, sizeof(ndef_buf), &sdm)) return 0;
+
+    ntag424_sdm_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.file_no = opt->file_no;
+    cfg.comm_mode = 0x00;
+    cfg.ar1 = 0xE0;
+    cfg.ar2 = 0xEE;
+    cfg.sdm_options = 0xC1;
+    cfg.sdm_meta_read = 0x0E;
+    cfg.sdm_file_read = opt->change_key_no;
+    cfg.sdm_ctr_ret = opt->change_key_no;
+    cfg.uid_offset = sdm.uid_offset;
+    cfg.sdm_read_ctr_offset = sdm.ctr_offset;
+    cfg.picc_data_offset = sdm.picc_offset;
+    cfg.sdm_mac_input_offset = sdm.mac_input_offset;
+    cfg.sdm_mac_offset = sdm.mac_offset;
+    if (!ntag424_change_file_settings_sdm(card, sess, &cfg, &sw)) return 0;
+    if (!ntag424_write_ndef(card, sdm.ndef, sdm.ndef_len, &sw)) return 0;
+
+    uint8_t fs[64];
+    size_t fs_len = sizeof(fs);
+    return ntag424_get_file_settings(card, NULL, opt->file_no, fs, &fs_len, &sw);
+}
+
+static const struct {
+    const char *name;
+    bench_fn fn;
+} k_workloads[] = {
+    {"auth", bench_auth},
+    {"file-settings", bench_file_settings},
+    {"change-key", bench_change_key},
+    {"provision", bench_provision},
+};
+
+int main(int argc, char **argv) {
+    bench_options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.change_key_no = 0x01;
+    opt.file_no = 0x02;
+    opt.iterations = 100;
+    int index = 0;
+    const char *record_path = NULL;
+    const char *workload = NULL;
+
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "--reader") == 0 && argi + 1 < argc) {
+            index = atoi(argv[++argi]);
+        } else if (strcmp(argv[argi], "--key") == 0 && argi + 1 < argc) {
+            if (!parse_hex_key(argv[++argi], opt.key)) {
+                fprintf(stderr, "--key expects 32 hex chars.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--key-no") == 0 && argi + 1 < argc) {
+            opt.key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--change-key") == 0 && argi + 1 < argc) {
+            if (!parse_hex_key(argv[++argi], opt.change_key)) {
+                fprintf(stderr, "--change-key expects 32 hex chars.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--change-keyno") == 0 && argi + 1 < argc) {
+            opt.change_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--iterations") == 0 && argi + 1 < argc) {
+            opt.iterations = strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--record") == 0 && argi + 1 < argc) {
+            record_path = argv[++argi];
+        } else if (argv[argi][0] != '-' && !workload) {
+            workload = argv[argi];
+        } else {
+            workload = NULL;
+            break;
+        }
+    }
+
+    bench_fn fn = NULL;
+    for (size_t i = 0; workload && i < sizeof(k_workloads) / sizeof(k_workloads[0]); i++) {
+        if (strcmp(k_workloads[i].name, workload) == 0) fn = k_workloads[i].fn;
+    }
+    if (!fn || opt.iterations == 0 || opt.change_key_no == opt.key_no) {
+        fprintf(stderr, "Usage: %s [--reader N] [--key HEX] [--key-no N] [--change-key HEX] [--change-keyno N] "
+                        "[--iterations N] [--record PATH] auth|file-settings|change-key|provision\n"
+                        "--change-keyno must differ from --key-no.\n", argv[0]);
+        return 2;
+    }
+
+    long rc = 0;
+    ntag424_context_t *ctx;
+    if (!ntag424_context_open(&ctx, &rc)) {
+        fprintf(stderr, "SCardEstablishContext failed: 0x%08lX\n", (unsigned long)rc);
+        return 1;
+    }
+    char *readers = NULL;
+    if (!ntag424_context_list_readers(ctx, &readers, &rc)) {
+        fprintf(stderr, "No PC/SC readers found.\n");
+        ntag424_context_close(ctx);
+        return 1;
+    }
+    const char *reader = readers;
+    for (int i = 0; i < index && *reader; i++) reader += strlen(reader) + 1;
+    if (!*reader) {
+        fprintf(stderr, "Reader index out of range.\n");
+        free(readers);
+        ntag424_context_close(ctx);
+        return 1;
+    }
+
+    FILE *trace = NULL;
+    if (record_path) {
+        trace = fopen(record_path, "w");
+        if (!trace) {
+            fprintf(stderr, "Failed to open trace file: %s\n", record_path);
+            free(readers);
+            ntag424_context_close(ctx);
+            return 1;
+        }
+        fprintf(trace, "# ntag424 APDU trace: C-APDU R-APDU elapsed_us (%s x %lu)\n", workload, opt.iterations);
+        ntag424_context_set_apdu_trace(ctx, bench_trace, trace);
+    }
+    ntag424_context_set_apdu_observer(ctx, bench_observer, NULL);
+    ntag424_context_set_random(ctx, bench_rnda, NULL);
+
+    ntag424_card_t *card;
+    ntag424_session_t *sess = ntag424_session_new();
+    if (!sess || !ntag424_card_connect(ctx, reader, &card, &rc)) {
+        fprintf(stderr, "SCardConnect failed: 0x%08lX\n", (unsigned long)rc);
+        ntag424_session_free(sess);
+        if (trace) fclose(trace);
+        free(readers);
+        ntag424_context_close(ctx);
+        return 1;
+    }
+
+    unsigned long failed = 0;
+    double wall0 = clock_us(CLOCK_MONOTONIC);
+    double cpu0 = clock_us(CLOCK_PROCESS_CPUTIME_ID);
+    for (unsigned long i = 0; i < opt.iterations; i++) {
+        if (!fn(card, sess, &opt)) failed++;
+        ntag424_session_clear(sess);
+    }
+    double wall = clock_us(CLOCK_MONOTONIC) - wall0;
+    double cpu = clock_us(CLOCK_PROCESS_CPUTIME_ID) - cpu0;
+
+    printf("%s: %lu iteration(s), %lu failed, %lu APDU(s)\n", workload, opt.iterations, failed, g_apdus);
+    printf("%s: %.1f ops/s, %.1f us wall/op, %.1f us CPU/op, %.2f us CPU/APDU\n", workload,
+           wall > 0 ? opt.iterations * 1e6 / wall : 0.0, wall / opt.iterations, cpu / opt.iterations,
+           g_apdus ? cpu / g_apdus : 0.0);
+
+    ntag424_card_disconnect(card);
+    ntag424_session_free(sess);
+    if (trace) fclose(trace);
+    free(readers);
+    ntag424_context_close(ctx);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,276 @@
+// PC/SC replay backend for benchmarks. Links in place of libpcsclite / the
+// PCSC framework and answers SCardTransmit from a trace recorded by
+// ntag424_bench --record, so library costs can be measured without a tag.
+//
+//   NTAG_REPLAY_TRACE=PATH         trace to replay (required)
+//   NTAG_REPLAY_LATENCY_US=N       injected RF latency per exchange, or
+//                                  "trace" for the recorded timings
+//
+// The trace is served in order and restarts at the top when exhausted. A
+// command that differs from the recorded one still gets the recorded
+// response; the count of such commands is printed on SCardReleaseContext.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#include <wintypes.h>
+#endif
+
+#define REPLAY_READER "NTAG424 Replay Reader 00 00"
+
+typedef struct {
+    uint8_t *apdu;
+    size_t apdu_len;
+    uint8_t *resp;  // NULL: the transfer failed when recorded
+    size_t resp_len;
+    unsigned long elapsed_us;
+} replay_entry_t;
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = {SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST)};
+const SCARD_IO_REQUEST g_rgSCardT1Pci = {SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST)};
+const SCARD_IO_REQUEST g_rgSCardRawPci = {SCARD_PROTOCOL_RAW, sizeof(SCARD_IO_REQUEST)};
+
+static pthread_mutex_t g_replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static replay_entry_t *g_replay = NULL;
+static size_t g_replay_count = 0;
+static size_t g_replay_pos = 0;
+static unsigned g_replay_refs = 0;
+static long g_replay_latency_us = 0;  // -1: recorded timings
+static unsigned long g_replay_exchanges = 0;
+static unsigned long g_replay_mismatches = 0;
+
+// Decodes a hex token into a malloc'd buffer.
+static int replay_hex(const char *hex, uint8_t **out, size_t *out_len) {
+    size_t len = strlen(hex);
+    if ((len % 2) != 0) return 0;
+    uint8_t *buf = (uint8_t *)malloc(len / 2 + 1);
+    if (!buf) return 0;
+    for (size_t i = 0; i < len / 2; i++) {
+        unsigned int v = 0;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+            sscanf(hex + 2 * i, "%2x", &v) != 1) {
+            free(buf);
+            return 0;
+        }
+        buf[i] = (uint8_t)v;
+    }
+    *out = buf;
+    *out_len = len / 2;
+    return 1;
+}
+
+static void replay_free(void) {
+    for (size_t i = 0; i < g_replay_count; i++) {
+        free(g_replay[i].apdu);
+        free(g_replay[i].resp);
+    }
+    free(g_replay);
+    g_replay = NULL;
+    g_replay_count = 0;
+}
+
+// Lines are "C-APDU R-APDU ELAPSED_US" in hex, R-APDU "-" for a failed
+// transfer; '#' starts a comment.
+static int replay_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char line[4096];
+    size_t cap = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        char apdu_hex[1024], resp_hex[2048];
+        unsigned long elapsed = 0;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "%1023s %2047s %lu", apdu_hex, resp_hex, &elapsed) != 3) {
+            ok = 0;
+            break;
+        }
+        if (g_replay_count == cap) {
+            cap = cap ? cap * 2 : 256;
+            replay_entry_t *entries = (replay_entry_t *)realloc(g_replay, cap * sizeof(*entries));
+            if (!entries) {
+                ok = 0;
+                break;
+            }
+            g_replay = entries;
+        }
+        replay_entry_t *e = &g_replay[g_replay_count];
+        memset(e, 0, sizeof(*e));
+        e->elapsed_us = elapsed;
+        ok = replay_hex(apdu_hex, &e->apdu, &e->apdu_len) &&
+             (strcmp(resp_hex, "-") == 0 || replay_hex(resp_hex, &e->resp, &e->resp_len));
+        if (ok) {
+            g_replay_count++;
+        } else {
+            free(e->apdu);
+        }
+    }
+    fclose(f);
+    if (!ok || g_replay_count == 0) {
+        replay_free();
+        return 0;
+    }
+    return 1;
+}
+
+static void replay_sleep_us(unsigned long us) {
+    struct timespec ts = {(time_t)(us / 1000000u), (long)(us % 1000000u) * 1000L};
+    nanosleep(&ts, NULL);
+}
+
+LONG SCardEstablishContext(DWORD scope, LPCVOID r1, LPCVOID r2, LPSCARDCONTEXT ctx) {
+    (void)scope;
+    (void)r1;
+    (void)r2;
+    LONG rc = SCARD_S_SUCCESS;
+    pthread_mutex_lock(&g_replay_lock);
+    if (g_replay_refs == 0) {
+        const char *path = getenv("NTAG_REPLAY_TRACE");
+        const char *latency = getenv("NTAG_REPLAY_LATENCY_US");
+        g_replay_latency_us = 0;
+        if (latency) g_replay_latency_us = strcmp(latency, "trace") == 0 ? -1 : strtol(latency, NULL, 0);
+        if (!path || !replay_load(path)) {
+            fprintf(stderr, "pcsc_replay: set NTAG_REPLAY_TRACE to a readable trace file\n");
+            rc = SCARD_E_NO_SERVICE;
+        }
+    }
+    if (rc == SCARD_S_SUCCESS) {
+        g_replay_refs++;
+        *ctx = (SCARDCONTEXT)g_replay_refs;
+    }
+    pthread_mutex_unlock(&g_replay_lock);
+    return rc;
+}
+
+LONG SCardReleaseContext(SCARDCONTEXT ctx) {
+    (void)ctx;
+    pthread_mutex_lock(&g_replay_lock);
+    if (g_replay_refs > 0 && --g_replay_refs == 0) {
+        if (g_replay_mismatches > 0) {
+            fprintf(stderr, "pcsc_replay: %lu of %lu command(s) differed from the trace\n",
+                    g_replay_mismatches, g_replay_exchanges);
+        }
+        replay_free();
+        g_replay_pos = 0;
+        g_replay_exchanges = 0;
+        g_replay_mismatches = 0;
+    }
+    pthread_mutex_unlock(&g_replay_lock);
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardListReaders(SCARDCONTEXT ctx, LPCSTR groups, LPSTR readers, LPDWORD len) {
+    (void)ctx;
+    (void)groups;
+    static const char list[] = REPLAY_READER "\0";
+    if (readers && *len < sizeof(list)) return SCARD_E_INSUFFICIENT_BUFFER;
+    if (readers) memcpy(readers, list, sizeof(list));
+    *len = sizeof(list);
+    return SCARD_S_SUCCESS;
+}
+
+// The replay card never leaves: the reader reports it present once and then
+// times out. The PnP pseudo reader is reported as unsupported.
+LONG SCardGetStatusChange(SCARDCONTEXT ctx, DWORD timeout, SCARD_READERSTATE *rs, DWORD n) {
+    (void)ctx;
+    int changed = 0;
+    for (DWORD i = 0; i < n; i++) {
+        DWORD state = strcmp(rs[i].szReader, REPLAY_READER) == 0 ? SCARD_STATE_PRESENT : SCARD_STATE_UNKNOWN;
+        if ((rs[i].dwCurrentState & ~SCARD_STATE_CHANGED) != state) {
+            rs[i].dwEventState = state | SCARD_STATE_CHANGED;
+            changed = 1;
+        } else {
+            rs[i].dwEventState = state;
+        }
+    }
+    if (changed) return SCARD_S_SUCCESS;
+    if (timeout != INFINITE) replay_sleep_us((unsigned long)timeout * 1000u);
+    return SCARD_E_TIMEOUT;
+}
+
+LONG SCardConnect(SCARDCONTEXT ctx, LPCSTR reader, DWORD share, DWORD protocols, LPSCARDHANDLE card,
+                  LPDWORD active_protocol) {
+    (void)ctx;
+    (void)share;
+    (void)protocols;
+    if (strcmp(reader, REPLAY_READER) != 0) return SCARD_E_UNKNOWN_READER;
+    *card = 1;
+    *active_protocol = SCARD_PROTOCOL_T1;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardDisconnect(SCARDHANDLE card, DWORD disposition) {
+    (void)card;
+    (void)disposition;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardStatus(SCARDHANDLE card, LPSTR reader, LPDWORD reader_len, LPDWORD state, LPDWORD protocol,
+                 LPBYTE atr, LPDWORD atr_len) {
+    (void)card;
+    static const uint8_t k_atr[] = {0x3B, 0x81, 0x80, 0x01, 0x80, 0x80};
+    if (reader && reader_len && *reader_len >= sizeof(REPLAY_READER)) memcpy(reader, REPLAY_READER, sizeof(REPLAY_READER));
+    if (reader_len) *reader_len = sizeof(REPLAY_READER);
+    if (state) *state = SCARD_STATE_PRESENT;
+    if (protocol) *protocol = SCARD_PROTOCOL_T1;
+    if (!atr_len || *atr_len < sizeof(k_atr)) return SCARD_E_INSUFFICIENT_BUFFER;
+    if (atr) memcpy(atr, k_atr, sizeof(k_atr));
+    *atr_len = sizeof(k_atr);
+    return SCARD_S_SUCCESS;
+}
+
+// No reader behind the trace: escapes and attributes are not available.
+LONG SCardControl(SCARDHANDLE card, DWORD code, LPCVOID in, DWORD in_len, LPVOID out, DWORD out_len,
+                  LPDWORD returned) {
+    (void)card;
+    (void)code;
+    (void)in;
+    (void)in_len;
+    (void)out;
+    (void)out_len;
+    if (returned) *returned = 0;
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardGetAttrib(SCARDHANDLE card, DWORD attr, LPBYTE buf, LPDWORD len) {
+    (void)card;
+    (void)attr;
+    (void)buf;
+    (void)len;
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardTransmit(SCARDHANDLE card, const SCARD_IO_REQUEST *send_pci, LPCBYTE apdu, DWORD apdu_len,
+                   SCARD_IO_REQUEST *recv_pci, LPBYTE resp, LPDWORD resp_len) {
+    (void)card;
+    (void)send_pci;
+    (void)recv_pci;
+    pthread_mutex_lock(&g_replay_lock);
+    if (!g_replay) {
+        pthread_mutex_unlock(&g_replay_lock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    const replay_entry_t *e = &g_replay[g_replay_pos];
+    g_replay_pos = (g_replay_pos + 1) % g_replay_count;
+    g_replay_exchanges++;
+    if (e->apdu_len != apdu_len || memcmp(e->apdu, apdu, apdu_len) != 0) g_replay_mismatches++;
+    unsigned long delay = g_replay_latency_us < 0 ? e->elapsed_us : (unsigned long)g_replay_latency_us;
+    pthread_mutex_unlock(&g_replay_lock);
+
+    if (delay > 0) replay_sleep_us(delay);
+    if (!e->resp) return SCARD_E_NOT_TRANSACTED;
+    if (*resp_len < e->resp_len) return SCARD_E_INSUFFICIENT_BUFFER;
+    memcpy(resp, e->resp, e->resp_len);
+    *resp_len = (DWORD)e->resp_len;
+    return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,4157 @@
+#include "ntag424.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Crypto backend, chosen at compile time:
+//   -DNTAG_CRYPTO_COMMONCRYPTO  CommonCrypto (default on macOS)
+//   -DNTAG_CRYPTO_OPENSSL       OpenSSL EVP, link with -lcrypto (default elsewhere)
+//   -DNTAG_CRYPTO_AESNI         x86 AES-NI instructions, build with -maes
+//   -DNTAG_CRYPTO_ARMCE         ARMv8 Crypto Extensions, build with -march=armv8-a+crypto
+#if !defined(NTAG_CRYPTO_COMMONCRYPTO) && !defined(NTAG_CRYPTO_OPENSSL) && \
+    !defined(NTAG_CRYPTO_AESNI) && !defined(NTAG_CRYPTO_ARMCE)
+#if defined(__APPLE__)
+#define NTAG_CRYPTO_COMMONCRYPTO
+#else
+#define NTAG_CRYPTO_OPENSSL
+#endif
+#endif
+
+#if defined(NTAG_CRYPTO_AESNI)
+#if !defined(__AES__)
+#error "NTAG_CRYPTO_AESNI requires AES-NI code generation (-maes)"
+#endif
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif defined(NTAG_CRYPTO_ARMCE)
+#if !defined(__ARM_FEATURE_CRYPTO) && !defined(__ARM_FEATURE_AES)
+#error "NTAG_CRYPTO_ARMCE requires ARMv8 Crypto Extensions (-march=armv8-a+crypto)"
+#endif
+#include <arm_neon.h>
+#elif defined(NTAG_CRYPTO_OPENSSL)
+#include <openssl/evp.h>
+#else
+#include <CommonCrypto/CommonCrypto.h>
+#endif
+
+#if defined(__APPLE__)
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#include <wintypes.h>
+#endif
+
+#define MAX_APDU 512
+#define AES_MB_LANES 8
+#define SHORT_APDU_MAX_LE 256
+#define SHORT_APDU_MAX_LC 255
+#define EXT_APDU_MAX_DATA 4096
+#define EXT_APDU_BUF (EXT_APDU_MAX_DATA + 9)
+
+// pcsc-lite keeps these in reader.h, which is not on every platform.
+#ifndef SCARD_CTL_CODE
+#define SCARD_CTL_CODE(code) (0x42000000 + (code))
+#endif
+#ifndef SCARD_ATTR_MAXINPUT
+#define SCARD_ATTR_MAXINPUT 0x0007A007
+#endif
+// CCID escape (IOCTL_SMARTCARD_VENDOR_IFD_EXCHANGE in the ccid driver).
+#define CCID_ESCAPE_IOCTL SCARD_CTL_CODE(1)
+
+// Expanded AES-128 key, owned by the selected backend.
+typedef struct {
+#if defined(NTAG_CRYPTO_AESNI)
+    __m128i rk_enc[11];
+    __m128i rk_dec[11];
+#elif defined(NTAG_CRYPTO_ARMCE)
+    uint8x16_t rk_enc[11];
+    uint8x16_t rk_dec[11];
+#elif defined(NTAG_CRYPTO_OPENSSL)
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+#else
+    CCCryptorRef enc;
+    CCCryptorRef dec;
+#endif
+} aes_key_t;
+
+typedef struct {
+    aes_key_t aes;
+    uint8_t k1[16];
+    uint8_t k2[16];
+} cmac_key_t;
+
+struct ntag424_session {
+    uint8_t kenc[16];
+    uint8_t kmac[16];
+    uint8_t ti[4];
+    uint16_t cmd_ctr;
+    uint8_t key_no;
+    int authenticated;
+    aes_key_t enc_key;   // kenc schedule, set up once per authentication
+    cmac_key_t mac_key;  // kmac schedule and CMAC subkeys
+};
+
+struct ntag424_context {
+    SCARDCONTEXT pcsc;
+    int no_pcsc;  // emulated cards only
+    ntag424_apdu_observer_fn observer;
+    void *observer_user;
+    ntag424_apdu_trace_fn trace;
+    void *trace_user;
+    ntag424_random_fn random;  // RndA source, ntag424_random_bytes when NULL
+    void *random_user;
+};
+
+struct ntag424_reader {
+    ntag424_context_t *ctx;
+    SCARD_READERSTATE rs;
+    char *name;
+    int card_seen;
+};
+
+struct ntag424_reader_monitor {
+    ntag424_context_t *ctx;
+    SCARD_READERSTATE pnp;
+    char *readers;  // last reported list, NULL when empty
+    int started;
+    int no_pnp;
+};
+
+// Largest READ BINARY / UPDATE BINARY payloads to use for the current tag,
+// from the CC file's MLe/MLc. Values above the short APDU limits are only
+// set with ext_ok and drop back to short APDUs if the reader rejects them.
+// inf_c / inf_d are the ISO 14443-4 I-block payloads towards the tag and
+// back, from the ATS; 0 until known.
+typedef struct {
+    size_t max_le;
+    size_t max_lc;
+    size_t inf_c;
+    size_t inf_d;
+} frame_limits_t;
+
+struct ntag424_card {
+    ntag424_context_t *ctx;
+    SCARDHANDLE handle;
+    SCARD_IO_REQUEST pio;
+    frame_limits_t lim;
+    int busy;            // an engine operation is in flight
+    ntag424_emu_t *emu;  // set for emulated cards, which bypass PC/SC
+};
+
+struct ntag424_sdm_verifier {
+    cmac_key_t file_key;
+    aes_key_t meta_key;
+    int has_meta_key;
+};
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static long transmit(ntag424_card_t *card, const uint8_t *apdu, size_t apdu_len,
+                     uint8_t *resp, size_t *resp_len, uint16_t *sw) {
+    ntag424_context_t *ctx = card->ctx;
+    DWORD rlen = (DWORD)*resp_len;
+    uint64_t t0 = (ctx->observer || ctx->trace) ? monotonic_us() : 0;
+    LONG rc;
+    if (card->emu) {
+        size_t elen = *resp_len;
+        rc = ntag424_emu_transmit(card->emu, apdu, apdu_len, resp, &elen) ? SCARD_S_SUCCESS : SCARD_E_NOT_TRANSACTED;
+        rlen = (DWORD)elen;
+    } else {
+        rc = SCardTransmit(card->handle, &card->pio, apdu, (DWORD)apdu_len, NULL, resp, &rlen);
+    }
+    if (ctx->observer || ctx->trace) {
+        uint64_t elapsed = monotonic_us() - t0;
+        if (ctx->observer) {
+            uint16_t obs_sw = (rc == SCARD_S_SUCCESS && rlen >= 2)
+                                  ? (uint16_t)((resp[rlen - 2] << 8) | resp[rlen - 1]) : 0;
+            ctx->observer(ctx->observer_user, apdu, apdu_len, obs_sw, elapsed);
+        }
+        if (ctx->trace) ctx->trace(ctx->trace_user, apdu, apdu_len, resp, rc == SCARD_S_SUCCESS ? rlen : 0, elapsed);
+    }
+    if (rc != SCARD_S_SUCCESS) return rc;
+    if (rlen < 2) return SCARD_E_PROTO_MISMATCH;
+    *sw = (uint16_t)((resp[rlen - 2] << 8) | resp[rlen - 1]);
+    *resp_len = rlen - 2;
+    return SCARD_S_SUCCESS;
+}
+
+long ntag424_transmit(ntag424_card_t *card, const uint8_t *apdu, size_t apdu_len,
+                      uint8_t *resp, size_t *resp_len, uint16_t *sw) {
+    return transmit(card, apdu, apdu_len, resp, resp_len, sw);
+}
+
+static int sw_ok(uint16_t sw) {
+    return sw == 0x9000 || sw == 0x9100;
+}
+
+static void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len) {
+    for (size_t i = 0; i < len; i++) out[i] = a[i] ^ b[i];
+}
+
+static void left_shift_1bit(uint8_t *out, const uint8_t *in) {
+    uint8_t carry = 0;
+    for (int i = 15; i >= 0; i--) {
+        uint8_t new_carry = (in[i] & 0x80) ? 1 : 0;
+        out[i] = (uint8_t)((in[i] << 1) | carry);
+        carry = new_carry;
+    }
+}
+
+// Crypto backend interface: aes_key_init/aes_key_free expand and release a
+// key schedule; aes_key_ecb_encrypt and aes_key_cbc run block operations on
+// it. Everything else (one-shot CBC, CMAC) is built on these four.
+#if defined(NTAG_CRYPTO_AESNI)
+
+#define AESNI_EXPAND(k, rcon) aesni_expand_step((k), _mm_aeskeygenassist_si128((k), (rcon)))
+
+static __m128i aesni_expand_step(__m128i key, __m128i gen) {
+    gen = _mm_shuffle_epi32(gen, 0xFF);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, gen);
+}
+
+static int aes_key_init(aes_key_t *k, const uint8_t key[16]) {
+    __m128i *rk = k->rk_enc;
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    rk[1] = AESNI_EXPAND(rk[0], 0x01);
+    rk[2] = AESNI_EXPAND(rk[1], 0x02);
+    rk[3] = AESNI_EXPAND(rk[2], 0x04);
+    rk[4] = AESNI_EXPAND(rk[3], 0x08);
+    rk[5] = AESNI_EXPAND(rk[4], 0x10);
+    rk[6] = AESNI_EXPAND(rk[5], 0x20);
+    rk[7] = AESNI_EXPAND(rk[6], 0x40);
+    rk[8] = AESNI_EXPAND(rk[7], 0x80);
+    rk[9] = AESNI_EXPAND(rk[8], 0x1B);
+    rk[10] = AESNI_EXPAND(rk[9], 0x36);
+    k->rk_dec[0] = rk[10];
+    for (int i = 1; i < 10; i++) k->rk_dec[i] = _mm_aesimc_si128(rk[10 - i]);
+    k->rk_dec[10] = rk[0];
+    return 1;
+}
+
+static void aes_key_free(aes_key_t *k) {
+    memset(k, 0, sizeof(*k));
+}
+
+static __m128i aesni_encrypt_block(const aes_key_t *k, __m128i b) {
+    b = _mm_xor_si128(b, k->rk_enc[0]);
+    for (int i = 1; i < 10; i++) b = _mm_aesenc_si128(b, k->rk_enc[i]);
+    return _mm_aesenclast_si128(b, k->rk_enc[10]);
+}
+
+static int aes_key_ecb_encrypt(aes_key_t *k, const uint8_t in[16], uint8_t out[16]) {
+    __m128i b = aesni_encrypt_block(k, _mm_loadu_si128((const __m128i *)in));
+    _mm_storeu_si128((__m128i *)out, b);
+    return 1;
+}
+
+static int aes_key_cbc(aes_key_t *k, int encrypt, const uint8_t iv[16],
+                       const uint8_t *in, size_t in_len, uint8_t *out) {
+    if ((in_len % 16) != 0) return 0;
+    __m128i chain = _mm_loadu_si128((const __m128i *)iv);
+    size_t n = in_len / 16;
+    size_t i = 0;
+    if (encrypt) {
+        for (; i < n; i++) {
+            __m128i b = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+            chain = aesni_encrypt_block(k, _mm_xor_si128(b, chain));
+            _mm_storeu_si128((__m128i *)(out + 16 * i), chain);
+        }
+        return 1;
+    }
+    // CBC decryption has no chaining dependency, so run four blocks at once.
+    const __m128i *dk = k->rk_dec;
+    for (; i + 4 <= n; i += 4) {
+        __m128i c0 = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        __m128i c1 = _mm_loadu_si128((const __m128i *)(in + 16 * (i + 1)));
+        __m128i c2 = _mm_loadu_si128((const __m128i *)(in + 16 * (i + 2)));
+        __m128i c3 = _mm_loadu_si128((const __m128i *)(in + 16 * (i + 3)));
+        __m128i b0 = _mm_xor_si128(c0, dk[0]);
+        __m128i b1 = _mm_xor_si128(c1, dk[0]);
+        __m128i b2 = _mm_xor_si128(c2, dk[0]);
+        __m128i b3 = _mm_xor_si128(c3, dk[0]);
+        for (int r = 1; r < 10; r++) {
+            b0 = _mm_aesdec_si128(b0, dk[r]);
+            b1 = _mm_aesdec_si128(b1, dk[r]);
+            b2 = _mm_aesdec_si128(b2, dk[r]);
+            b3 = _mm_aesdec_si128(b3, dk[r]);
+        }
+        b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, dk[10]), chain);
+        b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1, dk[10]), c0);
+        b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2, dk[10]), c1);
+        b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3, dk[10]), c2);
+        _mm_storeu_si128((__m128i *)(out + 16 * i), b0);
+        _mm_storeu_si128((__m128i *)(out + 16 * (i + 1)), b1);
+        _mm_storeu_si128((__m128i *)(out + 16 * (i + 2)), b2);
+        _mm_storeu_si128((__m128i *)(out + 16 * (i + 3)), b3);
+        chain = c3;
+    }
+    for (; i < n; i++) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        __m128i b = _mm_xor_si128(c, dk[0]);
+        for (int r = 1; r < 10; r++) b = _mm_aesdec_si128(b, dk[r]);
+        b = _mm_xor_si128(_mm_aesdeclast_si128(b, dk[10]), chain);
+        _mm_storeu_si128((__m128i *)(out + 16 * i), b);
+        chain = c;
+    }
+    return 1;
+}
+
+#elif defined(NTAG_CRYPTO_ARMCE)
+
+// SubWord via AESE: with all four columns equal, ShiftRows is a no-op and
+// AESE with a zero round key reduces to SubBytes.
+static uint32_t armce_sub_word(uint32_t w) {
+    uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(w));
+    v = vaeseq_u8(v, vdupq_n_u8(0));
+    return vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+}
+
+static void armce_expand_enc(aes_key_t *k, const uint8_t key[16]) {
+    static const uint8_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36};
+    uint32_t w[44];
+    for (int i = 0; i < 4; i++) {
+        w[i] = (uint32_t)key[4 * i] | ((uint32_t)key[4 * i + 1] << 8) |
+               ((uint32_t)key[4 * i + 2] << 16) | ((uint32_t)key[4 * i + 3] << 24);
+    }
+    for (int i = 4; i < 44; i++) {
+        uint32_t t = w[i - 1];
+        if ((i % 4) == 0) {
+            t = armce_sub_word((t >> 8) | (t << 24)) ^ rcon[i / 4 - 1];
+        }
+        w[i] = w[i - 4] ^ t;
+    }
+    for (int r = 0; r < 11; r++) {
+        k->rk_enc[r] = vreinterpretq_u8_u32(vld1q_u32(&w[4 * r]));
+    }
+    memset(w, 0, sizeof(w));
+}
+
+static int aes_key_init(aes_key_t *k, const uint8_t key[16]) {
+    armce_expand_enc(k, key);
+    k->rk_dec[0] = k->rk_enc[10];
+    for (int r = 1; r < 10; r++) k->rk_dec[r] = vaesimcq_u8(k->rk_enc[10 - r]);
+    k->rk_dec[10] = k->rk_enc[0];
+    return 1;
+}
+
+static void aes_key_free(aes_key_t *k) {
+    memset(k, 0, sizeof(*k));
+}
+
+static uint8x16_t armce_encrypt_block(const aes_key_t *k, uint8x16_t b) {
+    for (int r = 0; r < 9; r++) b = vaesmcq_u8(vaeseq_u8(b, k->rk_enc[r]));
+    b = vaeseq_u8(b, k->rk_enc[9]);
+    return veorq_u8(b, k->rk_enc[10]);
+}
+
+static uint8x16_t armce_decrypt_block(const aes_key_t *k, uint8x16_t b) {
+    for (int r = 0; r < 9; r++) b = vaesimcq_u8(vaesdq_u8(b, k->rk_dec[r]));
+    b = vaesdq_u8(b, k->rk_dec[9]);
+    return veorq_u8(b, k->rk_dec[10]);
+}
+
+static int aes_key_ecb_encrypt(aes_key_t *k, const uint8_t in[16], uint8_t out[16]) {
+    vst1q_u8(out, armce_encrypt_block(k, vld1q_u8(in)));
+    return 1;
+}
+
+static int aes_key_cbc(aes_key_t *k, int encrypt, const uint8_t iv[16],
+                       const uint8_t *in, size_t in_len, uint8_t *out) {
+    if ((in_len % 16) != 0) return 0;
+    uint8x16_t chain = vld1q_u8(iv);
+    for (size_t off = 0; off < in_len; off += 16) {
+        uint8x16_t b = vld1q_u8(in + off);
+        if (encrypt) {
+            chain = armce_encrypt_block(k, veorq_u8(b, chain));
+            vst1q_u8(out + off, chain);
+        } else {
+            vst1q_u8(out + off, veorq_u8(armce_decrypt_block(k, b), chain));
+            chain = b;
+        }
+    }
+    return 1;
+}
+
+#elif defined(NTAG_CRYPTO_OPENSSL)
+
+static int aes_key_init(aes_key_t *k, const uint8_t key[16]) {
+    static const uint8_t zero_iv[16] = {0};
+    memset(k, 0, sizeof(*k));
+    k->enc = EVP_CIPHER_CTX_new();
+    k->dec = EVP_CIPHER_CTX_new();
+    if (!k->enc || !k->dec ||
+        EVP_CipherInit_ex(k->enc, EVP_aes_128_cbc(), NULL, key, zero_iv, 1) != 1 ||
+        EVP_CipherInit_ex(k->dec, EVP_aes_128_cbc(), NULL, key, zero_iv, 0) != 1) {
+        EVP_CIPHER_CTX_free(k->enc);
+        EVP_CIPHER_CTX_free(k->dec);
+        memset(k, 0, sizeof(*k));
+        return 0;
+    }
+    EVP_CIPHER_CTX_set_padding(k->enc, 0);
+    EVP_CIPHER_CTX_set_padding(k->dec, 0);
+    return 1;
+}
+
+static void aes_key_free(aes_key_t *k) {
+    EVP_CIPHER_CTX_free(k->enc);
+    EVP_CIPHER_CTX_free(k->dec);
+    k->enc = NULL;
+    k->dec = NULL;
+}
+
+static int aes_key_cbc(aes_key_t *k, int encrypt, const uint8_t iv[16],
+                       const uint8_t *in, size_t in_len, uint8_t *out) {
+    EVP_CIPHER_CTX *c = encrypt ? k->enc : k->dec;
+    if (!c || (in_len % 16) != 0 || in_len > 0x7FFFFFFF) return 0;
+    // A NULL cipher and key keeps the expanded schedule and only resets the IV.
+    if (EVP_CipherInit_ex(c, NULL, NULL, NULL, iv, -1) != 1) return 0;
+    int out_len = 0;
+    if (EVP_CipherUpdate(c, out, &out_len, in, (int)in_len) != 1) return 0;
+    return (size_t)out_len == in_len;
+}
+
+static int aes_key_ecb_encrypt(aes_key_t *k, const uint8_t in[16], uint8_t out[16]) {
+    static const uint8_t zero_iv[16] = {0};
+    return aes_key_cbc(k, 1, zero_iv, in, 16, out);
+}
+
+#else
+
+// The cryptors keep the key schedule, so per-call work is an IV reset plus
+// the block operations.
+static int aes_key_init(aes_key_t *k, const uint8_t key[16]) {
+    memset(k, 0, sizeof(*k));
+    if (CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES128, 0, key, 16, NULL, &k->enc) != kCCSuccess) {
+        return 0;
+    }
+    if (CCCryptorCreate(kCCDecrypt, kCCAlgorithmAES128, 0, key, 16, NULL, &k->dec) != kCCSuccess) {
+        CCCryptorRelease(k->enc);
+        k->enc = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void aes_key_free(aes_key_t *k) {
+    if (k->enc) CCCryptorRelease(k->enc);
+    if (k->dec) CCCryptorRelease(k->dec);
+    k->enc = NULL;
+    k->dec = NULL;
+}
+
+static int aes_key_cbc(aes_key_t *k, int encrypt, const uint8_t iv[16],
+                       const uint8_t *in, size_t in_len, uint8_t *out) {
+    CCCryptorRef c = encrypt ? k->enc : k->dec;
+    if (!c || (in_len % 16) != 0) return 0;
+    if (CCCryptorReset(c, iv) != kCCSuccess) return 0;
+    size_t out_len = 0;
+    CCCryptorStatus st = CCCryptorUpdate(c, in, in_len, out, in_len, &out_len);
+    return (st == kCCSuccess && out_len == in_len);
+}
+
+static int aes_key_ecb_encrypt(aes_key_t *k, const uint8_t in[16], uint8_t out[16]) {
+    static const uint8_t zero_iv[16] = {0};
+    return aes_key_cbc(k, 1, zero_iv, in, 16, out);
+}
+
+#endif
+
+static int aes_cbc_crypt(int encrypt, const uint8_t key[16], const uint8_t iv[16],
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+    aes_key_t k;
+    if (!aes_key_init(&k, key)) return 0;
+    int ok = aes_key_cbc(&k, encrypt, iv, in, in_len, out);
+    aes_key_free(&k);
+    return ok;
+}
+
+static int generate_cmac_subkeys(aes_key_t *k, uint8_t k1[16], uint8_t k2[16]) {
+    uint8_t L[16];
+    uint8_t zero[16] = {0};
+    if (!aes_key_ecb_encrypt(k, zero, L)) return 0;
+    left_shift_1bit(k1, L);
+    if (L[0] & 0x80) {
+        k1[15] ^= 0x87;
+    }
+    left_shift_1bit(k2, k1);
+    if (k1[0] & 0x80) {
+        k2[15] ^= 0x87;
+    }
+    return 1;
+}
+
+static int cmac_key_init(cmac_key_t *ck, const uint8_t key[16]) {
+    if (!aes_key_init(&ck->aes, key)) return 0;
+    if (!generate_cmac_subkeys(&ck->aes, ck->k1, ck->k2)) {
+        aes_key_free(&ck->aes);
+        return 0;
+    }
+    return 1;
+}
+
+static void cmac_key_free(cmac_key_t *ck) {
+    aes_key_free(&ck->aes);
+    memset(ck->k1, 0, sizeof(ck->k1));
+    memset(ck->k2, 0, sizeof(ck->k2));
+}
+
+// Builds the final CMAC block: the last 16 message bytes masked with K1, or
+// the padded remainder masked with K2. Returns the total number of blocks.
+static size_t cmac_last_block(const uint8_t *msg, size_t msg_len,
+                              const uint8_t k1[16], const uint8_t k2[16],
+                              uint8_t last_block[16]) {
+    size_t n = (msg_len + 15) / 16;
+    if (n == 0) n = 1;
+    int last_complete = (msg_len != 0 && (msg_len % 16) == 0);
+
+    memset(last_block, 0, 16);
+    if (last_complete) {
+        const uint8_t *last = msg + 16 * (n - 1);
+        xor_block(last_block, last, k1, 16);
+    } else {
+        size_t last_len = msg_len - 16 * (n - 1);
+        if (msg_len == 0) last_len = 0;
+        if (last_len > 0) memcpy(last_block, msg + 16 * (n - 1), last_len);
+        last_block[last_len] = 0x80;
+        xor_block(last_block, last_block, k2, 16);
+    }
+    return n;
+}
+
+// Streaming CMAC: cmac_init, any number of cmac_update calls, cmac_final.
+// The context holds the running CBC-MAC state and up to one block of
+// pending input; a full block is only fed to the cipher once more input
+// arrives, since the last block must be masked with K1 or K2 instead.
+// Block-aligned runs go to the backend a 64-byte chunk at a time.
+typedef struct {
+    cmac_key_t *key;
+    uint8_t x[16];
+    uint8_t blk[16];
+    size_t fill;
+} cmac_ctx_t;
+
+static void cmac_init(cmac_ctx_t *c, cmac_key_t *ck) {
+    c->key = ck;
+    memset(c->x, 0, sizeof(c->x));
+    c->fill = 0;
+}
+
+static int cmac_update(cmac_ctx_t *c, const uint8_t *p, size_t len) {
+    uint8_t chunk_out[64];
+    while (len > 0) {
+        if (c->fill == 16) {
+            xor_block(c->blk, c->blk, c->x, 16);
+            if (!aes_key_ecb_encrypt(&c->key->aes, c->blk, c->x)) return 0;
+            c->fill = 0;
+        }
+        if (c->fill == 0) {
+            // Whole blocks, keeping at least one byte back as a candidate
+            // last block.
+            size_t full = ((len - 1) / 16) * 16;
+            while (full > 0) {
+                size_t chunk = full > sizeof(chunk_out) ? sizeof(chunk_out) : full;
+                if (!aes_key_cbc(&c->key->aes, 1, c->x, p, chunk, chunk_out)) return 0;
+                memcpy(c->x, chunk_out + chunk - 16, 16);
+                p += chunk;
+                len -= chunk;
+                full -= chunk;
+            }
+        }
+        size_t take = 16 - c->fill;
+        if (take > len) take = len;
+        memcpy(c->blk + c->fill, p, take);
+        c->fill += take;
+        p += take;
+        len -= take;
+    }
+    return 1;
+}
+
+static int cmac_final(cmac_ctx_t *c, uint8_t out[16]) {
+    if (c->fill == 16) {
+        xor_block(c->blk, c->blk, c->key->k1, 16);
+    } else {
+        c->blk[c->fill] = 0x80;
+        memset(c->blk + c->fill + 1, 0, 15 - c->fill);
+        xor_block(c->blk, c->blk, c->key->k2, 16);
+    }
+    xor_block(c->blk, c->blk, c->x, 16);
+    int ok = aes_key_ecb_encrypt(&c->key->aes, c->blk, out);
+    memset(c, 0, sizeof(*c));
+    return ok;
+}
+
+// Multi-buffer AES: one block per lane, each lane with its own key. The
+// hardware backends interleave the rounds of up to AES_MB_LANES independent
+// lanes so the AES units stay busy; the library backends loop per lane.
+// Schedules from aes_mb_key_init are encrypt-only on the hardware backends.
+#if defined(NTAG_CRYPTO_AESNI)
+
+static void aes_mb_key_init(aes_key_t *keys, const uint8_t (*raw)[16], size_t n) {
+    for (size_t i = 0; i < n; i++) keys[i].rk_enc[0] = _mm_loadu_si128((const __m128i *)raw[i]);
+#define AESNI_MB_ROUND(r, rcon) \
+    for (size_t i = 0; i < n; i++) keys[i].rk_enc[r] = AESNI_EXPAND(keys[i].rk_enc[(r) - 1], rcon)
+    AESNI_MB_ROUND(1, 0x01);
+    AESNI_MB_ROUND(2, 0x02);
+    AESNI_MB_ROUND(3, 0x04);
+    AESNI_MB_ROUND(4, 0x08);
+    AESNI_MB_ROUND(5, 0x10);
+    AESNI_MB_ROUND(6, 0x20);
+    AESNI_MB_ROUND(7, 0x40);
+    AESNI_MB_ROUND(8, 0x80);
+    AESNI_MB_ROUND(9, 0x1B);
+    AESNI_MB_ROUND(10, 0x36);
+#undef AESNI_MB_ROUND
+}
+
+static void aes_mb_key_free(aes_key_t *keys, size_t n) {
+    memset(keys, 0, n * sizeof(*keys));
+}
+
+static void aes_mb_encrypt(aes_key_t *const *keys, const uint8_t (*in)[16],
+                           uint8_t (*out)[16], size_t n) {
+    for (size_t base = 0; base < n; base += AES_MB_LANES) {
+        size_t m = n - base;
+        if (m > AES_MB_LANES) m = AES_MB_LANES;
+        __m128i b[AES_MB_LANES];
+        for (size_t i = 0; i < m; i++) {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[base + i]), keys[base + i]->rk_enc[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t i = 0; i < m; i++) b[i] = _mm_aesenc_si128(b[i], keys[base + i]->rk_enc[r]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], keys[base + i]->rk_enc[10]);
+            _mm_storeu_si128((__m128i *)out[base + i], b[i]);
+        }
+    }
+}
+
+#elif defined(NTAG_CRYPTO_ARMCE)
+
+static void aes_mb_key_init(aes_key_t *keys, const uint8_t (*raw)[16], size_t n) {
+    for (size_t i = 0; i < n; i++) armce_expand_enc(&keys[i], raw[i]);
+}
+
+static void aes_mb_key_free(aes_key_t *keys, size_t n) {
+    memset(keys, 0, n * sizeof(*keys));
+}
+
+static void aes_mb_encrypt(aes_key_t *const *keys, const uint8_t (*in)[16],
+                           uint8_t (*out)[16], size_t n) {
+    for (size_t base = 0; base < n; base += AES_MB_LANES) {
+        size_t m = n - base;
+        if (m > AES_MB_LANES) m = AES_MB_LANES;
+        uint8x16_t b[AES_MB_LANES];
+        for (size_t i = 0; i < m; i++) b[i] = vld1q_u8(in[base + i]);
+        for (int r = 0; r < 9; r++) {
+            for (size_t i = 0; i < m; i++) b[i] = vaesmcq_u8(vaeseq_u8(b[i], keys[base + i]->rk_enc[r]));
+        }
+        for (size_t i = 0; i < m; i++) {
+            b[i] = veorq_u8(vaeseq_u8(b[i], keys[base + i]->rk_enc[9]), keys[base + i]->rk_enc[10]);
+            vst1q_u8(out[base + i], b[i]);
+        }
+    }
+}
+
+#else
+
+static void aes_mb_key_init(aes_key_t *keys, const uint8_t (*raw)[16], size_t n) {
+    for (size_t i = 0; i < n; i++) aes_key_init(&keys[i], raw[i]);
+}
+
+static void aes_mb_key_free(aes_key_t *keys, size_t n) {
+    for (size_t i = 0; i < n; i++) aes_key_free(&keys[i]);
+}
+
+static void aes_mb_encrypt(aes_key_t *const *keys, const uint8_t (*in)[16],
+                           uint8_t (*out)[16], size_t n) {
+    for (size_t i = 0; i < n; i++) aes_key_ecb_encrypt(keys[i], in[i], out[i]);
+}
+
+#endif
+
+// Computes n (<= AES_MB_LANES) independent CMACs in lock step: the subkey
+// derivation and every CBC-MAC step run as one multi-buffer call across the
+// lanes that still have blocks left.
+static void cmac_mb(aes_key_t *const *keys, const uint8_t *const *msgs, const size_t *lens,
+                    uint8_t (*out)[16], size_t n) {
+    uint8_t zero[AES_MB_LANES][16];
+    uint8_t L[AES_MB_LANES][16];
+    uint8_t last[AES_MB_LANES][16];
+    size_t blocks[AES_MB_LANES];
+    size_t max_blocks = 0;
+
+    memset(zero, 0, sizeof(zero));
+    aes_mb_encrypt(keys, (const uint8_t (*)[16])zero, L, n);
+    for (size_t i = 0; i < n; i++) {
+        uint8_t k1[16], k2[16];
+        left_shift_1bit(k1, L[i]);
+        if (L[i][0] & 0x80) k1[15] ^= 0x87;
+        left_shift_1bit(k2, k1);
+        if (k1[0] & 0x80) k2[15] ^= 0x87;
+        blocks[i] = cmac_last_block(msgs[i], lens[i], k1, k2, last[i]);
+        if (blocks[i] > max_blocks) max_blocks = blocks[i];
+        memset(out[i], 0, 16);
+    }
+
+    for (size_t j = 0; j < max_blocks; j++) {
+        aes_key_t *lane_keys[AES_MB_LANES];
+        uint8_t in[AES_MB_LANES][16];
+        uint8_t res[AES_MB_LANES][16];
+        size_t lane[AES_MB_LANES];
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (j >= blocks[i]) continue;
+            const uint8_t *blk = (j + 1 == blocks[i]) ? last[i] : msgs[i] + 16 * j;
+            xor_block(in[m], out[i], blk, 16);
+            lane_keys[m] = keys[i];
+            lane[m++] = i;
+        }
+        aes_mb_encrypt(lane_keys, (const uint8_t (*)[16])in, res, m);
+        for (size_t a = 0; a < m; a++) memcpy(out[lane[a]], res[a], 16);
+    }
+}
+
+static void cmac_truncate_8(const uint8_t cmac[16], uint8_t out[8]) {
+    // Take odd-indexed bytes 1,3,5,...,15 in order.
+    for (int i = 0; i < 8; i++) out[i] = cmac[1 + i * 2];
+}
+
+// Pads buf in place; it must have room for the padded length.
+static size_t pad_iso9797_m2(uint8_t *buf, size_t len) {
+    size_t pad_len = 16 - (len % 16);
+    buf[len] = 0x80;
+    memset(buf + len + 1, 0, pad_len - 1);
+    return len + pad_len;
+}
+
+static size_t unpad_iso9797_m2(uint8_t *buf, size_t len) {
+    if (len == 0) return 0;
+    ssize_t i = (ssize_t)len - 1;
+    while (i >= 0 && buf[i] == 0x00) i--;
+    if (i >= 0 && buf[i] == 0x80) {
+        return (size_t)i;
+    }
+    return len;
+}
+
+static void rotate_left_1(uint8_t *out, const uint8_t *in, size_t len) {
+    if (len == 0) return;
+    memmove(out, in + 1, len - 1);
+    out[len - 1] = in[0];
+}
+
+static void rotate_right_1(uint8_t *out, const uint8_t *in, size_t len) {
+    if (len == 0) return;
+    memmove(out + 1, in, len - 1);
+    out[0] = in[len - 1];
+}
+
+int ntag424_random_bytes(uint8_t *buf, size_t len) {
+#if defined(__APPLE__)
+    arc4random_buf(buf, len);
+    return 1;
+#else
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    if (n == len) return 1;
+    memset(buf, 0, len);
+    return 0;
+#endif
+}
+
+// AN10922 AES-128 diversification: D = 0x01 || M is padded to two blocks
+// with 80 00.., the second block masked with K1 if D filled it and K2
+// otherwise, and the last CBC-MAC block is the key. Unlike plain CMAC the
+// input always spans two blocks, also when D is shorter than 16 bytes.
+int ntag424_diversify_key(const uint8_t master[16], const uint8_t *div_input, size_t div_len,
+                          uint8_t out[16]) {
+    if (div_len == 0 || div_len > 31) return 0;
+    uint8_t d[32];
+    memset(d, 0, sizeof(d));
+    d[0] = 0x01;
+    memcpy(d + 1, div_input, div_len);
+    if (div_len < 31) d[1 + div_len] = 0x80;
+
+    cmac_key_t ck;
+    if (!cmac_key_init(&ck, master)) return 0;
+    xor_block(d + 16, d + 16, div_len == 31 ? ck.k1 : ck.k2, 16);
+    uint8_t iv[16] = {0};
+    uint8_t mac[32];
+    int ok = aes_key_cbc(&ck.aes, 1, iv, d, sizeof(d), mac);
+    cmac_key_free(&ck);
+    if (ok) memcpy(out, mac + 16, 16);
+    memset(d, 0, sizeof(d));
+    memset(mac, 0, sizeof(mac));
+    return ok;
+}
+
+static const char *const k_sdm_field_names[] = {"uid", "ctr", "picc", "mac", "enc"};
+static const size_t k_sdm_field_lens[] = {NTAG424_SDM_UID_LEN_ASCII, NTAG424_SDM_CTR_LEN_ASCII,
+                                          NTAG424_SDM_PICC_LEN_ASCII, NTAG424_SDM_MAC_LEN_ASCII,
+                                          NTAG424_SDM_ENC_LEN_ASCII};
+
+void ntag424_sdm_template_default(ntag424_sdm_template_t *tpl) {
+    memset(tpl, 0, sizeof(*tpl));
+    const uint8_t fields[] = {NTAG424_SDM_FIELD_UID, NTAG424_SDM_FIELD_CTR, NTAG424_SDM_FIELD_MAC};
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        tpl->params[i].field = fields[i];
+        snprintf(tpl->params[i].name, sizeof(tpl->params[i].name), "%s", k_sdm_field_names[fields[i]]);
+    }
+    tpl->count = sizeof(fields);
+}
+
+static int is_url_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' || c == '~';
+}
+
+// Parses --sdm-params: the query parameters in URL order, each "field" or
+// "field=name" with field one of uid, ctr, picc, mac, enc (e.g.
+// "picc=e,mac=m"). mac is required; picc carries UID and counter encrypted,
+// so it cannot be combined with plain uid/ctr. enc (SDMENCFileData) must sit
+// inside the MAC input, before mac, and needs UID and counter, plain or in
+// picc.
+int ntag424_sdm_template_parse(const char *spec, ntag424_sdm_template_t *tpl) {
+    memset(tpl, 0, sizeof(*tpl));
+    unsigned seen = 0;
+    const char *p = spec;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char *eq = memchr(p, '=', len);
+        size_t field_len = eq ? (size_t)(eq - p) : len;
+
+        size_t field = 0;
+        while (field < NTAG424_SDM_FIELD_COUNT &&
+               !(strlen(k_sdm_field_names[field]) == field_len &&
+                 strncmp(k_sdm_field_names[field], p, field_len) == 0)) {
+            field++;
+        }
+        if (field == NTAG424_SDM_FIELD_COUNT || (seen & (1u << field)) || tpl->count >= NTAG424_SDM_FIELD_COUNT) return 0;
+        if (field == NTAG424_SDM_FIELD_ENC && (seen & (1u << NTAG424_SDM_FIELD_MAC))) return 0;
+        seen |= 1u << field;
+
+        ntag424_sdm_param_t *param = &tpl->params[tpl->count++];
+        param->field = (uint8_t)field;
+        const char *name = eq ? eq + 1 : p;
+        size_t name_len = eq ? len - field_len - 1 : field_len;
+        if (name_len == 0 || name_len >= sizeof(param->name)) return 0;
+        for (size_t i = 0; i < name_len; i++) {
+            if (!is_url_name_char(name[i])) return 0;
+        }
+        memcpy(param->name, name, name_len);
+        param->name[name_len] = '\0';
+
+        if (!end) break;
+        p = end + 1;
+    }
+    if (!(seen & (1u << NTAG424_SDM_FIELD_MAC))) return 0;
+    if ((seen & (1u << NTAG424_SDM_FIELD_PICC)) && (seen & ((1u << NTAG424_SDM_FIELD_UID) | (1u << NTAG424_SDM_FIELD_CTR)))) return 0;
+    unsigned plain_ids = (1u << NTAG424_SDM_FIELD_UID) | (1u << NTAG424_SDM_FIELD_CTR);
+    if ((seen & (1u << NTAG424_SDM_FIELD_ENC)) && !(seen & (1u << NTAG424_SDM_FIELD_PICC)) &&
+        (seen & plain_ids) != plain_ids) {
+        return 0;
+    }
+    return 1;
+}
+
+// Emits the NDEF file image (NLEN + one short URI record) for base_url with
+// the template's placeholders into buf, recording every SDM offset as it is
+// written. Offsets are relative to the start of the NDEF file. No allocation;
+// out->ndef points into buf.
+int ntag424_sdm_build_ndef(const char *base_url, const ntag424_sdm_template_t *tpl,
+                          uint8_t *buf, size_t cap, ntag424_sdm_ndef_t *out) {
+    if (!base_url || !tpl || !buf || !out || tpl->count == 0) return 0;
+    memset(out, 0, sizeof(*out));
+    out->uid_offset = NTAG424_SDM_OFFSET_NONE;
+    out->ctr_offset = NTAG424_SDM_OFFSET_NONE;
+    out->picc_offset = NTAG424_SDM_OFFSET_NONE;
+    out->mac_offset = NTAG424_SDM_OFFSET_NONE;
+    out->enc_offset = NTAG424_SDM_OFFSET_NONE;
+
+    struct {
+        const char *prefix;
+        uint8_t code;
+    } prefixes[] = {
+        {"https://www.", 0x02},
+        {"http://www.", 0x01},
+        {"https://", 0x04},
+        {"http://", 0x03},
+    };
+
+    uint8_t prefix_code = 0x00;
+    out->url_prefix = "";
+    const char *uri = base_url;
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t plen = strlen(prefixes[i].prefix);
+        if (strncmp(base_url, prefixes[i].prefix, plen) == 0) {
+            prefix_code = prefixes[i].code;
+            out->url_prefix = prefixes[i].prefix;
+            uri = base_url + plen;
+            break;
+        }
+    }
+
+    // NLEN(2) | D1 01 len 'U' | prefix code | URI...
+    const size_t uri_start = 7;
+    if (cap < uri_start) return 0;
+    size_t pos = uri_start;
+    char sep = '?';
+    for (const char *s = uri; *s; s++) {
+        if (pos >= cap) return 0;
+        if (*s == '?') sep = '&';
+        buf[pos++] = (uint8_t)*s;
+    }
+
+    for (size_t i = 0; i < tpl->count; i++) {
+        const ntag424_sdm_param_t *param = &tpl->params[i];
+        size_t name_len = strlen(param->name);
+        size_t value_len = k_sdm_field_lens[param->field];
+        if (pos + 2 + name_len + value_len > cap) return 0;
+
+        buf[pos++] = (uint8_t)sep;
+        sep = '&';
+        if (i == 0) out->mac_input_offset = (uint32_t)pos; // MAC input starts at the first name
+        memcpy(buf + pos, param->name, name_len);
+        pos += name_len;
+        buf[pos++] = '=';
+
+        switch (param->field) {
+            case NTAG424_SDM_FIELD_UID: out->uid_offset = (uint32_t)pos; break;
+            case NTAG424_SDM_FIELD_CTR: out->ctr_offset = (uint32_t)pos; break;
+            case NTAG424_SDM_FIELD_PICC: out->picc_offset = (uint32_t)pos; break;
+            case NTAG424_SDM_FIELD_MAC: out->mac_offset = (uint32_t)pos; break;
+            case NTAG424_SDM_FIELD_ENC: out->enc_offset = (uint32_t)pos; break;
+        }
+        out->fields |= (uint8_t)(1u << param->field);
+        memset(buf + pos, '0', value_len);
+        pos += value_len;
+    }
+
+    size_t payload_len = 1 + (pos - uri_start);
+    if (payload_len > 255 || out->mac_offset == NTAG424_SDM_OFFSET_NONE) return 0;
+    size_t record_len = 4 + payload_len;
+
+    buf[0] = (uint8_t)((record_len >> 8) & 0xFF);
+    buf[1] = (uint8_t)(record_len & 0xFF);
+    buf[2] = 0xD1;           // MB=1, ME=1, SR=1, TNF=0x01
+    buf[3] = 0x01;           // Type length
+    buf[4] = (uint8_t)payload_len;
+    buf[5] = 0x55;           // 'U'
+    buf[6] = prefix_code;    // URI prefix code
+
+    out->ndef = buf;
+    out->ndef_len = pos;
+    out->uri = (const char *)buf + uri_start;
+    out->uri_len = pos - uri_start;
+    return 1;
+}
+
+static int hex_decode(const char *hex, size_t hex_len, uint8_t *out) {
+    if (hex_len % 2) return 0;
+    for (size_t i = 0; i < hex_len / 2; i++) {
+        int v = 0;
+        for (int j = 0; j < 2; j++) {
+            char c = hex[2 * i + j];
+            int d;
+            if (c >= '0' && c <= '9') d = c - '0';
+            else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+            else return 0;
+            v = (v << 4) | d;
+        }
+        out[i] = (uint8_t)v;
+    }
+    return 1;
+}
+
+// Returns the value of query parameter "name" and its length, or NULL.
+static const char *find_query_param(const char *url, const char *name, size_t *len_out) {
+    size_t nlen = strlen(name);
+    const char *q = strchr(url, '?');
+    while (q) {
+        q++;
+        if (strncmp(q, name, nlen) == 0 && q[nlen] == '=') {
+            const char *v = q + nlen + 1;
+            size_t len = 0;
+            while (v[len] && v[len] != '&' && v[len] != '#' && !isspace((unsigned char)v[len])) len++;
+            *len_out = len;
+            return v;
+        }
+        q = strchr(q, '&');
+    }
+    return NULL;
+}
+
+// PICCDataTag: bit 7 UID mirrored (low nibble then the UID length, 7),
+// bit 6 SDMReadCtr mirrored. The fields follow the tag byte in that order.
+static int sdm_picc_fields(const uint8_t dec[16], ntag424_sdm_tap_t *tap) {
+    uint8_t tag = dec[0];
+    size_t n = 1;
+    if ((tag & 0x30) != 0 || (tag & 0x0F) != ((tag & 0x80) ? 7 : 0)) return 0;
+    tap->fields = 0;
+    if (tag & 0x80) {
+        memcpy(tap->uid, dec + n, 7);
+        n += 7;
+        tap->fields |= 1u << NTAG424_SDM_FIELD_UID;
+    }
+    if (tag & 0x40) {
+        memcpy(tap->ctr_le, dec + n, 3);
+        tap->fields |= 1u << NTAG424_SDM_FIELD_CTR;
+    }
+    return 1;
+}
+
+// SV1 (C3 3C) or SV2 (3C C3) || 00 01 00 80 || [UID] || [SDMReadCtr], zero
+// padded to one block, with the fields of tap.
+static void sdm_session_vector(uint8_t sv[16], uint8_t b0, uint8_t b1, const ntag424_sdm_tap_t *tap) {
+    size_t n = 6;
+    memset(sv, 0, 16);
+    sv[0] = b0;
+    sv[1] = b1;
+    sv[3] = 0x01;
+    sv[5] = 0x80;
+    if (tap->fields & (1u << NTAG424_SDM_FIELD_UID)) {
+        memcpy(sv + n, tap->uid, 7);
+        n += 7;
+    }
+    if (tap->fields & (1u << NTAG424_SDM_FIELD_CTR)) memcpy(sv + n, tap->ctr_le, 3);
+}
+
+// Parses a tap URL in the build_sdm_ndef layout of tpl. The MAC input is
+// the URL text from the first parameter name up to the start of the MAC
+// value.
+int ntag424_sdm_parse_url_template(const char *url, const ntag424_sdm_template_t *tpl, ntag424_sdm_tap_t *tap) {
+    memset(tap, 0, sizeof(*tap));
+    if (tpl->count == 0) return 0;
+    const char *first = NULL;
+    const char *mac = NULL;
+    unsigned seen = 0;
+    for (size_t i = 0; i < tpl->count; i++) {
+        const ntag424_sdm_param_t *param = &tpl->params[i];
+        size_t len = 0;
+        const char *v = find_query_param(url, param->name, &len);
+        if (!v || len != k_sdm_field_lens[param->field]) return 0;
+        if (i == 0) first = v - strlen(param->name) - 1;
+        uint8_t ctr_be[3];
+        int ok = 1;
+        switch (param->field) {
+            case NTAG424_SDM_FIELD_UID: ok = hex_decode(v, len, tap->uid); break;
+            case NTAG424_SDM_FIELD_CTR:
+                ok = hex_decode(v, len, ctr_be);
+                tap->ctr_le[0] = ctr_be[2];
+                tap->ctr_le[1] = ctr_be[1];
+                tap->ctr_le[2] = ctr_be[0];
+                break;
+            case NTAG424_SDM_FIELD_PICC:
+                ok = hex_decode(v, len, tap->picc);
+                tap->picc_pending = 1;
+                break;
+            case NTAG424_SDM_FIELD_MAC:
+                ok = hex_decode(v, len, tap->mac);
+                mac = v;
+                break;
+            case NTAG424_SDM_FIELD_ENC: tap->enc = v; break;
+        }
+        if (!ok) return 0;
+        seen |= 1u << param->field;
+    }
+    if (!mac || first > mac) return 0;
+    tap->fields = (uint8_t)(seen & ((1u << NTAG424_SDM_FIELD_UID) | (1u << NTAG424_SDM_FIELD_CTR)));
+    if (tap->enc && (tap->enc < first || tap->enc + NTAG424_SDM_ENC_LEN_ASCII > mac)) return 0;
+    tap->mac_input = first;
+    tap->mac_input_len = (size_t)(mac - first);
+    tap->valid = 1;
+    return 1;
+}
+
+int ntag424_sdm_parse_url(const char *url, ntag424_sdm_tap_t *tap) {
+    ntag424_sdm_template_t tpl;
+    ntag424_sdm_template_default(&tpl);
+    return ntag424_sdm_parse_url_template(url, &tpl, tap);
+}
+
+int ntag424_sdm_parse_file(const uint8_t *file, size_t len, const ntag424_file_settings_t *fs,
+                           const uint8_t meta_key[16], ntag424_sdm_tap_t *tap) {
+    memset(tap, 0, sizeof(*tap));
+    // Mirrors are ASCII; SV2 takes the UID and counter only where mirrored.
+    if (!fs->valid || !fs->sdm_enabled || !(fs->sdm_options & 0x01) || fs->sdm_file_read == 0x0F) return 0;
+    if (!(fs->present & NTAG424_FS_HAS_MAC_INPUT) || !(fs->present & NTAG424_FS_HAS_MAC_OFFSET)) return 0;
+    if (fs->sdm_mac_input_offset > fs->sdm_mac_offset || fs->sdm_mac_offset + NTAG424_SDM_MAC_LEN_ASCII > len) return 0;
+    int with_uid = (fs->sdm_options & 0x80) != 0;
+    int with_ctr = (fs->sdm_options & 0x40) != 0;
+
+    uint8_t ctr_be[3];
+    if (fs->sdm_meta_read == 0x0E) {
+        if (with_uid && (fs->uid_offset + NTAG424_SDM_UID_LEN_ASCII > len ||
+                         !hex_decode((const char *)file + fs->uid_offset, NTAG424_SDM_UID_LEN_ASCII, tap->uid))) {
+            return 0;
+        }
+        if (with_ctr) {
+            if (fs->sdm_read_ctr_offset + NTAG424_SDM_CTR_LEN_ASCII > len ||
+                !hex_decode((const char *)file + fs->sdm_read_ctr_offset, NTAG424_SDM_CTR_LEN_ASCII, ctr_be)) {
+                return 0;
+            }
+            tap->ctr_le[0] = ctr_be[2];
+            tap->ctr_le[1] = ctr_be[1];
+            tap->ctr_le[2] = ctr_be[0];
+        }
+        tap->fields = (uint8_t)((with_uid ? 1u << NTAG424_SDM_FIELD_UID : 0) |
+                                (with_ctr ? 1u << NTAG424_SDM_FIELD_CTR : 0));
+    } else if (fs->sdm_meta_read <= 0x04) {
+        // PICCData = E(KSDMMetaRead, IV 0, PICCDataTag || [UID] || [SDMReadCtr] || padding).
+        uint8_t picc[16];
+        static const uint8_t iv0[16] = {0};
+        if (fs->picc_data_offset + NTAG424_SDM_PICC_LEN_ASCII > len ||
+            !hex_decode((const char *)file + fs->picc_data_offset, NTAG424_SDM_PICC_LEN_ASCII, tap->picc)) {
+            return 0;
+        }
+        if (meta_key) {
+            int ok = aes_cbc_crypt(0, meta_key, iv0, tap->picc, sizeof(tap->picc), picc) && sdm_picc_fields(picc, tap);
+            memset(picc, 0, sizeof(picc));
+            if (!ok) return 0;
+        } else {
+            tap->picc_pending = 1;
+        }
+    } else {
+        return 0;
+    }
+
+    if (fs->sdm_options & 0x10) {
+        // Only one block of SDMENCFileData, inside the MAC input. The tag
+        // encrypts file data only with both UID and counter mirrored.
+        if (!with_uid || !with_ctr || !(fs->present & NTAG424_FS_HAS_ENC) ||
+            fs->sdm_enc_length != NTAG424_SDM_ENC_LEN_ASCII ||
+            fs->sdm_enc_offset < fs->sdm_mac_input_offset ||
+            fs->sdm_enc_offset + NTAG424_SDM_ENC_LEN_ASCII > fs->sdm_mac_offset) {
+            return 0;
+        }
+        tap->enc = (const char *)file + fs->sdm_enc_offset;
+    }
+
+    if (!hex_decode((const char *)file + fs->sdm_mac_offset, NTAG424_SDM_MAC_LEN_ASCII, tap->mac)) return 0;
+    tap->mac_input = (const char *)file + fs->sdm_mac_input_offset;
+    tap->mac_input_len = fs->sdm_mac_offset - fs->sdm_mac_input_offset;
+    tap->valid = 1;
+    return 1;
+}
+
+// PICCData is one block under IV 0, so a run of taps decrypts as one CBC
+// pass over their blocks under the cached KSDMMetaRead schedule (which the
+// backends pipeline), with each block then unchained from its predecessor.
+#define SDM_PICC_BATCH 64
+
+static void sdm_decrypt_picc(ntag424_sdm_verifier_t *v, ntag424_sdm_tap_t *taps, size_t n) {
+    uint8_t enc[SDM_PICC_BATCH][16];
+    uint8_t dec[SDM_PICC_BATCH][16];
+    size_t idx[SDM_PICC_BATCH];
+    size_t i = 0;
+    while (i < n) {
+        size_t m = 0;
+        for (; i < n && m < SDM_PICC_BATCH; i++) {
+            if (!taps[i].valid || !taps[i].picc_pending) continue;
+            if (!v->has_meta_key) {
+                taps[i].valid = 0;
+                continue;
+            }
+            memcpy(enc[m], taps[i].picc, 16);
+            idx[m++] = i;
+        }
+        if (m == 0) continue;
+        uint8_t iv[16] = {0};
+        int ok = aes_key_cbc(&v->meta_key, 0, iv, enc[0], m * 16, dec[0]);
+        for (size_t a = 0; a < m; a++) {
+            ntag424_sdm_tap_t *tap = &taps[idx[a]];
+            if (a > 0) xor_block(dec[a], dec[a], enc[a - 1], 16);
+            tap->picc_pending = 0;
+            if (!ok || !sdm_picc_fields(dec[a], tap)) tap->valid = 0;
+        }
+        memset(dec, 0, m * 16);
+    }
+}
+
+// SDMENCFileData of the matched lanes: KSesSDMFileReadENC = E(K, SV1 ^ K1)
+// with SV1 = C3 3C 00 01 00 80 || UID || CTR, IV = E(KSes, CTR || 0); the
+// tag only encrypts with both mirrored. The session keys and IVs run
+// multi-buffer; one block of data is then D(KSes) xor IV per tap.
+static void sdm_decrypt_enc(ntag424_sdm_verifier_t *v, ntag424_sdm_tap_t *taps, const size_t *lanes, size_t m) {
+    size_t idx[AES_MB_LANES];
+    uint8_t sv1[AES_MB_LANES][16];
+    uint8_t ksess[AES_MB_LANES][16];
+    uint8_t ivs[AES_MB_LANES][16];
+    size_t k = 0;
+    for (size_t a = 0; a < m; a++) {
+        ntag424_sdm_tap_t *tap = &taps[lanes[a]];
+        if (!tap->match || !tap->enc) continue;
+        if (tap->fields != ((1u << NTAG424_SDM_FIELD_UID) | (1u << NTAG424_SDM_FIELD_CTR))) {
+            tap->match = 0;
+            continue;
+        }
+        uint8_t *sv = sv1[k];
+        sdm_session_vector(sv, 0xC3, 0x3C, tap);
+        xor_block(sv, sv, v->file_key.k1, 16);
+        idx[k++] = lanes[a];
+    }
+    if (k == 0) return;
+
+    aes_key_t *file_lanes[AES_MB_LANES];
+    for (size_t a = 0; a < k; a++) file_lanes[a] = &v->file_key.aes;
+    aes_mb_encrypt(file_lanes, (const uint8_t (*)[16])sv1, ksess, k);
+
+    aes_key_t sess_keys[AES_MB_LANES];
+    aes_key_t *sess_lanes[AES_MB_LANES];
+    memset(sv1, 0, sizeof(sv1));
+    for (size_t a = 0; a < k; a++) {
+        memcpy(sv1[a], taps[idx[a]].ctr_le, 3);
+        sess_lanes[a] = &sess_keys[a];
+    }
+    aes_mb_key_init(sess_keys, (const uint8_t (*)[16])ksess, k);
+    aes_mb_encrypt(sess_lanes, (const uint8_t (*)[16])sv1, ivs, k);
+    aes_mb_key_free(sess_keys, k);
+
+    for (size_t a = 0; a < k; a++) {
+        ntag424_sdm_tap_t *tap = &taps[idx[a]];
+        uint8_t enc[NTAG424_SDM_ENC_DATA_LEN];
+        aes_key_t dk;
+        if (!hex_decode(tap->enc, NTAG424_SDM_ENC_LEN_ASCII, enc) || !aes_key_init(&dk, ksess[a])) {
+            tap->match = 0;
+            continue;
+        }
+        if (!aes_key_cbc(&dk, 0, ivs[a], enc, sizeof(enc), tap->enc_data)) tap->match = 0;
+        aes_key_free(&dk);
+    }
+    memset(ksess, 0, sizeof(ksess));
+}
+
+// Verifies parsed taps against the SDM file read key, AES_MB_LANES at a time.
+// SV2 (3C C3 00 01 00 80 || [UID] || [CTR], zero padded) is one block, so
+// the session key is E(K, SV2 ^ K1) under the fixed file key schedule; the
+// session MACs then run as one multi-buffer CMAC across the lanes.
+void ntag424_sdm_verify(ntag424_sdm_verifier_t *v, ntag424_sdm_tap_t *taps, size_t n) {
+    cmac_key_t *file_key = &v->file_key;
+    sdm_decrypt_picc(v, taps, n);
+    for (size_t base = 0; base < n; base += AES_MB_LANES) {
+        size_t idx[AES_MB_LANES];
+        uint8_t sv2[AES_MB_LANES][16];
+        uint8_t ksess[AES_MB_LANES][16];
+        size_t m = 0;
+        for (size_t i = base; i < n && i < base + AES_MB_LANES; i++) {
+            if (!taps[i].valid) continue;
+            uint8_t *sv = sv2[m];
+            sdm_session_vector(sv, 0x3C, 0xC3, &taps[i]);
+            xor_block(sv, sv, file_key->k1, 16);
+            idx[m++] = i;
+        }
+        if (m == 0) continue;
+
+        aes_key_t *file_lanes[AES_MB_LANES];
+        for (size_t a = 0; a < m; a++) file_lanes[a] = &file_key->aes;
+        aes_mb_encrypt(file_lanes, (const uint8_t (*)[16])sv2, ksess, m);
+
+        aes_key_t sess_keys[AES_MB_LANES];
+        aes_key_t *sess_lanes[AES_MB_LANES];
+        const uint8_t *msgs[AES_MB_LANES];
+        size_t lens[AES_MB_LANES];
+        uint8_t cmacs[AES_MB_LANES][16];
+        aes_mb_key_init(sess_keys, (const uint8_t (*)[16])ksess, m);
+        for (size_t a = 0; a < m; a++) {
+            sess_lanes[a] = &sess_keys[a];
+            msgs[a] = (const uint8_t *)taps[idx[a]].mac_input;
+            lens[a] = taps[idx[a]].mac_input_len;
+        }
+        cmac_mb(sess_lanes, msgs, lens, cmacs, m);
+        aes_mb_key_free(sess_keys, m);
+
+        for (size_t a = 0; a < m; a++) {
+            uint8_t mact[8];
+            cmac_truncate_8(cmacs[a], mact);
+            taps[idx[a]].match = (memcmp(mact, taps[idx[a]].mac, 8) == 0);
+        }
+        memset(ksess, 0, sizeof(ksess));
+        sdm_decrypt_enc(v, taps, idx, m);
+    }
+}
+
+ntag424_sdm_verifier_t *ntag424_sdm_verifier_new(const uint8_t sdm_file_key[16]) {
+    ntag424_sdm_verifier_t *v = (ntag424_sdm_verifier_t *)calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    if (!cmac_key_init(&v->file_key, sdm_file_key)) {
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+int ntag424_sdm_verifier_set_meta_key(ntag424_sdm_verifier_t *v, const uint8_t sdm_meta_key[16]) {
+    if (v->has_meta_key) aes_key_free(&v->meta_key);
+    v->has_meta_key = aes_key_init(&v->meta_key, sdm_meta_key);
+    return v->has_meta_key;
+}
+
+void ntag424_sdm_verifier_free(ntag424_sdm_verifier_t *v) {
+    if (!v) return;
+    cmac_key_free(&v->file_key);
+    if (v->has_meta_key) aes_key_free(&v->meta_key);
+    free(v);
+}
+
+static void frame_limits_default(frame_limits_t *lim) {
+    lim->max_le = 0xFF;
+    lim->max_lc = 0xFF;
+}
+
+// Largest APDU the reader takes on the host link (CCID message size), 0 if
+// it does not say.
+static size_t reader_max_apdu(ntag424_card_t *card) {
+    if (card->emu) return 0;
+    uint8_t buf[4] = {0};
+    DWORD len = sizeof(buf);
+    if (SCardGetAttrib(card->handle, SCARD_ATTR_MAXINPUT, buf, &len) != SCARD_S_SUCCESS || len != sizeof(buf)) {
+        return 0;
+    }
+    return (size_t)buf[0] | ((size_t)buf[1] << 8) | ((size_t)buf[2] << 16) | ((size_t)buf[3] << 24);
+}
+
+// Sizes chunks from the CC file. Without ext_ok the short APDU limits still
+// apply, but MLe=0x0100 lets a single READ BINARY return 256 bytes. With
+// ext_ok the reader's own APDU limit caps the extended sizes, so a reader
+// that would reject them is not tried first.
+void ntag424_card_set_frame_limits(ntag424_card_t *card, uint16_t mle, uint16_t mlc, int ext_ok) {
+    frame_limits_t *lim = &card->lim;
+    frame_limits_default(lim);
+    size_t max_le = ext_ok ? EXT_APDU_MAX_DATA : SHORT_APDU_MAX_LE;
+    size_t max_lc = ext_ok ? EXT_APDU_MAX_DATA : SHORT_APDU_MAX_LC;
+    size_t reader_max = ext_ok ? reader_max_apdu(card) : 0;
+    if (reader_max > 9) {
+        // Response data + SW; header + extended Lc + data + extended Le.
+        if (max_le > reader_max - 2) max_le = reader_max - 2 < SHORT_APDU_MAX_LE ? SHORT_APDU_MAX_LE : reader_max - 2;
+        if (max_lc > reader_max - 9) max_lc = reader_max - 9 < SHORT_APDU_MAX_LC ? SHORT_APDU_MAX_LC : reader_max - 9;
+    }
+    if (mle >= 0x000F) lim->max_le = mle < max_le ? mle : max_le;
+    if (mlc >= 0x0001) lim->max_lc = mlc < max_lc ? mlc : max_lc;
+}
+
+int ntag424_parse_ats(const uint8_t *ats, size_t len, ntag424_ats_info_t *info) {
+    static const uint16_t k_fsc[] = {16, 24, 32, 40, 48, 64, 96, 128, 256, 512, 1024, 2048, 4096};
+    memset(info, 0, sizeof(*info));
+    // No T0: FSCI 2 and 106 kbit/s only; FWI 4 is the ISO 14443-4 default.
+    info->fsci = 2;
+    info->fwi = 4;
+    if (len < 1 || ats[0] != len) return 0;
+    size_t pos = 1;
+    if (len > 1) {
+        uint8_t t0 = ats[pos++];
+        info->fsci = t0 & 0x0F;
+        if ((t0 & 0x10) && pos < len) {
+            uint8_t ta1 = ats[pos++];
+            info->same_d = (ta1 & 0x80) != 0;
+            info->ds = (uint8_t)((ta1 >> 4) & 0x07);
+            info->dr = (uint8_t)(ta1 & 0x07);
+        }
+        if ((t0 & 0x20) && pos < len) {
+            info->fwi = (uint8_t)(ats[pos] >> 4);
+            info->sfgi = (uint8_t)(ats[pos] & 0x0F);
+            pos++;
+        }
+        if ((t0 & 0x40) && pos < len) {
+            info->nad = (ats[pos] & 0x01) != 0;
+            info->cid = (ats[pos] & 0x02) != 0;
+            pos++;
+        }
+    }
+    // RFU FSCI values are read as 256 bytes.
+    info->fsc = info->fsci < sizeof(k_fsc) / sizeof(k_fsc[0]) ? k_fsc[info->fsci] : 256;
+    return 1;
+}
+
+unsigned ntag424_ats_max_divisor(const ntag424_ats_info_t *ats, unsigned max_d) {
+    for (unsigned bit = 3; bit-- > 0;) {
+        unsigned d = 2u << bit;
+        if (d > max_d) continue;
+        // Asymmetric rates need the reader to pick DS and DR apart; a common
+        // divisor for both directions is what PPS usually carries anyway.
+        if ((ats->ds & (1u << bit)) && (ats->dr & (1u << bit))) return d;
+    }
+    return 1;
+}
+
+void ntag424_card_set_rf_frames(ntag424_card_t *card, const ntag424_ats_info_t *ats, size_t fsd) {
+    // PCB and CRC_A in every I-block, plus the CID byte when the tag takes one.
+    size_t prologue = 3 + (ats->cid ? 1 : 0);
+    if (fsd == 0) fsd = 256;
+    card->lim.inf_c = ats->fsc > prologue ? ats->fsc - prologue : 0;
+    card->lim.inf_d = fsd > prologue ? fsd - prologue : 0;
+}
+
+// Largest chunk up to max whose exchange (chunk plus overhead bytes of APDU
+// header or status word) fills whole I-blocks of inf bytes, so the reader
+// does not chain a nearly empty last block. Keeps max when that would cut
+// the chunk by more than one block.
+static size_t frame_align(size_t max, size_t overhead, size_t inf) {
+    if (inf == 0 || max + overhead <= inf) return max;
+    size_t n = ((max + overhead) / inf) * inf - overhead;
+    return n + inf > max && n > 0 ? n : max;
+}
+
+long ntag424_card_control(ntag424_card_t *card, unsigned long code, const uint8_t *in, size_t in_len,
+                          uint8_t *out, size_t *out_len) {
+    if (card->emu) return SCARD_E_UNSUPPORTED_FEATURE;
+    DWORD ret = 0;
+    LONG rc = SCardControl(card->handle, (DWORD)code, in, (DWORD)in_len, out, (DWORD)*out_len, &ret);
+    *out_len = rc == SCARD_S_SUCCESS ? (size_t)ret : 0;
+    return rc;
+}
+
+int ntag424_card_set_bit_rate(ntag424_card_t *card, unsigned d_to_tag, unsigned d_from_tag, long *rc_out) {
+    uint8_t br_it = 0, br_ti = 0;
+    while ((1u << br_it) < d_to_tag && br_it < 3) br_it++;
+    while ((1u << br_ti) < d_from_tag && br_ti < 3) br_ti++;
+    // InPSL for target 1 (PN53x), in the reader's FF 00 00 00 pseudo-APDU.
+    uint8_t cmd[] = {0xFF, 0x00, 0x00, 0x00, 0x05, 0xD4, 0x4E, 0x01, br_it, br_ti};
+    uint8_t resp[16];
+    size_t rlen = sizeof(resp);
+    long rc = ntag424_card_control(card, CCID_ESCAPE_IOCTL, cmd, sizeof(cmd), resp, &rlen);
+    if (rc == SCARD_S_SUCCESS && !(rlen >= 3 && resp[0] == 0xD5 && resp[1] == 0x4F && resp[2] == 0x00)) {
+        rc = SCARD_E_UNSUPPORTED_FEATURE;
+    }
+    if (rc_out) *rc_out = rc;
+    return rc == SCARD_S_SUCCESS;
+}
+
+void ntag424_card_frame_limits(const ntag424_card_t *card, size_t *max_le, size_t *max_lc) {
+    if (max_le) *max_le = card->lim.max_le;
+    if (max_lc) *max_lc = card->lim.max_lc;
+}
+
+static int is_length_error(long rc, uint16_t sw) {
+    return rc != SCARD_S_SUCCESS || sw == 0x6700 || (sw & 0xFF00) == 0x6C00;
+}
+
+int ntag424_write_ndef(ntag424_card_t *card, const uint8_t *data, size_t len, uint16_t *sw_out) {
+    frame_limits_t *lim = &card->lim;
+    uint16_t sw = 0;
+    if (!ntag424_select_ndef_app(card, &sw)) {
+        if (sw_out) *sw_out = sw;
+        return 0;
+    }
+    if (!ntag424_select_file(card, 0xE104, &sw)) {
+        if (sw_out) *sw_out = sw;
+        return 0;
+    }
+
+    size_t offset = 0;
+    while (offset < len) {
+        size_t chunk = len - offset;
+        if (chunk > lim->max_lc) {
+            chunk = frame_align(lim->max_lc, lim->max_lc > SHORT_APDU_MAX_LC ? 7 : 5, lim->inf_c);
+        }
+        uint8_t apdu[EXT_APDU_BUF];
+        size_t apdu_len = 0;
+        apdu[apdu_len++] = 0x00;
+        apdu[apdu_len++] = 0xD6; // Update Binary
+        apdu[apdu_len++] = (uint8_t)((offset >> 8) & 0xFF);
+        apdu[apdu_len++] = (uint8_t)(offset & 0xFF);
+        if (chunk > SHORT_APDU_MAX_LC) {
+            apdu[apdu_len++] = 0x00; // extended Lc
+            apdu[apdu_len++] = (uint8_t)((chunk >> 8) & 0xFF);
+        }
+        apdu[apdu_len++] = (uint8_t)(chunk & 0xFF);
+        memcpy(apdu + apdu_len, data + offset, chunk);
+        apdu_len += chunk;
+
+        uint8_t resp[MAX_APDU];
+        size_t rlen = sizeof(resp);
+        sw = 0;
+        long rc = transmit(card, apdu, apdu_len, resp, &rlen, &sw);
+        if (chunk > SHORT_APDU_MAX_LC && is_length_error(rc, sw)) {
+            lim->max_lc = SHORT_APDU_MAX_LC;
+            continue;
+        }
+        if (rc != SCARD_S_SUCCESS || !sw_ok(sw)) {
+            if (sw_out) *sw_out = sw;
+            return 0;
+        }
+        offset += chunk;
+    }
+
+    if (sw_out) *sw_out = 0x9000;
+    return 1;
+}
+
+static uint32_t read_u24_le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+static void write_u24_le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)((v >> 8) & 0xFF);
+    p[2] = (uint8_t)((v >> 16) & 0xFF);
+}
+
+static uint32_t crc32_ieee(const uint8_t *data, size_t len) {
+    // CRC32 as used by NTAG 424 DNA for ChangeKey: init=0xFFFFFFFF, reflected, no final xor.
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j++) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0xEDB88320u;
+            } else {
+                crc >>= 1;
+            }
+        }
+    }
+    return crc;
+}
+
+int ntag424_get_uid(ntag424_card_t *card, uint8_t *uid, size_t *uid_len) {
+    uint8_t apdu[] = {0xFF, 0xCA, 0x00, 0x00, 0x00};
+    uint8_t resp[MAX_APDU];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, sizeof(apdu), resp, &rlen, &sw);
+    if (rc != SCARD_S_SUCCESS || !sw_ok(sw) || rlen == 0) return 0;
+    memcpy(uid, resp, rlen);
+    *uid_len = rlen;
+    return 1;
+}
+
+int ntag424_get_ats(ntag424_card_t *card, uint8_t *ats, size_t *ats_len) {
+    uint8_t apdu[] = {0xFF, 0xCA, 0x01, 0x00, 0x00};
+    uint8_t resp[MAX_APDU];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, sizeof(apdu), resp, &rlen, &sw);
+    if (rc != SCARD_S_SUCCESS || !sw_ok(sw) || rlen == 0) return 0;
+    memcpy(ats, resp, rlen);
+    *ats_len = rlen;
+    return 1;
+}
+
+int ntag424_select_ndef_app(ntag424_card_t *card, uint16_t *sw_out) {
+    uint8_t aid[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
+    uint8_t apdu[5 + sizeof(aid) + 1];
+    size_t apdu_len = 0;
+    apdu[apdu_len++] = 0x00;
+    apdu[apdu_len++] = 0xA4;
+    apdu[apdu_len++] = 0x04;
+    apdu[apdu_len++] = 0x00;
+    apdu[apdu_len++] = (uint8_t)sizeof(aid);
+    memcpy(apdu + apdu_len, aid, sizeof(aid));
+    apdu_len += sizeof(aid);
+    apdu[apdu_len++] = 0x00;
+
+    uint8_t resp[MAX_APDU];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, apdu_len, resp, &rlen, &sw);
+    if (sw_out) *sw_out = sw;
+    if (rc != SCARD_S_SUCCESS) return 0;
+    return sw_ok(sw);
+}
+
+int ntag424_select_file(ntag424_card_t *card, uint16_t file_id, uint16_t *sw_out) {
+    uint8_t apdu[] = {0x00, 0xA4, 0x00, 0x0C, 0x02,
+                      (uint8_t)((file_id >> 8) & 0xFF), (uint8_t)(file_id & 0xFF)};
+    uint8_t resp[MAX_APDU];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, sizeof(apdu), resp, &rlen, &sw);
+    if (sw_out) *sw_out = sw;
+    if (rc != SCARD_S_SUCCESS) return 0;
+    return sw_ok(sw);
+}
+
+// READ BINARY of le bytes (1..EXT_APDU_MAX_DATA). Le up to 256 goes out as a
+// short APDU, anything larger in extended form. *out_len is the capacity of
+// out on entry.
+int ntag424_read_binary(ntag424_card_t *card, uint16_t offset, size_t le,
+                        uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    if (le == 0 || le > EXT_APDU_MAX_DATA) return 0;
+    uint8_t apdu[7] = {0x00, 0xB0, (uint8_t)((offset >> 8) & 0xFF), (uint8_t)(offset & 0xFF)};
+    size_t apdu_len = 4;
+    if (le > SHORT_APDU_MAX_LE) {
+        apdu[apdu_len++] = 0x00;
+        apdu[apdu_len++] = (uint8_t)((le >> 8) & 0xFF);
+    }
+    apdu[apdu_len++] = (uint8_t)(le & 0xFF);
+
+    uint8_t resp[EXT_APDU_BUF];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, apdu_len, resp, &rlen, &sw);
+    if (rc != SCARD_S_SUCCESS) return 0;
+
+    if ((sw & 0xFF00) == 0x6C00) {
+        apdu[4] = (uint8_t)(sw & 0x00FF);
+        rlen = sizeof(resp);
+        rc = transmit(card, apdu, 5, resp, &rlen, &sw);
+        if (rc != SCARD_S_SUCCESS) return 0;
+    }
+
+    if (sw_out) *sw_out = sw;
+    if (!sw_ok(sw) || rlen > *out_len) return 0;
+    memcpy(out, resp, rlen);
+    *out_len = rlen;
+    return 1;
+}
+
+int ntag424_read_binary_chunked(ntag424_card_t *card, uint16_t offset, size_t len,
+                                uint8_t *out, size_t *got, uint16_t *sw_out) {
+    size_t total = 0;
+    *got = 0;
+    while (total < len) {
+        size_t remaining = len - total;
+        size_t chunk = remaining > card->lim.max_le ? frame_align(card->lim.max_le, 2, card->lim.inf_d) : remaining;
+        size_t n = remaining;
+        if (!ntag424_read_binary(card, (uint16_t)(offset + total), chunk, out + total, &n, sw_out)) {
+            if (chunk > SHORT_APDU_MAX_LE) {
+                card->lim.max_le = SHORT_APDU_MAX_LE; // reader refused extended Le
+                continue;
+            }
+            return 0;
+        }
+        if (n == 0) return 0;
+        total += n;
+        *got = total;
+    }
+    return 1;
+}
+
+// Releases the cached key schedules and wipes the session keys. Safe on a
+// zeroed or already cleared session.
+void ntag424_session_clear(ntag424_session_t *sess) {
+    if (!sess) return;
+    aes_key_free(&sess->enc_key);
+    cmac_key_free(&sess->mac_key);
+    memset(sess, 0, sizeof(*sess));
+}
+
+ntag424_session_t *ntag424_session_new(void) {
+    return (ntag424_session_t *)calloc(1, sizeof(ntag424_session_t));
+}
+
+void ntag424_session_free(ntag424_session_t *sess) {
+    ntag424_session_clear(sess);
+    free(sess);
+}
+
+int ntag424_session_active(const ntag424_session_t *sess) {
+    return sess && sess->authenticated;
+}
+
+uint8_t ntag424_session_key_no(const ntag424_session_t *sess) {
+    return sess->key_no;
+}
+
+uint16_t ntag424_session_cmd_ctr(const ntag424_session_t *sess) {
+    return sess->cmd_ctr;
+}
+
+const uint8_t *ntag424_session_ti(const ntag424_session_t *sess) {
+    return sess->ti;
+}
+
+// Part 1 of EV2First: 90 71 00 00 02 KeyNo LenCap 00 (LenCap=0)
+static size_t auth_part1_apdu(uint8_t key_no, uint8_t *apdu) {
+    apdu[0] = 0x90;
+    apdu[1] = 0x71;
+    apdu[2] = 0x00;
+    apdu[3] = 0x00;
+    apdu[4] = 0x02;
+    apdu[5] = key_no;
+    apdu[6] = 0x00; // LenCap = 0
+    apdu[7] = 0x00;
+    return 8;
+}
+
+// Decrypts RndB from the part 1 response, picks RndA and builds part 2:
+// 90 AF 00 00 20 <RndA||RndB'> 00
+static int auth_part2_apdu(const ntag424_context_t *ctx, const uint8_t key[16], const uint8_t *resp, size_t rlen,
+                           uint16_t sw, uint8_t rndA[16], uint8_t rndB[16], uint8_t *apdu, size_t *apdu_len) {
+    if (sw != 0x91AF || rlen != 16) return 0;
+
+    uint8_t iv0[16] = {0};
+    if (!aes_cbc_crypt(0, key, iv0, resp, 16, rndB)) return 0;
+
+    if (ctx->random) ctx->random(ctx->random_user, rndA, 16);
+    else if (!ntag424_random_bytes(rndA, 16)) return 0;
+
+    uint8_t rndB_rot[16];
+    rotate_left_1(rndB_rot, rndB, 16);
+
+    uint8_t rndAB[32];
+    memcpy(rndAB, rndA, 16);
+    memcpy(rndAB + 16, rndB_rot, 16);
+
+    uint8_t rndAB_enc[32];
+    if (!aes_cbc_crypt(1, key, iv0, rndAB, 32, rndAB_enc)) return 0;
+
+    apdu[0] = 0x90;
+    apdu[1] = 0xAF;
+    apdu[2] = 0x00;
+    apdu[3] = 0x00;
+    apdu[4] = 0x20;
+    memcpy(apdu + 5, rndAB_enc, 32);
+    apdu[37] = 0x00;
+    *apdu_len = 38;
+    return 1;
+}
+
+// Derives the session keys of an EV2First authentication; the tag side of
+// the emulator uses it too.
+static int session_derive(ntag424_session_t *sess, const uint8_t key[16], uint8_t key_no,
+                          const uint8_t rndA[16], const uint8_t rndB[16], const uint8_t ti[4]) {
+    // SV1/SV2 = prefix || RndA[15:14] || (RndA[13:8] ^ RndB[15:10]) ||
+    // RndB[9:0] || RndA[7:0], MAC-ed piecewise under the one key schedule.
+    static const uint8_t prefix1[6] = {0xA5, 0x5A, 0x00, 0x01, 0x00, 0x80};
+    static const uint8_t prefix2[6] = {0x5A, 0xA5, 0x00, 0x01, 0x00, 0x80};
+    uint8_t xor_part[6];
+    for (int i = 0; i < 6; i++) {
+        xor_part[i] = rndA[2 + i] ^ rndB[i];
+    }
+
+    cmac_key_t ck;
+    if (!cmac_key_init(&ck, key)) return 0;
+    int ok = 1;
+    for (int i = 0; i < 2 && ok; i++) {
+        cmac_ctx_t c;
+        cmac_init(&c, &ck);
+        ok = cmac_update(&c, i == 0 ? prefix1 : prefix2, 6) &&
+             cmac_update(&c, rndA, 2) &&
+             cmac_update(&c, xor_part, 6) &&
+             cmac_update(&c, rndB + 6, 10) &&
+             cmac_update(&c, rndA + 8, 8) &&
+             cmac_final(&c, i == 0 ? sess->kenc : sess->kmac);
+    }
+    cmac_key_free(&ck);
+    if (!ok) return 0;
+    if (!aes_key_init(&sess->enc_key, sess->kenc)) return 0;
+    if (!cmac_key_init(&sess->mac_key, sess->kmac)) {
+        aes_key_free(&sess->enc_key);
+        return 0;
+    }
+    memcpy(sess->ti, ti, 4);
+    sess->cmd_ctr = 0;
+    sess->key_no = key_no;
+    sess->authenticated = 1;
+    return 1;
+}
+
+// Checks RndA' from the part 2 response and derives the session keys.
+static int auth_finish(const uint8_t key[16], uint8_t key_no, const uint8_t rndA[16], const uint8_t rndB[16],
+                       const uint8_t *resp, size_t rlen, uint16_t sw, ntag424_session_t *sess) {
+    if (sw != 0x9100 || rlen != 32) return 0;
+
+    uint8_t iv0[16] = {0};
+    uint8_t dec[32];
+    if (!aes_cbc_crypt(0, key, iv0, resp, 32, dec)) return 0;
+
+    uint8_t ti[4];
+    memcpy(ti, dec, 4);
+
+    uint8_t rndA_rot[16];
+    memcpy(rndA_rot, dec + 4, 16);
+
+    uint8_t rndA_check[16];
+    rotate_right_1(rndA_check, rndA_rot, 16);
+    if (memcmp(rndA_check, rndA, 16) != 0) return 0;
+    return session_derive(sess, key, key_no, rndA, rndB, ti);
+}
+
+// Secure messaging, command side. With encrypt set this is CommMode.Full
+// (data encrypted both ways); otherwise CommMode.MAC, where data travels in
+// clear and only the MACs protect it (e.g. GetFileSettings). The frame is
+// built in place: data is padded and encrypted inside apdu, and the MAC is
+// streamed over the header fields and the frame body without gathering them.
+// apdu must hold MAX_APDU bytes.
+static int ssm_wrap(ntag424_session_t *sess, int encrypt,
+                    uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                    const uint8_t *cmd_data, size_t cmd_data_len,
+                    uint8_t *apdu, size_t *apdu_len_out) {
+    if (!sess || !sess->authenticated) return 0;
+
+    size_t enc_len = cmd_data_len;
+    if (encrypt && cmd_data_len > 0) enc_len = (cmd_data_len / 16 + 1) * 16;
+    size_t data_len = cmd_header_len + enc_len + 8;
+    if (data_len > 255) return 0;
+
+    apdu[0] = 0x90;
+    apdu[1] = cmd;
+    apdu[2] = 0x00;
+    apdu[3] = 0x00;
+    apdu[4] = (uint8_t)data_len;
+    uint8_t *header = apdu + 5;
+    uint8_t *payload = header + cmd_header_len;
+    if (cmd_header_len > 0) memcpy(header, cmd_header, cmd_header_len);
+    if (cmd_data_len > 0) memcpy(payload, cmd_data, cmd_data_len);
+
+    uint8_t ctr[2] = {(uint8_t)(sess->cmd_ctr & 0xFF), (uint8_t)((sess->cmd_ctr >> 8) & 0xFF)};
+    if (encrypt && cmd_data_len > 0) {
+        uint8_t ivc[16] = {0};
+        ivc[0] = 0xA5;
+        ivc[1] = 0x5A;
+        memcpy(ivc + 2, sess->ti, 4);
+        memcpy(ivc + 6, ctr, 2);
+        if (!aes_key_ecb_encrypt(&sess->enc_key, ivc, ivc)) return 0;
+        pad_iso9797_m2(payload, cmd_data_len);
+        if (!aes_key_cbc(&sess->enc_key, 1, ivc, payload, enc_len, payload)) return 0;
+    }
+
+    cmac_ctx_t mac;
+    cmac_init(&mac, &sess->mac_key);
+    uint8_t cmac[16];
+    if (!cmac_update(&mac, &cmd, 1) || !cmac_update(&mac, ctr, 2) ||
+        !cmac_update(&mac, sess->ti, 4) || !cmac_update(&mac, header, cmd_header_len) ||
+        !cmac_update(&mac, payload, enc_len) || !cmac_final(&mac, cmac)) {
+        return 0;
+    }
+    cmac_truncate_8(cmac, payload + enc_len);
+
+    size_t apdu_len = 5 + data_len;
+    apdu[apdu_len++] = 0x00;
+    *apdu_len_out = apdu_len;
+    return 1;
+}
+
+// Secure messaging, response side: checks the response MAC, decrypts in
+// CommMode.Full and advances CmdCtr. *out_len is the capacity of out on entry.
+// Ciphertext is decrypted straight into out; only the padded last block
+// goes through a local block so out need not have room for the padding.
+static int ssm_unwrap(ntag424_session_t *sess, int encrypt, uint16_t sw,
+                      const uint8_t *resp, size_t rlen,
+                      uint8_t *out, size_t *out_len) {
+    if ((sw & 0xFF00) != 0x9100) return 0;
+    if (rlen < 8) return 0;
+
+    size_t resp_enc_len = rlen - 8;
+    const uint8_t *resp_enc = resp;
+    const uint8_t *resp_mact = resp + resp_enc_len;
+
+    uint16_t cmdctr1 = (uint16_t)(sess->cmd_ctr + 1);
+    uint8_t sw2 = (uint8_t)(sw & 0x00FF);
+    uint8_t ctr[2] = {(uint8_t)(cmdctr1 & 0xFF), (uint8_t)((cmdctr1 >> 8) & 0xFF)};
+    cmac_ctx_t mac;
+    cmac_init(&mac, &sess->mac_key);
+    uint8_t cmac2[16];
+    if (!cmac_update(&mac, &sw2, 1) || !cmac_update(&mac, ctr, 2) ||
+        !cmac_update(&mac, sess->ti, 4) || !cmac_update(&mac, resp_enc, resp_enc_len) ||
+        !cmac_final(&mac, cmac2)) {
+        return 0;
+    }
+    uint8_t mact2[8];
+    cmac_truncate_8(cmac2, mact2);
+    if (memcmp(resp_mact, mact2, 8) != 0) return 0;
+
+    size_t out_written = 0;
+    if (resp_enc_len > 0 && !encrypt) {
+        if (resp_enc_len > *out_len) return 0;
+        memcpy(out, resp_enc, resp_enc_len);
+        out_written = resp_enc_len;
+    } else if (resp_enc_len > 0) {
+        if ((resp_enc_len % 16) != 0) return 0;
+        uint8_t ivr[16] = {0};
+        ivr[0] = 0x5A;
+        ivr[1] = 0xA5;
+        memcpy(ivr + 2, sess->ti, 4);
+        memcpy(ivr + 6, ctr, 2);
+        if (!aes_key_ecb_encrypt(&sess->enc_key, ivr, ivr)) return 0;
+
+        size_t head = resp_enc_len - 16;
+        if (head > *out_len) return 0;
+        if (head > 0 && !aes_key_cbc(&sess->enc_key, 0, ivr, resp_enc, head, out)) return 0;
+        uint8_t last[16];
+        const uint8_t *last_iv = head > 0 ? resp_enc + head - 16 : ivr;
+        if (!aes_key_cbc(&sess->enc_key, 0, last_iv, resp_enc + head, 16, last)) return 0;
+        size_t tail = unpad_iso9797_m2(last, 16);
+        if (head + tail > *out_len) return 0;
+        memcpy(out + head, last, tail);
+        memset(last, 0, sizeof(last));
+        out_written = head + tail;
+    }
+
+    *out_len = out_written;
+    sess->cmd_ctr = cmdctr1;
+    return 1;
+}
+
+// Tag operations as state machines over APDU exchanges. op_step is called
+// once to produce the first frame and then once per response; it either
+// leaves the next frame in op->apdu (OP_SEND) or finishes (OP_DONE). The
+// blocking API drives it in place with op_run, the engine below from its
+// event loop, so both share one implementation.
+enum {
+    OP_AUTH,
+    OP_SSM,
+    OP_PLAIN,
+    OP_DATA
+};
+
+enum {
+    OP_SEND,
+    OP_DONE
+};
+
+enum {
+    OP_POST_NONE,
+    OP_POST_COUNTER,
+    OP_POST_SESSION_END
+};
+
+struct ntag424_op {
+    int kind;
+    int post;
+    int state;
+    ntag424_card_t *card;
+    ntag424_session_t *sess;
+
+    uint8_t apdu[MAX_APDU];
+    size_t apdu_len;
+    uint8_t resp[MAX_APDU];
+    size_t resp_len;
+    uint16_t sw;
+    long rc;
+
+    // OP_AUTH
+    uint8_t key[16];
+    uint8_t key_no;
+    uint8_t rndA[16];
+    uint8_t rndB[16];
+
+    // OP_SSM: the command is wrapped on the first step, so header and data
+    // only need to live that long. The async constructors point them at buf.
+    int encrypt;
+    uint8_t cmd;
+    const uint8_t *header;
+    size_t header_len;
+    const uint8_t *data;
+    size_t data_len;
+    uint8_t buf[32];
+    uint8_t *out;
+    size_t out_cap;
+    size_t out_len;
+    uint8_t out_buf[16];
+
+    // OP_DATA: ReadData / WriteData over additional frames (cmd 0xAD or
+    // 0x8D). The CBC chain and the MAC run across the frames, so only one
+    // frame is held at a time; data / out are the caller's buffers.
+    uint8_t comm_mode;
+    uint8_t data_hdr[7];
+    size_t data_pos;        // write: plaintext consumed
+    uint8_t iv[16];
+    cmac_ctx_t data_mac;
+    uint8_t blk[16];        // write: stream bytes not yet framed
+    size_t blk_pos;
+    size_t blk_len;
+    int padded;
+    int mac_done;
+    uint8_t tail[48];       // read: bytes that may still be padding or MAC
+    size_t tail_len;
+
+    int ok;
+    uint32_t counter;
+
+    ntag424_op_done_fn done;
+    void *user;
+    ntag424_op_t *next;
+};
+
+static void op_init(ntag424_op_t *op, int kind, ntag424_card_t *card, ntag424_session_t *sess) {
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    op->card = card;
+    op->sess = sess;
+}
+
+static void op_init_auth(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess,
+                         const uint8_t key[16], uint8_t key_no) {
+    op_init(op, OP_AUTH, card, sess);
+    memcpy(op->key, key, 16);
+    op->key_no = key_no;
+}
+
+static void op_init_ssm(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess, int encrypt,
+                        uint8_t cmd, const uint8_t *header, size_t header_len,
+                        const uint8_t *data, size_t data_len,
+                        uint8_t *out, size_t out_cap) {
+    op_init(op, OP_SSM, card, sess);
+    op->encrypt = encrypt;
+    op->cmd = cmd;
+    op->header = header;
+    op->header_len = header_len;
+    op->data = data;
+    op->data_len = data_len;
+    op->out = out;
+    op->out_cap = out_cap;
+}
+
+// GetFileCounters, plain or in CommMode.Full; the counter lands in op->counter.
+static void op_init_counter(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no) {
+    if (sess) {
+        op_init_ssm(op, card, sess, 1, 0xF6, op->buf, 1, NULL, 0, op->out_buf, sizeof(op->out_buf));
+    } else {
+        op_init(op, OP_PLAIN, card, NULL);
+        uint8_t apdu[] = {0x90, 0xF6, 0x00, 0x00, 0x01, file_no, 0x00};
+        memcpy(op->apdu, apdu, sizeof(apdu));
+        op->apdu_len = sizeof(apdu);
+        op->out = op->out_buf;
+        op->out_cap = sizeof(op->out_buf);
+    }
+    op->buf[0] = file_no;
+    op->post = OP_POST_COUNTER;
+}
+
+static int op_finish(ntag424_op_t *op, int ok) {
+    if (ok && op->post == OP_POST_COUNTER) {
+        if (op->out_len < 3) {
+            ok = 0;
+        } else {
+            op->counter = (uint32_t)op->out[0] | ((uint32_t)op->out[1] << 8) | ((uint32_t)op->out[2] << 16);
+        }
+    }
+    op->ok = ok;
+    memset(op->rndA, 0, sizeof(op->rndA));
+    memset(op->rndB, 0, sizeof(op->rndB));
+    return OP_DONE;
+}
+
+// ReadData / WriteData. FileNo || Offset || Length is the command header in
+// every CommMode; data longer than one frame continues in 0xAF frames.
+#define DATA_HDR_LEN 7
+
+static void op_init_data(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess, uint8_t cmd,
+                         uint8_t comm_mode, uint8_t file_no, uint32_t offset, uint32_t len) {
+    op_init(op, OP_DATA, card, sess);
+    op->cmd = cmd;
+    op->comm_mode = comm_mode & 0x03;
+    op->data_hdr[0] = file_no;
+    write_u24_le(op->data_hdr + 1, offset);
+    write_u24_le(op->data_hdr + 4, len);
+}
+
+// Stream bytes per frame: one I-block once the tag's FSC is known (5 byte
+// header and Le besides the data), else a full short APDU.
+static size_t data_frame_cap(const ntag424_card_t *card) {
+    size_t cap = card->lim.inf_c > 6 + 16 ? card->lim.inf_c - 6 : SHORT_APDU_MAX_LC;
+    return cap > SHORT_APDU_MAX_LC ? SHORT_APDU_MAX_LC : cap;
+}
+
+static int data_write_left(const ntag424_op_t *op) {
+    if (op->blk_pos < op->blk_len) return 1;
+    if (op->comm_mode == 0x03) return !op->padded || !op->mac_done;
+    return op->data_pos < op->data_len || (op->comm_mode == 0x01 && !op->mac_done);
+}
+
+// Next cap bytes of the WriteData stream: the data (encrypted block by block
+// in CommMode.Full), then the command MAC unless the file is plain.
+static int data_write_fill(ntag424_op_t *op, uint8_t *dst, size_t cap, size_t *n_out) {
+    size_t n = 0;
+    while (n < cap) {
+        if (op->blk_pos < op->blk_len) {
+            size_t k = op->blk_len - op->blk_pos;
+            if (k > cap - n) k = cap - n;
+            memcpy(dst + n, op->blk + op->blk_pos, k);
+            op->blk_pos += k;
+            n += k;
+        } else if (op->comm_mode == 0x03 && !op->padded) {
+            // The last block carries the padding, a whole block of it if the
+            // data ends on a block boundary.
+            size_t k = op->data_len - op->data_pos;
+            if (k > 16) k = 16;
+            memcpy(op->blk, op->data + op->data_pos, k);
+            op->data_pos += k;
+            if (k < 16) {
+                pad_iso9797_m2(op->blk, k);
+                op->padded = 1;
+            }
+            if (!aes_key_cbc(&op->sess->enc_key, 1, op->iv, op->blk, 16, op->blk) ||
+                !cmac_update(&op->data_mac, op->blk, 16)) {
+                return 0;
+            }
+            memcpy(op->iv, op->blk, 16);
+            op->blk_pos = 0;
+            op->blk_len = 16;
+        } else if (op->comm_mode != 0x03 && op->data_pos < op->data_len) {
+            size_t k = op->data_len - op->data_pos;
+            if (k > cap - n) k = cap - n;
+            memcpy(dst + n, op->data + op->data_pos, k);
+            if (op->comm_mode == 0x01 && !cmac_update(&op->data_mac, dst + n, k)) return 0;
+            op->data_pos += k;
+            n += k;
+        } else if (op->comm_mode != 0x00 && !op->mac_done) {
+            uint8_t cmac[16];
+            if (!cmac_final(&op->data_mac, cmac)) return 0;
+            cmac_truncate_8(cmac, op->blk);
+            op->blk_pos = 0;
+            op->blk_len = 8;
+            op->mac_done = 1;
+        } else {
+            break;
+        }
+    }
+    *n_out = n;
+    return 1;
+}
+
+// Takes one ReadData response frame. Up to 24 bytes are held back until the
+// last frame: they may be the MAC and the padded last block.
+static int data_read_take(ntag424_op_t *op, const uint8_t *frame, size_t len, int last) {
+    uint8_t work[sizeof(op->tail) + MAX_APDU];
+    if (len > MAX_APDU) return 0;
+    memcpy(work, op->tail, op->tail_len);
+    memcpy(work + op->tail_len, frame, len);
+    size_t work_len = op->tail_len + len;
+    size_t mac_len = op->comm_mode == 0x00 ? 0 : 8;
+
+    size_t body;
+    if (last) {
+        if (work_len < mac_len) return 0;
+        body = work_len - mac_len;
+        if (op->comm_mode == 0x03 && (body == 0 || body % 16 != 0)) return 0;
+    } else {
+        size_t keep = op->comm_mode == 0x03 ? 24 : mac_len;
+        body = work_len > keep ? work_len - keep : 0;
+        if (op->comm_mode == 0x03) body -= body % 16;
+    }
+
+    if (mac_len > 0 && !cmac_update(&op->data_mac, work, body)) return 0;
+    if (op->comm_mode != 0x03) {
+        if (op->out_len + body > op->out_cap) return 0;
+        memcpy(op->out + op->out_len, work, body);
+        op->out_len += body;
+    } else if (body > 0) {
+        size_t head = last ? body - 16 : body;
+        if (op->out_len + head > op->out_cap) return 0;
+        if (head > 0 && !aes_key_cbc(&op->sess->enc_key, 0, op->iv, work, head, op->out + op->out_len)) return 0;
+        op->out_len += head;
+        if (head > 0) memcpy(op->iv, work + head - 16, 16);
+        if (last) {
+            uint8_t block[16];
+            if (!aes_key_cbc(&op->sess->enc_key, 0, op->iv, work + head, 16, block)) return 0;
+            size_t tail = unpad_iso9797_m2(block, 16);
+            int ok = tail < 16 && op->out_len + tail <= op->out_cap;
+            if (ok) memcpy(op->out + op->out_len, block, tail);
+            memset(block, 0, sizeof(block));
+            if (!ok) return 0;
+            op->out_len += tail;
+        }
+    }
+
+    int ok = 1;
+    if (last && mac_len > 0) {
+        uint8_t cmac[16], mact[8];
+        ok = cmac_final(&op->data_mac, cmac);
+        cmac_truncate_8(cmac, mact);
+        ok = ok && memcmp(mact, work + body, 8) == 0;
+        op->tail_len = 0;
+    } else {
+        op->tail_len = work_len - body;
+        memcpy(op->tail, work + body, op->tail_len);
+    }
+    memset(work, 0, sizeof(work));
+    return ok;
+}
+
+// Starts the 0xAD / 0x8D frame and, outside CommMode.Plain, the MAC and IV
+// of the command (WriteData) or of the response (ReadData).
+static int data_first_frame(ntag424_op_t *op) {
+    ntag424_session_t *sess = op->sess;
+    int secure = op->comm_mode != 0x00;
+    if (secure && !ntag424_session_active(sess)) return 0;
+    uint16_t ctr = secure ? (uint16_t)(sess->cmd_ctr + (op->cmd == 0xAD ? 1 : 0)) : 0;
+    uint8_t ctr_le[2] = {(uint8_t)(ctr & 0xFF), (uint8_t)(ctr >> 8)};
+
+    if (op->cmd == 0xAD) {
+        if (secure) {
+            if (!ssm_wrap(sess, 0, 0xAD, op->data_hdr, DATA_HDR_LEN, NULL, 0, op->apdu, &op->apdu_len)) return 0;
+            uint8_t sw2 = 0x00;
+            cmac_init(&op->data_mac, &sess->mac_key);
+            if (!cmac_update(&op->data_mac, &sw2, 1) || !cmac_update(&op->data_mac, ctr_le, 2) ||
+                !cmac_update(&op->data_mac, sess->ti, 4)) {
+                return 0;
+            }
+        } else {
+            uint8_t *a = op->apdu;
+            a[0] = 0x90;
+            a[1] = 0xAD;
+            a[2] = 0x00;
+            a[3] = 0x00;
+            a[4] = DATA_HDR_LEN;
+            memcpy(a + 5, op->data_hdr, DATA_HDR_LEN);
+            a[5 + DATA_HDR_LEN] = 0x00;
+            op->apdu_len = 6 + DATA_HDR_LEN;
+        }
+    } else if (secure) {
+        uint8_t cmd = 0x8D;
+        cmac_init(&op->data_mac, &sess->mac_key);
+        if (!cmac_update(&op->data_mac, &cmd, 1) || !cmac_update(&op->data_mac, ctr_le, 2) ||
+            !cmac_update(&op->data_mac, sess->ti, 4) || !cmac_update(&op->data_mac, op->data_hdr, DATA_HDR_LEN)) {
+            return 0;
+        }
+    }
+
+    if (op->comm_mode == 0x03) {
+        uint8_t iv[16] = {0};
+        iv[0] = op->cmd == 0xAD ? 0x5A : 0xA5;
+        iv[1] = op->cmd == 0xAD ? 0xA5 : 0x5A;
+        memcpy(iv + 2, sess->ti, 4);
+        memcpy(iv + 6, ctr_le, 2);
+        if (!aes_key_ecb_encrypt(&sess->enc_key, iv, op->iv)) return 0;
+    }
+    return 1;
+}
+
+// WriteData frame: 90 8D 00 00 Lc FileNo Offset Length stream 00 first,
+// 90 AF 00 00 Lc stream 00 after.
+static int data_write_frame(ntag424_op_t *op, int first) {
+    uint8_t *a = op->apdu;
+    size_t hdr = first ? DATA_HDR_LEN : 0;
+    size_t n = 0;
+    if (!data_write_fill(op, a + 5 + hdr, data_frame_cap(op->card) - hdr, &n)) return 0;
+    a[0] = 0x90;
+    a[1] = first ? 0x8D : 0xAF;
+    a[2] = 0x00;
+    a[3] = 0x00;
+    a[4] = (uint8_t)(hdr + n);
+    if (first) memcpy(a + 5, op->data_hdr, DATA_HDR_LEN);
+    a[5 + hdr + n] = 0x00;
+    op->apdu_len = 6 + hdr + n;
+    return 1;
+}
+
+static int data_step(ntag424_op_t *op, int state) {
+    ntag424_session_t *sess = op->sess;
+    if (state == 0) {
+        if (!data_first_frame(op)) return op_finish(op, 0);
+        if (op->cmd == 0x8D && !data_write_frame(op, 1)) return op_finish(op, 0);
+        return OP_SEND;
+    }
+
+    if (op->sw == 0x91AF) {
+        if (op->cmd == 0xAD) {
+            if (!data_read_take(op, op->resp, op->resp_len, 0)) return op_finish(op, 0);
+        } else if (op->resp_len != 0 || !data_write_left(op) || !data_write_frame(op, 0)) {
+            return op_finish(op, 0);
+        }
+        if (op->cmd == 0xAD) {
+            static const uint8_t more[] = {0x90, 0xAF, 0x00, 0x00, 0x00};
+            memcpy(op->apdu, more, sizeof(more));
+            op->apdu_len = sizeof(more);
+        }
+        return OP_SEND;
+    }
+    if (op->sw != 0x9100) return op_finish(op, 0);
+
+    int ok;
+    if (op->cmd == 0xAD) {
+        ok = data_read_take(op, op->resp, op->resp_len, 1);
+    } else if (data_write_left(op)) {
+        ok = 0;
+    } else if (op->comm_mode == 0x00) {
+        ok = op->resp_len == 0;
+    } else {
+        size_t none = 0;
+        ok = ssm_unwrap(sess, 0, op->sw, op->resp, op->resp_len, NULL, &none);
+    }
+    // A plain command inside a session still counts; the secure ones advanced
+    // CmdCtr while checking the response MAC.
+    if (ok && ntag424_session_active(sess)) {
+        if (op->comm_mode == 0x00) sess->cmd_ctr++;
+        else if (op->cmd == 0xAD) sess->cmd_ctr++;
+    }
+    return op_finish(op, ok);
+}
+
+// Advances op by one exchange. On entry after the first step, op->resp,
+// resp_len, sw and rc hold the card's answer to op->apdu.
+static int op_step(ntag424_op_t *op) {
+    int state = op->state++;
+    if (state > 0 && op->rc != SCARD_S_SUCCESS) return op_finish(op, 0);
+
+    switch (op->kind) {
+        case OP_AUTH:
+            if (state == 0) {
+                ntag424_session_clear(op->sess);
+                op->apdu_len = auth_part1_apdu(op->key_no, op->apdu);
+                return OP_SEND;
+            }
+            if (state == 1) {
+                if (!auth_part2_apdu(op->card->ctx, op->key, op->resp, op->resp_len, op->sw,
+                                     op->rndA, op->rndB, op->apdu, &op->apdu_len)) {
+                    return op_finish(op, 0);
+                }
+                return OP_SEND;
+            }
+            return op_finish(op, auth_finish(op->key, op->key_no, op->rndA, op->rndB,
+                                             op->resp, op->resp_len, op->sw, op->sess));
+
+        case OP_SSM:
+            if (state == 0) {
+                if (!ssm_wrap(op->sess, op->encrypt, op->cmd, op->header, op->header_len,
+                              op->data, op->data_len, op->apdu, &op->apdu_len)) {
+                    return op_finish(op, 0);
+                }
+                return OP_SEND;
+            }
+            if (op->post == OP_POST_SESSION_END) {
+                // The command ended the session; the answer carries no MAC.
+                ntag424_session_clear(op->sess);
+                return op_finish(op, op->sw == 0x9100 && op->resp_len == 0);
+            }
+            op->out_len = op->out_cap;
+            return op_finish(op, ssm_unwrap(op->sess, op->encrypt, op->sw, op->resp, op->resp_len,
+                                            op->out, &op->out_len));
+
+        case OP_DATA:
+            return data_step(op, state);
+
+        case OP_PLAIN:
+            if (state == 0) return OP_SEND;
+            if (!sw_ok(op->sw) || op->resp_len > op->out_cap) return op_finish(op, 0);
+            memcpy(op->out, op->resp, op->resp_len);
+            op->out_len = op->resp_len;
+            return op_finish(op, 1);
+    }
+    return op_finish(op, 0);
+}
+
+static void op_exchange(ntag424_op_t *op) {
+    op->resp_len = sizeof(op->resp);
+    op->sw = 0;
+    op->rc = transmit(op->card, op->apdu, op->apdu_len, op->resp, &op->resp_len, &op->sw);
+}
+
+// Runs op to completion on the calling thread.
+static int op_run(ntag424_op_t *op, uint16_t *sw_out) {
+    while (op_step(op) == OP_SEND) {
+        op_exchange(op);
+        if (sw_out) *sw_out = op->sw;
+    }
+    return op->ok;
+}
+
+int ntag424_authenticate_ev2_first(ntag424_card_t *card, ntag424_session_t *sess,
+                                   const uint8_t key[16], uint8_t key_no) {
+    ntag424_op_t op;
+    op_init_auth(&op, card, sess, key, key_no);
+    int ok = op_run(&op, NULL);
+    memset(op.key, 0, sizeof(op.key));
+    return ok;
+}
+
+static int ssm_cmd(ntag424_card_t *card, ntag424_session_t *sess, int encrypt,
+                   uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                   const uint8_t *cmd_data, size_t cmd_data_len,
+                   uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    ntag424_op_t op;
+    op_init_ssm(&op, card, sess, encrypt, cmd, cmd_header, cmd_header_len,
+                cmd_data, cmd_data_len, out, *out_len);
+    if (!op_run(&op, sw_out)) return 0;
+    *out_len = op.out_len;
+    return 1;
+}
+
+int ntag424_cmd_full(ntag424_card_t *card, ntag424_session_t *sess,
+                     uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                     const uint8_t *cmd_data, size_t cmd_data_len,
+                     uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    return ssm_cmd(card, sess, 1, cmd, cmd_header, cmd_header_len,
+                   cmd_data, cmd_data_len, out, out_len, sw_out);
+}
+
+int ntag424_cmd_mac(ntag424_card_t *card, ntag424_session_t *sess,
+                    uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                    const uint8_t *cmd_data, size_t cmd_data_len,
+                    uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    return ssm_cmd(card, sess, 0, cmd, cmd_header, cmd_header_len,
+                   cmd_data, cmd_data_len, out, out_len, sw_out);
+}
+
+static void op_init_read_data(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess,
+                              uint8_t comm_mode, uint8_t file_no, uint32_t offset, uint32_t len,
+                              uint8_t *out, size_t out_cap) {
+    op_init_data(op, card, sess, 0xAD, comm_mode, file_no, offset, len);
+    op->out = out;
+    op->out_cap = out_cap;
+}
+
+static void op_init_write_data(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess,
+                               uint8_t comm_mode, uint8_t file_no, uint32_t offset,
+                               const uint8_t *data, size_t len) {
+    op_init_data(op, card, sess, 0x8D, comm_mode, file_no, offset, (uint32_t)len);
+    op->data = data;
+    op->data_len = len;
+}
+
+int ntag424_read_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode, uint8_t file_no,
+                      uint32_t offset, uint32_t len, uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    if (offset > 0xFFFFFF || len > 0xFFFFFF) return 0;
+    ntag424_op_t op;
+    op_init_read_data(&op, card, sess, comm_mode, file_no, offset, len, out, *out_len);
+    int ok = op_run(&op, sw_out) && (len == 0 || op.out_len == len);
+    memset(op.iv, 0, sizeof(op.iv));
+    if (!ok) return 0;
+    *out_len = op.out_len;
+    return 1;
+}
+
+int ntag424_write_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode, uint8_t file_no,
+                       uint32_t offset, const uint8_t *data, size_t len, uint16_t *sw_out) {
+    if (offset > 0xFFFFFF || len == 0 || len > 0xFFFFFF) return 0;
+    ntag424_op_t op;
+    op_init_write_data(&op, card, sess, comm_mode, file_no, offset, data, len);
+    int ok = op_run(&op, sw_out);
+    memset(op.iv, 0, sizeof(op.iv));
+    memset(op.blk, 0, sizeof(op.blk));
+    return ok;
+}
+
+int ntag424_get_file_settings(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                              uint8_t *out, size_t *out_len, uint16_t *sw_out) {
+    if (sess) {
+        uint8_t header = file_no;
+        return ntag424_cmd_mac(card, sess, 0xF5, &header, 1, NULL, 0, out, out_len, sw_out);
+    }
+    uint8_t apdu[] = {0x90, 0xF5, 0x00, 0x00, 0x01, file_no, 0x00};
+    uint8_t resp[MAX_APDU];
+    size_t rlen = sizeof(resp);
+    uint16_t sw = 0;
+    long rc = transmit(card, apdu, sizeof(apdu), resp, &rlen, &sw);
+    if (sw_out) *sw_out = sw;
+    if (rc != SCARD_S_SUCCESS || !sw_ok(sw)) return 0;
+    if (rlen > *out_len) return 0;
+    memcpy(out, resp, rlen);
+    *out_len = rlen;
+    return 1;
+}
+
+int ntag424_parse_file_settings(const uint8_t *data, size_t len, ntag424_file_settings_t *info) {
+    memset(info, 0, sizeof(*info));
+    if (len < 7) return 0;
+
+    info->valid = 1;
+    info->file_type = data[0];
+    info->file_option = data[1];
+    info->ar1 = data[2];
+    info->ar2 = data[3];
+    info->file_size = read_u24_le(&data[4]);
+    info->sdm_enabled = (info->file_option & 0x40) ? 1 : 0;
+
+    size_t idx = 7;
+    if (!info->sdm_enabled) return 1;
+
+    if (len < idx + 3) return 0;
+    info->sdm_options = data[idx++];
+    info->sdm_ar = (uint16_t)(data[idx] | (data[idx + 1] << 8));
+    idx += 2;
+    info->sdm_meta_read = (uint8_t)((info->sdm_ar >> 12) & 0x0F);
+    info->sdm_file_read = (uint8_t)((info->sdm_ar >> 8) & 0x0F);
+    info->rfu = (uint8_t)((info->sdm_ar >> 4) & 0x0F);
+    info->sdm_ctr_ret = (uint8_t)(info->sdm_ar & 0x0F);
+    info->sdm_read_ctr_enabled = (info->sdm_options & 0x40) ? 1 : 0;
+    info->present |= NTAG424_FS_HAS_SDM;
+
+    uint8_t sdm_options = info->sdm_options;
+    uint8_t sdm_meta = info->sdm_meta_read;
+    uint8_t sdm_file = info->sdm_file_read;
+
+    if ((sdm_options & 0x80) && sdm_meta == 0x0E) {
+        if (len < idx + 3) return 0;
+        info->uid_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_UID_OFFSET;
+    }
+
+    if ((sdm_options & 0x40) && sdm_meta == 0x0E) {
+        if (len < idx + 3) return 0;
+        info->sdm_read_ctr_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_READ_CTR_OFFSET;
+    }
+
+    if (sdm_meta <= 0x04) {
+        if (len < idx + 3) return 0;
+        info->picc_data_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_PICC_OFFSET;
+    }
+
+    if (sdm_file != 0x0F) {
+        if (len < idx + 3) return 0;
+        info->sdm_mac_input_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_MAC_INPUT;
+    }
+
+    if (sdm_file != 0x0F && (sdm_options & 0x10)) {
+        if (len < idx + 6) return 0;
+        info->sdm_enc_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->sdm_enc_length = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_ENC;
+    }
+
+    if (sdm_file != 0x0F) {
+        if (len < idx + 3) return 0;
+        info->sdm_mac_offset = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_MAC_OFFSET;
+    }
+
+    if (sdm_options & 0x20) {
+        if (len < idx + 3) return 0;
+        info->sdm_read_ctr_limit = read_u24_le(&data[idx]);
+        idx += 3;
+        info->present |= NTAG424_FS_HAS_READ_CTR_LIMIT;
+    }
+
+    return 1;
+}
+
+// ChangeKey payload: (NewKey XOR OldKey) || KeyVer || CRC32(NewKey).
+static size_t change_key_data(const uint8_t old_key[16], const uint8_t new_key[16], uint8_t key_ver,
+                              uint8_t key_data[21]) {
+    for (int i = 0; i < 16; i++) key_data[i] = new_key[i] ^ old_key[i];
+    key_data[16] = key_ver;
+    uint32_t crc = crc32_ieee(new_key, 16);
+    key_data[17] = (uint8_t)(crc & 0xFF);
+    key_data[18] = (uint8_t)((crc >> 8) & 0xFF);
+    key_data[19] = (uint8_t)((crc >> 16) & 0xFF);
+    key_data[20] = (uint8_t)((crc >> 24) & 0xFF);
+    return 21;
+}
+
+// ChangeKey. Changing the key the session authenticated with sends
+// NewKey || KeyVer instead; the tag then ends the session and answers
+// without a MAC, and old_key is not used.
+static void op_init_change_key(ntag424_op_t *op, ntag424_card_t *card, ntag424_session_t *sess,
+                               uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
+                               uint8_t key_ver) {
+    int same = sess && sess->authenticated && sess->key_no == key_no;
+    op_init_ssm(op, card, sess, 1, 0xC4, op->buf, 1, op->buf + 1, same ? 17 : 21,
+                op->out_buf, sizeof(op->out_buf));
+    op->buf[0] = key_no;
+    if (same) {
+        memcpy(op->buf + 1, new_key, 16);
+        op->buf[17] = key_ver;
+        op->post = OP_POST_SESSION_END;
+    } else {
+        change_key_data(old_key, new_key, key_ver, op->buf + 1);
+    }
+}
+
+int ntag424_change_key(ntag424_card_t *card, ntag424_session_t *sess,
+                       uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
+                       uint8_t key_ver, uint16_t *sw_out) {
+    ntag424_op_t op;
+    op_init_change_key(&op, card, sess, key_no, old_key, new_key, key_ver);
+    int ok = op_run(&op, sw_out);
+    memset(op.buf, 0, sizeof(op.buf));
+    return ok;
+}
+
+int ntag424_change_file_settings_sdm(ntag424_card_t *card, ntag424_session_t *sess,
+                                     const ntag424_sdm_config_t *cfg, uint16_t *sw_out) {
+    uint8_t data[64];
+    size_t len = 0;
+    uint8_t sdm_options = cfg->sdm_options;
+    uint8_t sdm_meta = cfg->sdm_meta_read;
+    uint8_t sdm_file = cfg->sdm_file_read;
+    uint8_t sdm_ctr = cfg->sdm_ctr_ret;
+
+    uint8_t file_option = (uint8_t)((cfg->comm_mode & 0x03) | 0x40); // enable SDM/mirroring
+    data[len++] = file_option;
+    data[len++] = cfg->ar1;
+    data[len++] = cfg->ar2;
+    data[len++] = sdm_options;
+
+    uint16_t sdm_ar = (uint16_t)(((sdm_meta & 0x0F) << 12) |
+                                 ((sdm_file & 0x0F) << 8) |
+                                 (0x0F << 4) |
+                                 (sdm_ctr & 0x0F));
+    data[len++] = (uint8_t)(sdm_ar & 0xFF);       // LSB first
+    data[len++] = (uint8_t)((sdm_ar >> 8) & 0xFF);
+
+    if ((sdm_options & 0x80) && sdm_meta == 0x0E) {
+        write_u24_le(&data[len], cfg->uid_offset);
+        len += 3;
+    }
+
+    if ((sdm_options & 0x40) && sdm_meta == 0x0E) {
+        write_u24_le(&data[len], cfg->sdm_read_ctr_offset);
+        len += 3;
+    }
+
+    if (sdm_meta <= 0x04) {
+        write_u24_le(&data[len], cfg->picc_data_offset);
+        len += 3;
+    }
+
+    if (sdm_file != 0x0F) {
+        write_u24_le(&data[len], cfg->sdm_mac_input_offset);
+        len += 3;
+    }
+
+    if (sdm_file != 0x0F && (sdm_options & 0x10)) {
+        write_u24_le(&data[len], cfg->sdm_enc_offset);
+        len += 3;
+        write_u24_le(&data[len], cfg->sdm_enc_length);
+        len += 3;
+    }
+
+    if (sdm_file != 0x0F) {
+        write_u24_le(&data[len], cfg->sdm_mac_offset);
+        len += 3;
+    }
+
+    uint8_t header = cfg->file_no;
+    uint8_t resp[16];
+    size_t resp_len = sizeof(resp);
+    return ntag424_cmd_full(card, sess, 0x5F, &header, 1, data, len, resp, &resp_len, sw_out);
+}
+
+int ntag424_get_sdm_read_counter(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                                 uint32_t *counter, uint16_t *sw_out) {
+    ntag424_op_t op;
+    op_init_counter(&op, card, sess, file_no);
+    if (!op_run(&op, sw_out)) return 0;
+    *counter = op.counter;
+    return 1;
+}
+
+int ntag424_context_open(ntag424_context_t **ctx_out, long *rc_out) {
+    *ctx_out = NULL;
+    ntag424_context_t *ctx = (ntag424_context_t *)calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        if (rc_out) *rc_out = (long)SCARD_E_NO_MEMORY;
+        return 0;
+    }
+    LONG rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx->pcsc);
+    if (rc_out) *rc_out = (long)rc;
+    if (rc != SCARD_S_SUCCESS) {
+        free(ctx);
+        return 0;
+    }
+    *ctx_out = ctx;
+    return 1;
+}
+
+int ntag424_context_open_emu(ntag424_context_t **ctx_out) {
+    *ctx_out = (ntag424_context_t *)calloc(1, sizeof(ntag424_context_t));
+    if (!*ctx_out) return 0;
+    (*ctx_out)->no_pcsc = 1;
+    return 1;
+}
+
+void ntag424_context_close(ntag424_context_t *ctx) {
+    if (!ctx) return;
+    if (!ctx->no_pcsc) SCardReleaseContext(ctx->pcsc);
+    free(ctx);
+}
+
+void ntag424_context_set_apdu_observer(ntag424_context_t *ctx, ntag424_apdu_observer_fn fn, void *user) {
+    ctx->observer = fn;
+    ctx->observer_user = user;
+}
+
+void ntag424_context_set_apdu_trace(ntag424_context_t *ctx, ntag424_apdu_trace_fn fn, void *user) {
+    ctx->trace = fn;
+    ctx->trace_user = user;
+}
+
+void ntag424_context_set_random(ntag424_context_t *ctx, ntag424_random_fn fn, void *user) {
+    ctx->random = fn;
+    ctx->random_user = user;
+}
+
+int ntag424_context_list_readers(ntag424_context_t *ctx, char **readers_out, long *rc_out) {
+    *readers_out = NULL;
+    DWORD len = 0;
+    LONG rc = SCardListReaders(ctx->pcsc, NULL, NULL, &len);
+    if (rc_out) *rc_out = (long)rc;
+    if (rc != SCARD_S_SUCCESS || len == 0) return 0;
+
+    char *readers = (char *)malloc(len);
+    if (!readers) {
+        if (rc_out) *rc_out = (long)SCARD_E_NO_MEMORY;
+        return 0;
+    }
+    rc = SCardListReaders(ctx->pcsc, NULL, readers, &len);
+    if (rc_out) *rc_out = (long)rc;
+    if (rc != SCARD_S_SUCCESS || readers[0] == '\0') {
+        free(readers);
+        return 0;
+    }
+    *readers_out = readers;
+    return 1;
+}
+
+int ntag424_reader_open(ntag424_context_t *ctx, const char *name, ntag424_reader_t **reader_out) {
+    *reader_out = NULL;
+    ntag424_reader_t *r = (ntag424_reader_t *)calloc(1, sizeof(*r));
+    if (!r) return 0;
+    size_t len = strlen(name);
+    r->name = (char *)malloc(len + 1);
+    if (!r->name) {
+        free(r);
+        return 0;
+    }
+    memcpy(r->name, name, len + 1);
+    r->ctx = ctx;
+    r->rs.szReader = r->name;
+    r->rs.dwCurrentState = SCARD_STATE_UNAWARE;
+    *reader_out = r;
+    return 1;
+}
+
+void ntag424_reader_close(ntag424_reader_t *reader) {
+    if (!reader) return;
+    free(reader->name);
+    free(reader);
+}
+
+const char *ntag424_reader_name(const ntag424_reader_t *reader) {
+    return reader->name;
+}
+
+int ntag424_reader_wait_tap(ntag424_reader_t *reader, unsigned timeout_ms, long *rc_out) {
+    SCARD_READERSTATE *rs = &reader->rs;
+    LONG rc = SCardGetStatusChange(reader->ctx->pcsc, (DWORD)timeout_ms, rs, 1);
+    if (rc_out) *rc_out = (long)rc;
+    if (rc == SCARD_E_TIMEOUT) return NTAG424_WAIT_NONE;
+    if (rc == SCARD_E_CANCELLED) return NTAG424_WAIT_CANCELLED;
+    if (rc != SCARD_S_SUCCESS) return NTAG424_WAIT_ERROR;
+    rs->dwCurrentState = rs->dwEventState & ~SCARD_STATE_CHANGED;
+
+    if (rs->dwEventState & SCARD_STATE_UNKNOWN) return NTAG424_WAIT_REMOVED;
+    if (!(rs->dwEventState & SCARD_STATE_PRESENT)) {
+        reader->card_seen = 0;
+        return NTAG424_WAIT_NONE;
+    }
+    if (reader->card_seen || (rs->dwEventState & SCARD_STATE_MUTE)) return NTAG424_WAIT_NONE;
+    reader->card_seen = 1;
+    return NTAG424_WAIT_TAP;
+}
+
+int ntag424_reader_monitor_open(ntag424_context_t *ctx, ntag424_reader_monitor_t **mon_out) {
+    *mon_out = NULL;
+    ntag424_reader_monitor_t *mon = (ntag424_reader_monitor_t *)calloc(1, sizeof(*mon));
+    if (!mon) return 0;
+    mon->ctx = ctx;
+    mon->pnp.szReader = "\\\\?PnP?\\Notification";
+    mon->pnp.dwCurrentState = SCARD_STATE_UNAWARE;
+    *mon_out = mon;
+    return 1;
+}
+
+void ntag424_reader_monitor_close(ntag424_reader_monitor_t *mon) {
+    if (!mon) return;
+    free(mon->readers);
+    free(mon);
+}
+
+static int reader_list_has(const char *list, const char *name) {
+    for (const char *p = list; p && *p; p += strlen(p) + 1) {
+        if (strcmp(p, name) == 0) return 1;
+    }
+    return 0;
+}
+
+int ntag424_reader_monitor_poll(ntag424_reader_monitor_t *mon, unsigned timeout_ms,
+                                ntag424_reader_event_fn fn, void *user, long *rc_out) {
+    LONG rc = SCARD_S_SUCCESS;
+    if (mon->started && !mon->no_pnp) {
+        rc = SCardGetStatusChange(mon->ctx->pcsc, (DWORD)timeout_ms, &mon->pnp, 1);
+        if (rc_out) *rc_out = (long)rc;
+        if (rc == SCARD_E_TIMEOUT) return NTAG424_WAIT_NONE;
+        if (rc == SCARD_E_CANCELLED) return NTAG424_WAIT_CANCELLED;
+        if (rc != SCARD_S_SUCCESS) return NTAG424_WAIT_ERROR;
+        // Without PnP support the pseudo reader reports UNKNOWN right away;
+        // fall back to listing the readers once per timeout.
+        if (mon->pnp.dwEventState & SCARD_STATE_UNKNOWN) mon->no_pnp = 1;
+        mon->pnp.dwCurrentState = mon->pnp.dwEventState & ~SCARD_STATE_CHANGED;
+    } else if (mon->started) {
+        struct timespec ts = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+    mon->started = 1;
+
+    char *readers = NULL;
+    long list_rc = 0;
+    if (!ntag424_context_list_readers(mon->ctx, &readers, &list_rc) && list_rc != SCARD_S_SUCCESS &&
+        list_rc != (long)SCARD_E_NO_READERS_AVAILABLE) {
+        if (rc_out) *rc_out = list_rc;
+        return NTAG424_WAIT_ERROR;
+    }
+    if (rc_out) *rc_out = (long)SCARD_S_SUCCESS;
+
+    int events = 0;
+    for (const char *p = mon->readers; p && *p; p += strlen(p) + 1) {
+        if (reader_list_has(readers, p)) continue;
+        if (fn) fn(user, NTAG424_READER_REMOVED, p);
+        events++;
+    }
+    for (const char *p = readers; p && *p; p += strlen(p) + 1) {
+        if (reader_list_has(mon->readers, p)) continue;
+        if (fn) fn(user, NTAG424_READER_ADDED, p);
+        events++;
+    }
+    free(mon->readers);
+    mon->readers = readers;
+    return events;
+}
+
+int ntag424_card_connect(ntag424_context_t *ctx, const char *reader, ntag424_card_t **card_out, long *rc_out) {
+    *card_out = NULL;
+    ntag424_card_t *card = (ntag424_card_t *)calloc(1, sizeof(*card));
+    if (!card) {
+        if (rc_out) *rc_out = (long)SCARD_E_NO_MEMORY;
+        return 0;
+    }
+    DWORD active_protocol = 0;
+    LONG rc = SCardConnect(ctx->pcsc, reader, SCARD_SHARE_SHARED,
+                           SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card->handle, &active_protocol);
+    if (rc_out) *rc_out = (long)rc;
+    if (rc != SCARD_S_SUCCESS) {
+        free(card);
+        return 0;
+    }
+    card->pio = active_protocol == SCARD_PROTOCOL_T1 ? *SCARD_PCI_T1 : *SCARD_PCI_T0;
+    card->ctx = ctx;
+    frame_limits_default(&card->lim);
+    *card_out = card;
+    return 1;
+}
+
+int ntag424_card_connect_emu(ntag424_context_t *ctx, ntag424_emu_t *emu, ntag424_card_t **card_out) {
+    *card_out = NULL;
+    ntag424_card_t *card = (ntag424_card_t *)calloc(1, sizeof(*card));
+    if (!card) return 0;
+    card->ctx = ctx;
+    card->emu = emu;
+    frame_limits_default(&card->lim);
+    *card_out = card;
+    return 1;
+}
+
+void ntag424_card_disconnect(ntag424_card_t *card) {
+    if (!card) return;
+    if (!card->emu) SCardDisconnect(card->handle, SCARD_LEAVE_CARD);
+    free(card);
+}
+
+int ntag424_card_atr(ntag424_card_t *card, uint8_t *atr, size_t *atr_len) {
+    if (card->emu) {
+        // PC/SC's ATR for an ISO 14443-4 card without historical bytes.
+        static const uint8_t k_emu_atr[] = {0x3B, 0x81, 0x80, 0x01, 0x80, 0x80};
+        if (*atr_len < sizeof(k_emu_atr)) return 0;
+        memcpy(atr, k_emu_atr, sizeof(k_emu_atr));
+        *atr_len = sizeof(k_emu_atr);
+        return 1;
+    }
+    uint8_t buf[64];
+    DWORD len = sizeof(buf);
+    DWORD state = 0, proto = 0;
+    char reader_name[256];
+    DWORD rn_len = sizeof(reader_name);
+    LONG rc = SCardStatus(card->handle, reader_name, &rn_len, &state, &proto, buf, &len);
+    if (rc != SCARD_S_SUCCESS || len > *atr_len) return 0;
+    memcpy(atr, buf, len);
+    *atr_len = len;
+    return 1;
+}
+
+ntag424_op_t *ntag424_op_authenticate(ntag424_card_t *card, ntag424_session_t *sess,
+                                      const uint8_t key[16], uint8_t key_no,
+                                      ntag424_op_done_fn done, void *user) {
+    ntag424_op_t *op = (ntag424_op_t *)calloc(1, sizeof(*op));
+    if (!op) return NULL;
+    op_init_auth(op, card, sess, key, key_no);
+    op->done = done;
+    op->user = user;
+    return op;
+}
+
+ntag424_op_t *ntag424_op_read_counter(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                                      ntag424_op_done_fn done, void *user) {
+    ntag424_op_t *op = (ntag424_op_t *)calloc(1, sizeof(*op));
+    if (!op) return NULL;
+    op_init_counter(op, card, sess, file_no);
+    op->done = done;
+    op->user = user;
+    return op;
+}
+
+ntag424_op_t *ntag424_op_change_key(ntag424_card_t *card, ntag424_session_t *sess,
+                                    uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
+                                    uint8_t key_ver, ntag424_op_done_fn done, void *user) {
+    ntag424_op_t *op = (ntag424_op_t *)calloc(1, sizeof(*op));
+    if (!op) return NULL;
+    op_init_change_key(op, card, sess, key_no, old_key, new_key, key_ver);
+    op->done = done;
+    op->user = user;
+    return op;
+}
+
+ntag424_op_t *ntag424_op_read_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode,
+                                   uint8_t file_no, uint32_t offset, uint32_t len, uint8_t *out, size_t out_cap,
+                                   ntag424_op_done_fn done, void *user) {
+    if (offset > 0xFFFFFF || len > 0xFFFFFF) return NULL;
+    ntag424_op_t *op = (ntag424_op_t *)calloc(1, sizeof(*op));
+    if (!op) return NULL;
+    op_init_read_data(op, card, sess, comm_mode, file_no, offset, len, out, out_cap);
+    op->done = done;
+    op->user = user;
+    return op;
+}
+
+ntag424_op_t *ntag424_op_write_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode,
+                                    uint8_t file_no, uint32_t offset, const uint8_t *data, size_t len,
+                                    ntag424_op_done_fn done, void *user) {
+    if (offset > 0xFFFFFF || len == 0 || len > 0xFFFFFF) return NULL;
+    ntag424_op_t *op = (ntag424_op_t *)calloc(1, sizeof(*op));
+    if (!op) return NULL;
+    op_init_write_data(op, card, sess, comm_mode, file_no, offset, data, len);
+    op->done = done;
+    op->user = user;
+    return op;
+}
+
+void ntag424_op_free(ntag424_op_t *op) {
+    if (!op) return;
+    memset(op, 0, sizeof(*op));
+    free(op);
+}
+
+int ntag424_op_ok(const ntag424_op_t *op) {
+    return op->ok;
+}
+
+uint16_t ntag424_op_sw(const ntag424_op_t *op) {
+    return op->sw;
+}
+
+uint32_t ntag424_op_counter(const ntag424_op_t *op) {
+    return op->counter;
+}
+
+size_t ntag424_op_data_len(const ntag424_op_t *op) {
+    return op->out_len;
+}
+
+ntag424_card_t *ntag424_op_card(const ntag424_op_t *op) {
+    return op->card;
+}
+
+// Frames wait on io_queue for one of the I/O threads, which do nothing but
+// the blocking SCardTransmit and hand the op back on done_queue. All state
+// machine steps (and so all crypto) and the callbacks run in
+// ntag424_engine_poll on the owning thread.
+struct ntag424_engine {
+    pthread_mutex_t lock;
+    pthread_cond_t io_cond;
+    pthread_cond_t done_cond;
+    ntag424_op_t *io_head;
+    ntag424_op_t *io_tail;
+    ntag424_op_t *done_head;
+    ntag424_op_t *done_tail;
+    size_t pending;
+    int stopping;
+    pthread_t *threads;
+    unsigned nthreads;
+};
+
+static void op_queue_push(ntag424_op_t **head, ntag424_op_t **tail, ntag424_op_t *op) {
+    op->next = NULL;
+    if (*tail) {
+        (*tail)->next = op;
+    } else {
+        *head = op;
+    }
+    *tail = op;
+}
+
+static void *engine_io_thread(void *arg) {
+    ntag424_engine_t *e = (ntag424_engine_t *)arg;
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        while (!e->io_head && !e->stopping) pthread_cond_wait(&e->io_cond, &e->lock);
+        if (e->stopping) break;
+        ntag424_op_t *op = e->io_head;
+        e->io_head = op->next;
+        if (!e->io_head) e->io_tail = NULL;
+        pthread_mutex_unlock(&e->lock);
+
+        op_exchange(op);
+
+        pthread_mutex_lock(&e->lock);
+        op_queue_push(&e->done_head, &e->done_tail, op);
+        pthread_cond_signal(&e->done_cond);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+ntag424_engine_t *ntag424_engine_new(unsigned io_threads) {
+    if (io_threads == 0) io_threads = 1;
+    ntag424_engine_t *e = (ntag424_engine_t *)calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->threads = (pthread_t *)calloc(io_threads, sizeof(*e->threads));
+    if (!e->threads) {
+        free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->io_cond, NULL);
+    pthread_cond_init(&e->done_cond, NULL);
+    for (unsigned i = 0; i < io_threads; i++) {
+        if (pthread_create(&e->threads[e->nthreads], NULL, engine_io_thread, e) != 0) break;
+        e->nthreads++;
+    }
+    if (e->nthreads == 0) {
+        ntag424_engine_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void ntag424_engine_free(ntag424_engine_t *e) {
+    if (!e) return;
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_broadcast(&e->io_cond);
+    pthread_mutex_unlock(&e->lock);
+    for (unsigned i = 0; i < e->nthreads; i++) pthread_join(e->threads[i], NULL);
+    pthread_cond_destroy(&e->io_cond);
+    pthread_cond_destroy(&e->done_cond);
+    pthread_mutex_destroy(&e->lock);
+    free(e->threads);
+    free(e);
+}
+
+static void engine_send(ntag424_engine_t *e, ntag424_op_t *op) {
+    pthread_mutex_lock(&e->lock);
+    op_queue_push(&e->io_head, &e->io_tail, op);
+    pthread_cond_signal(&e->io_cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Op finished: release the card before the callback, which may submit the
+// next op for it or free this one.
+static void engine_complete(ntag424_engine_t *e, ntag424_op_t *op) {
+    op->card->busy = 0;
+    e->pending--;
+    if (op->done) op->done(op->user, op);
+}
+
+int ntag424_engine_submit(ntag424_engine_t *e, ntag424_op_t *op) {
+    if (!op || op->card->busy) return 0;
+    op->card->busy = 1;
+    e->pending++;
+    if (op_step(op) == OP_SEND) {
+        engine_send(e, op);
+    } else {
+        engine_complete(e, op);
+    }
+    return 1;
+}
+
+size_t ntag424_engine_pending(const ntag424_engine_t *e) {
+    return e->pending;
+}
+
+int ntag424_engine_poll(ntag424_engine_t *e, unsigned timeout_ms) {
+    if (e->pending == 0) return 0;
+
+    pthread_mutex_lock(&e->lock);
+    if (!e->done_head && timeout_ms > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!e->done_head) {
+            if (pthread_cond_timedwait(&e->done_cond, &e->lock, &deadline) != 0) break;
+        }
+    }
+    ntag424_op_t *ready = e->done_head;
+    e->done_head = NULL;
+    e->done_tail = NULL;
+    pthread_mutex_unlock(&e->lock);
+
+    int completed = 0;
+    while (ready) {
+        ntag424_op_t *op = ready;
+        ready = op->next;
+        if (op_step(op) == OP_SEND) {
+            engine_send(e, op);
+        } else {
+            engine_complete(e, op);
+            completed++;
+        }
+    }
+    return completed;
+}
+
+// Key database: a header plus fixed-size records in one file, mapped into
+// memory. Records are only ever appended; a later record for the same UID
+// and key number supersedes the earlier one, except that a pending record
+// (a key not yet confirmed by ChangeKey) is kept out of the index. The
+// header count is the commit point, so a record is synced before the count
+// that makes it visible. An open-addressing index over the mapping is
+// rebuilt at open.
+#define KEYDB_MAGIC 0x4B34344Eu // "N44K" little-endian
+#define KEYDB_VERSION 1
+#define KEYDB_INITIAL_RECORDS 1024
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t rfu[5];
+} keydb_header_t;
+
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[10];
+    uint8_t key_no;
+    uint8_t key_ver;
+    uint8_t state;  // KEYDB_PENDING, or 0 for a key the tag holds
+    uint8_t rfu[2];
+    uint8_t key[16];
+} keydb_record_t;
+
+#define KEYDB_PENDING 0x01
+
+struct ntag424_keydb {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    uint32_t *index; // record number + 1; 0 marks a free slot
+    size_t index_cap; // power of two, at most half full
+    size_t live;
+};
+
+static keydb_header_t *keydb_header(ntag424_keydb_t *db) {
+    return (keydb_header_t *)db->map;
+}
+
+static keydb_record_t *keydb_records(ntag424_keydb_t *db) {
+    return (keydb_record_t *)(db->map + sizeof(keydb_header_t));
+}
+
+static size_t keydb_capacity(const ntag424_keydb_t *db) {
+    return (db->map_len - sizeof(keydb_header_t)) / sizeof(keydb_record_t);
+}
+
+// FNV-1a over UID and key number.
+static uint32_t keydb_hash(const uint8_t *uid, size_t uid_len, uint8_t key_no) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < uid_len; i++) h = (h ^ uid[i]) * 16777619u;
+    return (h ^ key_no) * 16777619u;
+}
+
+// Index slot holding uid/key_no, or the free slot where it belongs.
+static size_t keydb_slot(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no) {
+    size_t mask = db->index_cap - 1;
+    size_t i = keydb_hash(uid, uid_len, key_no) & mask;
+    const keydb_record_t *recs = keydb_records(db);
+    while (db->index[i]) {
+        const keydb_record_t *r = &recs[db->index[i] - 1];
+        if (r->uid_len == uid_len && r->key_no == key_no && memcmp(r->uid, uid, uid_len) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int keydb_index_add(ntag424_keydb_t *db, uint32_t recno) {
+    if (2 * (db->live + 1) > db->index_cap) {
+        size_t old_cap = db->index_cap;
+        uint32_t *old = db->index;
+        size_t cap = old_cap ? old_cap * 2 : 64;
+        db->index = (uint32_t *)calloc(cap, sizeof(*db->index));
+        if (!db->index) {
+            db->index = old;
+            return 0;
+        }
+        db->index_cap = cap;
+        const keydb_record_t *recs = keydb_records(db);
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i]) continue;
+            const keydb_record_t *r = &recs[old[i] - 1];
+            db->index[keydb_slot(db, r->uid, r->uid_len, r->key_no)] = old[i];
+        }
+        free(old);
+    }
+    const keydb_record_t *r = &keydb_records(db)[recno];
+    size_t slot = keydb_slot(db, r->uid, r->uid_len, r->key_no);
+    if (!db->index[slot]) db->live++;
+    db->index[slot] = recno + 1;
+    return 1;
+}
+
+// Maps len bytes of the file; the old mapping stays valid on failure.
+static int keydb_map(ntag424_keydb_t *db, size_t len) {
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (m == MAP_FAILED) return 0;
+    if (db->map) munmap(db->map, db->map_len);
+    db->map = (uint8_t *)m;
+    db->map_len = len;
+    return 1;
+}
+
+// msync needs a page-aligned start.
+static int keydb_sync(ntag424_keydb_t *db, size_t off, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = off - off % page;
+    return msync(db->map + start, off + len - start, MS_SYNC) == 0;
+}
+
+int ntag424_keydb_open(const char *path, ntag424_keydb_t **db_out) {
+    *db_out = NULL;
+    ntag424_keydb_t *db = (ntag424_keydb_t *)calloc(1, sizeof(*db));
+    if (!db) return 0;
+    db->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (db->fd < 0) {
+        free(db);
+        return 0;
+    }
+
+    struct stat st;
+    int ok = fstat(db->fd, &st) == 0;
+    size_t len = ok ? (size_t)st.st_size : 0;
+    int fresh = ok && len == 0;
+    if (fresh) {
+        len = sizeof(keydb_header_t) + KEYDB_INITIAL_RECORDS * sizeof(keydb_record_t);
+        ok = ftruncate(db->fd, (off_t)len) == 0;
+    }
+    ok = ok && len >= sizeof(keydb_header_t) && keydb_map(db, len);
+    if (ok && fresh) {
+        keydb_header_t *h = keydb_header(db);
+        h->magic = KEYDB_MAGIC;
+        h->version = KEYDB_VERSION;
+        h->record_size = (uint16_t)sizeof(keydb_record_t);
+        h->count = 0;
+        ok = keydb_sync(db, 0, sizeof(*h));
+    }
+    if (ok) {
+        const keydb_header_t *h = keydb_header(db);
+        ok = h->magic == KEYDB_MAGIC && h->version == KEYDB_VERSION &&
+             h->record_size == sizeof(keydb_record_t) && h->count <= keydb_capacity(db);
+    }
+    for (uint32_t i = 0; ok && i < keydb_header(db)->count; i++) {
+        const keydb_record_t *r = &keydb_records(db)[i];
+        ok = r->uid_len <= sizeof(r->uid) && (r->state == KEYDB_PENDING || keydb_index_add(db, i));
+    }
+    if (!ok) {
+        ntag424_keydb_close(db);
+        return 0;
+    }
+    *db_out = db;
+    return 1;
+}
+
+void ntag424_keydb_close(ntag424_keydb_t *db) {
+    if (!db) return;
+    if (db->map) munmap(db->map, db->map_len);
+    if (db->fd >= 0) close(db->fd);
+    free(db->index);
+    free(db);
+}
+
+int ntag424_keydb_get(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                      uint8_t key[16], uint8_t *key_ver) {
+    if (uid_len > sizeof(((keydb_record_t *)0)->uid) || db->index_cap == 0) return 0;
+    uint32_t n = db->index[keydb_slot(db, uid, uid_len, key_no)];
+    if (!n) return 0;
+    const keydb_record_t *r = &keydb_records(db)[n - 1];
+    memcpy(key, r->key, 16);
+    if (key_ver) *key_ver = r->key_ver;
+    return 1;
+}
+
+int ntag424_keydb_get_pending(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                              uint8_t key[16], uint8_t *key_ver) {
+    // Only the newest record for uid/key_no counts; a pending record after
+    // it is rare enough that a backwards scan beats a second index.
+    const keydb_record_t *recs = keydb_records(db);
+    for (uint32_t i = keydb_header(db)->count; i-- > 0;) {
+        const keydb_record_t *r = &recs[i];
+        if (r->uid_len != uid_len || r->key_no != key_no || memcmp(r->uid, uid, uid_len) != 0) continue;
+        if (r->state != KEYDB_PENDING) return 0;
+        memcpy(key, r->key, 16);
+        if (key_ver) *key_ver = r->key_ver;
+        return 1;
+    }
+    return 0;
+}
+
+static int keydb_append(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                        const uint8_t key[16], uint8_t key_ver, uint8_t state) {
+    if (uid_len > sizeof(((keydb_record_t *)0)->uid)) return 0;
+    uint32_t count = keydb_header(db)->count;
+    if (count == UINT32_MAX) return 0;
+    if (count == keydb_capacity(db)) {
+        size_t len = sizeof(keydb_header_t) + 2 * keydb_capacity(db) * sizeof(keydb_record_t);
+        if (ftruncate(db->fd, (off_t)len) != 0 || !keydb_map(db, len)) return 0;
+    }
+
+    keydb_record_t *r = &keydb_records(db)[count];
+    memset(r, 0, sizeof(*r));
+    r->uid_len = (uint8_t)uid_len;
+    memcpy(r->uid, uid, uid_len);
+    r->key_no = key_no;
+    r->key_ver = key_ver;
+    r->state = state;
+    memcpy(r->key, key, 16);
+    size_t off = sizeof(keydb_header_t) + count * sizeof(keydb_record_t);
+    if (!keydb_sync(db, off, sizeof(*r))) return 0;
+    keydb_header(db)->count = count + 1;
+    if (!keydb_sync(db, 0, sizeof(keydb_header_t))) return 0;
+    return state == KEYDB_PENDING || keydb_index_add(db, count);
+}
+
+int ntag424_keydb_put(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                      const uint8_t key[16], uint8_t key_ver) {
+    return keydb_append(db, uid, uid_len, key_no, key, key_ver, 0);
+}
+
+int ntag424_keydb_put_pending(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                              const uint8_t key[16], uint8_t key_ver) {
+    return keydb_append(db, uid, uid_len, key_no, key, key_ver, KEYDB_PENDING);
+}
+
+// Tag emulator. A software NTAG 424 DNA with the factory file layout that
+// answers the commands this library sends, so the host stack can be driven
+// at full speed without an RF field. Cards connected with
+// ntag424_card_connect_emu route transmit() here instead of SCardTransmit.
+// The secure messaging responder reuses the host side's crypto and
+// session derivation, mirrored: it checks command MACs under CmdCtr and
+// MACs its answers under CmdCtr + 1. Any integrity or sequence error ends
+// the session, as on the tag.
+#define EMU_FILE_COUNT 3
+#define EMU_FILE_MAX 256
+#define EMU_KEY_COUNT 5
+// ReadData / WriteData: the whole exchange, padding, MAC and SW included,
+// and the data per response frame before the tag asks for 0xAF.
+#define EMU_CHAIN_MAX (EMU_FILE_MAX + 32)
+#define EMU_CHAIN_FRAME 120
+
+typedef struct {
+    uint8_t file_no;
+    uint16_t iso_id;
+    uint8_t file_option;
+    uint8_t ar1;  // RW << 4 | Change
+    uint8_t ar2;  // Read << 4 | Write
+    uint8_t sdm_options;
+    uint16_t sdm_ar;
+    uint32_t uid_offset;
+    uint32_t ctr_offset;
+    uint32_t picc_offset;
+    uint32_t mac_input_offset;
+    uint32_t enc_offset;
+    uint32_t enc_length;
+    uint32_t mac_offset;
+    uint32_t ctr_limit;
+    uint32_t sdm_ctr;
+    uint32_t size;
+    uint8_t data[EMU_FILE_MAX];
+} emu_file_t;
+
+struct ntag424_emu {
+    uint8_t uid[7];
+    uint8_t keys[EMU_KEY_COUNT][16];
+    uint8_t key_ver[EMU_KEY_COUNT];
+    emu_file_t files[EMU_FILE_COUNT];
+    int app_selected;
+    int selected;  // index into files, -1 for none
+    int read_since_select;
+    int view_valid;  // view holds the mirrors of the first read since select
+    uint8_t view[EMU_FILE_MAX];
+    int auth_pending;  // part 1 answered, waiting for 0xAF
+    uint8_t auth_key_no;
+    uint8_t rndB[16];
+    uint8_t chain_ins;  // ReadData / WriteData waiting for 0xAF, 0 for none
+    uint8_t chain_mode;
+    uint8_t chain[EMU_CHAIN_MAX];
+    size_t chain_len;
+    size_t chain_pos;
+    size_t chain_need;
+    ntag424_session_t sess;
+};
+
+static const uint8_t k_emu_cc[] = {0x00, 0x17, 0x20, 0x01, 0x00, 0x00, 0xFF, 0x04, 0x06, 0xE1, 0x04, 0x01,
+                                   0x00, 0x00, 0x00, 0x05, 0x06, 0xE1, 0x05, 0x00, 0x80, 0x82, 0x83};
+static const uint8_t k_emu_ats[] = {0x06, 0x77, 0x77, 0x71, 0x02, 0x80};
+
+static void emu_file_init(emu_file_t *f, uint8_t file_no, uint16_t iso_id, uint32_t size,
+                          uint8_t file_option, uint8_t ar1, uint8_t ar2) {
+    memset(f, 0, sizeof(*f));
+    f->file_no = file_no;
+    f->iso_id = iso_id;
+    f->size = size;
+    f->file_option = file_option;
+    f->ar1 = ar1;
+    f->ar2 = ar2;
+}
+
+ntag424_emu_t *ntag424_emu_new(const uint8_t uid[7]) {
+    ntag424_emu_t *emu = (ntag424_emu_t *)calloc(1, sizeof(*emu));
+    if (!emu) return NULL;
+    memcpy(emu->uid, uid, 7);
+    emu_file_init(&emu->files[0], 0x01, 0xE103, 32, 0x00, 0x00, 0xE0);
+    memcpy(emu->files[0].data, k_emu_cc, sizeof(k_emu_cc));
+    emu_file_init(&emu->files[1], 0x02, 0xE104, 256, 0x00, 0xE0, 0xEE);
+    emu_file_init(&emu->files[2], 0x03, 0xE105, 128, 0x03, 0x30, 0x23);
+    emu->selected = -1;
+    return emu;
+}
+
+void ntag424_emu_free(ntag424_emu_t *emu) {
+    if (!emu) return;
+    ntag424_session_clear(&emu->sess);
+    memset(emu->keys, 0, sizeof(emu->keys));
+    free(emu);
+}
+
+uint32_t ntag424_emu_sdm_counter(const ntag424_emu_t *emu, uint8_t file_no) {
+    for (size_t i = 0; i < EMU_FILE_COUNT; i++) {
+        if (emu->files[i].file_no == file_no) return emu->files[i].sdm_ctr;
+    }
+    return 0;
+}
+
+static emu_file_t *emu_file(ntag424_emu_t *emu, uint8_t file_no) {
+    for (size_t i = 0; i < EMU_FILE_COUNT; i++) {
+        if (emu->files[i].file_no == file_no) return &emu->files[i];
+    }
+    return NULL;
+}
+
+// Access condition nibble: 0xE is free, 0xF never, else the session's key.
+static int emu_access(const ntag424_emu_t *emu, uint8_t cond) {
+    if (cond == 0x0E) return 1;
+    return cond != 0x0F && emu->sess.authenticated && emu->sess.key_no == cond;
+}
+
+static size_t emu_sw(uint8_t *resp, size_t len, uint16_t sw) {
+    resp[len] = (uint8_t)(sw >> 8);
+    resp[len + 1] = (uint8_t)(sw & 0xFF);
+    return len + 2;
+}
+
+// Ends the session and answers sw without a MAC.
+static size_t emu_fail(ntag424_emu_t *emu, uint8_t *resp, uint16_t sw) {
+    ntag424_session_clear(&emu->sess);
+    return emu_sw(resp, 0, sw);
+}
+
+static void emu_hex(char *out, const uint8_t *in, size_t len) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 0x0F];
+    }
+}
+
+// GetFileSettings answer, in the layout ntag424_parse_file_settings reads.
+static size_t emu_file_settings(const emu_file_t *f, uint8_t *out) {
+    size_t len = 0;
+    out[len++] = 0x00;  // StandardData
+    out[len++] = f->file_option;
+    out[len++] = f->ar1;
+    out[len++] = f->ar2;
+    write_u24_le(out + len, f->size);
+    len += 3;
+    if (!(f->file_option & 0x40)) return len;
+
+    uint8_t meta = (uint8_t)(f->sdm_ar >> 12);
+    uint8_t file_read = (uint8_t)((f->sdm_ar >> 8) & 0x0F);
+    out[len++] = f->sdm_options;
+    out[len++] = (uint8_t)(f->sdm_ar & 0xFF);
+    out[len++] = (uint8_t)(f->sdm_ar >> 8);
+    if ((f->sdm_options & 0x80) && meta == 0x0E) {
+        write_u24_le(out + len, f->uid_offset);
+        len += 3;
+    }
+    if ((f->sdm_options & 0x40) && meta == 0x0E) {
+        write_u24_le(out + len, f->ctr_offset);
+        len += 3;
+    }
+    if (meta <= 0x04) {
+        write_u24_le(out + len, f->picc_offset);
+        len += 3;
+    }
+    if (file_read != 0x0F) {
+        write_u24_le(out + len, f->mac_input_offset);
+        len += 3;
+        if (f->sdm_options & 0x10) {
+            write_u24_le(out + len, f->enc_offset);
+            len += 3;
+            write_u24_le(out + len, f->enc_length);
+            len += 3;
+        }
+        write_u24_le(out + len, f->mac_offset);
+        len += 3;
+    }
+    if (f->sdm_options & 0x20) {
+        write_u24_le(out + len, f->ctr_limit);
+        len += 3;
+    }
+    return len;
+}
+
+// ChangeFileSettings data (FileOption || AR || SDM fields) for f.
+static uint16_t emu_apply_file_settings(emu_file_t *f, const uint8_t *d, size_t len) {
+    if (len < 3) return 0x917E;
+    emu_file_t nf = *f;
+    size_t idx = 0;
+    nf.file_option = d[idx++];
+    nf.ar1 = d[idx++];
+    nf.ar2 = d[idx++];
+    if ((nf.file_option & ~0x43) != 0 || (nf.file_option & 0x03) == 0x02) return 0x919E;
+    if (nf.file_option & 0x40) {
+        if (len < idx + 3) return 0x917E;
+        nf.sdm_options = d[idx++];
+        nf.sdm_ar = (uint16_t)(d[idx] | (d[idx + 1] << 8));
+        idx += 2;
+        uint8_t meta = (uint8_t)(nf.sdm_ar >> 12);
+        uint8_t file_read = (uint8_t)((nf.sdm_ar >> 8) & 0x0F);
+        // SDMENCFileData needs UID, counter and a MAC.
+        int with_enc = (nf.sdm_options & 0x10) != 0;
+        if (with_enc && ((nf.sdm_options & 0xC0) != 0xC0 || file_read == 0x0F)) return 0x919E;
+        uint32_t *fields[8];
+        uint32_t widths[8];
+        size_t n = 0;
+        if ((nf.sdm_options & 0x80) && meta == 0x0E) {
+            fields[n] = &nf.uid_offset;
+            widths[n++] = NTAG424_SDM_UID_LEN_ASCII;
+        }
+        if ((nf.sdm_options & 0x40) && meta == 0x0E) {
+            fields[n] = &nf.ctr_offset;
+            widths[n++] = NTAG424_SDM_CTR_LEN_ASCII;
+        }
+        if (meta <= 0x04) {
+            if (meta >= EMU_KEY_COUNT) return 0x919E;
+            fields[n] = &nf.picc_offset;
+            widths[n++] = NTAG424_SDM_PICC_LEN_ASCII;
+        }
+        if (file_read != 0x0F) {
+            if (file_read >= EMU_KEY_COUNT) return 0x919E;
+            fields[n] = &nf.mac_input_offset;
+            widths[n++] = 0;
+            if (with_enc) {
+                fields[n] = &nf.enc_offset;
+                widths[n++] = 0;
+                fields[n] = &nf.enc_length;
+                widths[n++] = 0;
+            }
+            fields[n] = &nf.mac_offset;
+            widths[n++] = NTAG424_SDM_MAC_LEN_ASCII;
+        }
+        if (nf.sdm_options & 0x20) {
+            fields[n] = &nf.ctr_limit;
+            widths[n++] = 0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (len < idx + 3) return 0x917E;
+            *fields[i] = read_u24_le(d + idx);
+            idx += 3;
+            if (fields[i] != &nf.ctr_limit && *fields[i] + widths[i] > nf.size) return 0x919E;
+        }
+        if (file_read != 0x0F && nf.mac_input_offset > nf.mac_offset) return 0x919E;
+        if (with_enc && (nf.enc_length == 0 || nf.enc_length % 32 != 0 || nf.enc_offset < nf.mac_input_offset ||
+                         nf.enc_offset + nf.enc_length > nf.mac_offset)) {
+            return 0x919E;
+        }
+    } else {
+        nf.sdm_options = 0;
+        nf.sdm_ar = 0;
+    }
+    if (idx != len) return 0x917E;
+    *f = nf;
+    return 0x9100;
+}
+
+// Copy of f's data as an SDM read returns it: UID, counter, encrypted PICC
+// data, encrypted file data and the MAC mirrored in as upper-case hex.
+static int emu_sdm_mirror(const ntag424_emu_t *emu, const emu_file_t *f, uint8_t *out) {
+    memcpy(out, f->data, f->size);
+    uint8_t meta = (uint8_t)(f->sdm_ar >> 12);
+    uint8_t file_read = (uint8_t)((f->sdm_ar >> 8) & 0x0F);
+    uint8_t ctr_le[3];
+    write_u24_le(ctr_le, f->sdm_ctr);
+    int with_uid = (f->sdm_options & 0x80) != 0;
+    int with_ctr = (f->sdm_options & 0x40) != 0;
+
+    if (with_uid && meta == 0x0E) emu_hex((char *)out + f->uid_offset, emu->uid, 7);
+    if (with_ctr && meta == 0x0E) {
+        uint8_t ctr_be[3] = {ctr_le[2], ctr_le[1], ctr_le[0]};
+        emu_hex((char *)out + f->ctr_offset, ctr_be, 3);
+    }
+    if (meta <= 0x04) {
+        // PICCDataTag || [UID] || [SDMReadCtr] || random padding.
+        uint8_t picc[16];
+        size_t n = 0;
+        if (!ntag424_random_bytes(picc, sizeof(picc))) return 0;
+        picc[n++] = (uint8_t)((with_uid ? 0x87 : 0x00) | (with_ctr ? 0x40 : 0x00));
+        if (with_uid) {
+            memcpy(picc + n, emu->uid, 7);
+            n += 7;
+        }
+        if (with_ctr) memcpy(picc + n, ctr_le, 3);
+        uint8_t iv0[16] = {0};
+        if (!aes_cbc_crypt(1, emu->keys[meta], iv0, picc, 16, picc)) return 0;
+        emu_hex((char *)out + f->picc_offset, picc, 16);
+    }
+    if (f->sdm_options & 0x10) {
+        // The first half of the SDMENC window, encrypted under
+        // KSesSDMFileReadENC = CMAC(K, C3 3C 00 01 00 80 || UID || SDMReadCtr)
+        // with IV = E(KSes, SDMReadCtr || 0), replaces the whole window.
+        uint8_t sv1[16] = {0xC3, 0x3C, 0x00, 0x01, 0x00, 0x80};
+        memcpy(sv1 + 6, emu->uid, 7);
+        memcpy(sv1 + 13, ctr_le, 3);
+        uint8_t ksess[16];
+        uint8_t iv[16] = {0};
+        uint8_t enc[EMU_FILE_MAX / 2];
+        size_t n = f->enc_length / 2;
+        memcpy(iv, ctr_le, 3);
+        cmac_key_t ck;
+        if (!cmac_key_init(&ck, emu->keys[file_read])) return 0;
+        cmac_ctx_t c;
+        cmac_init(&c, &ck);
+        int ok = cmac_update(&c, sv1, 16) && cmac_final(&c, ksess);
+        cmac_key_free(&ck);
+        aes_key_t k;
+        if (!ok || !aes_key_init(&k, ksess)) return 0;
+        ok = aes_key_ecb_encrypt(&k, iv, iv) && aes_key_cbc(&k, 1, iv, f->data + f->enc_offset, n, enc);
+        aes_key_free(&k);
+        memset(ksess, 0, sizeof(ksess));
+        if (!ok) return 0;
+        emu_hex((char *)out + f->enc_offset, enc, n);
+    }
+    if (file_read != 0x0F) {
+        // SV2 = 3C C3 00 01 00 80 || [UID] || [SDMReadCtr], zero padded.
+        uint8_t sv2[16] = {0x3C, 0xC3, 0x00, 0x01, 0x00, 0x80};
+        size_t n = 6;
+        if (with_uid) {
+            memcpy(sv2 + n, emu->uid, 7);
+            n += 7;
+        }
+        if (with_ctr) memcpy(sv2 + n, ctr_le, 3);
+        uint8_t ksess[16];
+        uint8_t cmac[16];
+        cmac_key_t ck;
+        if (!cmac_key_init(&ck, emu->keys[file_read])) return 0;
+        cmac_ctx_t c;
+        cmac_init(&c, &ck);
+        int ok = cmac_update(&c, sv2, 16) && cmac_final(&c, ksess);
+        cmac_key_free(&ck);
+        if (!ok || !cmac_key_init(&ck, ksess)) return 0;
+        cmac_init(&c, &ck);
+        ok = cmac_update(&c, out + f->mac_input_offset, f->mac_offset - f->mac_input_offset) &&
+             cmac_final(&c, cmac);
+        cmac_key_free(&ck);
+        memset(ksess, 0, sizeof(ksess));
+        if (!ok) return 0;
+        uint8_t mact[8];
+        cmac_truncate_8(cmac, mact);
+        emu_hex((char *)out + f->mac_offset, mact, 8);
+    }
+    return 1;
+}
+
+// Checks a secure messaging command addressed to the current session and,
+// with encrypt set, decrypts its data in place. *len covers header and data
+// on entry and on return, without the MAC.
+static int emu_ssm_in(ntag424_emu_t *emu, uint8_t cmd, uint8_t *d, size_t *len, size_t header_len, int encrypt) {
+    ntag424_session_t *sess = &emu->sess;
+    if (*len < header_len + 8) return 0;
+    size_t body = *len - 8;
+    uint8_t ctr[2] = {(uint8_t)(sess->cmd_ctr & 0xFF), (uint8_t)(sess->cmd_ctr >> 8)};
+    cmac_ctx_t mac;
+    cmac_init(&mac, &sess->mac_key);
+    uint8_t cmac[16];
+    uint8_t mact[8];
+    if (!cmac_update(&mac, &cmd, 1) || !cmac_update(&mac, ctr, 2) || !cmac_update(&mac, sess->ti, 4) ||
+        !cmac_update(&mac, d, body) || !cmac_final(&mac, cmac)) {
+        return 0;
+    }
+    cmac_truncate_8(cmac, mact);
+    if (memcmp(mact, d + body, 8) != 0) return 0;
+
+    size_t enc_len = body - header_len;
+    if (encrypt && enc_len > 0) {
+        if ((enc_len % 16) != 0) return 0;
+        uint8_t ivc[16] = {0xA5, 0x5A};
+        memcpy(ivc + 2, sess->ti, 4);
+        memcpy(ivc + 6, ctr, 2);
+        if (!aes_key_ecb_encrypt(&sess->enc_key, ivc, ivc) ||
+            !aes_key_cbc(&sess->enc_key, 0, ivc, d + header_len, enc_len, d + header_len)) {
+            return 0;
+        }
+        size_t plain = unpad_iso9797_m2(d + header_len, enc_len);
+        if (plain == enc_len) return 0;
+        body = header_len + plain;
+    }
+    *len = body;
+    return 1;
+}
+
+// Answers a secure messaging command with 91 00, data (encrypted with
+// encrypt set) and the response MAC, and advances CmdCtr.
+static size_t emu_ssm_out(ntag424_emu_t *emu, int encrypt, const uint8_t *data, size_t data_len, uint8_t *resp) {
+    ntag424_session_t *sess = &emu->sess;
+    sess->cmd_ctr++;
+    uint8_t ctr[2] = {(uint8_t)(sess->cmd_ctr & 0xFF), (uint8_t)(sess->cmd_ctr >> 8)};
+    size_t len = data_len;
+    if (data_len > 0) memcpy(resp, data, data_len);
+    if (encrypt && data_len > 0) {
+        uint8_t ivr[16] = {0x5A, 0xA5};
+        memcpy(ivr + 2, sess->ti, 4);
+        memcpy(ivr + 6, ctr, 2);
+        len = pad_iso9797_m2(resp, data_len);
+        if (!aes_key_ecb_encrypt(&sess->enc_key, ivr, ivr) || !aes_key_cbc(&sess->enc_key, 1, ivr, resp, len, resp)) {
+            return emu_fail(emu, resp, 0x91CA);
+        }
+    }
+    uint8_t sw2 = 0x00;
+    cmac_ctx_t mac;
+    cmac_init(&mac, &sess->mac_key);
+    uint8_t cmac[16];
+    if (!cmac_update(&mac, &sw2, 1) || !cmac_update(&mac, ctr, 2) || !cmac_update(&mac, sess->ti, 4) ||
+        !cmac_update(&mac, resp, len) || !cmac_final(&mac, cmac)) {
+        return emu_fail(emu, resp, 0x91CA);
+    }
+    cmac_truncate_8(cmac, resp + len);
+    return emu_sw(resp, len + 8, 0x9100);
+}
+
+// AuthenticateEV2First, tag side.
+static size_t emu_auth(ntag424_emu_t *emu, uint8_t ins, const uint8_t *d, size_t len, uint8_t *resp) {
+    uint8_t iv0[16] = {0};
+    if (ins == 0x71) {
+        emu->auth_pending = 0;
+        ntag424_session_clear(&emu->sess);
+        if (len < 2) return emu_sw(resp, 0, 0x917E);
+        if (d[0] >= EMU_KEY_COUNT) return emu_sw(resp, 0, 0x9140);
+        emu->auth_key_no = d[0];
+        if (!ntag424_random_bytes(emu->rndB, 16) ||
+            !aes_cbc_crypt(1, emu->keys[d[0]], iv0, emu->rndB, 16, resp)) {
+            return emu_sw(resp, 0, 0x91CA);
+        }
+        emu->auth_pending = 1;
+        return emu_sw(resp, 16, 0x91AF);
+    }
+
+    if (!emu->auth_pending) return emu_sw(resp, 0, 0x91CA);
+    emu->auth_pending = 0;
+    if (len != 32) return emu_sw(resp, 0, 0x917E);
+    const uint8_t *key = emu->keys[emu->auth_key_no];
+    uint8_t dec[32];
+    uint8_t rndB_rot[16];
+    if (!aes_cbc_crypt(0, key, iv0, d, 32, dec)) return emu_sw(resp, 0, 0x91CA);
+    rotate_left_1(rndB_rot, emu->rndB, 16);
+    if (memcmp(dec + 16, rndB_rot, 16) != 0) return emu_sw(resp, 0, 0x91AE);
+
+    // TI || RndA' || PDcap2 || PCDcap2
+    uint8_t plain[32] = {0};
+    rotate_left_1(plain + 4, dec, 16);
+    if (!ntag424_random_bytes(plain, 4) || !aes_cbc_crypt(1, key, iv0, plain, 32, resp) ||
+        !session_derive(&emu->sess, key, emu->auth_key_no, dec, emu->rndB, plain)) {
+        return emu_sw(resp, 0, 0x91CA);
+    }
+    memset(dec, 0, sizeof(dec));
+    return emu_sw(resp, 32, 0x9100);
+}
+
+// CommMode for data access to f: plain when one of the two access
+// conditions that allow it is free, else the file's, once the session's key
+// matches one of them. Returns -1 (sw set) without access.
+static int emu_data_mode(const ntag424_emu_t *emu, const emu_file_t *f, int write, uint16_t *sw) {
+    uint8_t rw = (uint8_t)(f->ar1 >> 4);
+    uint8_t cond = write ? (uint8_t)(f->ar2 & 0x0F) : (uint8_t)(f->ar2 >> 4);
+    if (rw == 0x0E || cond == 0x0E) return 0x00;
+    if (!emu->sess.authenticated) {
+        *sw = 0x91AE;
+        return -1;
+    }
+    if (!emu_access(emu, rw) && !emu_access(emu, cond)) {
+        *sw = 0x919D;
+        return -1;
+    }
+    return (f->file_option & 0x03) == 0x02 ? 0x00 : f->file_option & 0x03;
+}
+
+// Next ReadData frame from the chain buffer: 91 AF while more is left.
+static size_t emu_chain_out(ntag424_emu_t *emu, uint8_t *resp) {
+    size_t n = emu->chain_len - emu->chain_pos;
+    if (n > EMU_CHAIN_FRAME) n = EMU_CHAIN_FRAME;
+    memcpy(resp, emu->chain + emu->chain_pos, n);
+    emu->chain_pos += n;
+    if (emu->chain_pos < emu->chain_len) return emu_sw(resp, n, 0x91AF);
+    emu->chain_ins = 0;
+    memset(emu->chain, 0, sizeof(emu->chain));
+    return emu_sw(resp, n, 0x9100);
+}
+
+// ReadData with FileNo || Offset || Length (0 for the rest of the file).
+// Free reads of an SDM file are SDM reads and carry the mirrors.
+static size_t emu_read_data(ntag424_emu_t *emu, uint8_t *d, size_t len, uint8_t *resp) {
+    int in_session = emu->sess.authenticated;
+    if (len < DATA_HDR_LEN) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+    emu_file_t *f = emu_file(emu, d[0]);
+    if (!f) return in_session ? emu_fail(emu, resp, 0x91F0) : emu_sw(resp, 0, 0x91F0);
+    uint16_t sw = 0x919D;
+    int mode = emu_data_mode(emu, f, 0, &sw);
+    if (mode < 0) return in_session ? emu_fail(emu, resp, sw) : emu_sw(resp, 0, sw);
+    if (mode != 0x00 && !emu_ssm_in(emu, 0xAD, d, &len, DATA_HDR_LEN, 0)) return emu_fail(emu, resp, 0x911E);
+    if (len != DATA_HDR_LEN) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+    uint32_t offset = read_u24_le(d + 1);
+    uint32_t n = read_u24_le(d + 4);
+    if (offset >= f->size || n > f->size - offset) {
+        return in_session ? emu_fail(emu, resp, 0x91BE) : emu_sw(resp, 0, 0x91BE);
+    }
+    if (n == 0) n = f->size - offset;
+
+    uint8_t file[EMU_FILE_MAX];
+    const uint8_t *src = f->data;
+    if (mode == 0x00 && (f->file_option & 0x40)) {
+        if ((f->sdm_options & 0x20) && f->sdm_ctr >= f->ctr_limit) {
+            return in_session ? emu_fail(emu, resp, 0x919D) : emu_sw(resp, 0, 0x919D);
+        }
+        if ((f->sdm_options & 0x40) && f->sdm_ctr < 0xFFFFFF) f->sdm_ctr++;
+        if (!emu_sdm_mirror(emu, f, file)) return in_session ? emu_fail(emu, resp, 0x91CA) : emu_sw(resp, 0, 0x91CA);
+        src = file;
+    }
+    if (mode == 0x00) {
+        memcpy(emu->chain, src + offset, n);
+        emu->chain_len = n;
+        if (in_session) emu->sess.cmd_ctr++;
+    } else {
+        size_t out = emu_ssm_out(emu, mode == 0x03, src + offset, n, emu->chain);
+        if (out == 2) return emu_sw(resp, 0, (uint16_t)((emu->chain[0] << 8) | emu->chain[1]));
+        emu->chain_len = out - 2;
+    }
+    memset(file, 0, sizeof(file));
+    emu->chain_ins = 0xAD;
+    emu->chain_pos = 0;
+    return emu_chain_out(emu, resp);
+}
+
+// WriteData frames, the first with FileNo || Offset || Length. The tag
+// answers 91 AF until the data, its padding and the MAC have all arrived.
+static size_t emu_write_data(ntag424_emu_t *emu, uint8_t ins, const uint8_t *d, size_t len, uint8_t *resp) {
+    int in_session = emu->sess.authenticated;
+    if (ins == 0x8D) {
+        if (len < DATA_HDR_LEN) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+        emu_file_t *f = emu_file(emu, d[0]);
+        if (!f) return in_session ? emu_fail(emu, resp, 0x91F0) : emu_sw(resp, 0, 0x91F0);
+        uint16_t sw = 0x919D;
+        int mode = emu_data_mode(emu, f, 1, &sw);
+        if (mode < 0) return in_session ? emu_fail(emu, resp, sw) : emu_sw(resp, 0, sw);
+        uint32_t offset = read_u24_le(d + 1);
+        uint32_t n = read_u24_le(d + 4);
+        if (n == 0 || offset >= f->size || n > f->size - offset) {
+            return in_session ? emu_fail(emu, resp, 0x91BE) : emu_sw(resp, 0, 0x91BE);
+        }
+        size_t stream = mode == 0x03 ? (n / 16 + 1) * 16 + 8 : mode == 0x01 ? n + 8 : n;
+        emu->chain_mode = (uint8_t)mode;
+        emu->chain_need = DATA_HDR_LEN + stream;
+        emu->chain_len = 0;
+    }
+    if (emu->chain_len + len > emu->chain_need) {
+        emu->chain_ins = 0;
+        return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+    }
+    memcpy(emu->chain + emu->chain_len, d, len);
+    emu->chain_len += len;
+    if (emu->chain_len < emu->chain_need) {
+        emu->chain_ins = 0x8D;
+        return emu_sw(resp, 0, 0x91AF);
+    }
+
+    emu->chain_ins = 0;
+    size_t body = emu->chain_len;
+    int mode = emu->chain_mode;
+    if (mode != 0x00 && !emu_ssm_in(emu, 0x8D, emu->chain, &body, DATA_HDR_LEN, mode == 0x03)) {
+        return emu_fail(emu, resp, 0x911E);
+    }
+    emu_file_t *f = emu_file(emu, emu->chain[0]);
+    uint32_t offset = read_u24_le(emu->chain + 1);
+    uint32_t n = read_u24_le(emu->chain + 4);
+    if (body != DATA_HDR_LEN + n) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+    memcpy(f->data + offset, emu->chain + DATA_HDR_LEN, n);
+    memset(emu->chain, 0, sizeof(emu->chain));
+    emu->view_valid = 0;
+    if (mode != 0x00) return emu_ssm_out(emu, 0, NULL, 0, resp);
+    if (in_session) emu->sess.cmd_ctr++;
+    return emu_sw(resp, 0, 0x9100);
+}
+
+// Native commands (CLA 0x90). d holds the command data and may be modified.
+static size_t emu_native(ntag424_emu_t *emu, uint8_t ins, uint8_t *d, size_t len, uint8_t *resp) {
+    if (ins == 0xAF && emu->chain_ins == 0xAD) {
+        if (len != 0) return emu->sess.authenticated ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+        return emu_chain_out(emu, resp);
+    }
+    if (ins == 0xAF && emu->chain_ins == 0x8D) return emu_write_data(emu, ins, d, len, resp);
+    emu->chain_ins = 0;
+    if (ins == 0x71 || ins == 0xAF) return emu_auth(emu, ins, d, len, resp);
+    emu->auth_pending = 0;
+    int in_session = emu->sess.authenticated;
+
+    switch (ins) {
+        case 0xAD:  // ReadData
+            return emu_read_data(emu, d, len, resp);
+
+        case 0x8D:  // WriteData
+            return emu_write_data(emu, ins, d, len, resp);
+
+        case 0xF5: {  // GetFileSettings, CommMode.MAC in a session
+            if (in_session && !emu_ssm_in(emu, ins, d, &len, 1, 0)) return emu_fail(emu, resp, 0x911E);
+            if (len != 1) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+            emu_file_t *f = emu_file(emu, d[0]);
+            if (!f) return in_session ? emu_fail(emu, resp, 0x91F0) : emu_sw(resp, 0, 0x91F0);
+            uint8_t fs[64];
+            size_t fs_len = emu_file_settings(f, fs);
+            if (in_session) return emu_ssm_out(emu, 0, fs, fs_len, resp);
+            memcpy(resp, fs, fs_len);
+            return emu_sw(resp, fs_len, 0x9100);
+        }
+
+        case 0x5F: {  // ChangeFileSettings, CommMode.Full; needs the Change key
+            if (!in_session) return emu_sw(resp, 0, 0x91AE);
+            if (!emu_ssm_in(emu, ins, d, &len, 1, 1)) return emu_fail(emu, resp, 0x911E);
+            emu_file_t *f = emu_file(emu, d[0]);
+            if (!f) return emu_fail(emu, resp, 0x91F0);
+            if (!emu_access(emu, f->ar1 & 0x0F)) return emu_fail(emu, resp, 0x919D);
+            uint16_t sw = emu_apply_file_settings(f, d + 1, len - 1);
+            if (sw != 0x9100) return emu_fail(emu, resp, sw);
+            emu->view_valid = 0;
+            return emu_ssm_out(emu, 1, NULL, 0, resp);
+        }
+
+        case 0xC4: {  // ChangeKey, CommMode.Full; needs the master key
+            if (!in_session) return emu_sw(resp, 0, 0x91AE);
+            if (!emu_ssm_in(emu, ins, d, &len, 1, 1)) return emu_fail(emu, resp, 0x911E);
+            if (len < 1 || d[0] >= EMU_KEY_COUNT) return emu_fail(emu, resp, 0x9140);
+            if (emu->sess.key_no != 0) return emu_fail(emu, resp, 0x919D);
+            uint8_t key_no = d[0];
+            if (key_no == emu->sess.key_no) {
+                // NewKey || KeyVer; the session ends and the answer has no MAC.
+                if (len != 18) return emu_fail(emu, resp, 0x917E);
+                memcpy(emu->keys[key_no], d + 1, 16);
+                emu->key_ver[key_no] = d[17];
+                ntag424_session_clear(&emu->sess);
+                return emu_sw(resp, 0, 0x9100);
+            }
+            if (len != 22) return emu_fail(emu, resp, 0x917E);
+            uint8_t new_key[16];
+            xor_block(new_key, d + 1, emu->keys[key_no], 16);
+            uint32_t crc = crc32_ieee(new_key, 16);
+            if (crc != ((uint32_t)d[18] | ((uint32_t)d[19] << 8) | ((uint32_t)d[20] << 16) | ((uint32_t)d[21] << 24))) {
+                return emu_fail(emu, resp, 0x911E);
+            }
+            memcpy(emu->keys[key_no], new_key, 16);
+            emu->key_ver[key_no] = d[17];
+            memset(new_key, 0, sizeof(new_key));
+            return emu_ssm_out(emu, 1, NULL, 0, resp);
+        }
+
+        case 0xF6: {  // GetFileCounters, CommMode.Full unless SDMCtrRet is free
+            if (in_session && !emu_ssm_in(emu, ins, d, &len, 1, 1)) return emu_fail(emu, resp, 0x911E);
+            if (len != 1) return in_session ? emu_fail(emu, resp, 0x917E) : emu_sw(resp, 0, 0x917E);
+            emu_file_t *f = emu_file(emu, d[0]);
+            if (!f) return in_session ? emu_fail(emu, resp, 0x91F0) : emu_sw(resp, 0, 0x91F0);
+            uint8_t ctr_ret = (uint8_t)(f->sdm_ar & 0x0F);
+            if (!(f->file_option & 0x40) || !emu_access(emu, ctr_ret)) {
+                return in_session ? emu_fail(emu, resp, 0x919D) : emu_sw(resp, 0, 0x919D);
+            }
+            uint8_t ctrs[5] = {0};
+            write_u24_le(ctrs, f->sdm_ctr);
+            if (in_session) return emu_ssm_out(emu, 1, ctrs, sizeof(ctrs), resp);
+            memcpy(resp, ctrs, sizeof(ctrs));
+            return emu_sw(resp, sizeof(ctrs), 0x9100);
+        }
+    }
+    return emu_sw(resp, 0, 0x911C);
+}
+
+// READ BINARY / UPDATE BINARY on the selected file. Only files whose access
+// rights allow free plain access are served; the first read after a select
+// counts as an SDM read and bumps SDMReadCtr. Later reads return the same
+// mirrors, so a file read in chunks carries one consistent UID/CTR/MAC.
+static size_t emu_binary(ntag424_emu_t *emu, uint8_t ins, uint32_t offset, const uint8_t *d, size_t lc,
+                         size_t le, uint8_t *resp, size_t cap) {
+    if (emu->selected < 0) return emu_sw(resp, 0, 0x6986);
+    emu_file_t *f = &emu->files[emu->selected];
+    uint8_t rw = (uint8_t)(f->ar1 >> 4);
+    if (ins == 0xD6) {
+        if (rw != 0x0E && (f->ar2 & 0x0F) != 0x0E) return emu_sw(resp, 0, 0x6982);
+        if (lc == 0) return emu_sw(resp, 0, 0x6700);
+        if (offset + lc > f->size) return emu_sw(resp, 0, 0x6B00);
+        memcpy(f->data + offset, d, lc);
+        emu->view_valid = 0;
+        return emu_sw(resp, 0, 0x9000);
+    }
+
+    if (rw != 0x0E && (f->ar2 >> 4) != 0x0E) return emu_sw(resp, 0, 0x6982);
+    if (offset >= f->size) return emu_sw(resp, 0, 0x6B00);
+    size_t n = f->size - offset;
+    if (le < n) n = le;
+    if (n + 2 > cap) return emu_sw(resp, 0, 0x6700);
+    if (!(f->file_option & 0x40)) {
+        memcpy(resp, f->data + offset, n);
+        return emu_sw(resp, n, 0x9000);
+    }
+    if ((f->sdm_options & 0x20) && f->sdm_ctr >= f->ctr_limit) return emu_sw(resp, 0, 0x6982);
+    if (!emu->read_since_select) {
+        emu->read_since_select = 1;
+        if ((f->sdm_options & 0x40) && f->sdm_ctr < 0xFFFFFF) f->sdm_ctr++;
+    }
+    if (!emu->view_valid) {
+        if (!emu_sdm_mirror(emu, f, emu->view)) return emu_sw(resp, 0, 0x6F00);
+        emu->view_valid = 1;
+    }
+    memcpy(resp, emu->view + offset, n);
+    return emu_sw(resp, n, 0x9000);
+}
+
+int ntag424_emu_transmit(ntag424_emu_t *emu, const uint8_t *apdu, size_t apdu_len, uint8_t *resp, size_t *resp_len) {
+    // The largest answer is a 256 byte READ BINARY plus SW; native answers are
+    // built in place, so leave room for the biggest of those too.
+    if (apdu_len < 4 || *resp_len < 64) return 0;
+    uint8_t cla = apdu[0];
+    uint8_t ins = apdu[1];
+    uint8_t p1 = apdu[2];
+    uint8_t p2 = apdu[3];
+
+    // Case 1..4 APDUs, short or extended.
+    const uint8_t *body = apdu + 4;
+    size_t body_len = apdu_len - 4;
+    size_t lc = 0;
+    size_t le = 0;
+    const uint8_t *d = NULL;
+    if (body_len == 1) {
+        le = body[0] ? body[0] : 256;
+    } else if (body_len == 3 && body[0] == 0x00) {
+        le = (size_t)((body[1] << 8) | body[2]);
+        if (le == 0) le = 65536;
+    } else if (body_len > 1 && body[0] != 0x00) {
+        lc = body[0];
+        d = body + 1;
+        if (body_len == 1 + lc + 1) {
+            le = body[1 + lc] ? body[1 + lc] : 256;
+        } else if (body_len != 1 + lc) {
+            *resp_len = emu_sw(resp, 0, 0x6700);
+            return 1;
+        }
+    } else if (body_len > 3) {
+        lc = (size_t)((body[1] << 8) | body[2]);
+        d = body + 3;
+        if (body_len == 3 + lc + 2) {
+            le = (size_t)((body[3 + lc] << 8) | body[4 + lc]);
+            if (le == 0) le = 65536;
+        } else if (body_len != 3 + lc) {
+            *resp_len = emu_sw(resp, 0, 0x6700);
+            return 1;
+        }
+    } else if (body_len != 0) {
+        *resp_len = emu_sw(resp, 0, 0x6700);
+        return 1;
+    }
+
+    if (cla == 0x90) {
+        if (p1 != 0x00 || p2 != 0x00) {
+            *resp_len = emu_sw(resp, 0, 0x917E);
+            return 1;
+        }
+        uint8_t data[256];
+        if (lc > sizeof(data)) {
+            *resp_len = emu_sw(resp, 0, 0x917E);
+            return 1;
+        }
+        if (lc > 0) memcpy(data, d, lc);
+        *resp_len = emu_native(emu, ins, data, lc, resp);
+        memset(data, 0, sizeof(data));
+        return 1;
+    }
+
+    if (cla == 0xFF && ins == 0xCA && p2 == 0x00 && (p1 == 0x00 || p1 == 0x01)) {
+        const uint8_t *v = p1 == 0x00 ? emu->uid : k_emu_ats;
+        size_t n = p1 == 0x00 ? 7 : sizeof(k_emu_ats);
+        memcpy(resp, v, n);
+        *resp_len = emu_sw(resp, n, 0x9000);
+        return 1;
+    }
+
+    if (cla != 0x00) {
+        *resp_len = emu_sw(resp, 0, 0x6E00);
+        return 1;
+    }
+    emu->auth_pending = 0;
+    emu->chain_ins = 0;
+    switch (ins) {
+        case 0xA4: {  // ISO SELECT ends the session
+            static const uint8_t aid[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
+            ntag424_session_clear(&emu->sess);
+            uint16_t sw = 0x6A82;
+            if (p1 == 0x04 && lc == sizeof(aid) && memcmp(d, aid, sizeof(aid)) == 0) {
+                emu->app_selected = 1;
+                emu->selected = -1;
+                sw = 0x9000;
+            } else if (p1 == 0x00 && lc == 2 && emu->app_selected) {
+                uint16_t fid = (uint16_t)((d[0] << 8) | d[1]);
+                for (int i = 0; i < EMU_FILE_COUNT; i++) {
+                    if (emu->files[i].iso_id == fid) {
+                        emu->selected = i;
+                        emu->read_since_select = 0;
+                        emu->view_valid = 0;
+                        sw = 0x9000;
+                    }
+                }
+            }
+            *resp_len = emu_sw(resp, 0, sw);
+            return 1;
+        }
+        case 0xB0:
+        case 0xD6: {
+            if (p1 & 0x80) {
+                *resp_len = emu_sw(resp, 0, 0x6A86);
+                return 1;
+            }
+            uint32_t offset = (uint32_t)((p1 << 8) | p2);
+            if (ins == 0xB0 && le == 0) le = 256;
+            *resp_len = emu_binary(emu, ins, offset, d, lc, le, resp, *resp_len);
+            return 1;
+        }
+    }
+    *resp_len = emu_sw(resp, 0, 0x6D00);
+    return 1;
+}
@@ -0,0 +1,459 @@
+#ifndef NTAG424_H
+#define NTAG424_H
+
+// libntag424: NTAG 424 DNA access over PC/SC.
+//
+// All state lives in handles. A context wraps one PC/SC context; readers and
+// cards are opened from it, and a session holds the EV2 secure messaging
+// state for one card at a time. The library keeps no global state, so
+// separate handles can be used from separate threads; sharing one handle
+// between threads needs external locking.
+//
+// Unless noted otherwise, functions return 1 on success and 0 on failure,
+// store the card status word in *sw_out, and report PC/SC errors as the raw
+// 32-bit code in *rc_out. Either pointer may be NULL.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NTAG424_SDM_UID_LEN_ASCII 14
+#define NTAG424_SDM_CTR_LEN_ASCII 6
+#define NTAG424_SDM_MAC_LEN_ASCII 16
+#define NTAG424_SDM_PICC_LEN_ASCII 32
+#define NTAG424_SDM_ENC_LEN_ASCII 32  // SDMENCLength: one block of file data
+#define NTAG424_SDM_ENC_DATA_LEN 16
+#define NTAG424_SDM_OFFSET_NONE 0xFFFFFF
+#define NTAG424_SDM_NDEF_MAX 256
+
+typedef struct ntag424_context ntag424_context_t;
+typedef struct ntag424_reader ntag424_reader_t;
+typedef struct ntag424_reader_monitor ntag424_reader_monitor_t;
+typedef struct ntag424_card ntag424_card_t;
+typedef struct ntag424_session ntag424_session_t;
+typedef struct ntag424_sdm_verifier ntag424_sdm_verifier_t;
+
+// Called after every APDU exchange on cards of the context, from the thread
+// that ran it. sw is 0 when the transfer itself failed.
+typedef void (*ntag424_apdu_observer_fn)(void *user, const uint8_t *apdu, size_t apdu_len,
+                                         uint16_t sw, uint64_t elapsed_us);
+
+// Like the observer, with the complete response including SW1SW2 (resp_len
+// is 0 when the transfer failed). Meant for recording traces to replay.
+typedef void (*ntag424_apdu_trace_fn)(void *user, const uint8_t *apdu, size_t apdu_len,
+                                      const uint8_t *resp, size_t resp_len, uint64_t elapsed_us);
+
+// Fills buf with the host challenge RndA of AuthenticateEV2First. Only for
+// replaying recorded traces, which need the same RndA as the recording; a
+// predictable RndA gives up the freshness of the session keys.
+typedef void (*ntag424_random_fn)(void *user, uint8_t *buf, size_t len);
+
+// Bits in ntag424_file_settings_t.present for the optional SDM fields.
+#define NTAG424_FS_HAS_UID_OFFSET      0x0001
+#define NTAG424_FS_HAS_READ_CTR_OFFSET 0x0002
+#define NTAG424_FS_HAS_PICC_OFFSET     0x0004
+#define NTAG424_FS_HAS_MAC_INPUT       0x0008
+#define NTAG424_FS_HAS_ENC             0x0010
+#define NTAG424_FS_HAS_MAC_OFFSET      0x0020
+#define NTAG424_FS_HAS_READ_CTR_LIMIT  0x0040
+#define NTAG424_FS_HAS_SDM             0x0080
+
+// Parsed GetFileSettings response. Fixed-width fields so the struct can be
+// embedded in binary records.
+typedef struct {
+    uint8_t valid;
+    uint8_t sdm_enabled;
+    uint8_t sdm_read_ctr_enabled;
+    uint8_t file_type;
+    uint8_t file_option;
+    uint8_t sdm_options;
+    uint8_t sdm_meta_read;
+    uint8_t sdm_file_read;
+    uint8_t sdm_ctr_ret;
+    uint8_t ar1;
+    uint8_t ar2;
+    uint8_t rfu;
+    uint16_t sdm_ar;
+    uint16_t present;
+    uint32_t file_size;
+    uint32_t uid_offset;
+    uint32_t sdm_read_ctr_offset;
+    uint32_t picc_data_offset;
+    uint32_t sdm_mac_input_offset;
+    uint32_t sdm_enc_offset;
+    uint32_t sdm_enc_length;
+    uint32_t sdm_mac_offset;
+    uint32_t sdm_read_ctr_limit;
+} ntag424_file_settings_t;
+
+// ChangeFileSettings parameters for an SDM-enabled file. Offsets are only
+// sent when the options and access rights call for them.
+typedef struct {
+    uint8_t file_no;
+    uint8_t comm_mode;
+    uint8_t ar1;
+    uint8_t ar2;
+    uint8_t sdm_options;
+    uint8_t sdm_meta_read;
+    uint8_t sdm_file_read;
+    uint8_t sdm_ctr_ret;
+    uint32_t uid_offset;
+    uint32_t sdm_read_ctr_offset;
+    uint32_t picc_data_offset;
+    uint32_t sdm_mac_input_offset;
+    uint32_t sdm_enc_offset;  // with SDMOptions 0x10 (SDMENCFileData)
+    uint32_t sdm_enc_length;
+    uint32_t sdm_mac_offset;
+} ntag424_sdm_config_t;
+
+// SDM NDEF template fields.
+enum {
+    NTAG424_SDM_FIELD_UID,
+    NTAG424_SDM_FIELD_CTR,
+    NTAG424_SDM_FIELD_PICC,
+    NTAG424_SDM_FIELD_MAC,
+    NTAG424_SDM_FIELD_ENC,
+    NTAG424_SDM_FIELD_COUNT
+};
+
+typedef struct {
+    uint8_t field;
+    char name[16];
+} ntag424_sdm_param_t;
+
+// Query parameters appended to the SDM base URL, in URL order.
+typedef struct {
+    ntag424_sdm_param_t params[NTAG424_SDM_FIELD_COUNT];
+    size_t count;
+} ntag424_sdm_template_t;
+
+typedef struct {
+    uint8_t *ndef;
+    size_t ndef_len;
+    const char *url_prefix; // abbreviated by the URI prefix code
+    const char *uri;        // rest of the URL, inside ndef
+    size_t uri_len;
+    uint8_t fields;         // bit per NTAG424_SDM_FIELD_*
+    uint32_t uid_offset;
+    uint32_t ctr_offset;
+    uint32_t picc_offset;
+    uint32_t mac_input_offset;
+    uint32_t mac_offset;
+    uint32_t enc_offset;    // the tag encrypts the first NTAG424_SDM_ENC_DATA_LEN bytes here
+} ntag424_sdm_ndef_t;
+
+typedef struct {
+    uint8_t uid[7];
+    uint8_t ctr_le[3];
+    uint8_t fields;         // NTAG424_SDM_FIELD_UID / _CTR bits present in the tap
+    uint8_t mac[8];
+    const char *mac_input;  // "uid=...&mac=" slice of the URL
+    size_t mac_input_len;
+    uint8_t picc[16];       // PICCData still encrypted while picc_pending
+    int picc_pending;
+    const char *enc;        // SDMENCFileData mirror (hex), NULL without one
+    uint8_t enc_data[NTAG424_SDM_ENC_DATA_LEN];  // decrypted once match is set
+    int valid;
+    int match;
+} ntag424_sdm_tap_t;
+
+// Contexts and readers.
+int ntag424_context_open(ntag424_context_t **ctx_out, long *rc_out);
+void ntag424_context_close(ntag424_context_t *ctx);
+void ntag424_context_set_apdu_observer(ntag424_context_t *ctx, ntag424_apdu_observer_fn fn, void *user);
+void ntag424_context_set_apdu_trace(ntag424_context_t *ctx, ntag424_apdu_trace_fn fn, void *user);
+// NULL (the default) draws RndA from ntag424_random_bytes.
+void ntag424_context_set_random(ntag424_context_t *ctx, ntag424_random_fn fn, void *user);
+// Stores a malloc'd, double-NUL terminated list of reader names in
+// *readers_out; the caller frees it.
+int ntag424_context_list_readers(ntag424_context_t *ctx, char **readers_out, long *rc_out);
+
+enum {
+    NTAG424_WAIT_TAP = 1,        // a new card is present
+    NTAG424_WAIT_NONE = 0,       // timeout or a state change that is not a tap
+    NTAG424_WAIT_CANCELLED = -1,
+    NTAG424_WAIT_ERROR = -2,
+    NTAG424_WAIT_REMOVED = -3    // the reader was unplugged
+};
+
+int ntag424_reader_open(ntag424_context_t *ctx, const char *name, ntag424_reader_t **reader_out);
+void ntag424_reader_close(ntag424_reader_t *reader);
+const char *ntag424_reader_name(const ntag424_reader_t *reader);
+// Waits up to timeout_ms for a card. Reports each card once: it has to be
+// removed before NTAG424_WAIT_TAP is returned again. Mute cards are ignored.
+int ntag424_reader_wait_tap(ntag424_reader_t *reader, unsigned timeout_ms, long *rc_out);
+
+// Reader hot-plug. A monitor keeps the last seen reader list of ctx and
+// reports the difference after each \\?PnP?\Notification wake-up, so
+// readers are tracked by name instead of by list position.
+enum {
+    NTAG424_READER_ADDED = 1,
+    NTAG424_READER_REMOVED = 2
+};
+
+typedef void (*ntag424_reader_event_fn)(void *user, int event, const char *name);
+
+int ntag424_reader_monitor_open(ntag424_context_t *ctx, ntag424_reader_monitor_t **mon_out);
+void ntag424_reader_monitor_close(ntag424_reader_monitor_t *mon);
+// The first call reports every attached reader as added without waiting.
+// Later calls wait up to timeout_ms for a reader to come or go and call fn
+// once per change. Returns the number of changes or NTAG424_WAIT_NONE,
+// NTAG424_WAIT_CANCELLED, NTAG424_WAIT_ERROR.
+int ntag424_reader_monitor_poll(ntag424_reader_monitor_t *mon, unsigned timeout_ms,
+                                ntag424_reader_event_fn fn, void *user, long *rc_out);
+
+// Cards.
+int ntag424_card_connect(ntag424_context_t *ctx, const char *reader, ntag424_card_t **card_out, long *rc_out);
+void ntag424_card_disconnect(ntag424_card_t *card);
+int ntag424_card_atr(ntag424_card_t *card, uint8_t *atr, size_t *atr_len);
+// Raw APDU exchange. Returns the PC/SC result; on success *resp_len excludes
+// the status word, which goes to *sw.
+long ntag424_transmit(ntag424_card_t *card, const uint8_t *apdu, size_t apdu_len,
+                      uint8_t *resp, size_t *resp_len, uint16_t *sw);
+
+// Sizes READ BINARY / UPDATE BINARY chunks from the CC file's MLe/MLc.
+// Without ext_ok the short APDU limits still apply. Connect starts at 255.
+void ntag424_card_set_frame_limits(ntag424_card_t *card, uint16_t mle, uint16_t mlc, int ext_ok);
+void ntag424_card_frame_limits(const ntag424_card_t *card, size_t *max_le, size_t *max_lc);
+
+// ISO 14443-4 parameters from an ATS as ntag424_get_ats returns it
+// (TL T0 [TA1] [TB1] [TC1] historical bytes). Divisor masks have bit 0 for
+// D=2 (212 kbit/s), bit 1 for D=4 and bit 2 for D=8.
+typedef struct {
+    uint8_t fsci;
+    uint16_t fsc;    // largest frame the tag accepts, bytes
+    uint8_t ds;      // tag to reader divisors (TA1)
+    uint8_t dr;      // reader to tag divisors
+    uint8_t same_d;  // both directions must use one divisor
+    uint8_t fwi;
+    uint8_t sfgi;
+    uint8_t nad;     // NAD and CID support (TC1)
+    uint8_t cid;
+} ntag424_ats_info_t;
+
+// Returns 0 if TL does not match len; info then holds the defaults.
+int ntag424_parse_ats(const uint8_t *ats, size_t len, ntag424_ats_info_t *info);
+// Highest divisor up to max_d (1, 2, 4 or 8 for 106..848 kbit/s) the tag
+// supports in both directions.
+unsigned ntag424_ats_max_divisor(const ntag424_ats_info_t *ats, unsigned max_d);
+// Sizes chunks that need several APDUs so each READ BINARY response and
+// UPDATE BINARY command fills whole I-blocks: the tag's FSC from ats one
+// way, the reader's FSD (0: 256, what PC/SC readers use) the other.
+void ntag424_card_set_rf_frames(ntag424_card_t *card, const ntag424_ats_info_t *ats, size_t fsd);
+// Raw SCardControl. *out_len is the capacity of out on entry. Emulated
+// cards return SCARD_E_UNSUPPORTED_FEATURE.
+long ntag424_card_control(ntag424_card_t *card, unsigned long code, const uint8_t *in, size_t in_len,
+                          uint8_t *out, size_t *out_len);
+// Switches the tag's link to 106 * d kbit/s per direction with a PN53x
+// InPSL, sent over the CCID escape channel (ACR122U and other PN53x-based
+// readers; pcsc-lite's ccid driver needs ifdDriverOptions 0x0001). Returns
+// 0 if the reader refuses, with the link left as it was.
+int ntag424_card_set_bit_rate(ntag424_card_t *card, unsigned d_to_tag, unsigned d_from_tag, long *rc_out);
+
+// ISO 7816 / NFC Forum Type 4 access.
+int ntag424_get_uid(ntag424_card_t *card, uint8_t *uid, size_t *uid_len);
+int ntag424_get_ats(ntag424_card_t *card, uint8_t *ats, size_t *ats_len);
+int ntag424_select_ndef_app(ntag424_card_t *card, uint16_t *sw_out);
+int ntag424_select_file(ntag424_card_t *card, uint16_t file_id, uint16_t *sw_out);
+// One READ BINARY of le bytes; *out_len is the capacity of out on entry.
+int ntag424_read_binary(ntag424_card_t *card, uint16_t offset, size_t le,
+                        uint8_t *out, size_t *out_len, uint16_t *sw_out);
+// Reads len bytes of the selected file in frame-limit sized chunks, dropping
+// to short APDUs if the reader refuses extended ones. *got is the number of
+// bytes read, also on failure.
+int ntag424_read_binary_chunked(ntag424_card_t *card, uint16_t offset, size_t len,
+                                uint8_t *out, size_t *got, uint16_t *sw_out);
+// Selects the NDEF file and writes data from offset 0 with plain UPDATE
+// BINARY. The selects end any secure session on the card.
+int ntag424_write_ndef(ntag424_card_t *card, const uint8_t *data, size_t len, uint16_t *sw_out);
+
+// Secure messaging sessions.
+ntag424_session_t *ntag424_session_new(void);
+void ntag424_session_free(ntag424_session_t *sess);
+// Drops the session keys; the handle stays usable for a new authentication.
+void ntag424_session_clear(ntag424_session_t *sess);
+int ntag424_session_active(const ntag424_session_t *sess);
+uint8_t ntag424_session_key_no(const ntag424_session_t *sess);
+uint16_t ntag424_session_cmd_ctr(const ntag424_session_t *sess);
+const uint8_t *ntag424_session_ti(const ntag424_session_t *sess);
+
+int ntag424_authenticate_ev2_first(ntag424_card_t *card, ntag424_session_t *sess,
+                                   const uint8_t key[16], uint8_t key_no);
+// Native command in CommMode.Full (data encrypted both ways) or CommMode.MAC
+// (data in clear, MACs only). *out_len is the capacity of out on entry.
+int ntag424_cmd_full(ntag424_card_t *card, ntag424_session_t *sess,
+                     uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                     const uint8_t *cmd_data, size_t cmd_data_len,
+                     uint8_t *out, size_t *out_len, uint16_t *sw_out);
+int ntag424_cmd_mac(ntag424_card_t *card, ntag424_session_t *sess,
+                    uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
+                    const uint8_t *cmd_data, size_t cmd_data_len,
+                    uint8_t *out, size_t *out_len, uint16_t *sw_out);
+
+// File settings and keys. A NULL session sends the plain command.
+int ntag424_get_file_settings(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                              uint8_t *out, size_t *out_len, uint16_t *sw_out);
+int ntag424_parse_file_settings(const uint8_t *data, size_t len, ntag424_file_settings_t *info);
+// Changing the session's own key (the master key) ends the session; old_key
+// is ignored in that case.
+int ntag424_change_key(ntag424_card_t *card, ntag424_session_t *sess,
+                       uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
+                       uint8_t key_ver, uint16_t *sw_out);
+int ntag424_change_file_settings_sdm(ntag424_card_t *card, ntag424_session_t *sess,
+                                     const ntag424_sdm_config_t *cfg, uint16_t *sw_out);
+int ntag424_get_sdm_read_counter(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                                 uint32_t *counter, uint16_t *sw_out);
+// ReadData / WriteData in the file's CommMode (FileOption bits: 0x00 plain,
+// 0x01 MAC, 0x03 full). Data longer than one frame is chained in 0xAF
+// frames sized to the tag's FSC, with the MAC and CBC chain carried across
+// them. A read length of 0 reads to the end of the file; *out_len is the
+// capacity of out on entry. Plain commands may go without a session.
+int ntag424_read_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode, uint8_t file_no,
+                      uint32_t offset, uint32_t len, uint8_t *out, size_t *out_len, uint16_t *sw_out);
+int ntag424_write_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode, uint8_t file_no,
+                       uint32_t offset, const uint8_t *data, size_t len, uint16_t *sw_out);
+
+// SDM URL templates and offline verification.
+void ntag424_sdm_template_default(ntag424_sdm_template_t *tpl);
+// Parses "uid,ctr,mac" style lists; "field=name" renames a parameter. Fields
+// are uid, ctr, picc, mac and enc (SDMENCFileData, before mac).
+int ntag424_sdm_template_parse(const char *spec, ntag424_sdm_template_t *tpl);
+// Builds the NDEF URI record for base_url plus the template placeholders into
+// buf and reports the mirror offsets.
+int ntag424_sdm_build_ndef(const char *base_url, const ntag424_sdm_template_t *tpl,
+                           uint8_t *buf, size_t cap, ntag424_sdm_ndef_t *out);
+// Parses a tap URL with the default uid/ctr/mac parameters. tap points into url.
+int ntag424_sdm_parse_url(const char *url, ntag424_sdm_tap_t *tap);
+// Same for the parameters of tpl, which may mirror only the UID, only the
+// counter or neither. Encrypted PICCData is left pending for
+// ntag424_sdm_verify.
+int ntag424_sdm_parse_url_template(const char *url, const ntag424_sdm_template_t *tpl, ntag424_sdm_tap_t *tap);
+// Parses the mirrors of an SDM file image read back from the tag (file
+// offset 0 onwards) at the offsets in fs: UID and SDMReadCtr in plain as
+// far as SDMOptions mirrors them, or decrypted from PICCData with meta_key
+// (NULL leaves it pending for the verifier), plus the MAC and
+// SDMENCFileData. tap points into file.
+int ntag424_sdm_parse_file(const uint8_t *file, size_t len, const ntag424_file_settings_t *fs,
+                           const uint8_t meta_key[16], ntag424_sdm_tap_t *tap);
+ntag424_sdm_verifier_t *ntag424_sdm_verifier_new(const uint8_t sdm_file_key[16]);
+// KSDMMetaRead for taps with pending PICCData.
+int ntag424_sdm_verifier_set_meta_key(ntag424_sdm_verifier_t *v, const uint8_t sdm_meta_key[16]);
+void ntag424_sdm_verifier_free(ntag424_sdm_verifier_t *v);
+// Decrypts pending PICCData (clearing valid where it does not decrypt),
+// sets match on every valid tap and decrypts SDMENCFileData of the matches.
+// SV1 and SV2 carry only the fields the tap mirrors.
+void ntag424_sdm_verify(ntag424_sdm_verifier_t *v, ntag424_sdm_tap_t *taps, size_t n);
+
+// Fills buf from the system CSPRNG. Returns 0 (buf zeroed) if it cannot be
+// read; callers must not fall back to weaker randomness for key material.
+int ntag424_random_bytes(uint8_t *buf, size_t len);
+// AN10922 AES-128 key diversification of master over div_input (1..31
+// bytes, e.g. UID || AID || system identifier).
+int ntag424_diversify_key(const uint8_t master[16], const uint8_t *div_input, size_t div_len,
+                          uint8_t out[16]);
+
+// Key database. Keys are stored per tag UID and key number in one
+// memory-mapped file, so lookups are O(1) without file-system calls. Every
+// put is synced to disk before it returns. Record a new key with
+// put_pending before the ChangeKey that installs it and with put once
+// ChangeKey succeeded; until then get keeps returning the previous key.
+// Use one writer process per file.
+typedef struct ntag424_keydb ntag424_keydb_t;
+
+// Opens path, creating an empty database if the file does not exist.
+int ntag424_keydb_open(const char *path, ntag424_keydb_t **db_out);
+void ntag424_keydb_close(ntag424_keydb_t *db);
+// Returns 0 if no key is stored for uid and key_no. key_ver may be NULL.
+int ntag424_keydb_get(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                      uint8_t key[16], uint8_t *key_ver);
+// Appends a record that replaces any earlier key for uid and key_no.
+int ntag424_keydb_put(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                      const uint8_t key[16], uint8_t key_ver);
+// Appends a record for a key that is about to be installed. It does not
+// replace the stored key; get_pending returns it until the next put for
+// uid and key_no, e.g. to retry after a ChangeKey whose answer was lost.
+int ntag424_keydb_put_pending(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                              const uint8_t key[16], uint8_t key_ver);
+int ntag424_keydb_get_pending(ntag424_keydb_t *db, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                              uint8_t key[16], uint8_t *key_ver);
+
+// Asynchronous operations. SCardTransmit blocks for the whole RF round trip,
+// so an engine keeps a few I/O threads that only run the transfers, while
+// each operation is a state machine stepped from ntag424_engine_poll: the
+// crypto for one card runs while frames for others are in flight. Submit
+// and poll from one thread; callbacks run there too. For transfers to
+// really overlap, connect each card from its own context, since PC/SC
+// serialises calls on a shared one.
+typedef struct ntag424_op ntag424_op_t;
+typedef struct ntag424_engine ntag424_engine_t;
+
+// Called once the operation has finished; the callback may free op and
+// submit the next operation for the same card.
+typedef void (*ntag424_op_done_fn)(void *user, ntag424_op_t *op);
+
+ntag424_op_t *ntag424_op_authenticate(ntag424_card_t *card, ntag424_session_t *sess,
+                                      const uint8_t key[16], uint8_t key_no,
+                                      ntag424_op_done_fn done, void *user);
+// A NULL session reads the counter with the plain command.
+ntag424_op_t *ntag424_op_read_counter(ntag424_card_t *card, ntag424_session_t *sess, uint8_t file_no,
+                                      ntag424_op_done_fn done, void *user);
+ntag424_op_t *ntag424_op_change_key(ntag424_card_t *card, ntag424_session_t *sess,
+                                    uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
+                                    uint8_t key_ver, ntag424_op_done_fn done, void *user);
+// out and data must stay valid until the operation is done.
+ntag424_op_t *ntag424_op_read_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode,
+                                   uint8_t file_no, uint32_t offset, uint32_t len, uint8_t *out, size_t out_cap,
+                                   ntag424_op_done_fn done, void *user);
+ntag424_op_t *ntag424_op_write_data(ntag424_card_t *card, ntag424_session_t *sess, uint8_t comm_mode,
+                                    uint8_t file_no, uint32_t offset, const uint8_t *data, size_t len,
+                                    ntag424_op_done_fn done, void *user);
+void ntag424_op_free(ntag424_op_t *op);
+int ntag424_op_ok(const ntag424_op_t *op);
+uint16_t ntag424_op_sw(const ntag424_op_t *op);
+uint32_t ntag424_op_counter(const ntag424_op_t *op);
+// Bytes read by a finished ntag424_op_read_data.
+size_t ntag424_op_data_len(const ntag424_op_t *op);
+ntag424_card_t *ntag424_op_card(const ntag424_op_t *op);
+
+ntag424_engine_t *ntag424_engine_new(unsigned io_threads);
+// Drain ntag424_engine_pending to zero before freeing.
+void ntag424_engine_free(ntag424_engine_t *e);
+// Starts op. Fails if its card already has an operation in flight.
+int ntag424_engine_submit(ntag424_engine_t *e, ntag424_op_t *op);
+// Waits up to timeout_ms for answers, advances their operations and runs
+// the callbacks of those that finished. Returns the number finished.
+int ntag424_engine_poll(ntag424_engine_t *e, unsigned timeout_ms);
+size_t ntag424_engine_pending(const ntag424_engine_t *e);
+
+// Tag emulator. An in-memory NTAG 424 DNA in factory state (all keys zero,
+// CC/NDEF/proprietary files E103/E104/E105) that answers the commands of
+// this library: EV2First, GetFileSettings, ChangeFileSettings, ChangeKey
+// and GetFileCounters with secure messaging, ReadData and WriteData in the
+// file's CommMode over additional frames, ISO SELECT, READ BINARY and
+// UPDATE BINARY, and the reader's UID/ATS pseudo APDUs. SDM reads mirror
+// the UID and SDMReadCtr in plain or as encrypted PICCData, encrypt the
+// SDMENC window and write the MAC. Cards connected to an emulator go
+// through the observer and trace hooks like real ones, so the host stack
+// can be load tested with any number of virtual tags. One emulator serves
+// one card at a time.
+typedef struct ntag424_emu ntag424_emu_t;
+
+ntag424_emu_t *ntag424_emu_new(const uint8_t uid[7]);
+void ntag424_emu_free(ntag424_emu_t *emu);
+// Answers one C-APDU. resp receives the R-APDU including SW1SW2;
+// *resp_len is its capacity on entry (at least 64) and its length on return.
+int ntag424_emu_transmit(ntag424_emu_t *emu, const uint8_t *apdu, size_t apdu_len, uint8_t *resp, size_t *resp_len);
+uint32_t ntag424_emu_sdm_counter(const ntag424_emu_t *emu, uint8_t file_no);
+// A context without PC/SC, for emulated cards only; reader calls fail on it.
+int ntag424_context_open_emu(ntag424_context_t **ctx_out);
+// The card keeps using emu, which must outlive it.
+int ntag424_card_connect_emu(ntag424_context_t *ctx, ntag424_emu_t *emu, ntag424_card_t **card_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
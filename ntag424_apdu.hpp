@@ -0,0 +1,140 @@
+#ifndef NTAG424_APDU_HPP
+#define NTAG424_APDU_HPP
+
+// Header-only C++17 builders for the fixed-shape NTAG 424 DNA commands.
+//
+// Every frame is a std::array whose size, Lc and field offsets are fixed by
+// the command's type, so a builder does no length arithmetic at run time and
+// a command that does not fit a short APDU fails to compile. The builders
+// are constexpr; with constant arguments the frame is a compile-time
+// constant. Frames go to the card with ntag424_transmit(card, f.data(),
+// f.size(), ...), or to an emulator with ntag424_emu_transmit.
+//
+// secure_command only lays out the EV2 secure messaging frame. The caller
+// encrypts [data_offset, mac_offset) in CommMode.Full and writes the MAC
+// with its own session keys; ntag424.c builds the same frames in ssm_wrap.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace ntag424 {
+namespace apdu {
+
+template <std::size_t N>
+using frame = std::array<std::uint8_t, N>;
+
+enum class comm_mode { plain, mac, full };
+
+// CLA INS P1 P2 [Lc data] [Le] with a one-byte Lc and Le = 00.
+template <std::uint8_t Cla, std::uint8_t Ins, std::uint8_t P1, std::uint8_t P2, std::size_t Lc, bool HasLe>
+struct shape {
+    static_assert(Lc <= 255, "short APDU: Lc must fit in one byte");
+
+    static constexpr std::size_t lc = Lc;
+    static constexpr std::size_t data_offset = Lc > 0 ? 5 : 4;
+    static constexpr std::size_t size = data_offset + Lc + (HasLe ? 1 : 0);
+
+    static constexpr frame<size> build(const std::array<std::uint8_t, Lc> &data) {
+        frame<size> f{};
+        f[0] = Cla;
+        f[1] = Ins;
+        f[2] = P1;
+        f[3] = P2;
+        if (Lc > 0) f[4] = static_cast<std::uint8_t>(Lc);
+        for (std::size_t i = 0; i < Lc; i++) f[data_offset + i] = data[i];
+        return f;  // Le, when present, is the trailing 00
+    }
+};
+
+// Native command wrapped in ISO 7816-4: 90 INS 00 00 Lc data 00.
+template <std::uint8_t Ins, std::size_t Lc>
+using native = shape<0x90, Ins, 0x00, 0x00, Lc, true>;
+
+// EV2 secure messaging command: 90 INS 00 00 Lc header data MAC(8) 00.
+// In CommMode.Full, data is padded (ISO 9797-1 method 2) to the next block
+// and encrypted; a command without data is only MACed, as on the tag.
+template <std::uint8_t Ins, std::size_t HeaderLen, std::size_t DataLen, comm_mode Mode>
+struct secure_command {
+    static_assert(Mode != comm_mode::plain, "CommMode.Plain commands use native<>");
+
+    static constexpr std::size_t enc_len =
+        Mode == comm_mode::full && DataLen > 0 ? (DataLen / 16 + 1) * 16 : DataLen;
+    static constexpr std::size_t lc = HeaderLen + enc_len + 8;
+    static_assert(lc <= 255, "short APDU: header, data and MAC must fit in 255 bytes");
+
+    static constexpr std::size_t header_offset = 5;
+    static constexpr std::size_t data_offset = header_offset + HeaderLen;
+    static constexpr std::size_t mac_offset = data_offset + enc_len;
+    static constexpr std::size_t size = mac_offset + 8 + 1;
+
+    // Header and plaintext data in place, padding applied, MAC zeroed.
+    static constexpr frame<size> layout(const std::array<std::uint8_t, HeaderLen> &header,
+                                        const std::array<std::uint8_t, DataLen> &data) {
+        frame<size> f{};
+        f[0] = 0x90;
+        f[1] = Ins;
+        f[4] = static_cast<std::uint8_t>(lc);
+        for (std::size_t i = 0; i < HeaderLen; i++) f[header_offset + i] = header[i];
+        for (std::size_t i = 0; i < DataLen; i++) f[data_offset + i] = data[i];
+        if (enc_len > DataLen) f[data_offset + DataLen] = 0x80;
+        return f;
+    }
+
+    static constexpr void set_mac(frame<size> &f, const std::array<std::uint8_t, 8> &mac) {
+        for (std::size_t i = 0; i < 8; i++) f[mac_offset + i] = mac[i];
+    }
+};
+
+// ISO SELECT of the NDEF application by DF name (D2760000850101).
+inline constexpr frame<13> select_ndef_app() {
+    return shape<0x00, 0xA4, 0x04, 0x00, 7, true>::build({0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01});
+}
+
+// ISO SELECT of an EF by file identifier, no response data.
+inline constexpr frame<7> select_file(std::uint16_t file_id) {
+    return shape<0x00, 0xA4, 0x00, 0x0C, 2, false>::build(
+        {static_cast<std::uint8_t>(file_id >> 8), static_cast<std::uint8_t>(file_id & 0xFF)});
+}
+
+// GetFileSettings and GetFileCounters outside a session (CommMode.Plain).
+inline constexpr frame<7> get_file_settings(std::uint8_t file_no) {
+    return native<0xF5, 1>::build({file_no});
+}
+
+inline constexpr frame<7> get_file_counters(std::uint8_t file_no) {
+    return native<0xF6, 1>::build({file_no});
+}
+
+// AuthenticateEV2First part 1 (KeyNo, LenCap 00) and part 2 (the 32-byte
+// E(Kx, RndA || RndB')).
+inline constexpr frame<8> authenticate_ev2_first(std::uint8_t key_no) {
+    return native<0x71, 2>::build({key_no, 0x00});
+}
+
+inline constexpr frame<38> authenticate_ev2_part2(const std::array<std::uint8_t, 32> &token) {
+    return native<0xAF, 32>::build(token);
+}
+
+// Next frame of a chained response (91AF).
+inline constexpr frame<5> additional_frame() {
+    return native<0xAF, 0>::build({});
+}
+
+// The secure messaging commands ntag424.c sends with fixed shapes.
+using get_file_settings_mac = secure_command<0xF5, 1, 0, comm_mode::mac>;
+using get_file_counters_full = secure_command<0xF6, 1, 0, comm_mode::full>;
+using change_key_full = secure_command<0xC4, 1, 21, comm_mode::full>;      // other key: XOR || ver || CRC32
+using change_key_0_full = secure_command<0xC4, 1, 17, comm_mode::full>;    // key 0: new key || ver
+
+static_assert(select_ndef_app().size() == 13 && select_ndef_app()[4] == 7, "SELECT AID shape");
+static_assert(get_file_settings(0x02)[5] == 0x02 && get_file_settings(0x02)[6] == 0x00,
+              "GetFileSettings shape");
+static_assert(get_file_settings_mac::size == 15 && get_file_settings_mac::mac_offset == 6,
+              "GetFileSettings in CommMode.MAC: 1-byte header then MAC");
+static_assert(change_key_full::lc == 41 && change_key_0_full::lc == 41, "ChangeKey pads to 32 bytes");
+
+}  // namespace apdu
+}  // namespace ntag424
+
+#endif
@@ -0,0 +1,28 @@
+// Compile-only check of ntag424_apdu.hpp (make check): the header's own
+// static_asserts plus a few frames built as constants. Nothing here runs.
+
+#include "ntag424_apdu.hpp"
+
+namespace apdu = ntag424::apdu;
+
+constexpr auto k_select = apdu::select_file(0xE104);
+static_assert(k_select.size() == 7 && k_select[1] == 0xA4 && k_select[5] == 0xE1 && k_select[6] == 0x04,
+              "SELECT EF by file identifier");
+
+constexpr auto k_auth = apdu::authenticate_ev2_first(0x02);
+static_assert(k_auth.size() == 8 && k_auth[1] == 0x71 && k_auth[4] == 2 && k_auth[5] == 0x02 && k_auth[7] == 0x00,
+              "AuthenticateEV2First part 1");
+
+constexpr auto k_part2 = apdu::authenticate_ev2_part2({});
+static_assert(k_part2.size() == 38 && k_part2[1] == 0xAF && k_part2[4] == 32, "AuthenticateEV2First part 2");
+
+constexpr auto k_more = apdu::additional_frame();
+static_assert(k_more.size() == 5 && k_more[0] == 0x90 && k_more[1] == 0xAF && k_more[4] == 0x00, "additional frame");
+
+constexpr auto k_counters = apdu::get_file_counters_full::layout({0x02}, {});
+static_assert(k_counters.size() == 15 && k_counters[4] == 9 && k_counters[5] == 0x02,
+              "GetFileCounters: no data, so no padding block");
+
+constexpr auto k_change = apdu::change_key_0_full::layout({0x00}, {});
+static_assert(apdu::change_key_0_full::mac_offset == 6 + 32 && k_change[6 + 17] == 0x80,
+              "ChangeKey 0: ISO 9797-1 padding after new key || version");
@@ -4,58 +4,172 @@
 #include <string.h>
 #include <sys/types.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <CommonCrypto/CommonCrypto.h>
+#include "ntag424.h"
 
-#if defined(__APPLE__)
-#include <PCSC/winscard.h>
-#include <PCSC/wintypes.h>
-#else
-#include <winscard.h>
-#include <wintypes.h>
-#endif
-
-#define MAX_APDU 512
 #define SDM_READ_CTR_OFFSET_NONE 0xFFFFFF
-#define SDM_UID_LEN_ASCII 14
-#define SDM_CTR_LEN_ASCII 6
-#define SDM_MAC_LEN_ASCII 16
+#define DAEMON_POLL_TIMEOUT_MS 500
+#define SDM_VERIFY_BATCH 256
+#define MAX_TAG_OPS 16
+#define MAX_WRITE_DATA 256
+#define AUDIT_BATCH 4096
+#define AUDIT_FLUSH_MS 1000
+#define AUDIT_ROW_MAX 96
+#define RESULT_RING_SLOTS 256  // power of two
+#define TAG_BUF_SLOTS 64       // bits in g_tag_buf_used
+#define TAG_BUF_SLOT_SIZE 1024
+
+#define TAG_REPORT_MAGIC 0x5234344Eu // "N44R" little-endian
+#define TAG_REPORT_VERSION 1
+
+#define TAG_CACHE_MAGIC 0x4334344Eu // "N44C" little-endian
+#define TAG_CACHE_VERSION 1
+
+#define TAG_HAS_ATR        0x0001
+#define TAG_HAS_UID        0x0002
+#define TAG_HAS_ATS        0x0004
+#define TAG_HAS_CC         0x0008
+#define TAG_HAS_NDEF       0x0010
+#define TAG_HAS_CTR_PLAIN  0x0020
+#define TAG_HAS_CTR_SECURE 0x0040
+#define TAG_HAS_SDM_VERIFY 0x0080
+#define TAG_SDM_MAC_OK     0x0100  // with TAG_HAS_SDM_VERIFY: the tap MAC matched
+#define TAG_OK             0x8000
+
+// Everything the diagnostic dump shows, for --format json|binary. The binary
+// format is this struct verbatim (native byte order and padding), one per tag;
+// readers check magic, version and size first.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t flags;  // TAG_HAS_* bits, TAG_OK if every requested step passed
+    uint8_t atr_len;
+    uint8_t uid_len;
+    uint8_t ats_len;
+    uint8_t cc_mapping;
+    uint8_t atr[33];
+    uint8_t uid[10];
+    uint8_t ats[32];
+    uint8_t cc_read_access;
+    uint8_t cc_write_access;
+    uint16_t cc_len;
+    uint16_t cc_mle;
+    uint16_t cc_mlc;
+    uint16_t ndef_file_id;
+    uint16_t ndef_file_size;
+    uint16_t nlen;
+    uint16_t ndef_len;  // bytes captured in ndef (NLEN, capped at NTAG424_SDM_NDEF_MAX)
+    uint8_t ndef[NTAG424_SDM_NDEF_MAX];
+    ntag424_file_settings_t fs;
+    uint32_t ctr_plain;
+    uint32_t ctr_secure;
+} tag_report_t;
+
+// Steps accepted by --ops, in k_tag_op_names order.
+enum {
+    TAG_OP_PROVISION,
+    TAG_OP_ROTATE,
+    TAG_OP_SDM_SETUP,
+    TAG_OP_COUNTER,
+    TAG_OP_ROTATE_PLAN,
+    TAG_OP_SDM_VERIFY,
+    TAG_OP_WRITE_DATA,
+    TAG_OP_READ_DATA
+};
 
 typedef struct {
-    uint8_t kenc[16];
-    uint8_t kmac[16];
-    uint8_t ti[4];
-    uint16_t cmd_ctr;
+    uint8_t key[16];
     uint8_t key_no;
-    int authenticated;
-} ssm_session_t;
+    uint8_t counter_file_no;
+    int do_provision;
+    uint8_t new_key_no;
+    const char *key_out_path;
+    const char *provision_key_path;
+    int do_sdm_setup;
+    int do_sdm_verify;
+    uint8_t data_file_no;
+    int do_read_data;
+    const char *write_data_path;
+    uint8_t *write_data;
+    size_t write_data_len;
+    uint8_t sdm_key_no;
+    const char *sdm_base_url;
+    ntag424_sdm_template_t sdm_tpl;
+    const char *sdm_enc_data;  // plaintext for the enc field, at most NTAG424_SDM_ENC_DATA_LEN bytes
+    int do_rotate_key;
+    uint8_t rotate_key_no;
+    const char *rotate_old_key_path;
+    const char *rotate_new_key_in_path;
+    const char *rotate_new_key_path;
+    int daemon;
+    int all_readers;
+    const char *jobs_path;
+    const char *verify_urls_path;
+    const char *sdm_file_key_path;
+    int has_sdm_file_key;
+    uint8_t sdm_file_key[16];
+    const char *sdm_meta_key_path;
+    int has_sdm_meta_key;
+    uint8_t sdm_meta_key[16];
+    uint8_t ops[MAX_TAG_OPS];
+    size_t ops_count;
+    int ext_apdu;
+    unsigned rf_divisor;  // --rf-rate: highest divisor to request, 0 to leave the link alone
+    int counter_only;
+    const char *apdu_stats_path;
+    const char *cache_path;
+    const char *key_db_path;
+    int diversify;
+    uint8_t div_master[16];
+    uint8_t div_sysid[16];
+    size_t div_sysid_len;
+    uint8_t rotate_plan[5];
+    size_t rotate_plan_count;
+    const char *rotate_journal_path;
+    const char *reader_name;
+    const char *checkpoint_path;
+    const char *audit_csv_path;
+    unsigned long emulate_count;
+    unsigned emulate_threads;
+} tool_options_t;
 
 typedef struct {
-    int valid;
-    int sdm_enabled;
-    int sdm_read_ctr_enabled;
-    uint8_t file_option;
-    uint8_t sdm_options;
-    uint8_t sdm_meta_read;
-    uint8_t sdm_file_read;
-    uint8_t sdm_ctr_ret;
-    uint8_t ar1;
-    uint8_t ar2;
-    uint32_t file_size;
-} file_settings_info_t;
+    char key_path[256];
+    char url[512];
+} provision_job_t;
 
 typedef struct {
-    uint8_t *ndef;
-    size_t ndef_len;
-    uint32_t uid_offset;
-    uint32_t ctr_offset;
-    uint32_t mac_input_offset;
-    uint32_t mac_offset;
-    char url[512];
-} sdm_ndef_t;
+    pthread_mutex_t lock;
+    provision_job_t *jobs;
+    size_t count;
+    size_t cap;
+    size_t next;
+    int enabled;
+    volatile int exhausted;
+    unsigned long taps;
+    unsigned long failed;
+    double start_ms;
+} job_queue_t;
 
-static int select_ndef_app(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint16_t *sw_out);
-static int select_file(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint16_t file_id, uint16_t *sw_out);
+typedef struct {
+    ntag424_context_t *ctx;
+    char reader[256];
+    const tool_options_t *opt;
+    job_queue_t *queue;
+    unsigned long taps;
+    unsigned long failed;
+    pthread_t thread;
+    int running;
+    int removed;
+} reader_worker_t;
 
 static void print_hex(const uint8_t *buf, size_t len) {
     for (size_t i = 0; i < len; i++) {
@@ -64,154 +178,243 @@ static void print_hex(const uint8_t *buf, size_t len) {
     }
 }
 
-static int debug_apdu_enabled(void) {
-    const char *v = getenv("NTAG_DEBUG_APDU");
-    return v && v[0] != '\0' && v[0] != '0';
-}
-
-static LONG transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *pioSendPci,
-                     const uint8_t *apdu, size_t apdu_len,
-                     uint8_t *resp, size_t *resp_len,
-                     uint16_t *sw) {
-    DWORD rlen = (DWORD)*resp_len;
-    LONG rc = SCardTransmit(card, pioSendPci, apdu, (DWORD)apdu_len, NULL, resp, &rlen);
-    if (rc != SCARD_S_SUCCESS) return rc;
-    if (rlen < 2) return SCARD_E_PROTO_MISMATCH;
-    *sw = (uint16_t)((resp[rlen - 2] << 8) | resp[rlen - 1]);
-    *resp_len = rlen - 2;
-    return SCARD_S_SUCCESS;
+enum {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+};
+
+// Set once from --format before any reader thread starts.
+static int g_output_format = OUTPUT_TEXT;
+
+// Human-readable tag dump; silent in the structured output formats.
+static void out_printf(const char *fmt, ...) {
+    if (g_output_format != OUTPUT_TEXT) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
 }
 
-static int sw_ok(uint16_t sw) {
-    return sw == 0x9000 || sw == 0x9100;
+static void out_hex(const uint8_t *buf, size_t len) {
+    if (g_output_format == OUTPUT_TEXT) print_hex(buf, len);
 }
 
-static int aes_ecb_encrypt(const uint8_t key[16], const uint8_t in[16], uint8_t out[16]) {
-    size_t out_len = 0;
-    CCCryptorStatus st = CCCrypt(kCCEncrypt, kCCAlgorithmAES128, kCCOptionECBMode,
-                                 key, 16, NULL, in, 16, out, 16, &out_len);
-    return (st == kCCSuccess && out_len == 16);
+// Progress and status lines: stdout for text, stderr otherwise so stdout
+// carries only records.
+static FILE *status_stream(void) {
+    return g_output_format == OUTPUT_TEXT ? stdout : stderr;
 }
 
-static int aes_cbc_crypt(int encrypt, const uint8_t key[16], const uint8_t iv[16],
-                         const uint8_t *in, size_t in_len, uint8_t *out) {
-    size_t out_len = 0;
-    CCCryptorStatus st = CCCrypt(encrypt ? kCCEncrypt : kCCDecrypt,
-                                 kCCAlgorithmAES128, 0,
-                                 key, 16, iv,
-                                 in, in_len, out, in_len, &out_len);
-    return (st == kCCSuccess && out_len == in_len);
+static double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
 }
 
-static void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len) {
-    for (size_t i = 0; i < len; i++) out[i] = a[i] ^ b[i];
-}
-
-static void left_shift_1bit(uint8_t *out, const uint8_t *in) {
-    uint8_t carry = 0;
-    for (int i = 15; i >= 0; i--) {
-        uint8_t new_carry = (in[i] & 0x80) ? 1 : 0;
-        out[i] = (uint8_t)((in[i] << 1) | carry);
-        carry = new_carry;
+// Per-tap read buffers (NDEF message, file data). Slots are claimed from a
+// bitmap with compare-and-swap, so concurrent workers reuse preallocated
+// memory without a lock or an allocation per tap. Larger reads, or a tap
+// that finds every slot busy, fall back to malloc.
+static uint8_t g_tag_buf_pool[TAG_BUF_SLOTS][TAG_BUF_SLOT_SIZE];
+static _Atomic uint64_t g_tag_buf_used;
+
+static uint8_t *tag_buf_get(size_t len) {
+    if (len <= TAG_BUF_SLOT_SIZE) {
+        uint64_t used = atomic_load_explicit(&g_tag_buf_used, memory_order_relaxed);
+        while (~used != 0) {
+            unsigned slot = (unsigned)__builtin_ctzll(~used);
+            if (atomic_compare_exchange_weak_explicit(&g_tag_buf_used, &used, used | (1ull << slot),
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                return g_tag_buf_pool[slot];
+            }
+        }
     }
+    return (uint8_t *)malloc(len ? len : 1);
 }
 
-static void generate_cmac_subkeys(const uint8_t key[16], uint8_t k1[16], uint8_t k2[16]) {
-    uint8_t L[16];
-    uint8_t zero[16] = {0};
-    aes_ecb_encrypt(key, zero, L);
-    left_shift_1bit(k1, L);
-    if (L[0] & 0x80) {
-        k1[15] ^= 0x87;
-    }
-    left_shift_1bit(k2, k1);
-    if (k1[0] & 0x80) {
-        k2[15] ^= 0x87;
+static void tag_buf_put(uint8_t *buf) {
+    uintptr_t base = (uintptr_t)g_tag_buf_pool;
+    uintptr_t p = (uintptr_t)buf;
+    if (p >= base && p < base + sizeof(g_tag_buf_pool)) {
+        uint64_t bit = 1ull << ((p - base) / TAG_BUF_SLOT_SIZE);
+        atomic_fetch_and_explicit(&g_tag_buf_used, ~bit, memory_order_release);
+    } else {
+        free(buf);
     }
 }
 
-static int aes_cmac(const uint8_t key[16], const uint8_t *msg, size_t msg_len, uint8_t out[16]) {
-    uint8_t k1[16], k2[16];
-    generate_cmac_subkeys(key, k1, k2);
+// Log-linear latency histogram in microseconds: exact below 8 us, then
+// LAT_SUB_BUCKETS buckets per power of two (~12% resolution) up to ~67 s.
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1u << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB_BUCKETS * 24)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint32_t buckets[LAT_BUCKETS];
+} latency_hist_t;
+
+// Per-INS SCardTransmit latency, enabled by --apdu-stats. Shared by all
+// reader threads.
+static int g_apdu_stats = 0;
+static pthread_mutex_t g_apdu_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static latency_hist_t g_apdu_hist[256];
+
+static size_t lat_bucket(uint64_t us) {
+    if (us < LAT_SUB_BUCKETS) return (size_t)us;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(us);
+    size_t idx = LAT_SUB_BUCKETS * (msb - LAT_SUB_BITS + 1) +
+                 (size_t)((us >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+    return idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1;
+}
 
-    size_t n = (msg_len + 15) / 16;
-    if (n == 0) n = 1;
-    int last_complete = (msg_len != 0 && (msg_len % 16) == 0);
+// Upper bound of bucket idx, in microseconds.
+static uint64_t lat_bucket_limit(size_t idx) {
+    if (idx < LAT_SUB_BUCKETS) return idx;
+    unsigned shift = (unsigned)(idx / LAT_SUB_BUCKETS) - 1;
+    uint64_t base = (uint64_t)(LAT_SUB_BUCKETS + idx % LAT_SUB_BUCKETS) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
 
-    uint8_t last_block[16];
-    memset(last_block, 0, sizeof(last_block));
+static void lat_record(latency_hist_t *h, uint64_t us) {
+    if (h->count == 0 || us < h->min_us) h->min_us = us;
+    if (us > h->max_us) h->max_us = us;
+    h->count++;
+    h->sum_us += us;
+    h->buckets[lat_bucket(us)]++;
+}
 
-    if (last_complete) {
-        const uint8_t *last = msg + 16 * (n - 1);
-        xor_block(last_block, last, k1, 16);
-    } else {
-        size_t last_len = msg_len - 16 * (n - 1);
-        if (msg_len == 0) last_len = 0;
-        if (last_len > 0) memcpy(last_block, msg + 16 * (n - 1), last_len);
-        last_block[last_len] = 0x80;
-        xor_block(last_block, last_block, k2, 16);
+static uint64_t lat_percentile(const latency_hist_t *h, double pct) {
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = lat_bucket_limit(i);
+            return limit < h->max_us ? limit : h->max_us;
+        }
     }
+    return h->max_us;
+}
 
-    uint8_t x[16] = {0};
-    uint8_t y[16];
-    for (size_t i = 0; i + 1 < n; i++) {
-        xor_block(y, x, msg + 16 * i, 16);
-        if (!aes_ecb_encrypt(key, y, x)) return 0;
+static const char *apdu_ins_name(uint8_t ins) {
+    switch (ins) {
+        case 0x71: return "AuthenticateEV2First";
+        case 0xAF: return "AdditionalFrame";
+        case 0xF5: return "GetFileSettings";
+        case 0xF6: return "GetFileCounters";
+        case 0xC4: return "ChangeKey";
+        case 0x5F: return "ChangeFileSettings";
+        case 0xAD: return "ReadData";
+        case 0x8D: return "WriteData";
+        case 0xA4: return "ISOSelectFile";
+        case 0xB0: return "ISOReadBinary";
+        case 0xD6: return "ISOUpdateBinary";
+        case 0xCA: return "GetData";
+        default: return "";
     }
-
-    xor_block(y, x, last_block, 16);
-    if (!aes_ecb_encrypt(key, y, out)) return 0;
-    return 1;
 }
 
-static void cmac_truncate_8(const uint8_t cmac[16], uint8_t out[8]) {
-    // Take odd-indexed bytes 1,3,5,...,15 in order.
-    for (int i = 0; i < 8; i++) out[i] = cmac[1 + i * 2];
+// Prints the per-command table and, if csv_path is set, writes it as CSV.
+static void apdu_stats_report(const char *csv_path) {
+    if (!g_apdu_stats) return;
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to write APDU stats: %s\n", csv_path);
+        } else {
+            fprintf(csv, "ins,command,count,mean_us,p50_us,p95_us,p99_us,min_us,max_us\n");
+        }
+    }
+
+    FILE *out = status_stream();
+    fprintf(out, "APDU latency (ms):\n");
+    fprintf(out, "  %-4s %-22s %8s %9s %9s %9s %9s %9s\n",
+            "INS", "Command", "Count", "Mean", "p50", "p95", "p99", "Max");
+    pthread_mutex_lock(&g_apdu_stats_lock);
+    for (size_t ins = 0; ins < 256; ins++) {
+        const latency_hist_t *h = &g_apdu_hist[ins];
+        if (h->count == 0) continue;
+        double mean = (double)h->sum_us / (double)h->count;
+        uint64_t p50 = lat_percentile(h, 50.0);
+        uint64_t p95 = lat_percentile(h, 95.0);
+        uint64_t p99 = lat_percentile(h, 99.0);
+        fprintf(out, "  %02zX   %-22s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                ins, apdu_ins_name((uint8_t)ins), (unsigned long long)h->count, mean / 1000.0,
+                p50 / 1000.0, p95 / 1000.0, p99 / 1000.0, h->max_us / 1000.0);
+        if (csv) {
+            fprintf(csv, "%02zX,%s,%llu,%.1f,%llu,%llu,%llu,%llu,%llu\n",
+                    ins, apdu_ins_name((uint8_t)ins), (unsigned long long)h->count, mean,
+                    (unsigned long long)p50, (unsigned long long)p95, (unsigned long long)p99,
+                    (unsigned long long)h->min_us, (unsigned long long)h->max_us);
+        }
+    }
+    pthread_mutex_unlock(&g_apdu_stats_lock);
+    if (csv) fclose(csv);
 }
 
-static size_t pad_iso9797_m2(const uint8_t *in, size_t in_len, uint8_t *out) {
-    size_t pad_len = 16 - (in_len % 16);
-    if (pad_len == 0) pad_len = 16;
-    memcpy(out, in, in_len);
-    out[in_len] = 0x80;
-    memset(out + in_len + 1, 0, pad_len - 1);
-    return in_len + pad_len;
+static void apdu_stats_observer(void *user, const uint8_t *apdu, size_t apdu_len,
+                                uint16_t sw, uint64_t elapsed_us) {
+    (void)user;
+    (void)sw;
+    if (apdu_len < 2) return;
+    pthread_mutex_lock(&g_apdu_stats_lock);
+    lat_record(&g_apdu_hist[apdu[1]], elapsed_us);
+    pthread_mutex_unlock(&g_apdu_stats_lock);
 }
 
-static size_t unpad_iso9797_m2(uint8_t *buf, size_t len) {
-    if (len == 0) return 0;
-    ssize_t i = (ssize_t)len - 1;
-    while (i >= 0 && buf[i] == 0x00) i--;
-    if (i >= 0 && buf[i] == 0x80) {
-        return (size_t)i;
-    }
-    return len;
+// --apdu-trace: every exchange as hex on stderr, one line per direction.
+// Each line is written with one call so worker threads do not interleave.
+static int g_apdu_trace = 0;
+
+static void apdu_trace_line(const char *dir, const uint8_t *buf, size_t len) {
+    char stack_line[16 + 3 * 300];
+    size_t cap = 16 + 3 * len;
+    char *line = cap <= sizeof(stack_line) ? stack_line : (char *)malloc(cap);
+    size_t shown = len;
+    if (!line) {
+        // Out of memory for an extended frame: print what fits and say so.
+        line = stack_line;
+        cap = sizeof(stack_line);
+        shown = (cap - 16 - 48) / 3;  // room for the marker
+    }
+    size_t n = (size_t)snprintf(line, cap, "%s:", dir);
+    for (size_t i = 0; i < shown; i++) n += (size_t)snprintf(line + n, cap - n, " %02X", buf[i]);
+    if (shown < len) n += (size_t)snprintf(line + n, cap - n, " ...(+%zu bytes)", len - shown);
+    line[n++] = '\n';
+    line[n] = '\0';
+    fputs(line, stderr);
+    if (line != stack_line) free(line);
 }
 
-static void rotate_left_1(uint8_t *out, const uint8_t *in, size_t len) {
-    if (len == 0) return;
-    memmove(out, in + 1, len - 1);
-    out[len - 1] = in[0];
+static void apdu_trace_dump(void *user, const uint8_t *apdu, size_t apdu_len,
+                            const uint8_t *resp, size_t resp_len, uint64_t elapsed_us) {
+    (void)user;
+    (void)elapsed_us;
+    apdu_trace_line("C-APDU", apdu, apdu_len);
+    apdu_trace_line("R-APDU", resp, resp_len);
 }
 
-static void rotate_right_1(uint8_t *out, const uint8_t *in, size_t len) {
-    if (len == 0) return;
-    memmove(out + 1, in, len - 1);
-    out[0] = in[len - 1];
+// Opens a library context for this thread, with the --apdu-stats observer
+// and the --apdu-trace dump attached when enabled.
+static int open_context(ntag424_context_t **ctx, long *rc) {
+    if (!ntag424_context_open(ctx, rc)) return 0;
+    if (g_apdu_stats) ntag424_context_set_apdu_observer(*ctx, apdu_stats_observer, NULL);
+    if (g_apdu_trace) ntag424_context_set_apdu_trace(*ctx, apdu_trace_dump, NULL);
+    return 1;
 }
 
-static void random_bytes(uint8_t *buf, size_t len) {
-#if defined(__APPLE__)
-    arc4random_buf(buf, len);
-#else
-    FILE *f = fopen("/dev/urandom", "rb");
-    if (f) {
-        fread(buf, 1, len, f);
-        fclose(f);
-    } else {
-        for (size_t i = 0; i < len; i++) buf[i] = (uint8_t)rand();
-    }
-#endif
+static int open_emu_context(ntag424_context_t **ctx) {
+    if (!ntag424_context_open_emu(ctx)) return 0;
+    if (g_apdu_stats) ntag424_context_set_apdu_observer(*ctx, apdu_stats_observer, NULL);
+    if (g_apdu_trace) ntag424_context_set_apdu_trace(*ctx, apdu_trace_dump, NULL);
+    return 1;
 }
 
 static int parse_hex_key(const char *hex, uint8_t key[16]) {
@@ -224,6 +427,22 @@ static int parse_hex_key(const char *hex, uint8_t key[16]) {
     return 1;
 }
 
+// Parses up to max bytes of hex; odd lengths and non-hex characters fail.
+static int parse_hex_bytes(const char *hex, uint8_t *out, size_t max, size_t *out_len) {
+    size_t hex_len = strlen(hex);
+    if ((hex_len % 2) != 0 || hex_len / 2 > max) return 0;
+    for (size_t i = 0; i < hex_len / 2; i++) {
+        unsigned int v = 0;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+            sscanf(hex + 2 * i, "%2x", &v) != 1) {
+            return 0;
+        }
+        out[i] = (uint8_t)v;
+    }
+    *out_len = hex_len / 2;
+    return 1;
+}
+
 static void trim_whitespace(char *s) {
     if (!s) return;
     size_t len = strlen(s);
@@ -249,940 +468,1006 @@ static int read_key_file(const char *path, uint8_t key[16]) {
     return 0;
 }
 
-static int find_substr(const uint8_t *buf, size_t len, const char *needle, size_t *pos_out) {
-    size_t nlen = strlen(needle);
-    if (nlen == 0 || nlen > len) return 0;
-    for (size_t i = 0; i + nlen <= len; i++) {
-        if (memcmp(buf + i, needle, nlen) == 0) {
-            *pos_out = i;
-            return 1;
-        }
+// Raw contents for --write-data; NTAG 424 DNA files are at most 256 bytes,
+// larger DESFire files are left to the library.
+static int read_data_file(const char *path, uint8_t **data_out, size_t *len_out) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    uint8_t *buf = (uint8_t *)malloc(MAX_WRITE_DATA + 1);
+    size_t len = buf ? fread(buf, 1, MAX_WRITE_DATA + 1, f) : 0;
+    int ok = buf && !ferror(f) && len > 0 && len <= MAX_WRITE_DATA;
+    fclose(f);
+    if (!ok) {
+        free(buf);
+        return 0;
     }
-    return 0;
+    *data_out = buf;
+    *len_out = len;
+    return 1;
 }
 
-static int build_sdm_ndef(const char *base_url, sdm_ndef_t *out) {
-    if (!base_url || !out) return 0;
-    memset(out, 0, sizeof(*out));
-
-    const char *uid_placeholder = "00000000000000";
-    const char *ctr_placeholder = "000000";
-    const char *mac_placeholder = "0000000000000000";
-
-    int n = snprintf(out->url, sizeof(out->url), "%s?uid=%s&ctr=%s&mac=%s",
-                     base_url, uid_placeholder, ctr_placeholder, mac_placeholder);
-    if (n <= 0 || (size_t)n >= sizeof(out->url)) return 0;
-
-    struct {
-        const char *prefix;
-        uint8_t code;
-    } prefixes[] = {
-        {"https://www.", 0x02},
-        {"http://www.", 0x01},
-        {"https://", 0x04},
-        {"http://", 0x03},
-    };
+static int write_key_hex_file(const char *path, const uint8_t key[16]) {
+    FILE *f = fopen(path, "w");
+    if (!f) return 0;
+    for (int i = 0; i < 16; i++) fprintf(f, "%02X", key[i]);
+    fprintf(f, "\n");
+    fclose(f);
+    return 1;
+}
 
-    uint8_t prefix_code = 0x00;
-    const char *uri = out->url;
-    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
-        size_t plen = strlen(prefixes[i].prefix);
-        if (strncmp(out->url, prefixes[i].prefix, plen) == 0) {
-            prefix_code = prefixes[i].code;
-            uri = out->url + plen;
-            break;
+static void print_file_settings(const ntag424_file_settings_t *info) {
+    if (!info->valid) return;
+    out_printf("FileSettings:\n");
+    out_printf("  FileType: 0x%02X\n", info->file_type);
+    out_printf("  FileOption: 0x%02X (SDM=%s, CommMode=%u)\n",
+               info->file_option, info->sdm_enabled ? "on" : "off", (info->file_option & 0x03));
+    out_printf("  AccessRights: %02X %02X (RW=%X, CAR=%X, R=%X, W=%X)\n",
+               info->ar1, info->ar2, (info->ar1 >> 4) & 0x0F, info->ar1 & 0x0F,
+               (info->ar2 >> 4) & 0x0F, info->ar2 & 0x0F);
+    out_printf("  FileSize: %u bytes\n", info->file_size);
+    if (!(info->present & NTAG424_FS_HAS_SDM)) return;
+
+    uint8_t sdm_options = info->sdm_options;
+    out_printf("  SDMOptions: 0x%02X (UID=%s, ReadCtr=%s, EncFile=%s, ASCII=%s)\n",
+               sdm_options,
+               (sdm_options & 0x80) ? "on" : "off",
+               (sdm_options & 0x40) ? "on" : "off",
+               (sdm_options & 0x10) ? "on" : "off",
+               (sdm_options & 0x01) ? "on" : "off");
+    out_printf("  SDMAccessRights: 0x%04X (Meta=%X, File=%X, CtrRet=%X, RFU=%X)\n",
+               info->sdm_ar, info->sdm_meta_read, info->sdm_file_read, info->sdm_ctr_ret, info->rfu);
+
+    if (info->present & NTAG424_FS_HAS_UID_OFFSET) {
+        out_printf("  UIDOffset: 0x%06X\n", info->uid_offset);
+    }
+    if (info->present & NTAG424_FS_HAS_READ_CTR_OFFSET) {
+        if (info->sdm_read_ctr_offset == SDM_READ_CTR_OFFSET_NONE) {
+            out_printf("  SDMReadCtrOffset: none (0xFFFFFF)\n");
+        } else {
+            out_printf("  SDMReadCtrOffset: 0x%06X\n", info->sdm_read_ctr_offset);
         }
     }
+    if (info->present & NTAG424_FS_HAS_PICC_OFFSET) {
+        out_printf("  PICCDataOffset: 0x%06X\n", info->picc_data_offset);
+    }
+    if (info->present & NTAG424_FS_HAS_MAC_INPUT) {
+        out_printf("  SDMMACInputOffset: 0x%06X\n", info->sdm_mac_input_offset);
+    }
+    if (info->present & NTAG424_FS_HAS_ENC) {
+        out_printf("  SDMENCOffset: 0x%06X\n", info->sdm_enc_offset);
+        out_printf("  SDMENCLength: 0x%06X\n", info->sdm_enc_length);
+    }
+    if (info->present & NTAG424_FS_HAS_MAC_OFFSET) {
+        out_printf("  SDMMACOffset: 0x%06X\n", info->sdm_mac_offset);
+    }
+    if (info->present & NTAG424_FS_HAS_READ_CTR_LIMIT) {
+        out_printf("  SDMReadCtrLimit: 0x%06X\n", info->sdm_read_ctr_limit);
+    }
+}
 
-    size_t uri_len = strlen(uri);
-    if (uri_len > 255) return 0;
-    size_t payload_len = 1 + uri_len;
-    if (payload_len > 255) return 0;
-
-    size_t record_len = 4 + payload_len;
-    size_t total_len = 2 + record_len;
-    if (total_len > 256) return 0;
+// Discovery results per UID for --cache: a tag seen before skips the CC,
+// NDEF and FileSettings reads. Entries are trusted until this tool changes
+// the tag's file settings. The file is a tag_cache_header_t followed by the
+// entries verbatim (native byte order, like --format binary).
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[10];
+    uint8_t cc_mapping;
+    uint8_t cc_read_access;
+    uint8_t cc_write_access;
+    uint16_t cc_len;
+    uint16_t cc_mle;
+    uint16_t cc_mlc;
+    uint16_t ndef_file_id;
+    uint16_t ndef_file_size;
+    ntag424_file_settings_t fs;
+} tag_cache_entry_t;
 
-    uint8_t *ndef = (uint8_t *)calloc(total_len, 1);
-    if (!ndef) return 0;
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t count;
+} tag_cache_header_t;
+
+static int g_tag_cache = 0;
+static pthread_mutex_t g_tag_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static tag_cache_entry_t *g_tag_cache_entries;
+static size_t g_tag_cache_count;
+static size_t g_tag_cache_cap;
+static int g_tag_cache_dirty;
+
+// Linear scan: a sweep holds thousands of entries at most, which is far
+// below the cost of the APDUs the cache saves.
+static tag_cache_entry_t *tag_cache_find_locked(const uint8_t *uid, size_t uid_len) {
+    for (size_t i = 0; i < g_tag_cache_count; i++) {
+        tag_cache_entry_t *e = &g_tag_cache_entries[i];
+        if (e->uid_len == uid_len && memcmp(e->uid, uid, uid_len) == 0) return e;
+    }
+    return NULL;
+}
 
-    ndef[0] = (uint8_t)((record_len >> 8) & 0xFF);
-    ndef[1] = (uint8_t)(record_len & 0xFF);
-    ndef[2] = 0xD1;           // MB=1, ME=1, SR=1, TNF=0x01
-    ndef[3] = 0x01;           // Type length
-    ndef[4] = (uint8_t)payload_len;
-    ndef[5] = 0x55;           // 'U'
-    ndef[6] = prefix_code;    // URI prefix code
-    memcpy(ndef + 7, uri, uri_len);
+static int tag_cache_lookup(const uint8_t *uid, size_t uid_len, tag_cache_entry_t *out) {
+    if (!g_tag_cache) return 0;
+    pthread_mutex_lock(&g_tag_cache_lock);
+    tag_cache_entry_t *e = tag_cache_find_locked(uid, uid_len);
+    if (e) *out = *e;
+    pthread_mutex_unlock(&g_tag_cache_lock);
+    return e != NULL;
+}
 
-    size_t uid_key_pos = 0, ctr_key_pos = 0, mac_key_pos = 0;
-    if (!find_substr(ndef, total_len, "uid=", &uid_key_pos) ||
-        !find_substr(ndef, total_len, "ctr=", &ctr_key_pos) ||
-        !find_substr(ndef, total_len, "mac=", &mac_key_pos)) {
-        free(ndef);
-        return 0;
+static void tag_cache_store(const tag_cache_entry_t *entry) {
+    if (!g_tag_cache) return;
+    pthread_mutex_lock(&g_tag_cache_lock);
+    tag_cache_entry_t *e = tag_cache_find_locked(entry->uid, entry->uid_len);
+    if (!e && g_tag_cache_count == g_tag_cache_cap) {
+        size_t cap = g_tag_cache_cap ? g_tag_cache_cap * 2 : 64;
+        tag_cache_entry_t *entries = (tag_cache_entry_t *)realloc(g_tag_cache_entries, cap * sizeof(*entries));
+        if (entries) {
+            g_tag_cache_entries = entries;
+            g_tag_cache_cap = cap;
+        }
     }
-
-    size_t uid_offset = uid_key_pos + 4;
-    size_t ctr_offset = ctr_key_pos + 4;
-    size_t mac_offset = mac_key_pos + 4;
-
-    if (uid_offset + SDM_UID_LEN_ASCII > total_len ||
-        ctr_offset + SDM_CTR_LEN_ASCII > total_len ||
-        mac_offset + SDM_MAC_LEN_ASCII > total_len) {
-        free(ndef);
-        return 0;
+    if (!e && g_tag_cache_count < g_tag_cache_cap) e = &g_tag_cache_entries[g_tag_cache_count++];
+    if (e) {
+        *e = *entry;
+        g_tag_cache_dirty = 1;
     }
+    pthread_mutex_unlock(&g_tag_cache_lock);
+}
 
-    for (size_t i = 0; i < SDM_UID_LEN_ASCII; i++) {
-        if (ndef[uid_offset + i] != '0') {
-            free(ndef);
-            return 0;
-        }
-    }
-    for (size_t i = 0; i < SDM_CTR_LEN_ASCII; i++) {
-        if (ndef[ctr_offset + i] != '0') {
-            free(ndef);
-            return 0;
-        }
+static void tag_cache_invalidate(const uint8_t *uid, size_t uid_len) {
+    if (!g_tag_cache) return;
+    pthread_mutex_lock(&g_tag_cache_lock);
+    tag_cache_entry_t *e = tag_cache_find_locked(uid, uid_len);
+    if (e) {
+        *e = g_tag_cache_entries[--g_tag_cache_count];
+        g_tag_cache_dirty = 1;
     }
-    for (size_t i = 0; i < SDM_MAC_LEN_ASCII; i++) {
-        if (ndef[mac_offset + i] != '0') {
-            free(ndef);
-            return 0;
+    pthread_mutex_unlock(&g_tag_cache_lock);
+}
+
+// Enables the cache and loads path if it exists. Returns 0 for a file that
+// is unreadable or was written by an incompatible build.
+static int tag_cache_load(const char *path) {
+    g_tag_cache = 1;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 1;
+    tag_cache_header_t hdr;
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == TAG_CACHE_MAGIC &&
+             hdr.version == TAG_CACHE_VERSION && hdr.entry_size == sizeof(tag_cache_entry_t);
+    if (ok && hdr.count > 0) {
+        g_tag_cache_entries = (tag_cache_entry_t *)malloc(hdr.count * sizeof(tag_cache_entry_t));
+        ok = g_tag_cache_entries && fread(g_tag_cache_entries, sizeof(tag_cache_entry_t), hdr.count, f) == hdr.count;
+        if (ok) {
+            g_tag_cache_count = hdr.count;
+            g_tag_cache_cap = hdr.count;
+        } else {
+            free(g_tag_cache_entries);
+            g_tag_cache_entries = NULL;
         }
     }
+    fclose(f);
+    return ok;
+}
 
-    out->ndef = ndef;
-    out->ndef_len = total_len;
-    out->uid_offset = (uint32_t)uid_offset;
-    out->ctr_offset = (uint32_t)ctr_offset;
-    out->mac_input_offset = (uint32_t)uid_key_pos; // start at "uid="
-    out->mac_offset = (uint32_t)mac_offset;        // start of MAC value
-    return 1;
+// Writes the cache back through a temporary file when it changed.
+static int tag_cache_save(const char *path) {
+    if (!g_tag_cache || !g_tag_cache_dirty) return 1;
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return 0;
+    tag_cache_header_t hdr = {TAG_CACHE_MAGIC, TAG_CACHE_VERSION, (uint16_t)sizeof(tag_cache_entry_t),
+                              (uint32_t)g_tag_cache_count};
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+             fwrite(g_tag_cache_entries, sizeof(tag_cache_entry_t), g_tag_cache_count, f) == g_tag_cache_count;
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    return ok;
 }
 
-static int write_ndef_file_plain(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                                 const uint8_t *data, size_t len, uint16_t *sw_out) {
-    uint16_t sw = 0;
-    if (!select_ndef_app(card, pio, &sw)) {
-        if (sw_out) *sw_out = sw;
-        return 0;
-    }
-    if (!select_file(card, pio, 0xE104, &sw)) {
-        if (sw_out) *sw_out = sw;
-        return 0;
+// Key database for --key-db. Generated keys are stored per UID and key
+// number instead of one hex file each: pending before ChangeKey, and as the
+// tag's key once ChangeKey succeeded. Stored keys are preferred over the
+// command-line auth key, but an explicit --old-key wins. The --all-readers
+// workers share the handle.
+static ntag424_keydb_t *g_key_db = NULL;
+static pthread_mutex_t g_key_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int key_db_get(const uint8_t *uid, size_t uid_len, uint8_t key_no, uint8_t key[16]) {
+    if (!g_key_db || uid_len == 0) return 0;
+    pthread_mutex_lock(&g_key_db_lock);
+    int ok = ntag424_keydb_get(g_key_db, uid, uid_len, key_no, key, NULL);
+    pthread_mutex_unlock(&g_key_db_lock);
+    return ok;
+}
+
+static int key_db_put(const uint8_t *uid, size_t uid_len, uint8_t key_no, const uint8_t key[16], uint8_t key_ver) {
+    pthread_mutex_lock(&g_key_db_lock);
+    int ok = ntag424_keydb_put(g_key_db, uid, uid_len, key_no, key, key_ver);
+    pthread_mutex_unlock(&g_key_db_lock);
+    return ok;
+}
+
+static int key_db_put_pending(const uint8_t *uid, size_t uid_len, uint8_t key_no, const uint8_t key[16],
+                              uint8_t key_ver) {
+    pthread_mutex_lock(&g_key_db_lock);
+    int ok = ntag424_keydb_put_pending(g_key_db, uid, uid_len, key_no, key, key_ver);
+    pthread_mutex_unlock(&g_key_db_lock);
+    return ok;
+}
+
+static int key_db_get_pending(const uint8_t *uid, size_t uid_len, uint8_t key_no, uint8_t key[16]) {
+    if (!g_key_db || uid_len == 0) return 0;
+    pthread_mutex_lock(&g_key_db_lock);
+    int ok = ntag424_keydb_get_pending(g_key_db, uid, uid_len, key_no, key, NULL);
+    pthread_mutex_unlock(&g_key_db_lock);
+    return ok;
+}
+
+// With --div-key, the key for key_no is derived from the master key over
+// UID || KeyNo || system identifier (AN10922), so nothing is stored per tag.
+static int derive_tag_key(const tool_options_t *opt, const uint8_t *uid, size_t uid_len, uint8_t key_no,
+                          uint8_t key[16]) {
+    uint8_t m[31];
+    if (!opt->diversify || uid_len == 0 || uid_len + 1 + opt->div_sysid_len > sizeof(m)) return 0;
+    memcpy(m, uid, uid_len);
+    m[uid_len] = key_no;
+    memcpy(m + uid_len + 1, opt->div_sysid, opt->div_sysid_len);
+    return ntag424_diversify_key(opt->div_master, m, uid_len + 1 + opt->div_sysid_len, key);
+}
+
+// A fresh AES key from the system CSPRNG; there is no weaker fallback.
+static int random_key(const char *prefix, uint8_t key[16]) {
+    if (ntag424_random_bytes(key, 16)) return 1;
+    out_printf("%s: cannot read the system random source for a new key\n", prefix);
+    return 0;
+}
+
+// Inserts "_<UID>" before the ".hex" extension of path (or appends it), so
+// daemon mode does not overwrite the key file of the previous tag.
+static void tag_key_path(char *buf, size_t size, const char *path,
+                         const uint8_t *uid, size_t uid_len) {
+    char uid_hex[33];
+    size_t n = 0;
+    for (size_t i = 0; i < uid_len && n + 2 < sizeof(uid_hex); i++) {
+        n += (size_t)snprintf(uid_hex + n, sizeof(uid_hex) - n, "%02X", uid[i]);
+    }
+    uid_hex[n] = '\0';
+
+    size_t plen = strlen(path);
+    size_t stem = plen;
+    if (plen >= 4 && strcmp(path + plen - 4, ".hex") == 0) stem = plen - 4;
+    snprintf(buf, size, "%.*s_%s%s", (int)stem, path, uid_hex, path + stem);
+}
+
+// Rotation journal for --rotate-plan (--rotate-journal PATH). Each slot is
+// logged as "UID KEYNO pending OLDKEY NEWKEY" before its ChangeKey is sent
+// and "UID KEYNO done" once the tag confirmed it, so a batch cut short by a
+// removed tag resumes with the keys the tag may already hold. The file is
+// replayed into memory at start; the --all-readers workers share it.
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[10];
+    uint8_t key_no;
+    uint8_t done;
+    uint8_t old_key[16];
+    uint8_t new_key[16];
+} rotate_journal_entry_t;
+
+static FILE *g_rotate_journal = NULL;
+static pthread_mutex_t g_rotate_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static rotate_journal_entry_t *g_rotate_journal_entries = NULL;
+static size_t g_rotate_journal_count = 0;
+static size_t g_rotate_journal_cap = 0;
+
+static rotate_journal_entry_t *rotate_journal_find_locked(const uint8_t *uid, size_t uid_len, uint8_t key_no) {
+    for (size_t i = 0; i < g_rotate_journal_count; i++) {
+        rotate_journal_entry_t *e = &g_rotate_journal_entries[i];
+        if (e->key_no == key_no && e->uid_len == uid_len && memcmp(e->uid, uid, uid_len) == 0) return e;
     }
+    return NULL;
+}
 
-    size_t offset = 0;
-    while (offset < len) {
-        size_t chunk = len - offset;
-        if (chunk > 0xFF) chunk = 0xFF;
-        uint8_t apdu[MAX_APDU];
-        size_t apdu_len = 0;
-        apdu[apdu_len++] = 0x00;
-        apdu[apdu_len++] = 0xD6; // Update Binary
-        apdu[apdu_len++] = (uint8_t)((offset >> 8) & 0xFF);
-        apdu[apdu_len++] = (uint8_t)(offset & 0xFF);
-        apdu[apdu_len++] = (uint8_t)chunk;
-        memcpy(apdu + apdu_len, data + offset, chunk);
-        apdu_len += chunk;
-
-        uint8_t resp[MAX_APDU];
-        size_t rlen = sizeof(resp);
-        if (transmit(card, pio, apdu, apdu_len, resp, &rlen, &sw) != SCARD_S_SUCCESS ||
-            !sw_ok(sw)) {
-            if (sw_out) *sw_out = sw;
-            return 0;
+static int rotate_journal_set_locked(const rotate_journal_entry_t *e) {
+    rotate_journal_entry_t *slot = rotate_journal_find_locked(e->uid, e->uid_len, e->key_no);
+    if (!slot) {
+        if (g_rotate_journal_count == g_rotate_journal_cap) {
+            size_t cap = g_rotate_journal_cap ? g_rotate_journal_cap * 2 : 64;
+            rotate_journal_entry_t *entries =
+                (rotate_journal_entry_t *)realloc(g_rotate_journal_entries, cap * sizeof(*entries));
+            if (!entries) return 0;
+            g_rotate_journal_entries = entries;
+            g_rotate_journal_cap = cap;
         }
-        offset += chunk;
+        slot = &g_rotate_journal_entries[g_rotate_journal_count++];
     }
-
-    if (sw_out) *sw_out = 0x9000;
+    *slot = *e;
     return 1;
 }
 
-static uint32_t read_u24_le(const uint8_t *p) {
-    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+static int rotate_journal_find(const uint8_t *uid, size_t uid_len, uint8_t key_no, rotate_journal_entry_t *out) {
+    pthread_mutex_lock(&g_rotate_journal_lock);
+    const rotate_journal_entry_t *e = rotate_journal_find_locked(uid, uid_len, key_no);
+    if (e) *out = *e;
+    pthread_mutex_unlock(&g_rotate_journal_lock);
+    return e != NULL;
 }
 
-static void write_u24_le(uint8_t *p, uint32_t v) {
-    p[0] = (uint8_t)(v & 0xFF);
-    p[1] = (uint8_t)((v >> 8) & 0xFF);
-    p[2] = (uint8_t)((v >> 16) & 0xFF);
+static void fprint_hex_bytes(FILE *f, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) fprintf(f, "%02X", buf[i]);
 }
 
-static uint32_t crc32_ieee(const uint8_t *data, size_t len) {
-    // CRC32 as used by NTAG 424 DNA for ChangeKey: init=0xFFFFFFFF, reflected, no final xor.
-    uint32_t crc = 0xFFFFFFFFu;
-    for (size_t i = 0; i < len; i++) {
-        crc ^= data[i];
-        for (int j = 0; j < 8; j++) {
-            if (crc & 1) {
-                crc = (crc >> 1) ^ 0xEDB88320u;
-            } else {
-                crc >>= 1;
+// Appends the state of e and waits for it to reach the disk. Without
+// --rotate-journal this only succeeds.
+static int rotate_journal_write(const rotate_journal_entry_t *e) {
+    if (!g_rotate_journal) return 1;
+    pthread_mutex_lock(&g_rotate_journal_lock);
+    fprint_hex_bytes(g_rotate_journal, e->uid, e->uid_len);
+    fprintf(g_rotate_journal, " %u %s", e->key_no, e->done ? "done" : "pending");
+    if (!e->done) {
+        fputc(' ', g_rotate_journal);
+        fprint_hex_bytes(g_rotate_journal, e->old_key, sizeof(e->old_key));
+        fputc(' ', g_rotate_journal);
+        fprint_hex_bytes(g_rotate_journal, e->new_key, sizeof(e->new_key));
+    }
+    fputc('\n', g_rotate_journal);
+    int ok = fflush(g_rotate_journal) == 0 && fsync(fileno(g_rotate_journal)) == 0;
+    if (ok) ok = rotate_journal_set_locked(e);
+    pthread_mutex_unlock(&g_rotate_journal_lock);
+    return ok;
+}
+
+// Replays an existing journal (a missing one is empty) and opens it for
+// appending. A torn last line from a crash is ignored.
+static int rotate_journal_open(const char *path) {
+    int torn = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            torn = strchr(line, '\n') == NULL;
+            char uid_hex[32], state[16], old_hex[40] = "", new_hex[40] = "";
+            unsigned key_no = 0;
+            int n = sscanf(line, "%31s %u %15s %39s %39s", uid_hex, &key_no, state, old_hex, new_hex);
+            rotate_journal_entry_t e;
+            memset(&e, 0, sizeof(e));
+            size_t uid_len = 0;
+            if (n < 3 || key_no > 0x0F || !parse_hex_bytes(uid_hex, e.uid, sizeof(e.uid), &uid_len) || uid_len == 0) {
+                continue;
+            }
+            e.uid_len = (uint8_t)uid_len;
+            e.key_no = (uint8_t)key_no;
+            if (strcmp(state, "done") == 0) {
+                rotate_journal_entry_t *prev = rotate_journal_find_locked(e.uid, e.uid_len, e.key_no);
+                if (prev) e = *prev;
+                e.done = 1;
+            } else if (n != 5 || strcmp(state, "pending") != 0 || !parse_hex_key(old_hex, e.old_key) ||
+                       !parse_hex_key(new_hex, e.new_key)) {
+                continue;
+            }
+            if (!rotate_journal_set_locked(&e)) {
+                fclose(f);
+                return 0;
             }
         }
+        fclose(f);
     }
-    return crc;
+    g_rotate_journal = fopen(path, "a");
+    if (g_rotate_journal && torn) fputc('\n', g_rotate_journal);
+    return g_rotate_journal != NULL;
 }
 
-static int write_key_hex_file(const char *path, const uint8_t key[16]) {
-    FILE *f = fopen(path, "w");
-    if (!f) return 0;
-    for (int i = 0; i < 16; i++) fprintf(f, "%02X", key[i]);
-    fprintf(f, "\n");
-    fclose(f);
-    return 1;
+static void rotate_journal_close(void) {
+    if (g_rotate_journal) fclose(g_rotate_journal);
+    g_rotate_journal = NULL;
+    free(g_rotate_journal_entries);
+    g_rotate_journal_entries = NULL;
+    g_rotate_journal_count = g_rotate_journal_cap = 0;
 }
 
-static int get_uid(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint8_t *uid, size_t *uid_len) {
-    uint8_t apdu[] = {0xFF, 0xCA, 0x00, 0x00, 0x00};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (rc != SCARD_S_SUCCESS || !sw_ok(sw) || rlen == 0) return 0;
-    memcpy(uid, resp, rlen);
-    *uid_len = rlen;
-    return 1;
+// Provisioning checkpoints (--checkpoint PATH). After each provisioning step
+// the tag's progress is appended as one line, "UID [key-pending=N:KEY |
+// key=N:KEY] [settings=HEX] [ndef=LEN:HASH] [verified]", so a tag that failed
+// midway resumes at the first step that did not complete instead of
+// repeating ChangeKey with an old key that is no longer valid. The last
+// line for a UID is its state; settings and ndef hold a digest of what was
+// written, so a changed configuration is applied again.
+enum {
+    CKPT_KEY_PENDING = 0x01,  // ChangeKey sent, answer not seen
+    CKPT_KEY = 0x02,
+    CKPT_SETTINGS = 0x04,
+    CKPT_NDEF = 0x08,
+    CKPT_VERIFIED = 0x10      // FileSettings read back and matched settings
+};
+
+#define CKPT_SETTINGS_LEN 19
+
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[10];
+    uint8_t steps;  // CKPT_* bits
+    uint8_t key_no;
+    uint8_t key[16];
+    uint8_t settings[CKPT_SETTINGS_LEN];
+    uint16_t ndef_len;
+    uint32_t ndef_hash;
+} checkpoint_t;
+
+static FILE *g_checkpoint = NULL;
+static pthread_mutex_t g_checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static checkpoint_t *g_checkpoint_entries = NULL;
+static size_t g_checkpoint_count = 0;
+static size_t g_checkpoint_cap = 0;
+
+static checkpoint_t *checkpoint_find_locked(const uint8_t *uid, size_t uid_len) {
+    for (size_t i = 0; i < g_checkpoint_count; i++) {
+        checkpoint_t *e = &g_checkpoint_entries[i];
+        if (e->uid_len == uid_len && memcmp(e->uid, uid, uid_len) == 0) return e;
+    }
+    return NULL;
 }
 
-static int get_ats(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint8_t *ats, size_t *ats_len) {
-    uint8_t apdu[] = {0xFF, 0xCA, 0x01, 0x00, 0x00};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (rc != SCARD_S_SUCCESS || !sw_ok(sw) || rlen == 0) return 0;
-    memcpy(ats, resp, rlen);
-    *ats_len = rlen;
+static int checkpoint_set_locked(const checkpoint_t *e) {
+    checkpoint_t *slot = checkpoint_find_locked(e->uid, e->uid_len);
+    if (!slot) {
+        if (g_checkpoint_count == g_checkpoint_cap) {
+            size_t cap = g_checkpoint_cap ? g_checkpoint_cap * 2 : 64;
+            checkpoint_t *entries = (checkpoint_t *)realloc(g_checkpoint_entries, cap * sizeof(*entries));
+            if (!entries) return 0;
+            g_checkpoint_entries = entries;
+            g_checkpoint_cap = cap;
+        }
+        slot = &g_checkpoint_entries[g_checkpoint_count++];
+    }
+    *slot = *e;
     return 1;
 }
 
-static int select_ndef_app(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint16_t *sw_out) {
-    uint8_t aid[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
-    uint8_t apdu[5 + sizeof(aid) + 1];
-    size_t apdu_len = 0;
-    apdu[apdu_len++] = 0x00;
-    apdu[apdu_len++] = 0xA4;
-    apdu[apdu_len++] = 0x04;
-    apdu[apdu_len++] = 0x00;
-    apdu[apdu_len++] = (uint8_t)sizeof(aid);
-    memcpy(apdu + apdu_len, aid, sizeof(aid));
-    apdu_len += sizeof(aid);
-    apdu[apdu_len++] = 0x00;
-
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, apdu_len, resp, &rlen, &sw);
-    if (sw_out) *sw_out = sw;
-    if (rc != SCARD_S_SUCCESS) return 0;
-    return sw_ok(sw);
+// The recorded state of uid, or an empty one for a tag not seen before.
+static void checkpoint_get(const uint8_t *uid, size_t uid_len, checkpoint_t *out) {
+    pthread_mutex_lock(&g_checkpoint_lock);
+    const checkpoint_t *e = checkpoint_find_locked(uid, uid_len);
+    if (e) {
+        *out = *e;
+    } else {
+        memset(out, 0, sizeof(*out));
+        out->uid_len = (uint8_t)uid_len;
+        memcpy(out->uid, uid, uid_len);
+    }
+    pthread_mutex_unlock(&g_checkpoint_lock);
 }
 
-static int select_file(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, uint16_t file_id, uint16_t *sw_out) {
-    uint8_t apdu[] = {0x00, 0xA4, 0x00, 0x0C, 0x02,
-                      (uint8_t)((file_id >> 8) & 0xFF), (uint8_t)(file_id & 0xFF)};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (sw_out) *sw_out = sw;
-    if (rc != SCARD_S_SUCCESS) return 0;
-    return sw_ok(sw);
-}
-
-static int read_binary(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                       uint16_t offset, uint8_t le,
-                       uint8_t *out, size_t *out_len, uint16_t *sw_out) {
-    uint8_t apdu[] = {0x00, 0xB0, (uint8_t)((offset >> 8) & 0xFF),
-                      (uint8_t)(offset & 0xFF), le};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (rc != SCARD_S_SUCCESS) return 0;
+// Appends e and waits for it to reach the disk.
+static int checkpoint_write(const checkpoint_t *e) {
+    pthread_mutex_lock(&g_checkpoint_lock);
+    FILE *f = g_checkpoint;
+    fprint_hex_bytes(f, e->uid, e->uid_len);
+    if (e->steps & (CKPT_KEY | CKPT_KEY_PENDING)) {
+        fprintf(f, " %s=%u:", (e->steps & CKPT_KEY) ? "key" : "key-pending", e->key_no);
+        fprint_hex_bytes(f, e->key, sizeof(e->key));
+    }
+    if (e->steps & CKPT_SETTINGS) {
+        fputs(" settings=", f);
+        fprint_hex_bytes(f, e->settings, sizeof(e->settings));
+    }
+    if (e->steps & CKPT_NDEF) fprintf(f, " ndef=%u:%08X", e->ndef_len, (unsigned)e->ndef_hash);
+    if (e->steps & CKPT_VERIFIED) fputs(" verified", f);
+    fputc('\n', f);
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (ok) ok = checkpoint_set_locked(e);
+    pthread_mutex_unlock(&g_checkpoint_lock);
+    return ok;
+}
 
-    if ((sw & 0xFF00) == 0x6C00) {
-        apdu[4] = (uint8_t)(sw & 0x00FF);
-        rlen = sizeof(resp);
-        rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-        if (rc != SCARD_S_SUCCESS) return 0;
+static int checkpoint_parse_line(char *line, checkpoint_t *e) {
+    memset(e, 0, sizeof(*e));
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    size_t uid_len = 0;
+    if (!tok || !parse_hex_bytes(tok, e->uid, sizeof(e->uid), &uid_len) || uid_len == 0) return 0;
+    e->uid_len = (uint8_t)uid_len;
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        char *val = strchr(tok, '=');
+        if (val) *val++ = '\0';
+        if (val && (strcmp(tok, "key") == 0 || strcmp(tok, "key-pending") == 0)) {
+            char *key_hex = strchr(val, ':');
+            unsigned key_no = 0;
+            if (!key_hex || sscanf(val, "%u", &key_no) != 1 || key_no > 0x0F || !parse_hex_key(key_hex + 1, e->key)) {
+                return 0;
+            }
+            e->key_no = (uint8_t)key_no;
+            e->steps |= strcmp(tok, "key") == 0 ? CKPT_KEY : CKPT_KEY_PENDING;
+        } else if (val && strcmp(tok, "settings") == 0) {
+            size_t len = 0;
+            if (!parse_hex_bytes(val, e->settings, sizeof(e->settings), &len) || len != sizeof(e->settings)) return 0;
+            e->steps |= CKPT_SETTINGS;
+        } else if (val && strcmp(tok, "ndef") == 0) {
+            unsigned len = 0, hash = 0;
+            if (sscanf(val, "%u:%x", &len, &hash) != 2 || len > NTAG424_SDM_NDEF_MAX) return 0;
+            e->ndef_len = (uint16_t)len;
+            e->ndef_hash = hash;
+            e->steps |= CKPT_NDEF;
+        } else if (!val && strcmp(tok, "verified") == 0) {
+            e->steps |= CKPT_VERIFIED;
+        } else {
+            return 0;
+        }
     }
-
-    if (sw_out) *sw_out = sw;
-    if (!sw_ok(sw)) return 0;
-    memcpy(out, resp, rlen);
-    *out_len = rlen;
     return 1;
 }
 
-static int authenticate_ev2_first(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                                  const uint8_t key[16], uint8_t key_no,
-                                  ssm_session_t *sess) {
-    uint8_t apdu[MAX_APDU];
-    uint8_t resp[MAX_APDU];
-    size_t rlen;
-    uint16_t sw = 0;
-
-    // Part 1: 90 71 00 00 02 KeyNo LenCap 00 (LenCap=0)
-    apdu[0] = 0x90;
-    apdu[1] = 0x71;
-    apdu[2] = 0x00;
-    apdu[3] = 0x00;
-    apdu[4] = 0x02;
-    apdu[5] = key_no;
-    apdu[6] = 0x00; // LenCap = 0
-    apdu[7] = 0x00;
-
-    rlen = sizeof(resp);
-    if (transmit(card, pio, apdu, 8, resp, &rlen, &sw) != SCARD_S_SUCCESS) return 0;
-    if (sw != 0x91AF || rlen != 16) return 0;
-
-    uint8_t rndB_enc[16];
-    memcpy(rndB_enc, resp, 16);
-    uint8_t rndB[16];
-    uint8_t iv0[16] = {0};
-    if (!aes_cbc_crypt(0, key, iv0, rndB_enc, 16, rndB)) return 0;
-
-    uint8_t rndA[16];
-    const char *rndA_hex = getenv("NTAG_RNDA");
-    if (rndA_hex && strlen(rndA_hex) == 32) {
-        if (!parse_hex_key(rndA_hex, rndA)) {
-            random_bytes(rndA, 16);
+// Replays an existing checkpoint file (a missing one is empty) and opens it
+// for appending. Unreadable lines, such as a torn last line, are ignored.
+static int checkpoint_open(const char *path) {
+    int torn = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            torn = strchr(line, '\n') == NULL;
+            checkpoint_t e;
+            if (!checkpoint_parse_line(line, &e)) continue;
+            if (!checkpoint_set_locked(&e)) {
+                fclose(f);
+                return 0;
+            }
         }
-    } else {
-        random_bytes(rndA, 16);
-    }
-
-    uint8_t rndB_rot[16];
-    rotate_left_1(rndB_rot, rndB, 16);
-
-    uint8_t rndAB[32];
-    memcpy(rndAB, rndA, 16);
-    memcpy(rndAB + 16, rndB_rot, 16);
-
-    uint8_t rndAB_enc[32];
-    if (!aes_cbc_crypt(1, key, iv0, rndAB, 32, rndAB_enc)) return 0;
-
-    // Part 2: 90 AF 00 00 20 <RndA||RndB'> 00
-    apdu[0] = 0x90;
-    apdu[1] = 0xAF;
-    apdu[2] = 0x00;
-    apdu[3] = 0x00;
-    apdu[4] = 0x20;
-    memcpy(apdu + 5, rndAB_enc, 32);
-    apdu[37] = 0x00;
-
-    rlen = sizeof(resp);
-    if (transmit(card, pio, apdu, 38, resp, &rlen, &sw) != SCARD_S_SUCCESS) return 0;
-    if (sw != 0x9100 || rlen != 32) return 0;
-
-    uint8_t dec[32];
-    if (!aes_cbc_crypt(0, key, iv0, resp, 32, dec)) return 0;
-
-    uint8_t ti[4];
-    memcpy(ti, dec, 4);
-
-    uint8_t rndA_rot[16];
-    memcpy(rndA_rot, dec + 4, 16);
-
-    uint8_t rndA_check[16];
-    rotate_right_1(rndA_check, rndA_rot, 16);
-    if (memcmp(rndA_check, rndA, 16) != 0) return 0;
-
-    // Build SV1 and SV2 (32-byte messages)
-    uint8_t sv1[32];
-    uint8_t sv2[32];
-    uint8_t prefix1[6] = {0xA5, 0x5A, 0x00, 0x01, 0x00, 0x80};
-    uint8_t prefix2[6] = {0x5A, 0xA5, 0x00, 0x01, 0x00, 0x80};
-
-    memcpy(sv1, prefix1, 6);
-    memcpy(sv2, prefix2, 6);
-
-    // RndA[15:14] -> first two bytes, RndA[13:8] -> next 6 bytes
-    memcpy(sv1 + 6, rndA, 2);
-    memcpy(sv2 + 6, rndA, 2);
-
-    uint8_t xor_part[6];
-    for (int i = 0; i < 6; i++) {
-        xor_part[i] = rndA[2 + i] ^ rndB[i];
-    }
-    memcpy(sv1 + 8, xor_part, 6);
-    memcpy(sv2 + 8, xor_part, 6);
-
-    // RndB[9:0] -> bytes 6..15 (10 bytes)
-    memcpy(sv1 + 14, rndB + 6, 10);
-    memcpy(sv2 + 14, rndB + 6, 10);
-
-    // RndA[7:0] -> bytes 8..15 (8 bytes)
-    memcpy(sv1 + 24, rndA + 8, 8);
-    memcpy(sv2 + 24, rndA + 8, 8);
-
-    if (!aes_cmac(key, sv1, sizeof(sv1), sess->kenc)) return 0;
-    if (!aes_cmac(key, sv2, sizeof(sv2), sess->kmac)) return 0;
-    memcpy(sess->ti, ti, 4);
-    sess->cmd_ctr = 0;
-    sess->key_no = key_no;
-    sess->authenticated = 1;
-
-    const char *dbg_keys = getenv("NTAG_DEBUG_KEYS");
-    if (dbg_keys && *dbg_keys) {
-        printf("RndA: ");
-        print_hex(rndA, 16);
-        printf("\nRndB: ");
-        print_hex(rndB, 16);
-        printf("\nTI: ");
-        print_hex(ti, 4);
-        printf("\nKenc: ");
-        print_hex(sess->kenc, 16);
-        printf("\nKmac: ");
-        print_hex(sess->kmac, 16);
-        printf("\n");
+        fclose(f);
     }
-    return 1;
+    g_checkpoint = fopen(path, "a");
+    if (g_checkpoint && torn) fputc('\n', g_checkpoint);
+    return g_checkpoint != NULL;
 }
 
-static int ssm_cmd_full(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, ssm_session_t *sess,
-                        uint8_t cmd, const uint8_t *cmd_header, size_t cmd_header_len,
-                        const uint8_t *cmd_data, size_t cmd_data_len,
-                        uint8_t *out, size_t *out_len, uint16_t *sw_out) {
-    if (!sess || !sess->authenticated) return 0;
-
-    uint8_t ivc_in[16] = {0};
-    ivc_in[0] = 0xA5;
-    ivc_in[1] = 0x5A;
-    memcpy(ivc_in + 2, sess->ti, 4);
-    ivc_in[6] = (uint8_t)(sess->cmd_ctr & 0xFF);
-    ivc_in[7] = (uint8_t)((sess->cmd_ctr >> 8) & 0xFF);
-    uint8_t ivc[16];
-    if (!aes_ecb_encrypt(sess->kenc, ivc_in, ivc)) return 0;
-
-    uint8_t enc_data[MAX_APDU];
-    size_t enc_len = 0;
-    if (cmd_data_len > 0) {
-        uint8_t padded[MAX_APDU];
-        size_t padded_len = pad_iso9797_m2(cmd_data, cmd_data_len, padded);
-        if (padded_len > sizeof(enc_data)) return 0;
-        if (!aes_cbc_crypt(1, sess->kenc, ivc, padded, padded_len, enc_data)) return 0;
-        enc_len = padded_len;
-    }
-
-    uint8_t mac_input[MAX_APDU];
-    size_t mac_len = 0;
-    mac_input[mac_len++] = cmd;
-    mac_input[mac_len++] = (uint8_t)(sess->cmd_ctr & 0xFF);
-    mac_input[mac_len++] = (uint8_t)((sess->cmd_ctr >> 8) & 0xFF);
-    memcpy(mac_input + mac_len, sess->ti, 4);
-    mac_len += 4;
-    if (cmd_header_len > 0) {
-        memcpy(mac_input + mac_len, cmd_header, cmd_header_len);
-        mac_len += cmd_header_len;
-    }
-    if (enc_len > 0) {
-        memcpy(mac_input + mac_len, enc_data, enc_len);
-        mac_len += enc_len;
-    }
-
-    uint8_t cmac[16];
-    if (!aes_cmac(sess->kmac, mac_input, mac_len, cmac)) return 0;
-    uint8_t mact[8];
-    cmac_truncate_8(cmac, mact);
-
-    uint8_t apdu[MAX_APDU];
-    size_t apdu_len = 0;
-    apdu[apdu_len++] = 0x90;
-    apdu[apdu_len++] = cmd;
-    apdu[apdu_len++] = 0x00;
-    apdu[apdu_len++] = 0x00;
-
-    size_t data_len = cmd_header_len + enc_len + sizeof(mact);
-    if (data_len > 255) return 0;
-    apdu[apdu_len++] = (uint8_t)data_len;
-    if (cmd_header_len > 0) {
-        memcpy(apdu + apdu_len, cmd_header, cmd_header_len);
-        apdu_len += cmd_header_len;
-    }
-    if (enc_len > 0) {
-        memcpy(apdu + apdu_len, enc_data, enc_len);
-        apdu_len += enc_len;
-    }
-    memcpy(apdu + apdu_len, mact, sizeof(mact));
-    apdu_len += sizeof(mact);
-    apdu[apdu_len++] = 0x00;
-
-    if (debug_apdu_enabled()) {
-        printf("APDU cmd 0x%02X: ", cmd);
-        print_hex(apdu, apdu_len);
-        printf("\n");
-    }
-
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    if (transmit(card, pio, apdu, apdu_len, resp, &rlen, &sw) != SCARD_S_SUCCESS) return 0;
-    if (sw_out) *sw_out = sw;
-    if ((sw & 0xFF00) != 0x9100) return 0;
-    if (rlen < 8) return 0;
-
-    size_t resp_enc_len = rlen - 8;
-    uint8_t *resp_enc = resp;
-    uint8_t *resp_mact = resp + resp_enc_len;
-
-    uint8_t ivr_in[16] = {0};
-    ivr_in[0] = 0x5A;
-    ivr_in[1] = 0xA5;
-    memcpy(ivr_in + 2, sess->ti, 4);
-    uint16_t cmdctr1 = (uint16_t)(sess->cmd_ctr + 1);
-    ivr_in[6] = (uint8_t)(cmdctr1 & 0xFF);
-    ivr_in[7] = (uint8_t)((cmdctr1 >> 8) & 0xFF);
-    uint8_t ivr[16];
-    if (!aes_ecb_encrypt(sess->kenc, ivr_in, ivr)) return 0;
-
-    uint8_t mac_in2[MAX_APDU];
-    size_t mac2_len = 0;
-    mac_in2[mac2_len++] = (uint8_t)(sw & 0x00FF); // SW2
-    mac_in2[mac2_len++] = (uint8_t)(cmdctr1 & 0xFF);
-    mac_in2[mac2_len++] = (uint8_t)((cmdctr1 >> 8) & 0xFF);
-    memcpy(mac_in2 + mac2_len, sess->ti, 4);
-    mac2_len += 4;
-    if (resp_enc_len > 0) {
-        memcpy(mac_in2 + mac2_len, resp_enc, resp_enc_len);
-        mac2_len += resp_enc_len;
-    }
-
-    uint8_t cmac2[16];
-    if (!aes_cmac(sess->kmac, mac_in2, mac2_len, cmac2)) return 0;
-    uint8_t mact2[8];
-    cmac_truncate_8(cmac2, mact2);
-    if (memcmp(resp_mact, mact2, 8) != 0) return 0;
-
-    size_t out_written = 0;
-    if (resp_enc_len > 0) {
-        uint8_t dec[MAX_APDU];
-        if (!aes_cbc_crypt(0, sess->kenc, ivr, resp_enc, resp_enc_len, dec)) return 0;
-        out_written = unpad_iso9797_m2(dec, resp_enc_len);
-        if (out_written > *out_len) return 0;
-        memcpy(out, dec, out_written);
-    }
-
-    *out_len = out_written;
-    sess->cmd_ctr = cmdctr1;
-    return 1;
+static void checkpoint_close(void) {
+    if (g_checkpoint) fclose(g_checkpoint);
+    g_checkpoint = NULL;
+    free(g_checkpoint_entries);
+    g_checkpoint_entries = NULL;
+    g_checkpoint_count = g_checkpoint_cap = 0;
 }
 
-static int get_file_settings_plain(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                                   uint8_t file_no, uint8_t *out, size_t *out_len,
-                                   uint16_t *sw_out) {
-    uint8_t apdu[] = {0x90, 0xF5, 0x00, 0x00, 0x01, file_no, 0x00};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (sw_out) *sw_out = sw;
-    if (rc != SCARD_S_SUCCESS || !sw_ok(sw)) return 0;
-    if (rlen > *out_len) return 0;
-    memcpy(out, resp, rlen);
-    *out_len = rlen;
-    return 1;
+// Counter audit (--audit-csv PATH): one CSV row per tap with the UID, the
+// SDM read counter, SDMReadCtrLimit and a hash of the SDM settings. The
+// result stage appends a fixed-size row to the pending batch; a writer thread
+// takes whole batches (AUDIT_BATCH rows, or whatever is pending after
+// AUDIT_FLUSH_MS) and formats and writes them, so no tap waits on the disk.
+typedef struct {
+    uint64_t time_ms;  // wall clock, Unix epoch
+    uint8_t uid_len;
+    uint8_t uid[10];
+    uint8_t file_no;
+    uint8_t ctr_source;  // 0 none, 1 plain, 2 secure
+    uint8_t has_limit;
+    uint8_t has_settings;
+    uint8_t ok;
+    uint32_t ctr;
+    uint32_t ctr_limit;
+    uint32_t settings_hash;
+} audit_row_t;
+
+static FILE *g_audit = NULL;
+static pthread_mutex_t g_audit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_audit_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t g_audit_thread;
+static audit_row_t *g_audit_rows = NULL;
+static size_t g_audit_count = 0;
+static size_t g_audit_cap = 0;
+static int g_audit_stop = 0;
+static unsigned long g_audit_written = 0;
+static unsigned long g_audit_dropped = 0;
+static int g_audit_failed = 0;
+
+static size_t audit_format_row(char *out, size_t cap, const audit_row_t *r) {
+    static const char *const k_sources[] = {"", "plain", "secure"};
+    char uid[2 * sizeof(r->uid) + 1];
+    for (size_t i = 0; i < r->uid_len; i++) snprintf(uid + 2 * i, 3, "%02X", r->uid[i]);
+    uid[2 * r->uid_len] = '\0';
+    char ctr[12] = "", limit[12] = "", settings[9] = "";
+    if (r->ctr_source) snprintf(ctr, sizeof(ctr), "%u", r->ctr);
+    if (r->has_limit) snprintf(limit, sizeof(limit), "%u", r->ctr_limit);
+    if (r->has_settings) snprintf(settings, sizeof(settings), "%08X", (unsigned)r->settings_hash);
+    int n = snprintf(out, cap, "%llu,%s,%02X,%s,%s,%s,%s,%d\n", (unsigned long long)r->time_ms, uid, r->file_no, ctr,
+                     k_sources[r->ctr_source], limit, settings, r->ok);
+    return n > 0 && (size_t)n < cap ? (size_t)n : 0;
 }
 
-static int get_file_settings_secure(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                                    ssm_session_t *sess, uint8_t file_no,
-                                    uint8_t *out, size_t *out_len, uint16_t *sw_out) {
-    uint8_t header = file_no;
-    return ssm_cmd_full(card, pio, sess, 0xF5, &header, 1, NULL, 0, out, out_len, sw_out);
-}
-
-static int parse_file_settings(const uint8_t *data, size_t len, file_settings_info_t *info) {
-    if (info) memset(info, 0, sizeof(*info));
-    if (len < 7) return 0;
-
-    uint8_t file_type = data[0];
-    uint8_t file_option = data[1];
-    uint8_t ar1 = data[2];
-    uint8_t ar2 = data[3];
-    uint32_t file_size = read_u24_le(&data[4]);
-
-    printf("FileSettings:\n");
-    printf("  FileType: 0x%02X\n", file_type);
-    printf("  FileOption: 0x%02X (SDM=%s, CommMode=%u)\n",
-           file_option, (file_option & 0x40) ? "on" : "off", (file_option & 0x03));
-    printf("  AccessRights: %02X %02X (RW=%X, CAR=%X, R=%X, W=%X)\n",
-           ar1, ar2, (ar1 >> 4) & 0x0F, ar1 & 0x0F, (ar2 >> 4) & 0x0F, ar2 & 0x0F);
-    printf("  FileSize: %u bytes\n", file_size);
-
-    if (info) {
-        info->valid = 1;
-        info->file_option = file_option;
-        info->file_size = file_size;
-        info->sdm_enabled = (file_option & 0x40) ? 1 : 0;
-        info->ar1 = ar1;
-        info->ar2 = ar2;
-    }
-
-    size_t idx = 7;
-    if (!(file_option & 0x40)) return 1;
-
-    if (len < idx + 3) return 0;
-    uint8_t sdm_options = data[idx++];
-    uint8_t sdm_ar_lsb = data[idx++];
-    uint8_t sdm_ar_msb = data[idx++];
-    uint16_t sdm_ar = (uint16_t)(sdm_ar_lsb | (sdm_ar_msb << 8));
-    uint8_t sdm_meta = (uint8_t)((sdm_ar >> 12) & 0x0F);
-    uint8_t sdm_file = (uint8_t)((sdm_ar >> 8) & 0x0F);
-    uint8_t sdm_rfu = (uint8_t)((sdm_ar >> 4) & 0x0F);
-    uint8_t sdm_ctr = (uint8_t)(sdm_ar & 0x0F);
-
-    printf("  SDMOptions: 0x%02X (UID=%s, ReadCtr=%s, EncFile=%s, ASCII=%s)\n",
-           sdm_options,
-           (sdm_options & 0x80) ? "on" : "off",
-           (sdm_options & 0x40) ? "on" : "off",
-           (sdm_options & 0x10) ? "on" : "off",
-           (sdm_options & 0x01) ? "on" : "off");
-    printf("  SDMAccessRights: 0x%04X (Meta=%X, File=%X, CtrRet=%X, RFU=%X)\n",
-           sdm_ar, sdm_meta, sdm_file, sdm_ctr, sdm_rfu);
-
-    if (info) {
-        info->sdm_options = sdm_options;
-        info->sdm_meta_read = sdm_meta;
-        info->sdm_file_read = sdm_file;
-        info->sdm_ctr_ret = sdm_ctr;
-        info->sdm_read_ctr_enabled = (sdm_options & 0x40) ? 1 : 0;
-    }
-
-    if ((sdm_options & 0x80) && sdm_meta == 0x0E) {
-        if (len < idx + 3) return 0;
-        uint32_t uid_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  UIDOffset: 0x%06X\n", uid_offset);
-    }
-
-    if ((sdm_options & 0x40) && sdm_meta == 0x0E) {
-        if (len < idx + 3) return 0;
-        uint32_t ctr_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        if (ctr_offset == 0xFFFFFF) {
-            printf("  SDMReadCtrOffset: none (0xFFFFFF)\n");
+static void *audit_writer(void *arg) {
+    (void)arg;
+    audit_row_t *batch = NULL;
+    size_t batch_cap = 0;
+    char *text = NULL;
+    pthread_mutex_lock(&g_audit_lock);
+    for (;;) {
+        if (!g_audit_stop && g_audit_count < AUDIT_BATCH) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += AUDIT_FLUSH_MS / 1000;
+            deadline.tv_nsec += (AUDIT_FLUSH_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&g_audit_wake, &g_audit_lock, &deadline);
+        }
+        if (g_audit_count == 0) {
+            if (g_audit_stop) break;
+            continue;
+        }
+        // Swap buffers so appends go on while this batch is written.
+        audit_row_t *rows = g_audit_rows;
+        size_t count = g_audit_count, cap = g_audit_cap;
+        g_audit_rows = batch;
+        g_audit_cap = batch_cap;
+        g_audit_count = 0;
+        pthread_mutex_unlock(&g_audit_lock);
+
+        char *grown = (char *)realloc(text, count * AUDIT_ROW_MAX);
+        if (grown) {
+            text = grown;
+            size_t len = 0;
+            for (size_t i = 0; i < count; i++) len += audit_format_row(text + len, AUDIT_ROW_MAX, &rows[i]);
+            if (fwrite(text, 1, len, g_audit) != len || fflush(g_audit) != 0) g_audit_failed = 1;
         } else {
-            printf("  SDMReadCtrOffset: 0x%06X\n", ctr_offset);
+            g_audit_failed = 1;
         }
-    }
+        batch = rows;
+        batch_cap = cap;
 
-    if (sdm_meta <= 0x04) {
-        if (len < idx + 3) return 0;
-        uint32_t picc_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  PICCDataOffset: 0x%06X\n", picc_offset);
+        pthread_mutex_lock(&g_audit_lock);
+        g_audit_written += count;
     }
+    pthread_mutex_unlock(&g_audit_lock);
+    free(batch);
+    free(text);
+    return NULL;
+}
 
-    if (sdm_file != 0x0F) {
-        if (len < idx + 3) return 0;
-        uint32_t mac_input_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  SDMMACInputOffset: 0x%06X\n", mac_input_offset);
+// Opens the audit file for appending (with a header if it is new) and
+// starts the writer thread.
+static int audit_open(const char *path) {
+    g_audit = fopen(path, "a");
+    if (!g_audit) return 0;
+    if (ftell(g_audit) == 0) {
+        fputs("time_ms,uid,file_no,read_ctr,ctr_source,read_ctr_limit,sdm_settings_hash,ok\n", g_audit);
+        fflush(g_audit);
+    }
+    if (pthread_create(&g_audit_thread, NULL, audit_writer, NULL) != 0) {
+        fclose(g_audit);
+        g_audit = NULL;
+        return 0;
     }
+    return 1;
+}
 
-    if (sdm_file != 0x0F && (sdm_options & 0x10)) {
-        if (len < idx + 6) return 0;
-        uint32_t enc_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        uint32_t enc_len = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  SDMENCOffset: 0x%06X\n", enc_offset);
-        printf("  SDMENCLength: 0x%06X\n", enc_len);
+// Queues one row. Never blocks on I/O; a row that cannot be buffered is
+// counted as dropped.
+static void audit_append(const audit_row_t *row) {
+    pthread_mutex_lock(&g_audit_lock);
+    if (g_audit_count == g_audit_cap) {
+        size_t cap = g_audit_cap ? g_audit_cap * 2 : AUDIT_BATCH;
+        audit_row_t *rows = (audit_row_t *)realloc(g_audit_rows, cap * sizeof(*rows));
+        if (rows) {
+            g_audit_rows = rows;
+            g_audit_cap = cap;
+        }
+    }
+    if (g_audit_count < g_audit_cap) {
+        g_audit_rows[g_audit_count++] = *row;
+        if (g_audit_count == AUDIT_BATCH) pthread_cond_signal(&g_audit_wake);
+    } else {
+        g_audit_dropped++;
     }
+    pthread_mutex_unlock(&g_audit_lock);
+}
+
+// Writes what is still pending, stops the writer and closes the file.
+static void audit_close(const char *path) {
+    if (!g_audit) return;
+    pthread_mutex_lock(&g_audit_lock);
+    g_audit_stop = 1;
+    pthread_cond_signal(&g_audit_wake);
+    pthread_mutex_unlock(&g_audit_lock);
+    pthread_join(g_audit_thread, NULL);
+    if (fclose(g_audit) != 0) g_audit_failed = 1;
+    g_audit = NULL;
+    if (g_audit_failed) fprintf(stderr, "Audit: writing %s failed\n", path);
+    fprintf(status_stream(), "Audit: %lu row(s) written to %s", g_audit_written, path);
+    if (g_audit_dropped) fprintf(status_stream(), ", %lu dropped (out of memory)", g_audit_dropped);
+    fprintf(status_stream(), "\n");
+    free(g_audit_rows);
+    g_audit_rows = NULL;
+    g_audit_count = g_audit_cap = 0;
+}
 
-    if (sdm_file != 0x0F) {
-        if (len < idx + 3) return 0;
-        uint32_t mac_offset = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  SDMMACOffset: 0x%06X\n", mac_offset);
+// FNV-1a, to recognise an NDEF template that was already written.
+static uint32_t ndef_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (sdm_options & 0x20) {
-        if (len < idx + 3) return 0;
-        uint32_t ctr_limit = read_u24_le(&data[idx]);
-        idx += 3;
-        printf("  SDMReadCtrLimit: 0x%06X\n", ctr_limit);
+// FileNo || SDMOptions || SDMAccessRights || the five mirror offsets, with
+// offsets the tag does not use for these options zeroed. Built the same way
+// from a configuration and from FileSettings read back, so the two compare.
+static void sdm_settings_digest(uint8_t file_no, uint8_t sdm_options, uint16_t sdm_ar, const uint32_t offsets[5],
+                                uint8_t out[CKPT_SETTINGS_LEN]) {
+    uint8_t meta = (uint8_t)((sdm_ar >> 12) & 0x0F);
+    uint8_t file_read = (uint8_t)((sdm_ar >> 8) & 0x0F);
+    int used[5] = {
+        (sdm_options & 0x80) && meta == 0x0E,
+        (sdm_options & 0x40) && meta == 0x0E,
+        meta <= 0x04,
+        file_read != 0x0F,
+        file_read != 0x0F,
+    };
+    memset(out, 0, CKPT_SETTINGS_LEN);
+    out[0] = file_no;
+    out[1] = sdm_options;
+    out[2] = (uint8_t)(sdm_ar & 0xFF);
+    out[3] = (uint8_t)(sdm_ar >> 8);
+    for (int i = 0; i < 5; i++) {
+        if (!used[i]) continue;
+        out[4 + 3 * i] = (uint8_t)(offsets[i] & 0xFF);
+        out[5 + 3 * i] = (uint8_t)((offsets[i] >> 8) & 0xFF);
+        out[6 + 3 * i] = (uint8_t)((offsets[i] >> 16) & 0xFF);
     }
+}
 
+// Per-tag state shared by the pipeline steps. With reuse_session set (--ops),
+// consecutive steps keep running on sess and only re-authenticate when they
+// need a different key number or the tag dropped the session.
+typedef struct {
+    ntag424_card_t *card;
+    const tool_options_t *opt;
+    uint8_t uid[16];
+    size_t uid_len;
+    ntag424_file_settings_t fs_info;
+    int fs_plain_failed;
+    uint8_t auth_key[16];
+    int auth_fallback;  // auth_key is derived; a factory tag still has opt->key
+    uint8_t counter_key[16];
+    uint8_t counter_key_no;
+    int reuse_session;
+    unsigned auth_count;
+    ntag424_session_t *sess;
+    tag_report_t report;
+    int ckpt_on;  // --checkpoint and a known UID
+    checkpoint_t ckpt;
+} tag_run_t;
+
+// Makes t->sess an authenticated session for key_no, reusing the current one
+// when allowed. *reused tells the caller whether EV2First was skipped.
+static int tag_run_session(tag_run_t *t, const uint8_t key[16], uint8_t key_no, int *reused) {
+    *reused = 0;
+    if (t->reuse_session && ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == key_no) {
+        *reused = 1;
+        return 1;
+    }
+    t->auth_count++;
+    if (ntag424_authenticate_ev2_first(t->card, t->sess, key, key_no)) return 1;
+    if (!t->auth_fallback || key_no != t->opt->key_no || memcmp(key, t->auth_key, sizeof(t->auth_key)) != 0) return 0;
+    // With --div-key, a tag whose auth slot was never changed still answers
+    // to the command-line key; later steps then use that one.
+    t->auth_fallback = 0;
+    t->auth_count++;
+    if (!ntag424_authenticate_ev2_first(t->card, t->sess, t->opt->key, key_no)) return 0;
+    out_printf("Diversified key: KeyNo 0x%02X still has the command-line key\n", key_no);
+    memcpy(t->auth_key, t->opt->key, sizeof(t->auth_key));
+    if (t->counter_key_no == key_no) memcpy(t->counter_key, t->opt->key, sizeof(t->counter_key));
     return 1;
 }
 
-static int change_key(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, ssm_session_t *sess,
-                      uint8_t key_no, const uint8_t old_key[16], const uint8_t new_key[16],
-                      uint8_t key_ver, uint16_t *sw_out) {
-    uint8_t key_data[21];
-    for (int i = 0; i < 16; i++) key_data[i] = new_key[i] ^ old_key[i];
-    key_data[16] = key_ver;
-    uint32_t crc = crc32_ieee(new_key, 16);
-    key_data[17] = (uint8_t)(crc & 0xFF);
-    key_data[18] = (uint8_t)((crc >> 8) & 0xFF);
-    key_data[19] = (uint8_t)((crc >> 16) & 0xFF);
-    key_data[20] = (uint8_t)((crc >> 24) & 0xFF);
-
-    uint8_t header = key_no;
-    uint8_t resp[16];
-    size_t resp_len = sizeof(resp);
-    return ssm_cmd_full(card, pio, sess, 0xC4, &header, 1, key_data, sizeof(key_data),
-                        resp, &resp_len, sw_out);
-}
-
-static int change_file_settings_sdm(SCARDHANDLE card, const SCARD_IO_REQUEST *pio, ssm_session_t *sess,
-                                    uint8_t file_no, uint8_t comm_mode,
-                                    uint8_t ar1, uint8_t ar2,
-                                    uint8_t sdm_options,
-                                    uint8_t sdm_meta, uint8_t sdm_file, uint8_t sdm_ctr,
-                                    uint32_t uid_offset,
-                                    uint32_t sdm_read_ctr_offset,
-                                    uint32_t sdm_mac_input_offset,
-                                    uint32_t sdm_mac_offset,
-                                    uint16_t *sw_out) {
-    uint8_t data[64];
-    size_t len = 0;
-
-    uint8_t file_option = (uint8_t)((comm_mode & 0x03) | 0x40); // enable SDM/mirroring
-    data[len++] = file_option;
-    data[len++] = ar1;
-    data[len++] = ar2;
-    data[len++] = sdm_options;
-
-    uint16_t sdm_ar = (uint16_t)(((sdm_meta & 0x0F) << 12) |
-                                 ((sdm_file & 0x0F) << 8) |
-                                 (0x0F << 4) |
-                                 (sdm_ctr & 0x0F));
-    data[len++] = (uint8_t)(sdm_ar & 0xFF);       // LSB first
-    data[len++] = (uint8_t)((sdm_ar >> 8) & 0xFF);
-
-    if ((sdm_options & 0x80) && sdm_meta == 0x0E) {
-        write_u24_le(&data[len], uid_offset);
-        len += 3;
-    }
-
-    if ((sdm_options & 0x40) && sdm_meta == 0x0E) {
-        write_u24_le(&data[len], sdm_read_ctr_offset);
-        len += 3;
-    }
-
-    if (sdm_file != 0x0F) {
-        write_u24_le(&data[len], sdm_mac_input_offset);
-        len += 3;
-    }
-
-    if (sdm_file != 0x0F) {
-        write_u24_le(&data[len], sdm_mac_offset);
-        len += 3;
-    }
-
-    uint8_t header = file_no;
-    uint8_t resp[16];
-    size_t resp_len = sizeof(resp);
-    return ssm_cmd_full(card, pio, sess, 0x5F, &header, 1, data, len, resp, &resp_len, sw_out);
-}
-
-static int get_sdm_read_counter(SCARDHANDLE card, const SCARD_IO_REQUEST *pio,
-                                uint8_t file_no, uint32_t *counter, uint16_t *sw_out) {
-    uint8_t apdu[] = {0x90, 0xF6, 0x00, 0x00, 0x01, file_no, 0x00};
-    uint8_t resp[MAX_APDU];
-    size_t rlen = sizeof(resp);
-    uint16_t sw = 0;
-    LONG rc = transmit(card, pio, apdu, sizeof(apdu), resp, &rlen, &sw);
-    if (sw_out) *sw_out = sw;
-    if (rc != SCARD_S_SUCCESS || !sw_ok(sw) || rlen < 3) return 0;
-    *counter = (uint32_t)resp[0] | ((uint32_t)resp[1] << 8) | ((uint32_t)resp[2] << 16);
-    return 1;
+// Records step in the checkpoint file, dropping the bits in clear.
+static void tag_run_checkpoint(tag_run_t *t, const char *prefix, uint8_t step, uint8_t clear) {
+    if (!t->ckpt_on) return;
+    t->ckpt.steps = (uint8_t)((t->ckpt.steps & ~clear) | step);
+    if (!checkpoint_write(&t->ckpt)) out_printf("%s: failed to write checkpoint\n", prefix);
 }
 
-int main(int argc, char **argv) {
-    LONG rc;
-    SCARDCONTEXT ctx;
-    rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
-    if (rc != SCARD_S_SUCCESS) {
-        fprintf(stderr, "SCardEstablishContext failed: 0x%08lX\n", (unsigned long)rc);
-        return 1;
-    }
+static void print_session_reuse(const char *prefix, const ntag424_session_t *sess) {
+    out_printf("%s: reusing session (KeyNo 0x%02X, CmdCtr %u)\n", prefix,
+               ntag424_session_key_no(sess), ntag424_session_cmd_ctr(sess));
+}
 
-    DWORD readers_len = 0;
-    rc = SCardListReaders(ctx, NULL, NULL, &readers_len);
-    if (rc != SCARD_S_SUCCESS || readers_len == 0) {
-        fprintf(stderr, "No PC/SC readers found.\n");
-        SCardReleaseContext(ctx);
-        return 1;
+// Keeps the run state consistent after a successful ChangeKey: a same-slot
+// change ends the session, and later steps must use the new key.
+static void tag_run_key_changed(tag_run_t *t, uint8_t key_no, const uint8_t new_key[16]) {
+    if (ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == key_no) {
+        ntag424_session_clear(t->sess);
     }
-
-    char *readers = (char *)malloc(readers_len);
-    if (!readers) {
-        fprintf(stderr, "Out of memory.\n");
-        SCardReleaseContext(ctx);
-        return 1;
+    if (key_no == t->opt->key_no) {
+        memcpy(t->auth_key, new_key, sizeof(t->auth_key));
     }
+}
 
-    rc = SCardListReaders(ctx, NULL, readers, &readers_len);
-    if (rc != SCARD_S_SUCCESS || readers[0] == '\0') {
-        fprintf(stderr, "No PC/SC readers found.\n");
-        free(readers);
-        SCardReleaseContext(ctx);
-        return 1;
+// Records a key ChangeKey just installed in the key database, replacing
+// the previous key and the pending record.
+static int tag_run_key_commit(tag_run_t *t, const char *prefix, uint8_t key_no, const uint8_t key[16]) {
+    if (!key_db_put(t->uid, t->uid_len, key_no, key, 0x01)) {
+        out_printf("%s: failed to store key in key database\n", prefix);
+        return 0;
     }
+    out_printf("%s: key (KeyNo 0x%02X) stored in key database\n", prefix, key_no);
+    return 1;
+}
 
-    int index = 0;
-    uint8_t key[16] = {0};
-    uint8_t key_no = 0x00;
-    uint8_t counter_file_no = 0x02;
-    int do_provision = 0;
-    uint8_t new_key_no = 0x01;
-    const char *key_out_path = NULL;
-    const char *provision_key_path = NULL;
-    int do_sdm_setup = 0;
-    uint8_t sdm_key_no = 0x01;
-    const char *sdm_base_url = "https://example.com/tap";
-    int do_rotate_key = 0;
-    uint8_t rotate_key_no = 0x01;
-    const char *rotate_old_key_path = NULL;
-    const char *rotate_new_key_in_path = NULL;
-    const char *rotate_new_key_path = NULL;
+// Records the CC and FileSettings of this tag once both have been read.
+static void tag_run_cache_store(const tag_run_t *t) {
+    const tag_report_t *rep = &t->report;
+    if (!g_tag_cache || !(rep->flags & TAG_HAS_UID) || !(rep->flags & TAG_HAS_CC) || !t->fs_info.valid) return;
+    tag_cache_entry_t e;
+    memset(&e, 0, sizeof(e));
+    e.uid_len = rep->uid_len;
+    memcpy(e.uid, rep->uid, rep->uid_len);
+    e.cc_mapping = rep->cc_mapping;
+    e.cc_read_access = rep->cc_read_access;
+    e.cc_write_access = rep->cc_write_access;
+    e.cc_len = rep->cc_len;
+    e.cc_mle = rep->cc_mle;
+    e.cc_mlc = rep->cc_mlc;
+    e.ndef_file_id = rep->ndef_file_id;
+    e.ndef_file_size = rep->ndef_file_size;
+    e.fs = t->fs_info;
+    tag_cache_store(&e);
+}
 
-    int argi = 1;
-    if (argi < argc && argv[argi][0] != '-') {
-        index = atoi(argv[argi++]);
-    }
-    if (argi < argc && argv[argi][0] != '-') {
-        if (!parse_hex_key(argv[argi], key)) {
-            fprintf(stderr, "Key must be 32 hex chars (AES-128), e.g. 000000... \n");
-            return 2;
+static void tag_run_read_file_settings(tag_run_t *t, const char *fallback_prefix) {
+    uint8_t fs_data[128];
+    size_t fs_len = sizeof(fs_data);
+    uint16_t sw = 0;
+    if (ntag424_session_active(t->sess)) {
+        if (!ntag424_get_file_settings(t->card, t->sess, t->opt->counter_file_no,
+                                       fs_data, &fs_len, &sw)) {
+            ntag424_session_clear(t->sess);
+            out_printf("FileSettings: secure GET failed (SW1SW2=%04X)\n", sw);
+            return;
         }
-        argi++;
-    }
-    if (argi < argc && argv[argi][0] != '-') {
-        key_no = (uint8_t)strtoul(argv[argi++], NULL, 0);
-    }
-    if (argi < argc && argv[argi][0] != '-') {
-        counter_file_no = (uint8_t)strtoul(argv[argi++], NULL, 0);
-    }
-    for (; argi < argc; argi++) {
-        if (strcmp(argv[argi], "--provision") == 0) {
-            do_provision = 1;
-        } else if (strcmp(argv[argi], "--provision-key") == 0 && argi + 1 < argc) {
-            provision_key_path = argv[++argi];
-        } else if (strcmp(argv[argi], "--new-keyno") == 0 && argi + 1 < argc) {
-            new_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
-        } else if (strcmp(argv[argi], "--key-out") == 0 && argi + 1 < argc) {
-            key_out_path = argv[++argi];
-        } else if (strcmp(argv[argi], "--rotate-key") == 0) {
-            do_rotate_key = 1;
-        } else if (strcmp(argv[argi], "--rotate-keyno") == 0 && argi + 1 < argc) {
-            rotate_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
-        } else if (strcmp(argv[argi], "--old-key") == 0 && argi + 1 < argc) {
-            rotate_old_key_path = argv[++argi];
-        } else if (strcmp(argv[argi], "--rotate-new-key") == 0 && argi + 1 < argc) {
-            rotate_new_key_in_path = argv[++argi];
-        } else if (strcmp(argv[argi], "--new-key-out") == 0 && argi + 1 < argc) {
-            rotate_new_key_path = argv[++argi];
-        } else if (strcmp(argv[argi], "--sdm-setup") == 0) {
-            do_sdm_setup = 1;
-        } else if (strcmp(argv[argi], "--sdm-url") == 0 && argi + 1 < argc) {
-            sdm_base_url = argv[++argi];
-        } else if (strcmp(argv[argi], "--sdm-keyno") == 0 && argi + 1 < argc) {
-            sdm_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
-        } else {
-            fprintf(stderr, "Unknown argument: %s\n", argv[argi]);
-            fprintf(stderr, "Usage: %s [reader_index] [auth_key_hex] [auth_key_no] [file_no] "
-                            "[--provision] [--provision-key PATH] [--new-keyno N] [--key-out PATH] "
-                            "[--rotate-key] [--rotate-keyno N] [--old-key PATH] [--rotate-new-key PATH] [--new-key-out PATH] "
-                            "[--sdm-setup] [--sdm-url URL] [--sdm-keyno N]\n", argv[0]);
-            return 2;
+    } else if (!ntag424_get_file_settings(t->card, NULL, t->opt->counter_file_no, fs_data, &fs_len, &sw)) {
+        if (!fallback_prefix) {
+            t->fs_plain_failed = 1;
+            out_printf("FileSettings: GET failed (SW1SW2=%04X)\n", sw);
+            return;
+        }
+        out_printf("FileSettings: GET failed (SW1SW2=%04X), trying secure...\n", sw);
+        int reused = 0;
+        fs_len = sizeof(fs_data);
+        if (!tag_run_session(t, t->auth_key, t->opt->key_no, &reused)) {
+            out_printf("%s: authentication failed.\n", fallback_prefix);
+            return;
+        }
+        if (!ntag424_get_file_settings(t->card, t->sess, t->opt->counter_file_no,
+                                       fs_data, &fs_len, &sw)) {
+            ntag424_session_clear(t->sess);
+            out_printf("FileSettings: secure GET failed (SW1SW2=%04X)\n", sw);
+            return;
         }
     }
-    if (do_provision && do_rotate_key) {
-        fprintf(stderr, "Choose either --provision or --rotate-key (not both).\n");
-        return 2;
+    int parsed = ntag424_parse_file_settings(fs_data, fs_len, &t->fs_info);
+    print_file_settings(&t->fs_info);
+    if (!parsed) {
+        out_printf("FileSettings: parse error\n");
+        return;
     }
+    tag_run_cache_store(t);
+}
 
-    char *p = readers;
-    int i = 0;
-    char *selected = NULL;
-    while (*p) {
-        if (i == index) {
-            selected = p;
-            break;
-        }
-        p += strlen(p) + 1;
-        i++;
-    }
-
-    if (!selected) {
-        fprintf(stderr, "Reader index out of range. Available: 0..%d\n", i - 1);
-        free(readers);
-        SCardReleaseContext(ctx);
-        return 1;
-    }
-
-    printf("Using reader: %s\n", selected);
-
-    SCARDHANDLE card;
-    DWORD activeProtocol = 0;
-    rc = SCardConnect(ctx, selected, SCARD_SHARE_SHARED,
-                      SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card, &activeProtocol);
-    if (rc != SCARD_S_SUCCESS) {
-        fprintf(stderr, "SCardConnect failed: 0x%08lX\n", (unsigned long)rc);
-        free(readers);
-        SCardReleaseContext(ctx);
-        return 1;
-    }
+// Takes CC and FileSettings from the cache when the UID is known. The NDEF
+// application is still selected, as discovery leaves it for later steps.
+// Returns 0 to fall back to full discovery.
+static int tag_run_discover_cached(tag_run_t *t) {
+    tag_report_t *rep = &t->report;
+    tag_cache_entry_t e;
+    uint16_t sw = 0;
+    if (!(rep->flags & TAG_HAS_UID) || !tag_cache_lookup(t->uid, t->uid_len, &e)) return 0;
+    if (!ntag424_select_ndef_app(t->card, &sw)) return 0;
+
+    rep->cc_len = e.cc_len;
+    rep->cc_mapping = e.cc_mapping;
+    rep->cc_mle = e.cc_mle;
+    rep->cc_mlc = e.cc_mlc;
+    rep->ndef_file_id = e.ndef_file_id;
+    rep->ndef_file_size = e.ndef_file_size;
+    rep->cc_read_access = e.cc_read_access;
+    rep->cc_write_access = e.cc_write_access;
+    rep->flags |= TAG_HAS_CC;
+    t->fs_info = e.fs;
+    ntag424_card_set_frame_limits(t->card, e.cc_mle, e.cc_mlc, t->opt->ext_apdu);
+
+    out_printf("NDEF: cached CC (MLe 0x%04X, MLc 0x%04X, NDEF File ID 0x%04X, %u bytes)\n",
+               e.cc_mle, e.cc_mlc, e.ndef_file_id, e.ndef_file_size);
+    print_file_settings(&t->fs_info);
+    return 1;
+}
 
-    SCARD_IO_REQUEST ioReq;
-    if (activeProtocol == SCARD_PROTOCOL_T1) {
-        ioReq = *SCARD_PCI_T1;
+// Sizes multi-APDU reads and writes to the tag's frames and, with --rf-rate,
+// asks the reader for the fastest bit rate both sides support.
+static void tag_run_rf_setup(tag_run_t *t, const uint8_t *ats, size_t ats_len) {
+    ntag424_ats_info_t info;
+    if (!ntag424_parse_ats(ats, ats_len, &info)) {
+        out_printf("  ATS: TL does not match, keeping default frame sizes\n");
+        return;
+    }
+    ntag424_card_set_rf_frames(t->card, &info, 0);
+    out_printf("  FSC: %u bytes, FWI %u, SFGI %u, CID %s, bit rates (kbit/s): 106", info.fsc, info.fwi, info.sfgi,
+               info.cid ? "yes" : "no");
+    for (unsigned bit = 0; bit < 3; bit++) {
+        if ((info.ds & info.dr) & (1u << bit)) out_printf("/%u", 212u << bit);
+    }
+    out_printf("%s\n", info.same_d ? " (same both ways)" : "");
+
+    if (t->opt->rf_divisor <= 1) return;
+    unsigned d = ntag424_ats_max_divisor(&info, t->opt->rf_divisor);
+    if (d == 1) {
+        out_printf("RF: tag supports only 106 kbit/s\n");
+        return;
+    }
+    long rc = 0;
+    if (ntag424_card_set_bit_rate(t->card, d, d, &rc)) {
+        out_printf("RF: switched to %u kbit/s\n", 106u * d);
     } else {
-        ioReq = *SCARD_PCI_T0;
+        out_printf("RF: reader did not take %u kbit/s (0x%08lX), staying at the current rate\n", 106u * d,
+                   (unsigned long)rc);
     }
+}
 
-    uint8_t atr[64];
-    DWORD atr_len = sizeof(atr);
-    DWORD state = 0, proto = 0;
-    char reader_name[256];
-    DWORD rn_len = sizeof(reader_name);
-    rc = SCardStatus(card, reader_name, &rn_len, &state, &proto, atr, &atr_len);
-    if (rc == SCARD_S_SUCCESS) {
-        printf("ATR: ");
-        print_hex(atr, atr_len);
-        printf("\n");
-    }
+static void tag_run_discover(tag_run_t *t) {
+    ntag424_card_t *card = t->card;
+    tag_report_t *rep = &t->report;
 
-    uint8_t uid[16];
-    size_t uid_len = 0;
-    if (get_uid(card, &ioReq, uid, &uid_len)) {
-        printf("UID: ");
-        print_hex(uid, uid_len);
-        printf("\n");
+    uint8_t atr[64];
+    size_t atr_len = sizeof(atr);
+    if (ntag424_card_atr(card, atr, &atr_len)) {
+        out_printf("ATR: ");
+        out_hex(atr, atr_len);
+        out_printf("\n");
+        rep->atr_len = (uint8_t)(atr_len < sizeof(rep->atr) ? atr_len : sizeof(rep->atr));
+        memcpy(rep->atr, atr, rep->atr_len);
+        rep->flags |= TAG_HAS_ATR;
+    }
+
+    if (ntag424_get_uid(card, t->uid, &t->uid_len)) {
+        rep->uid_len = (uint8_t)(t->uid_len < sizeof(rep->uid) ? t->uid_len : sizeof(rep->uid));
+        memcpy(rep->uid, t->uid, rep->uid_len);
+        rep->flags |= TAG_HAS_UID;
+        out_printf("UID: ");
+        out_hex(t->uid, t->uid_len);
+        out_printf("\n");
     } else {
-        printf("UID: (not available via GET DATA)\n");
+        out_printf("UID: (not available via GET DATA)\n");
     }
 
     uint8_t ats[32];
     size_t ats_len = 0;
-    if (get_ats(card, &ioReq, ats, &ats_len)) {
-        printf("ATS: ");
-        print_hex(ats, ats_len);
-        printf("\n");
+    if (ntag424_get_ats(card, ats, &ats_len)) {
+        rep->ats_len = (uint8_t)(ats_len < sizeof(rep->ats) ? ats_len : sizeof(rep->ats));
+        memcpy(rep->ats, ats, rep->ats_len);
+        rep->flags |= TAG_HAS_ATS;
+        out_printf("ATS: ");
+        out_hex(ats, ats_len);
+        out_printf("\n");
+        tag_run_rf_setup(t, ats, ats_len);
     } else {
-        printf("ATS: (not available via GET DATA)\n");
+        out_printf("ATS: (not available via GET DATA)\n");
     }
+    if (tag_run_discover_cached(t)) return;
 
     uint16_t sw = 0;
-    if (!select_ndef_app(card, &ioReq, &sw)) {
-        printf("NDEF: SELECT NDEF app failed (SW1SW2=%04X)\n", sw);
-    } else if (!select_file(card, &ioReq, 0xE103, &sw)) {
-        printf("NDEF: SELECT CC file failed (SW1SW2=%04X)\n", sw);
+    if (!ntag424_select_ndef_app(card, &sw)) {
+        out_printf("NDEF: SELECT NDEF app failed (SW1SW2=%04X)\n", sw);
+    } else if (!ntag424_select_file(card, 0xE103, &sw)) {
+        out_printf("NDEF: SELECT CC file failed (SW1SW2=%04X)\n", sw);
     } else {
         uint8_t cc[32];
         size_t cc_len = sizeof(cc);
-        if (!read_binary(card, &ioReq, 0x0000, 0x0F, cc, &cc_len, &sw) || cc_len < 15) {
-            printf("NDEF: READ CC failed (SW1SW2=%04X)\n", sw);
+        if (!ntag424_read_binary(card, 0x0000, 0x0F, cc, &cc_len, &sw) || cc_len < 15) {
+            out_printf("NDEF: READ CC failed (SW1SW2=%04X)\n", sw);
         } else {
             uint16_t cclen = (uint16_t)((cc[0] << 8) | cc[1]);
             uint8_t mapping = cc[2];
@@ -1200,298 +1485,2177 @@ int main(int argc, char **argv) {
                 write_access = cc[14];
             }
 
-            if (!select_file(card, &ioReq, ndef_file_id, &sw)) {
-                printf("NDEF: SELECT NDEF file failed (SW1SW2=%04X)\n", sw);
+            rep->cc_len = cclen;
+            rep->cc_mapping = mapping;
+            rep->cc_mle = mle;
+            rep->cc_mlc = mlc;
+            rep->ndef_file_id = ndef_file_id;
+            rep->ndef_file_size = ndef_file_size;
+            rep->cc_read_access = read_access;
+            rep->cc_write_access = write_access;
+            rep->flags |= TAG_HAS_CC;
+
+            ntag424_card_set_frame_limits(card, mle, mlc, t->opt->ext_apdu);
+            if (t->opt->ext_apdu) {
+                size_t max_le = 0, max_lc = 0;
+                ntag424_card_frame_limits(card, &max_le, &max_lc);
+                out_printf("NDEF: extended-length APDUs enabled (READ up to %zu, UPDATE up to %zu bytes)\n",
+                           max_le, max_lc);
+            }
+
+            if (!ntag424_select_file(card, ndef_file_id, &sw)) {
+                out_printf("NDEF: SELECT NDEF file failed (SW1SW2=%04X)\n", sw);
             } else {
                 uint8_t nlen_bytes[4];
                 size_t nlen_len = sizeof(nlen_bytes);
-                if (!read_binary(card, &ioReq, 0x0000, 0x02, nlen_bytes, &nlen_len, &sw) || nlen_len < 2) {
-                    printf("NDEF: READ NLEN failed (SW1SW2=%04X)\n", sw);
+                if (!ntag424_read_binary(card, 0x0000, 0x02, nlen_bytes, &nlen_len, &sw) || nlen_len < 2) {
+                    out_printf("NDEF: READ NLEN failed (SW1SW2=%04X)\n", sw);
                 } else {
                     uint16_t nlen = (uint16_t)((nlen_bytes[0] << 8) | nlen_bytes[1]);
-                    uint8_t *ndef = (uint8_t *)calloc(nlen ? nlen : 1, 1);
-                    uint16_t offset = 2;
-                    uint16_t remaining = nlen;
+                    uint8_t *ndef = tag_buf_get(nlen);
                     size_t total = 0;
-                    int ok = 1;
-                    while (remaining > 0) {
-                        uint8_t chunk = remaining > 0xFF ? 0xFF : (uint8_t)remaining;
-                        uint8_t tmp[256];
-                        size_t tmp_len = sizeof(tmp);
-                        if (!read_binary(card, &ioReq, offset, chunk, tmp, &tmp_len, &sw)) {
-                            ok = 0;
-                            break;
-                        }
-                        memcpy(ndef + total, tmp, tmp_len);
-                        total += tmp_len;
-                        offset += (uint16_t)tmp_len;
-                        remaining -= (uint16_t)tmp_len;
-                    }
-
-                    if (!ok) {
-                        printf("NDEF: READ NDEF failed at offset %u (SW1SW2=%04X)\n", offset, sw);
+                    int ok = ndef && ntag424_read_binary_chunked(card, 0x0002, nlen, ndef, &total, &sw);
+                    if (!ndef) {
+                        fprintf(stderr, "Out of memory.\n");
+                    } else if (!ok) {
+                        out_printf("NDEF: READ NDEF failed at offset %zu (SW1SW2=%04X)\n", 2 + total, sw);
                     } else {
-                        printf("NDEF:\n");
-                        printf("  CC length: 0x%04X\n", cclen);
-                        printf("  Mapping version: 0x%02X\n", mapping);
-                        printf("  MLe: 0x%04X\n", mle);
-                        printf("  MLc: 0x%04X\n", mlc);
-                        printf("  NDEF File ID: 0x%04X\n", ndef_file_id);
-                        printf("  NDEF File Size: %u bytes\n", ndef_file_size);
-                        printf("  Read Access: 0x%02X\n", read_access);
-                        printf("  Write Access: 0x%02X\n", write_access);
-                        printf("  NLEN: %u bytes\n", nlen);
-                        printf("  NDEF (hex): ");
-                        print_hex(ndef, total);
-                        printf("\n");
+                        rep->nlen = nlen;
+                        rep->ndef_len = (uint16_t)(total < sizeof(rep->ndef) ? total : sizeof(rep->ndef));
+                        memcpy(rep->ndef, ndef, rep->ndef_len);
+                        rep->flags |= TAG_HAS_NDEF;
+                        out_printf("NDEF:\n");
+                        out_printf("  CC length: 0x%04X\n", cclen);
+                        out_printf("  Mapping version: 0x%02X\n", mapping);
+                        out_printf("  MLe: 0x%04X\n", mle);
+                        out_printf("  MLc: 0x%04X\n", mlc);
+                        out_printf("  NDEF File ID: 0x%04X\n", ndef_file_id);
+                        out_printf("  NDEF File Size: %u bytes\n", ndef_file_size);
+                        out_printf("  Read Access: 0x%02X\n", read_access);
+                        out_printf("  Write Access: 0x%02X\n", write_access);
+                        out_printf("  NLEN: %u bytes\n", nlen);
+                        out_printf("  NDEF (hex): ");
+                        out_hex(ndef, total);
+                        out_printf("\n");
                     }
-                    free(ndef);
+                    if (ndef) tag_buf_put(ndef);
                 }
             }
         }
     }
 
-    file_settings_info_t fs_info;
-    memset(&fs_info, 0, sizeof(fs_info));
-    uint8_t fs_data[128];
-    size_t fs_len = sizeof(fs_data);
-    int fs_plain_failed = 0;
-    uint16_t fs_plain_sw = 0;
-    if (get_file_settings_plain(card, &ioReq, counter_file_no, fs_data, &fs_len, &sw)) {
-        if (!parse_file_settings(fs_data, fs_len, &fs_info)) {
-            printf("FileSettings: parse error\n");
+    tag_run_read_file_settings(t, NULL);
+}
+
+// Picks the provisioning key: --provision-key, derived with --div-key, or
+// random and saved to the key database or a key file before ChangeKey.
+static int provision_new_key(tag_run_t *t, uint8_t new_key[16]) {
+    const tool_options_t *opt = t->opt;
+    char key_out_buf[64] = {0};
+    char tag_key_buf[256] = {0};
+    const char *key_out_path = opt->key_out_path;
+
+    int derived = 0;
+    if (opt->provision_key_path) {
+        if (!read_key_file(opt->provision_key_path, new_key)) {
+            out_printf("Provisioning: failed to read key file: %s\n", opt->provision_key_path);
+            return 0;
         }
+        out_printf("Provisioning: using key from %s (KeyNo 0x%02X)\n", opt->provision_key_path, opt->new_key_no);
+    } else if (opt->diversify) {
+        if (!derive_tag_key(opt, t->uid, t->uid_len, opt->new_key_no, new_key)) {
+            out_printf("Provisioning: key derivation failed\n");
+            return 0;
+        }
+        derived = 1;
+        out_printf("Provisioning: using diversified key (KeyNo 0x%02X)\n", opt->new_key_no);
+    } else if (g_key_db) {
+        if (!random_key("Provisioning", new_key)) return 0;
     } else {
-        fs_plain_failed = 1;
-        fs_plain_sw = sw;
-        printf("FileSettings: GET failed (SW1SW2=%04X)\n", sw);
+        if (!key_out_path) {
+            snprintf(key_out_buf, sizeof(key_out_buf), "ntag424_key%u.hex", opt->new_key_no);
+            key_out_path = key_out_buf;
+        }
+        if (opt->daemon && t->uid_len > 0) {
+            tag_key_path(tag_key_buf, sizeof(tag_key_buf), key_out_path, t->uid, t->uid_len);
+            key_out_path = tag_key_buf;
+        }
+        if (!random_key("Provisioning", new_key)) return 0;
+        if (!write_key_hex_file(key_out_path, new_key)) {
+            out_printf("Provisioning: failed to write key file: %s\n", key_out_path);
+            return 0;
+        }
+        out_printf("Provisioning: new key (KeyNo 0x%02X) written to %s\n", opt->new_key_no, key_out_path);
+    }
+    if (g_key_db && !derived) {
+        if (!key_db_put_pending(t->uid, t->uid_len, opt->new_key_no, new_key, 0x01)) {
+            out_printf("Provisioning: failed to store key in key database\n");
+            return 0;
+        }
+        out_printf("Provisioning: new key (KeyNo 0x%02X) pending in key database\n", opt->new_key_no);
     }
+    return 1;
+}
 
-    uint8_t counter_key[16];
-    memcpy(counter_key, key, sizeof(counter_key));
-    uint8_t counter_key_no = key_no;
+static int tag_run_provision(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
     uint8_t new_key[16];
-    int new_key_set = 0;
-    char key_out_buf[64] = {0};
+    uint16_t sw = 0;
 
-    if (do_provision) {
-        if (new_key_no > 0x0F) {
-            printf("Provisioning: new key number must be 0x00..0x0F\n");
-            goto cleanup;
+    if (opt->new_key_no > 0x0F) {
+        out_printf("Provisioning: new key number must be 0x00..0x0F\n");
+        return 0;
+    }
+    if ((g_key_db || opt->diversify) && t->uid_len == 0) {
+        out_printf("Provisioning: %s needs the tag UID\n", opt->diversify ? "--div-key" : "--key-db");
+        return 0;
+    }
+    if (t->ckpt_on && (t->ckpt.steps & (CKPT_KEY | CKPT_KEY_PENDING)) && t->ckpt.key_no == opt->new_key_no) {
+        // Resume with the key of the earlier attempt. If it is unclear
+        // whether the tag took it, authenticating with it tells.
+        memcpy(new_key, t->ckpt.key, sizeof(new_key));
+        int done = (t->ckpt.steps & CKPT_KEY) != 0;
+        if (!done) {
+            t->auth_count++;
+            done = ntag424_authenticate_ev2_first(t->card, t->sess, new_key, opt->new_key_no);
+            if (done) tag_run_checkpoint(t, "Provisioning", CKPT_KEY, CKPT_KEY_PENDING);
         }
-        if (provision_key_path) {
-            if (!read_key_file(provision_key_path, new_key)) {
-                printf("Provisioning: failed to read key file: %s\n", provision_key_path);
-                goto cleanup;
-            }
-            printf("Provisioning: using key from %s (KeyNo 0x%02X)\n", provision_key_path, new_key_no);
-        } else {
-            if (!key_out_path) {
-                snprintf(key_out_buf, sizeof(key_out_buf), "ntag424_key%u.hex", new_key_no);
-                key_out_path = key_out_buf;
+        if (done) {
+            out_printf("Provisioning: checkpoint: ChangeKey (KeyNo 0x%02X) already done\n", opt->new_key_no);
+            tag_run_key_changed(t, opt->new_key_no, new_key);
+            if (g_key_db && !opt->diversify && !tag_run_key_commit(t, "Provisioning", opt->new_key_no, new_key)) {
+                return 0;
             }
-            random_bytes(new_key, sizeof(new_key));
-            if (!write_key_hex_file(key_out_path, new_key)) {
-                printf("Provisioning: failed to write key file: %s\n", key_out_path);
-                goto cleanup;
-            }
-            printf("Provisioning: new key (KeyNo 0x%02X) written to %s\n", new_key_no, key_out_path);
+            memcpy(t->counter_key, new_key, sizeof(t->counter_key));
+            t->counter_key_no = opt->new_key_no;
+            return 1;
         }
+        out_printf("Provisioning: checkpoint: retrying ChangeKey (KeyNo 0x%02X) with the recorded key\n",
+                   opt->new_key_no);
+    } else if (!provision_new_key(t, new_key)) {
+        return 0;
+    }
 
-        ssm_session_t sess0;
-        memset(&sess0, 0, sizeof(sess0));
-        printf("Provisioning: authenticating with KeyNo 0x%02X for ChangeKey...\n", key_no);
-        if (!authenticate_ev2_first(card, &ioReq, key, key_no, &sess0)) {
-            printf("Provisioning: authentication failed.\n");
-            goto cleanup;
-        }
+    int reused = 0;
+    if (t->reuse_session && ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == opt->key_no) {
+        print_session_reuse("Provisioning", t->sess);
+    } else {
+        out_printf("Provisioning: authenticating with KeyNo 0x%02X for ChangeKey...\n", opt->key_no);
+    }
+    if (!tag_run_session(t, t->auth_key, opt->key_no, &reused)) {
+        out_printf("Provisioning: authentication failed.\n");
+        return 0;
+    }
 
-        uint8_t old_key[16] = {0};
-        if (!change_key(card, &ioReq, &sess0, new_key_no, old_key, new_key, 0x01, &sw)) {
-            printf("Provisioning: ChangeKey failed (SW1SW2=%04X)\n", sw);
-            goto cleanup;
-        }
-        printf("Provisioning: ChangeKey OK (KeyNo 0x%02X)\n", new_key_no);
-        new_key_set = 1;
+    uint8_t old_key[16] = {0};
+    t->ckpt.key_no = opt->new_key_no;
+    memcpy(t->ckpt.key, new_key, sizeof(t->ckpt.key));
+    tag_run_checkpoint(t, "Provisioning", CKPT_KEY_PENDING, CKPT_KEY);
+    if (!ntag424_change_key(t->card, t->sess, opt->new_key_no, old_key, new_key, 0x01, &sw)) {
+        out_printf("Provisioning: ChangeKey failed (SW1SW2=%04X)\n", sw);
+        return 0;
+    }
+    out_printf("Provisioning: ChangeKey OK (KeyNo 0x%02X)\n", opt->new_key_no);
+    tag_run_checkpoint(t, "Provisioning", CKPT_KEY, CKPT_KEY_PENDING);
+    tag_run_key_changed(t, opt->new_key_no, new_key);
+    if (g_key_db && !opt->diversify && !tag_run_key_commit(t, "Provisioning", opt->new_key_no, new_key)) return 0;
+
+    memcpy(t->counter_key, new_key, sizeof(t->counter_key));
+    t->counter_key_no = opt->new_key_no;
+    return 1;
+}
+
+// New key for key_no when no key file was given: derived with --div-key,
+// otherwise random and stored before ChangeKey, pending in the key database
+// or in path (ntag424_key<N>_new.hex by default, UID-suffixed in daemon
+// mode).
+static int tag_run_new_key(tag_run_t *t, const char *prefix, uint8_t key_no, const char *path,
+                           uint8_t key[16]) {
+    const tool_options_t *opt = t->opt;
+    char key_out_buf[64] = {0};
+    char tag_key_buf[256] = {0};
 
-        if (new_key_set) {
-            memcpy(counter_key, new_key, sizeof(counter_key));
-            counter_key_no = new_key_no;
+    if (opt->diversify) {
+        if (!derive_tag_key(opt, t->uid, t->uid_len, key_no, key)) {
+            out_printf("%s: key derivation failed\n", prefix);
+            return 0;
+        }
+        out_printf("%s: using diversified new key (KeyNo 0x%02X)\n", prefix, key_no);
+        return 1;
+    }
+    if (!random_key(prefix, key)) return 0;
+    if (g_key_db) {
+        if (!key_db_put_pending(t->uid, t->uid_len, key_no, key, 0x01)) {
+            out_printf("%s: failed to store key in key database\n", prefix);
+            return 0;
         }
+        out_printf("%s: new key (KeyNo 0x%02X) pending in key database\n", prefix, key_no);
+        return 1;
+    }
+    if (!path) {
+        snprintf(key_out_buf, sizeof(key_out_buf), "ntag424_key%u_new.hex", key_no);
+        path = key_out_buf;
+    }
+    if (opt->daemon && t->uid_len > 0) {
+        tag_key_path(tag_key_buf, sizeof(tag_key_buf), path, t->uid, t->uid_len);
+        path = tag_key_buf;
+    }
+    if (!write_key_hex_file(path, key)) {
+        out_printf("%s: failed to write new key file: %s\n", prefix, path);
+        return 0;
+    }
+    out_printf("%s: new key (KeyNo 0x%02X) written to %s\n", prefix, key_no, path);
+    return 1;
+}
+
+static int tag_run_rotate(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
+    uint16_t sw = 0;
+
+    if (opt->rotate_key_no > 0x0F) {
+        out_printf("Rotate: key number must be 0x00..0x0F\n");
+        return 0;
+    }
+    if ((g_key_db || opt->diversify) && t->uid_len == 0) {
+        out_printf("Rotate: %s needs the tag UID\n", opt->diversify ? "--div-key" : "--key-db");
+        return 0;
     }
 
-    if (do_rotate_key) {
-        if (rotate_key_no > 0x0F) {
-            printf("Rotate: key number must be 0x00..0x0F\n");
-            goto cleanup;
+    uint8_t old_key[16];
+    if (opt->rotate_old_key_path) {
+        if (!read_key_file(opt->rotate_old_key_path, old_key)) {
+            out_printf("Rotate: failed to read old key file: %s\n", opt->rotate_old_key_path);
+            return 0;
+        }
+    } else if (key_db_get(t->uid, t->uid_len, opt->rotate_key_no, old_key)) {
+        out_printf("Rotate: old key (KeyNo 0x%02X) from key database\n", opt->rotate_key_no);
+    } else {
+        out_printf("Rotate: --old-key PATH is required\n");
+        return 0;
+    }
+    // A key left pending by an earlier attempt may be what the tag holds if
+    // that ChangeKey went through but its answer was lost.
+    uint8_t pending_key[16];
+    int has_pending = key_db_get_pending(t->uid, t->uid_len, opt->rotate_key_no, pending_key) &&
+                      memcmp(pending_key, old_key, sizeof(old_key)) != 0;
+    int db_new_key = g_key_db && !opt->diversify;
+
+    uint8_t rotate_new_key[16];
+    if (opt->rotate_new_key_in_path) {
+        if (!read_key_file(opt->rotate_new_key_in_path, rotate_new_key)) {
+            out_printf("Rotate: failed to read new key file: %s\n", opt->rotate_new_key_in_path);
+            return 0;
         }
-        if (!rotate_old_key_path) {
-            printf("Rotate: --old-key PATH is required\n");
-            goto cleanup;
+        out_printf("Rotate: using new key from %s (KeyNo 0x%02X)\n", opt->rotate_new_key_in_path, opt->rotate_key_no);
+        db_new_key = g_key_db != NULL;
+        if (g_key_db) {
+            if (!key_db_put_pending(t->uid, t->uid_len, opt->rotate_key_no, rotate_new_key, 0x01)) {
+                out_printf("Rotate: failed to store key in key database\n");
+                return 0;
+            }
+            out_printf("Rotate: new key (KeyNo 0x%02X) pending in key database\n", opt->rotate_key_no);
         }
+    } else if (!tag_run_new_key(t, "Rotate", opt->rotate_key_no, opt->rotate_new_key_path, rotate_new_key)) {
+        return 0;
+    }
+
+    int reused = 0;
+    if (t->reuse_session && ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == opt->key_no) {
+        print_session_reuse("Rotate", t->sess);
+    } else {
+        out_printf("Rotate: authenticating with KeyNo 0x%02X for ChangeKey...\n", opt->key_no);
+    }
+    if (!tag_run_session(t, t->auth_key, opt->key_no, &reused)) {
+        out_printf("Rotate: authentication failed.\n");
+        return 0;
+    }
+
+    int ok = ntag424_change_key(t->card, t->sess, opt->rotate_key_no, old_key, rotate_new_key, 0x01, &sw);
+    if (!ok && has_pending && opt->rotate_key_no != opt->key_no) {
+        // The error ended the session; a wrong old key fails the tag's CRC
+        // check again, so trying the pending one is safe.
+        out_printf("Rotate: retrying with the pending key (KeyNo 0x%02X) from key database\n", opt->rotate_key_no);
+        ntag424_session_clear(t->sess);
+        ok = tag_run_session(t, t->auth_key, opt->key_no, &reused) &&
+             ntag424_change_key(t->card, t->sess, opt->rotate_key_no, pending_key, rotate_new_key, 0x01, &sw);
+    }
+    memset(pending_key, 0, sizeof(pending_key));
+    if (!ok) {
+        out_printf("Rotate: ChangeKey failed (SW1SW2=%04X)\n", sw);
+        return 0;
+    }
+    out_printf("Rotate: ChangeKey OK (KeyNo 0x%02X)\n", opt->rotate_key_no);
+    tag_run_key_changed(t, opt->rotate_key_no, rotate_new_key);
+    if (db_new_key && !tag_run_key_commit(t, "Rotate", opt->rotate_key_no, rotate_new_key)) return 0;
+
+    if (opt->rotate_key_no == t->counter_key_no) {
+        memcpy(t->counter_key, rotate_new_key, sizeof(t->counter_key));
+    }
+    return 1;
+}
+
+// Rotates every --rotate-plan slot on one authenticated session. The
+// authentication key's own slot goes last because changing it ends the
+// session. With --rotate-journal, a slot left pending by an interrupted
+// batch is retried with its journaled keys. The journal entry is synced
+// before ChangeKey, and a --key-db key is stored after it succeeded, just
+// before the entry is marked done.
+static int tag_run_rotate_plan(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
+    uint16_t sw = 0;
 
-        uint8_t old_key[16];
-        if (!read_key_file(rotate_old_key_path, old_key)) {
-            printf("Rotate: failed to read old key file: %s\n", rotate_old_key_path);
-            goto cleanup;
+    if (t->uid_len == 0 || t->uid_len > 10) {
+        out_printf("Rotate plan: needs the tag UID\n");
+        return 0;
+    }
+
+    uint8_t order[sizeof(opt->rotate_plan)];
+    size_t count = 0;
+    int own_slot = 0;
+    for (size_t i = 0; i < opt->rotate_plan_count; i++) {
+        if (opt->rotate_plan[i] == opt->key_no) {
+            own_slot = 1;
+        } else {
+            order[count++] = opt->rotate_plan[i];
         }
+    }
+    if (own_slot) order[count++] = opt->key_no;
 
-        uint8_t rotate_new_key[16];
-        if (rotate_new_key_in_path) {
-            if (!read_key_file(rotate_new_key_in_path, rotate_new_key)) {
-                printf("Rotate: failed to read new key file: %s\n", rotate_new_key_in_path);
-                goto cleanup;
+    int reused = 0;
+    if (t->reuse_session && ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == opt->key_no) {
+        print_session_reuse("Rotate plan", t->sess);
+    } else {
+        out_printf("Rotate plan: authenticating with KeyNo 0x%02X for %zu ChangeKey(s)...\n", opt->key_no, count);
+    }
+    if (!tag_run_session(t, t->auth_key, opt->key_no, &reused)) {
+        // An interrupted batch may have left the authentication key pending;
+        // whichever of its journaled keys works is the one the tag holds.
+        rotate_journal_entry_t e;
+        int ok = 0;
+        if (own_slot && rotate_journal_find(t->uid, t->uid_len, opt->key_no, &e) && !e.done) {
+            const uint8_t *candidates[2] = {e.old_key, e.new_key};
+            for (size_t i = 0; i < 2 && !ok; i++) {
+                if (memcmp(candidates[i], t->auth_key, sizeof(t->auth_key)) == 0) continue;
+                t->auth_count++;
+                ok = ntag424_authenticate_ev2_first(t->card, t->sess, candidates[i], opt->key_no);
+                if (ok) memcpy(t->auth_key, candidates[i], sizeof(t->auth_key));
+            }
+            if (ok && memcmp(t->auth_key, e.new_key, sizeof(t->auth_key)) == 0) {
+                // The last step already went through, so the batch is complete.
+                out_printf("Rotate plan: KeyNo 0x%02X was already rotated\n", opt->key_no);
+                ntag424_session_clear(t->sess);
+                if (g_key_db && !opt->diversify && !tag_run_key_commit(t, "Rotate plan", opt->key_no, e.new_key)) {
+                    return 0;
+                }
+                e.done = 1;
+                if (!rotate_journal_write(&e)) out_printf("Rotate plan: failed to write journal\n");
+                if (opt->key_no == t->counter_key_no) memcpy(t->counter_key, e.new_key, sizeof(t->counter_key));
+                return 1;
             }
-            printf("Rotate: using new key from %s (KeyNo 0x%02X)\n", rotate_new_key_in_path, rotate_key_no);
+        }
+        if (!ok) {
+            out_printf("Rotate plan: authentication failed.\n");
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t key_no = order[i];
+        rotate_journal_entry_t e;
+        int resumed = rotate_journal_find(t->uid, t->uid_len, key_no, &e);
+        if (resumed && e.done) {
+            out_printf("Rotate plan: KeyNo 0x%02X already rotated\n", key_no);
+            continue;
+        }
+        if (resumed) {
+            out_printf("Rotate plan: resuming KeyNo 0x%02X from journal\n", key_no);
         } else {
-            if (!rotate_new_key_path) {
-                snprintf(key_out_buf, sizeof(key_out_buf), "ntag424_key%u_new.hex", rotate_key_no);
-                rotate_new_key_path = key_out_buf;
+            memset(&e, 0, sizeof(e));
+            e.uid_len = (uint8_t)t->uid_len;
+            memcpy(e.uid, t->uid, t->uid_len);
+            e.key_no = key_no;
+            if (key_no == opt->key_no) {
+                memcpy(e.old_key, t->auth_key, sizeof(e.old_key));
+            } else if (opt->rotate_old_key_path) {
+                if (!read_key_file(opt->rotate_old_key_path, e.old_key)) {
+                    out_printf("Rotate plan: failed to read old key file: %s\n", opt->rotate_old_key_path);
+                    return 0;
+                }
+            } else if (key_db_get(t->uid, t->uid_len, key_no, e.old_key)) {
+                out_printf("Rotate plan: old key (KeyNo 0x%02X) from key database\n", key_no);
+            } else {
+                out_printf("Rotate plan: --old-key PATH is required for KeyNo 0x%02X\n", key_no);
+                return 0;
             }
-            random_bytes(rotate_new_key, sizeof(rotate_new_key));
-            if (!write_key_hex_file(rotate_new_key_path, rotate_new_key)) {
-                printf("Rotate: failed to write new key file: %s\n", rotate_new_key_path);
-                goto cleanup;
+            if (g_rotate_journal && g_key_db && !opt->diversify) {
+                // The journal entry holds both keys and is the pending record;
+                // the database only learns the key once the tag has it.
+                if (!random_key("Rotate plan", e.new_key)) return 0;
+            } else if (!tag_run_new_key(t, "Rotate plan", key_no, NULL, e.new_key)) {
+                return 0;
+            }
+            if (!rotate_journal_write(&e)) {
+                out_printf("Rotate plan: failed to write journal\n");
+                return 0;
             }
-            printf("Rotate: new key (KeyNo 0x%02X) written to %s\n", rotate_key_no, rotate_new_key_path);
         }
 
-        ssm_session_t sess0;
-        memset(&sess0, 0, sizeof(sess0));
-        printf("Rotate: authenticating with KeyNo 0x%02X for ChangeKey...\n", key_no);
-        if (!authenticate_ev2_first(card, &ioReq, key, key_no, &sess0)) {
-            printf("Rotate: authentication failed.\n");
-            goto cleanup;
+        int ok = ntag424_change_key(t->card, t->sess, key_no, e.old_key, e.new_key, 0x01, &sw);
+        if (!ok && resumed && key_no != opt->key_no) {
+            // The interrupted batch may have applied this change already. The
+            // error ended the session; NewKey -> NewKey then only passes the
+            // tag's CRC check if it holds NewKey.
+            ntag424_session_clear(t->sess);
+            ok = tag_run_session(t, t->auth_key, opt->key_no, &reused) &&
+                 ntag424_change_key(t->card, t->sess, key_no, e.new_key, e.new_key, 0x01, &sw);
         }
-
-        if (!change_key(card, &ioReq, &sess0, rotate_key_no, old_key, rotate_new_key, 0x01, &sw)) {
-            printf("Rotate: ChangeKey failed (SW1SW2=%04X)\n", sw);
-            goto cleanup;
+        if (!ok) {
+            out_printf("Rotate plan: ChangeKey failed (KeyNo 0x%02X, SW1SW2=%04X)\n", key_no, sw);
+            return 0;
         }
-        printf("Rotate: ChangeKey OK (KeyNo 0x%02X)\n", rotate_key_no);
-
-        if (rotate_key_no == counter_key_no) {
-            memcpy(counter_key, rotate_new_key, sizeof(counter_key));
+        out_printf("Rotate plan: ChangeKey OK (KeyNo 0x%02X)\n", key_no);
+        tag_run_key_changed(t, key_no, e.new_key);
+        if (g_key_db && !opt->diversify && !tag_run_key_commit(t, "Rotate plan", key_no, e.new_key)) return 0;
+        if (key_no == t->counter_key_no) {
+            memcpy(t->counter_key, e.new_key, sizeof(t->counter_key));
+        }
+        e.done = 1;
+        if (!rotate_journal_write(&e)) {
+            out_printf("Rotate plan: failed to write journal\n");
+            return 0;
         }
     }
+    return 1;
+}
 
-    if (do_sdm_setup) {
-        if (sdm_key_no > 0x0F) {
-            printf("SDM setup: SDM key number must be 0x00..0x0F\n");
-            goto cleanup;
-        }
+// SDM setup. The plain ISO NDEF write re-selects the file, which drops any
+// secure session, so with session reuse the template is written first and
+// ChangeFileSettings then runs on the session later steps can keep using.
+static int tag_run_sdm_setup(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
+    uint16_t sw = 0;
 
-        sdm_ndef_t sdm;
-        if (!build_sdm_ndef(sdm_base_url, &sdm)) {
-            printf("SDM setup: failed to build NDEF from base URL: %s\n", sdm_base_url);
-            goto cleanup;
-        }
+    if (opt->sdm_key_no > 0x0F) {
+        out_printf("SDM setup: SDM key number must be 0x00..0x0F\n");
+        return 0;
+    }
+
+    uint8_t ndef_buf[NTAG424_SDM_NDEF_MAX];
+    ntag424_sdm_ndef_t sdm;
+    if (!ntag424_sdm_build_ndef(opt->sdm_base_url, &opt->sdm_tpl, ndef_buf, sizeof(ndef_buf), &sdm)) {
+        out_printf("SDM setup: failed to build NDEF from base URL: %s\n", opt->sdm_base_url);
+        return 0;
+    }
+
+    out_printf("SDM URL template: %s%.*s\n", sdm.url_prefix, (int)sdm.uri_len, sdm.uri);
+    out_printf("SDM offsets: UID=0x%06X CTR=0x%06X MACInput=0x%06X MAC=0x%06X",
+           sdm.uid_offset, sdm.ctr_offset, sdm.mac_input_offset, sdm.mac_offset);
+    if (sdm.fields & (1u << NTAG424_SDM_FIELD_PICC)) out_printf(" PICC=0x%06X", sdm.picc_offset);
+    if (sdm.fields & (1u << NTAG424_SDM_FIELD_ENC)) out_printf(" ENC=0x%06X", sdm.enc_offset);
+    out_printf("\n");
+    int enc = (sdm.fields & (1u << NTAG424_SDM_FIELD_ENC)) != 0;
+    if (enc && opt->sdm_enc_data) {
+        // The tag encrypts the first half of the window; the rest stays '0'.
+        memcpy(ndef_buf + sdm.enc_offset, opt->sdm_enc_data, strlen(opt->sdm_enc_data));
+    }
+
+    int picc = (sdm.fields & (1u << NTAG424_SDM_FIELD_PICC)) != 0;
+    if (picc && opt->sdm_key_no > 0x04) {
+        out_printf("SDM setup: encrypted PICCData needs an SDM key number 0x00..0x04\n");
+        return 0;
+    }
 
-        printf("SDM URL template: %s\n", sdm.url);
-        printf("SDM offsets: UID=0x%06X CTR=0x%06X MACInput=0x%06X MAC=0x%06X\n",
-               sdm.uid_offset, sdm.ctr_offset, sdm.mac_input_offset, sdm.mac_offset);
+    ntag424_sdm_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.file_no = opt->counter_file_no;
+    cfg.comm_mode = 0x00;
+    cfg.ar1 = t->fs_info.valid ? t->fs_info.ar1 : 0xE0;
+    cfg.ar2 = t->fs_info.valid ? t->fs_info.ar2 : 0xEE;
+    // ASCII mode; UID and ReadCtr are mirrored in plain or inside PICCData.
+    cfg.sdm_options = 0x01;
+    if (picc || (sdm.fields & (1u << NTAG424_SDM_FIELD_UID))) cfg.sdm_options |= 0x80;
+    if (picc || (sdm.fields & (1u << NTAG424_SDM_FIELD_CTR))) cfg.sdm_options |= 0x40;
+    if (enc) cfg.sdm_options |= 0x10;
+    cfg.sdm_meta_read = picc ? opt->sdm_key_no : 0x0E;
+    cfg.sdm_file_read = opt->sdm_key_no;
+    cfg.sdm_ctr_ret = opt->sdm_key_no;
+    cfg.uid_offset = sdm.uid_offset;
+    cfg.sdm_read_ctr_offset = sdm.ctr_offset;
+    cfg.picc_data_offset = sdm.picc_offset;
+    cfg.sdm_mac_input_offset = sdm.mac_input_offset;
+    cfg.sdm_enc_offset = enc ? sdm.enc_offset : 0;
+    cfg.sdm_enc_length = enc ? NTAG424_SDM_ENC_LEN_ASCII : 0;
+    cfg.sdm_mac_offset = sdm.mac_offset;
+
+    // With --checkpoint, steps already recorded for this exact configuration
+    // are skipped.
+    uint8_t digest[CKPT_SETTINGS_LEN];
+    uint32_t offsets[5] = {cfg.uid_offset, cfg.sdm_read_ctr_offset, cfg.picc_data_offset,
+                           cfg.sdm_mac_input_offset, cfg.sdm_mac_offset};
+    uint16_t sdm_ar = (uint16_t)((cfg.sdm_meta_read << 12) | (cfg.sdm_file_read << 8) | 0x00F0 | cfg.sdm_ctr_ret);
+    sdm_settings_digest(cfg.file_no, cfg.sdm_options, sdm_ar, offsets, digest);
+    uint32_t hash = ndef_hash(sdm.ndef, sdm.ndef_len);
+    int settings_done = t->ckpt_on && (t->ckpt.steps & CKPT_SETTINGS) &&
+                        memcmp(t->ckpt.settings, digest, sizeof(digest)) == 0;
+    int ndef_done = t->ckpt_on && (t->ckpt.steps & CKPT_NDEF) && t->ckpt.ndef_len == sdm.ndef_len &&
+                    t->ckpt.ndef_hash == hash;
+    if (settings_done && ndef_done && (t->ckpt.steps & CKPT_VERIFIED)) {
+        out_printf("SDM setup: checkpoint: settings, NDEF template and verification already done\n");
+        return 1;
+    }
+    if (settings_done) out_printf("SDM setup: checkpoint: ChangeFileSettings already done\n");
+    if (ndef_done) out_printf("SDM setup: checkpoint: NDEF template already written\n");
 
-        ssm_session_t sess_cfg;
-        memset(&sess_cfg, 0, sizeof(sess_cfg));
-        printf("SDM setup: authenticating with KeyNo 0x%02X for ChangeFileSettings...\n", key_no);
-        if (!authenticate_ev2_first(card, &ioReq, key, key_no, &sess_cfg)) {
-            printf("SDM setup: authentication failed.\n");
-            free(sdm.ndef);
-            goto cleanup;
+    int ndef_first = t->reuse_session;
+    if (ndef_first && !ndef_done) {
+        if (!ntag424_write_ndef(t->card, sdm.ndef, sdm.ndef_len, &sw)) {
+            out_printf("SDM setup: write NDEF failed (SW1SW2=%04X)\n", sw);
+            return 0;
+        }
+        ntag424_session_clear(t->sess);
+        out_printf("SDM setup: NDEF template written (%zu bytes)\n", sdm.ndef_len);
+        t->ckpt.ndef_len = (uint16_t)sdm.ndef_len;
+        t->ckpt.ndef_hash = hash;
+        tag_run_checkpoint(t, "SDM setup", CKPT_NDEF, CKPT_VERIFIED);
+    }
+
+    if (!settings_done) {
+        int reused = 0;
+        out_printf("SDM setup: authenticating with KeyNo 0x%02X for ChangeFileSettings...\n", opt->key_no);
+        if (!tag_run_session(t, t->auth_key, opt->key_no, &reused)) {
+            out_printf("SDM setup: authentication failed.\n");
+            return 0;
+        }
+        if (!ntag424_change_file_settings_sdm(t->card, t->sess, &cfg, &sw)) {
+            out_printf("SDM setup: ChangeFileSettings failed (SW1SW2=%04X)\n", sw);
+            return 0;
         }
+        out_printf("SDM setup: ChangeFileSettings OK\n");
+        tag_cache_invalidate(t->uid, t->uid_len);
+        memcpy(t->ckpt.settings, digest, sizeof(digest));
+        tag_run_checkpoint(t, "SDM setup", CKPT_SETTINGS, CKPT_VERIFIED);
+    }
 
-        uint8_t ar1 = fs_info.valid ? fs_info.ar1 : 0xE0;
-        uint8_t ar2 = fs_info.valid ? fs_info.ar2 : 0xEE;
-        uint8_t sdm_options = 0xC1; // UID+ReadCtr mirroring, ASCII mode
-        uint8_t sdm_meta = 0x0E;    // plain meta
-        uint8_t sdm_file = sdm_key_no;
-        uint8_t sdm_ctr = sdm_key_no;
-        if (!change_file_settings_sdm(card, &ioReq, &sess_cfg, counter_file_no, 0x00,
-                                      ar1, ar2, sdm_options,
-                                      sdm_meta, sdm_file, sdm_ctr,
-                                      sdm.uid_offset, sdm.ctr_offset,
-                                      sdm.mac_input_offset, sdm.mac_offset,
-                                      &sw)) {
-            printf("SDM setup: ChangeFileSettings failed (SW1SW2=%04X)\n", sw);
-            free(sdm.ndef);
-            goto cleanup;
+    if (!ndef_first && !ndef_done) {
+        if (!ntag424_write_ndef(t->card, sdm.ndef, sdm.ndef_len, &sw)) {
+            out_printf("SDM setup: write NDEF failed (SW1SW2=%04X)\n", sw);
+            return 0;
+        }
+        ntag424_session_clear(t->sess);
+        out_printf("SDM setup: NDEF template written (%zu bytes)\n", sdm.ndef_len);
+        t->ckpt.ndef_len = (uint16_t)sdm.ndef_len;
+        t->ckpt.ndef_hash = hash;
+        tag_run_checkpoint(t, "SDM setup", CKPT_NDEF, CKPT_VERIFIED);
+    }
+
+    tag_run_read_file_settings(t, "SDM setup");
+    if (t->ckpt_on) {
+        // The read-back is the verification step: a tag that does not show
+        // the settings gets ChangeFileSettings again on the next attempt.
+        const ntag424_file_settings_t *fs = &t->fs_info;
+        uint8_t seen[CKPT_SETTINGS_LEN];
+        uint32_t fs_offsets[5] = {fs->uid_offset, fs->sdm_read_ctr_offset, fs->picc_data_offset,
+                                  fs->sdm_mac_input_offset, fs->sdm_mac_offset};
+        sdm_settings_digest(cfg.file_no, fs->sdm_options, fs->sdm_ar, fs_offsets, seen);
+        if (!fs->valid || !fs->sdm_enabled || memcmp(seen, digest, sizeof(digest)) != 0) {
+            out_printf("SDM setup: FileSettings read back do not match the applied settings\n");
+            tag_run_checkpoint(t, "SDM setup", 0, CKPT_SETTINGS | CKPT_VERIFIED);
+            return 0;
         }
-        printf("SDM setup: ChangeFileSettings OK\n");
+        out_printf("SDM setup: FileSettings verified\n");
+        tag_run_checkpoint(t, "SDM setup", CKPT_VERIFIED, 0);
+    }
+    return 1;
+}
+
+// Key for an SDM key number: the key database, the keys this run knows
+// (the one provisioned into the counter slot, the auth key), the
+// diversification master and finally --sdm-key.
+static int tag_run_sdm_key(tag_run_t *t, uint8_t key_no, uint8_t key[16]) {
+    const tool_options_t *opt = t->opt;
+    if (key_db_get(t->uid, t->uid_len, key_no, key)) return 1;
+    if (key_no == t->counter_key_no) {
+        memcpy(key, t->counter_key, 16);
+        return 1;
+    }
+    if (key_no == opt->key_no) {
+        memcpy(key, t->auth_key, 16);
+        return 1;
+    }
+    if (derive_tag_key(opt, t->uid, t->uid_len, key_no, key)) return 1;
+    if (opt->has_sdm_file_key) {
+        memcpy(key, opt->sdm_file_key, 16);
+        return 1;
+    }
+    return 0;
+}
+
+// Simulated tap (--sdm-verify): reads the SDM file back from offset 0 the
+// way a phone does, which bumps SDMReadCtr and fills the mirrors, then
+// checks the mirrored MAC on the host against the SDM file read key. Uses the
+// FileSettings read by discovery or SDM setup for the offsets.
+static int tag_run_sdm_verify(tag_run_t *t) {
+    const ntag424_file_settings_t *fs = &t->fs_info;
+    uint16_t sw = 0;
+
+    if (!fs->valid || !fs->sdm_enabled || !(fs->present & NTAG424_FS_HAS_MAC_OFFSET)) {
+        out_printf("SDM verify: no SDM MAC configured on FileNo 0x%02X\n", t->opt->counter_file_no);
+        return 0;
+    }
+    uint8_t file_key[16], meta_key[16];
+    int picc = fs->sdm_meta_read <= 0x04;
+    if (fs->sdm_file_read > 0x04 || !tag_run_sdm_key(t, fs->sdm_file_read, file_key) ||
+        (picc && !tag_run_sdm_key(t, fs->sdm_meta_read, meta_key))) {
+        out_printf("SDM verify: no key for SDMFileRead 0x%X%s; pass --sdm-key PATH\n", fs->sdm_file_read,
+                   picc ? " / SDMMetaRead" : "");
+        return 0;
+    }
+
+    uint8_t image[NTAG424_SDM_NDEF_MAX];
+    size_t need = fs->sdm_mac_offset + NTAG424_SDM_MAC_LEN_ASCII;
+    size_t total = 0;
+    if (need > sizeof(image)) {
+        out_printf("SDM verify: MAC offset 0x%06X is outside the NDEF file\n", fs->sdm_mac_offset);
+        return 0;
+    }
+    uint16_t file_id = (t->report.flags & TAG_HAS_CC) ? t->report.ndef_file_id : 0xE104;
+    ntag424_session_clear(t->sess);
+    if (!ntag424_select_ndef_app(t->card, &sw) || !ntag424_select_file(t->card, file_id, &sw) ||
+        !ntag424_read_binary_chunked(t->card, 0x0000, need, image, &total, &sw)) {
+        out_printf("SDM verify: reading the NDEF file failed (SW1SW2=%04X)\n", sw);
+        return 0;
+    }
+
+    // PICCData is left to the verifier, which decrypts it the way
+    // --verify-urls does for a batch of taps.
+    ntag424_sdm_tap_t tap;
+    if (!ntag424_sdm_parse_file(image, total, fs, NULL, &tap)) {
+        out_printf("SDM verify: mirrors at the SDM offsets do not parse\n");
+        t->report.flags |= TAG_HAS_SDM_VERIFY;
+        return 0;
+    }
+    ntag424_sdm_verifier_t *verifier = ntag424_sdm_verifier_new(file_key);
+    int ok = verifier && (!picc || ntag424_sdm_verifier_set_meta_key(verifier, meta_key));
+    memset(file_key, 0, sizeof(file_key));
+    memset(meta_key, 0, sizeof(meta_key));
+    if (!ok) {
+        ntag424_sdm_verifier_free(verifier);
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    ntag424_sdm_verify(verifier, &tap, 1);
+    ntag424_sdm_verifier_free(verifier);
+    if (!tap.valid) {
+        out_printf("SDM verify: PICCData does not decrypt with the SDMMetaRead key\n");
+        t->report.flags |= TAG_HAS_SDM_VERIFY;
+        return 0;
+    }
+
+    // A mirrored UID must also be this tag's own.
+    int with_uid = (tap.fields & (1u << NTAG424_SDM_FIELD_UID)) != 0;
+    if (with_uid && t->uid_len == sizeof(tap.uid) && memcmp(tap.uid, t->uid, sizeof(tap.uid)) != 0) tap.match = 0;
+    out_printf("SDM verify:");
+    if (with_uid) {
+        out_printf(" UID ");
+        out_hex(tap.uid, sizeof(tap.uid));
+        out_printf(",");
+    }
+    if (tap.fields & (1u << NTAG424_SDM_FIELD_CTR)) {
+        uint32_t ctr = (uint32_t)tap.ctr_le[0] | ((uint32_t)tap.ctr_le[1] << 8) | ((uint32_t)tap.ctr_le[2] << 16);
+        out_printf(" SDMReadCtr %u,", ctr);
+    }
+    out_printf(" MAC ");
+    out_hex(tap.mac, sizeof(tap.mac));
+    out_printf(tap.match ? " OK\n" : " MISMATCH\n");
+    if (tap.match && tap.enc) {
+        out_printf("SDM verify: SDMENCFileData ");
+        out_hex(tap.enc_data, sizeof(tap.enc_data));
+        out_printf("\n");
+    }
+    t->report.flags |= TAG_HAS_SDM_VERIFY | (tap.match ? TAG_SDM_MAC_OK : 0);
+    return tap.match;
+}
+
+static const char *comm_mode_name(uint8_t comm_mode) {
+    return comm_mode == 0x03 ? "Full" : comm_mode == 0x01 ? "MAC" : "Plain";
+}
+
+// WriteData / ReadData on --data-file (default the proprietary file 0x03) in
+// the CommMode its FileSettings ask for. A free access condition means plain
+// access; otherwise the step authenticates with the Write (Read) or RW key.
+static int tag_run_data(tag_run_t *t, int write) {
+    const tool_options_t *opt = t->opt;
+    const char *prefix = write ? "WriteData" : "ReadData";
+    uint8_t file_no = opt->data_file_no;
+    uint16_t sw = 0;
+
+    uint8_t fs_data[128];
+    size_t fs_len = sizeof(fs_data);
+    ntag424_file_settings_t fs;
+    int live = ntag424_session_active(t->sess);
+    if (!live && !ntag424_select_ndef_app(t->card, &sw)) {
+        out_printf("%s: SELECT failed (SW1SW2=%04X)\n", prefix, sw);
+        return 0;
+    }
+    if (!ntag424_get_file_settings(t->card, live ? t->sess : NULL, file_no, fs_data, &fs_len, &sw) ||
+        !ntag424_parse_file_settings(fs_data, fs_len, &fs)) {
+        if (live) ntag424_session_clear(t->sess);
+        out_printf("%s: FileSettings of FileNo 0x%02X unavailable (SW1SW2=%04X)\n", prefix, file_no, sw);
+        return 0;
+    }
 
-        if (!write_ndef_file_plain(card, &ioReq, sdm.ndef, sdm.ndef_len, &sw)) {
-            printf("SDM setup: write NDEF failed (SW1SW2=%04X)\n", sw);
-            free(sdm.ndef);
-            goto cleanup;
+    uint8_t rw = (uint8_t)(fs.ar1 >> 4);
+    uint8_t cond = write ? (uint8_t)(fs.ar2 & 0x0F) : (uint8_t)(fs.ar2 >> 4);
+    uint8_t comm_mode = 0x00;
+    if (rw != 0x0E && cond != 0x0E) {
+        uint8_t key_no = cond <= 0x04 ? cond : rw;
+        uint8_t key[16];
+        if (key_no > 0x04 || !tag_run_sdm_key(t, key_no, key)) {
+            out_printf("%s: no key for KeyNo 0x%X on FileNo 0x%02X; pass --sdm-key PATH\n", prefix, key_no, file_no);
+            return 0;
+        }
+        int reused = 0;
+        int authed = tag_run_session(t, key, key_no, &reused);
+        memset(key, 0, sizeof(key));
+        if (!authed) {
+            out_printf("%s: authentication with KeyNo 0x%02X failed.\n", prefix, key_no);
+            return 0;
         }
-        printf("SDM setup: NDEF template written (%zu bytes)\n", sdm.ndef_len);
-        free(sdm.ndef);
+        if (reused) print_session_reuse(prefix, t->sess);
+        comm_mode = (fs.file_option & 0x03) == 0x02 ? 0x00 : (uint8_t)(fs.file_option & 0x03);
+    }
 
-        fs_len = sizeof(fs_data);
-        if (get_file_settings_plain(card, &ioReq, counter_file_no, fs_data, &fs_len, &sw)) {
-            if (!parse_file_settings(fs_data, fs_len, &fs_info)) {
-                printf("FileSettings: parse error\n");
-            }
-        } else {
-            printf("FileSettings: GET failed (SW1SW2=%04X), trying secure...\n", sw);
-            fs_len = sizeof(fs_data);
-            if (get_file_settings_secure(card, &ioReq, &sess_cfg, counter_file_no, fs_data, &fs_len, &sw)) {
-                if (!parse_file_settings(fs_data, fs_len, &fs_info)) {
-                    printf("FileSettings: parse error\n");
-                }
-            } else {
-                printf("FileSettings: secure GET failed (SW1SW2=%04X)\n", sw);
-            }
+    if (write) {
+        if (opt->write_data_len > fs.file_size) {
+            out_printf("%s: %zu bytes do not fit FileNo 0x%02X (%u bytes)\n", prefix, opt->write_data_len, file_no,
+                       (unsigned)fs.file_size);
+            return 0;
         }
+        if (!ntag424_write_data(t->card, t->sess, comm_mode, file_no, 0, opt->write_data, opt->write_data_len, &sw)) {
+            ntag424_session_clear(t->sess);
+            out_printf("%s: failed (SW1SW2=%04X)\n", prefix, sw);
+            return 0;
+        }
+        out_printf("%s: %zu bytes to FileNo 0x%02X (CommMode %s)\n", prefix, opt->write_data_len, file_no,
+                   comm_mode_name(comm_mode));
+        return 1;
     }
 
-    uint32_t counter = 0;
-    if (get_sdm_read_counter(card, &ioReq, counter_file_no, &counter, &sw)) {
-        printf("SDM Read Counter (plain, FileNo 0x%02X): %u\n", counter_file_no, counter);
+    uint8_t *buf = tag_buf_get(fs.file_size);
+    if (!buf) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    size_t len = fs.file_size;
+    int ok = ntag424_read_data(t->card, t->sess, comm_mode, file_no, 0, 0, buf, &len, &sw);
+    if (ok) {
+        out_printf("%s: FileNo 0x%02X (CommMode %s, %zu bytes): ", prefix, file_no, comm_mode_name(comm_mode), len);
+        out_hex(buf, len);
+        out_printf("\n");
     } else {
-        printf("SDM Read Counter (plain): unavailable (SW1SW2=%04X)\n", sw);
+        ntag424_session_clear(t->sess);
+        out_printf("%s: failed (SW1SW2=%04X)\n", prefix, sw);
     }
+    memset(buf, 0, fs.file_size);
+    tag_buf_put(buf);
+    return ok;
+}
 
-    ssm_session_t sess;
-    memset(&sess, 0, sizeof(sess));
-    printf("Authenticating (EV2First) with KeyNo 0x%02X...\n", counter_key_no);
-    if (!authenticate_ev2_first(card, &ioReq, counter_key, counter_key_no, &sess)) {
-        printf("Authentication failed.\n");
-    } else {
-        printf("Authentication OK. TI: ");
-        print_hex(sess.ti, 4);
-        printf("\n");
-
-        if (fs_plain_failed) {
-            printf("FileSettings: retrying with secure messaging...\n");
-            fs_len = sizeof(fs_data);
-            if (get_file_settings_secure(card, &ioReq, &sess, counter_file_no, fs_data, &fs_len, &sw)) {
-                if (!parse_file_settings(fs_data, fs_len, &fs_info)) {
-                    printf("FileSettings: parse error\n");
-                }
-            } else {
-                printf("FileSettings: secure GET failed (SW1SW2=%04X)\n", sw);
-            }
-        }
+// Reads the SDM read counter, plain first and then over secure messaging with
+// the SDM key. The plain read is skipped while a session is live, since an
+// unsecured command would end it.
+static void tag_run_counter(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
+    uint16_t sw = 0;
 
-        uint8_t header = counter_file_no;
-        uint8_t resp[16];
-        size_t resp_len = sizeof(resp);
-        uint16_t sw2 = 0;
-        if (ssm_cmd_full(card, &ioReq, &sess, 0xF6, &header, 1, NULL, 0, resp, &resp_len, &sw2)) {
-            if (resp_len >= 3) {
-                uint32_t c = (uint32_t)resp[0] | ((uint32_t)resp[1] << 8) | ((uint32_t)resp[2] << 16);
-                printf("SDM Read Counter (secure, FileNo 0x%02X): %u\n", counter_file_no, c);
-            } else {
-                printf("SDM Read Counter (secure): response too short (%zu bytes)\n", resp_len);
-            }
+    if (!ntag424_session_active(t->sess)) {
+        uint32_t counter = 0;
+        if (ntag424_get_sdm_read_counter(t->card, NULL, opt->counter_file_no, &counter, &sw)) {
+            t->report.ctr_plain = counter;
+            t->report.flags |= TAG_HAS_CTR_PLAIN;
+            out_printf("SDM Read Counter (plain, FileNo 0x%02X): %u\n", opt->counter_file_no, counter);
         } else {
-            printf("SDM Read Counter (secure): failed (SW1SW2=%04X)\n", sw2);
+            out_printf("SDM Read Counter (plain): unavailable (SW1SW2=%04X)\n", sw);
         }
     }
 
-cleanup:
-    SCardDisconnect(card, SCARD_LEAVE_CARD);
-    free(readers);
-    SCardReleaseContext(ctx);
-    return 0;
+    int reused = 0;
+    if (t->reuse_session && ntag424_session_active(t->sess) && ntag424_session_key_no(t->sess) == t->counter_key_no) {
+        print_session_reuse("Counter", t->sess);
+    } else {
+        out_printf("Authenticating (EV2First) with KeyNo 0x%02X...\n", t->counter_key_no);
+    }
+    if (!tag_run_session(t, t->counter_key, t->counter_key_no, &reused)) {
+        out_printf("Authentication failed.\n");
+        return;
+    }
+    if (!reused) {
+        out_printf("Authentication OK. TI: ");
+        out_hex(ntag424_session_ti(t->sess), 4);
+        out_printf("\n");
+    }
+
+    if (t->fs_plain_failed) {
+        out_printf("FileSettings: retrying with secure messaging...\n");
+        tag_run_read_file_settings(t, NULL);
+        t->fs_plain_failed = 0;
+    }
+
+    uint32_t c = 0;
+    if (ntag424_get_sdm_read_counter(t->card, t->sess, opt->counter_file_no, &c, &sw)) {
+        t->report.ctr_secure = c;
+        t->report.flags |= TAG_HAS_CTR_SECURE;
+        out_printf("SDM Read Counter (secure, FileNo 0x%02X): %u\n", opt->counter_file_no, c);
+    } else {
+        ntag424_session_clear(t->sess);
+        out_printf("SDM Read Counter (secure): failed (SW1SW2=%04X)\n", sw);
+    }
 }
+
+// Counter-only sweep (--counter-only): SELECT plus a plain GetFileCounters,
+// without the CC, NDEF and FileSettings reads of discovery. Only if the
+// plain read is refused are the FileSettings fetched, and the secure read is
+// attempted only when SDMCtrRet names a key. Returns 0 if no counter was read.
+static int tag_run_counter_only(tag_run_t *t) {
+    const tool_options_t *opt = t->opt;
+    tag_report_t *rep = &t->report;
+    uint16_t sw = 0;
+
+    // GET DATA is answered by the reader, so the UID costs no tag exchange.
+    if (ntag424_get_uid(t->card, t->uid, &t->uid_len)) {
+        rep->uid_len = (uint8_t)(t->uid_len < sizeof(rep->uid) ? t->uid_len : sizeof(rep->uid));
+        memcpy(rep->uid, t->uid, rep->uid_len);
+        rep->flags |= TAG_HAS_UID;
+        out_printf("UID: ");
+        out_hex(t->uid, t->uid_len);
+        out_printf("\n");
+    }
+
+    if (!ntag424_select_ndef_app(t->card, &sw)) {
+        out_printf("NDEF: SELECT NDEF app failed (SW1SW2=%04X)\n", sw);
+        return 0;
+    }
+    // The audit row needs SDMReadCtrLimit and the SDM settings, so read the
+    // FileSettings first instead of only when the plain counter is refused.
+    uint8_t fs_data[128];
+    size_t fs_len = sizeof(fs_data);
+    if (g_audit && ntag424_get_file_settings(t->card, NULL, opt->counter_file_no, fs_data, &fs_len, &sw)) {
+        ntag424_parse_file_settings(fs_data, fs_len, &t->fs_info);
+    }
+    uint32_t counter = 0;
+    if (ntag424_get_sdm_read_counter(t->card, NULL, opt->counter_file_no, &counter, &sw)) {
+        rep->ctr_plain = counter;
+        rep->flags |= TAG_HAS_CTR_PLAIN;
+        out_printf("SDM Read Counter (plain, FileNo 0x%02X): %u\n", opt->counter_file_no, counter);
+        return 1;
+    }
+    out_printf("SDM Read Counter (plain): unavailable (SW1SW2=%04X)\n", sw);
+
+    if (!t->fs_info.valid) {
+        fs_len = sizeof(fs_data);
+        if (!ntag424_get_file_settings(t->card, NULL, opt->counter_file_no, fs_data, &fs_len, &sw)) {
+            out_printf("FileSettings: GET failed (SW1SW2=%04X)\n", sw);
+            return 0;
+        }
+        if (!ntag424_parse_file_settings(fs_data, fs_len, &t->fs_info)) {
+            out_printf("FileSettings: parse error\n");
+            return 0;
+        }
+    }
+    print_file_settings(&t->fs_info);
+    if (!(t->fs_info.present & NTAG424_FS_HAS_SDM)) {
+        out_printf("SDM Read Counter: SDM is not enabled on FileNo 0x%02X\n", opt->counter_file_no);
+        return 0;
+    }
+    // 0xE is free access (the plain read should have worked), 0xF no access.
+    uint8_t key_no = t->fs_info.sdm_ctr_ret;
+    if (key_no >= 0x0E) {
+        out_printf("SDM Read Counter: no authenticated access (SDMCtrRet 0x%X)\n", key_no);
+        return 0;
+    }
+
+    uint8_t key[16];
+    // The command-line key belongs to the auth key number; other numbers come
+    // from the key database or the diversification master.
+    if (!key_db_get(t->uid, t->uid_len, key_no, key) &&
+        (key_no == opt->key_no || !derive_tag_key(opt, t->uid, t->uid_len, key_no, key))) {
+        memcpy(key, t->counter_key, sizeof(key));
+    }
+    out_printf("Authenticating (EV2First) with KeyNo 0x%02X (SDMCtrRet)...\n", key_no);
+    t->auth_count++;
+    if (!ntag424_authenticate_ev2_first(t->card, t->sess, key, key_no)) {
+        out_printf("Authentication failed.\n");
+        return 0;
+    }
+    uint32_t c = 0;
+    if (!ntag424_get_sdm_read_counter(t->card, t->sess, opt->counter_file_no, &c, &sw)) {
+        ntag424_session_clear(t->sess);
+        out_printf("SDM Read Counter (secure): failed (SW1SW2=%04X)\n", sw);
+        return 0;
+    }
+    rep->ctr_secure = c;
+    rep->flags |= TAG_HAS_CTR_SECURE;
+    out_printf("SDM Read Counter (secure, FileNo 0x%02X): %u\n", opt->counter_file_no, c);
+    return 1;
+}
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} json_buf_t;
+
+static void jb_printf(json_buf_t *jb, const char *fmt, ...) {
+    if (jb->len >= jb->cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(jb->buf + jb->len, jb->cap - jb->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) jb->len += (size_t)n;
+}
+
+static void jb_hex(json_buf_t *jb, const char *key, const uint8_t *data, size_t len) {
+    static const char digits[] = "0123456789ABCDEF";
+    jb_printf(jb, ",\"%s\":\"", key);
+    if (jb->len + 2 * len + 1 >= jb->cap) {
+        jb->len = jb->cap;
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        jb->buf[jb->len++] = digits[data[i] >> 4];
+        jb->buf[jb->len++] = digits[data[i] & 0x0F];
+    }
+    jb->buf[jb->len++] = '"';
+}
+
+static void jb_u32(json_buf_t *jb, const char *key, uint32_t v) {
+    jb_printf(jb, ",\"%s\":%u", key, v);
+}
+
+// Writes the tag record for --format json (one JSON object per line) or
+// --format binary (the raw tag_report_t) with a single fwrite. Runs on the
+// result stage, which flushes stdout once it has caught up.
+static void emit_tag_report(const tag_report_t *rep) {
+    if (g_output_format == OUTPUT_BINARY) {
+        fwrite(rep, sizeof(*rep), 1, stdout);
+        return;
+    }
+
+    char out[4096];
+    json_buf_t jb = {out, sizeof(out), 0};
+    jb_printf(&jb, "{\"ok\":%s", (rep->flags & TAG_OK) ? "true" : "false");
+    if (rep->flags & TAG_HAS_UID) jb_hex(&jb, "uid", rep->uid, rep->uid_len);
+    if (rep->flags & TAG_HAS_ATR) jb_hex(&jb, "atr", rep->atr, rep->atr_len);
+    if (rep->flags & TAG_HAS_ATS) jb_hex(&jb, "ats", rep->ats, rep->ats_len);
+    if (rep->flags & TAG_HAS_CC) {
+        jb_printf(&jb, ",\"cc\":{\"len\":%u", rep->cc_len);
+        jb_u32(&jb, "mapping", rep->cc_mapping);
+        jb_u32(&jb, "mle", rep->cc_mle);
+        jb_u32(&jb, "mlc", rep->cc_mlc);
+        jb_u32(&jb, "ndef_file_id", rep->ndef_file_id);
+        jb_u32(&jb, "ndef_file_size", rep->ndef_file_size);
+        jb_u32(&jb, "read_access", rep->cc_read_access);
+        jb_u32(&jb, "write_access", rep->cc_write_access);
+        jb_printf(&jb, "}");
+    }
+    if (rep->flags & TAG_HAS_NDEF) {
+        jb_printf(&jb, ",\"ndef\":{\"nlen\":%u", rep->nlen);
+        jb_hex(&jb, "data", rep->ndef, rep->ndef_len);
+        jb_printf(&jb, "}");
+    }
+
+    const ntag424_file_settings_t *fs = &rep->fs;
+    if (fs->valid) {
+        jb_printf(&jb, ",\"file_settings\":{\"file_type\":%u", fs->file_type);
+        jb_u32(&jb, "file_option", fs->file_option);
+        jb_u32(&jb, "ar1", fs->ar1);
+        jb_u32(&jb, "ar2", fs->ar2);
+        jb_u32(&jb, "file_size", fs->file_size);
+        if (fs->present & NTAG424_FS_HAS_SDM) {
+            jb_printf(&jb, ",\"sdm\":{\"options\":%u", fs->sdm_options);
+            jb_u32(&jb, "access_rights", fs->sdm_ar);
+            jb_u32(&jb, "meta_read", fs->sdm_meta_read);
+            jb_u32(&jb, "file_read", fs->sdm_file_read);
+            jb_u32(&jb, "ctr_ret", fs->sdm_ctr_ret);
+            if (fs->present & NTAG424_FS_HAS_UID_OFFSET) jb_u32(&jb, "uid_offset", fs->uid_offset);
+            if (fs->present & NTAG424_FS_HAS_READ_CTR_OFFSET) jb_u32(&jb, "read_ctr_offset", fs->sdm_read_ctr_offset);
+            if (fs->present & NTAG424_FS_HAS_PICC_OFFSET) jb_u32(&jb, "picc_data_offset", fs->picc_data_offset);
+            if (fs->present & NTAG424_FS_HAS_MAC_INPUT) jb_u32(&jb, "mac_input_offset", fs->sdm_mac_input_offset);
+            if (fs->present & NTAG424_FS_HAS_ENC) {
+                jb_u32(&jb, "enc_offset", fs->sdm_enc_offset);
+                jb_u32(&jb, "enc_length", fs->sdm_enc_length);
+            }
+            if (fs->present & NTAG424_FS_HAS_MAC_OFFSET) jb_u32(&jb, "mac_offset", fs->sdm_mac_offset);
+            if (fs->present & NTAG424_FS_HAS_READ_CTR_LIMIT) jb_u32(&jb, "read_ctr_limit", fs->sdm_read_ctr_limit);
+            jb_printf(&jb, "}");
+        }
+        jb_printf(&jb, "}");
+    }
+    if (rep->flags & TAG_HAS_CTR_PLAIN) jb_u32(&jb, "read_ctr_plain", rep->ctr_plain);
+    if (rep->flags & TAG_HAS_CTR_SECURE) jb_u32(&jb, "read_ctr_secure", rep->ctr_secure);
+    if (rep->flags & TAG_HAS_SDM_VERIFY) jb_printf(&jb, ",\"sdm_mac_ok\":%s", (rep->flags & TAG_SDM_MAC_OK) ? "true" : "false");
+    jb_printf(&jb, "}\n");
+
+    if (jb.len >= jb.cap) return; // cannot happen with the fixed field sizes
+    fwrite(out, 1, jb.len, stdout);
+}
+
+// Per-tap results, handed from the RF workers to the output stage: a bounded
+// lock-free ring of preallocated fixed-size records with a sequence number
+// per slot (Vyukov's bounded queue). Any worker publishes and the stage
+// thread consumes, so a tap costs one record copy and never touches stdio or
+// the allocator. A full ring makes the worker wait for the stage instead of
+// growing, which keeps memory bounded.
+typedef struct {
+    tag_report_t report;
+    audit_row_t audit;
+    uint8_t has_report;
+    uint8_t has_audit;
+} tag_result_t;
+
+typedef struct {
+    _Atomic size_t seq;
+    tag_result_t rec;
+} result_slot_t;
+
+static result_slot_t *g_result_slots = NULL;
+static _Atomic size_t g_result_head;  // next position to publish
+static _Atomic size_t g_result_tail;  // next position to consume
+static _Atomic int g_result_stop;
+static pthread_t g_result_thread;
+
+static void result_ring_push(const tag_result_t *rec) {
+    size_t pos = atomic_load_explicit(&g_result_head, memory_order_relaxed);
+    for (;;) {
+        result_slot_t *slot = &g_result_slots[pos & (RESULT_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&g_result_head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->rec = *rec;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return;
+            }
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            sched_yield();  // full: the stage is RESULT_RING_SLOTS taps behind
+            pos = atomic_load_explicit(&g_result_head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&g_result_head, memory_order_relaxed);
+        }
+    }
+}
+
+static int result_ring_pop(tag_result_t *out) {
+    size_t pos = atomic_load_explicit(&g_result_tail, memory_order_relaxed);
+    for (;;) {
+        result_slot_t *slot = &g_result_slots[pos & (RESULT_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak_explicit(&g_result_tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *out = slot->rec;
+                atomic_store_explicit(&slot->seq, pos + RESULT_RING_SLOTS, memory_order_release);
+                return 1;
+            }
+        } else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+            return 0;  // empty
+        } else {
+            pos = atomic_load_explicit(&g_result_tail, memory_order_relaxed);
+        }
+    }
+}
+
+// The output stage: structured records to stdout, audit rows to the audit
+// batch. Sleeps briefly when the ring is empty and drains it before exiting.
+static void *result_stage(void *arg) {
+    (void)arg;
+    tag_result_t rec;
+    for (;;) {
+        int stop = atomic_load_explicit(&g_result_stop, memory_order_acquire);
+        int n = 0;
+        while (result_ring_pop(&rec)) {
+            if (rec.has_report) emit_tag_report(&rec.report);
+            if (rec.has_audit) audit_append(&rec.audit);
+            n++;
+        }
+        if (n > 0) fflush(stdout);
+        if (stop) break;
+        struct timespec ts = {0, 200000};
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static int result_stage_start(void) {
+    g_result_slots = (result_slot_t *)malloc(RESULT_RING_SLOTS * sizeof(*g_result_slots));
+    if (!g_result_slots) return 0;
+    for (size_t i = 0; i < RESULT_RING_SLOTS; i++) atomic_init(&g_result_slots[i].seq, i);
+    if (pthread_create(&g_result_thread, NULL, result_stage, NULL) != 0) {
+        free(g_result_slots);
+        g_result_slots = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Call once every worker is done: the stage drains the ring and exits.
+static void result_stage_stop(void) {
+    if (!g_result_slots) return;
+    atomic_store_explicit(&g_result_stop, 1, memory_order_release);
+    pthread_join(g_result_thread, NULL);
+    free(g_result_slots);
+    g_result_slots = NULL;
+}
+
+static const char *const k_tag_op_names[] = {"provision", "rotate", "sdm-setup", "counter", "rotate-plan", "sdm-verify",
+                                             "write-data", "read-data"};
+
+// Parses a comma separated --ops list ("provision,sdm-setup,counter").
+static int parse_ops_list(const char *list, tool_options_t *opt) {
+    opt->ops_count = 0;
+    const char *p = list;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        size_t op = 0;
+        while (op < sizeof(k_tag_op_names) / sizeof(k_tag_op_names[0]) &&
+               !(strlen(k_tag_op_names[op]) == len && strncmp(k_tag_op_names[op], p, len) == 0)) {
+            op++;
+        }
+        if (op == sizeof(k_tag_op_names) / sizeof(k_tag_op_names[0]) || opt->ops_count >= MAX_TAG_OPS) {
+            return 0;
+        }
+        opt->ops[opt->ops_count++] = (uint8_t)op;
+        if (!end) break;
+        p = end + 1;
+    }
+    return opt->ops_count > 0;
+}
+
+// Parses --rotate-plan: "all" for application keys 0..4, or a comma
+// separated list of key numbers.
+static int parse_rotate_plan(const char *list, tool_options_t *opt) {
+    opt->rotate_plan_count = 0;
+    if (strcmp(list, "all") == 0) {
+        for (uint8_t k = 0; k < sizeof(opt->rotate_plan); k++) opt->rotate_plan[opt->rotate_plan_count++] = k;
+        return 1;
+    }
+    const char *p = list;
+    while (*p) {
+        char *end = NULL;
+        unsigned long k = strtoul(p, &end, 0);
+        if (end == p || (*end != ',' && *end != '\0') || k >= sizeof(opt->rotate_plan)) return 0;
+        for (size_t i = 0; i < opt->rotate_plan_count; i++) {
+            if (opt->rotate_plan[i] == k) return 0;
+        }
+        opt->rotate_plan[opt->rotate_plan_count++] = (uint8_t)k;
+        if (*end == '\0') break;
+        p = end + 1;
+    }
+    return opt->rotate_plan_count > 0;
+}
+
+// The --audit-csv row for a finished tap.
+static void tag_run_audit_row(const tag_run_t *t, int ok, audit_row_t *out) {
+    const tag_report_t *rep = &t->report;
+    const ntag424_file_settings_t *fs = &t->fs_info;
+    audit_row_t row;
+    memset(&row, 0, sizeof(row));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    row.time_ms = (uint64_t)ts.tv_sec * 1000u + (uint64_t)(ts.tv_nsec / 1000000);
+    row.uid_len = (uint8_t)(t->uid_len < sizeof(row.uid) ? t->uid_len : sizeof(row.uid));
+    memcpy(row.uid, t->uid, row.uid_len);
+    row.file_no = t->opt->counter_file_no;
+    if (rep->flags & TAG_HAS_CTR_SECURE) {
+        row.ctr_source = 2;
+        row.ctr = rep->ctr_secure;
+    } else if (rep->flags & TAG_HAS_CTR_PLAIN) {
+        row.ctr_source = 1;
+        row.ctr = rep->ctr_plain;
+    }
+    if (fs->valid && (fs->present & NTAG424_FS_HAS_READ_CTR_LIMIT)) {
+        row.has_limit = 1;
+        row.ctr_limit = fs->sdm_read_ctr_limit;
+    }
+    if (fs->valid && fs->sdm_enabled) {
+        uint8_t digest[CKPT_SETTINGS_LEN];
+        uint32_t offsets[5] = {fs->uid_offset, fs->sdm_read_ctr_offset, fs->picc_data_offset, fs->sdm_mac_input_offset,
+                               fs->sdm_mac_offset};
+        sdm_settings_digest(row.file_no, fs->sdm_options, fs->sdm_ar, offsets, digest);
+        row.has_settings = 1;
+        row.settings_hash = ndef_hash(digest, sizeof(digest));
+    }
+    row.ok = (uint8_t)(ok != 0);
+    *out = row;
+}
+
+// Runs the configured pipeline against an already connected card: discovery,
+// then either the --ops list on one shared session, or the classic flag
+// driven provision, rotate, SDM setup and counter read with a fresh
+// authentication per step. --counter-only replaces all of it with
+// tag_run_counter_only. Returns 0 if a requested step failed.
+static int run_tag_pipeline(ntag424_card_t *card, const tool_options_t *opt) {
+    tag_run_t t;
+    memset(&t, 0, sizeof(t));
+    t.card = card;
+    t.opt = opt;
+    t.sess = ntag424_session_new();
+    if (!t.sess) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    memcpy(t.auth_key, opt->key, sizeof(t.auth_key));
+    memcpy(t.counter_key, opt->key, sizeof(t.counter_key));
+    t.counter_key_no = opt->key_no;
+    t.reuse_session = opt->ops_count > 0;
+    t.report.magic = TAG_REPORT_MAGIC;
+    t.report.version = TAG_REPORT_VERSION;
+    t.report.size = (uint16_t)sizeof(t.report);
+
+    uint8_t ops[MAX_TAG_OPS];
+    size_t ops_count = 0;
+    if (t.reuse_session) {
+        memcpy(ops, opt->ops, opt->ops_count);
+        ops_count = opt->ops_count;
+    } else if (!opt->counter_only) {
+        if (opt->do_provision) ops[ops_count++] = TAG_OP_PROVISION;
+        if (opt->do_rotate_key) ops[ops_count++] = TAG_OP_ROTATE;
+        if (opt->rotate_plan_count > 0) ops[ops_count++] = TAG_OP_ROTATE_PLAN;
+        if (opt->do_sdm_setup) ops[ops_count++] = TAG_OP_SDM_SETUP;
+        if (opt->do_sdm_verify) ops[ops_count++] = TAG_OP_SDM_VERIFY;
+        if (opt->write_data_path) ops[ops_count++] = TAG_OP_WRITE_DATA;
+        if (opt->do_read_data) ops[ops_count++] = TAG_OP_READ_DATA;
+        ops[ops_count++] = TAG_OP_COUNTER;
+    }
+
+    int ok = 1;
+    if (opt->counter_only) {
+        ok = tag_run_counter_only(&t);
+    } else {
+        tag_run_discover(&t);
+        if (key_db_get(t.uid, t.uid_len, opt->key_no, t.auth_key)) {
+            memcpy(t.counter_key, t.auth_key, sizeof(t.counter_key));
+            out_printf("Key DB: using stored key for KeyNo 0x%02X\n", opt->key_no);
+        } else if (derive_tag_key(opt, t.uid, t.uid_len, opt->key_no, t.auth_key)) {
+            memcpy(t.counter_key, t.auth_key, sizeof(t.counter_key));
+            t.auth_fallback = 1;
+            out_printf("Diversified key: using derived key for KeyNo 0x%02X\n", opt->key_no);
+        }
+        if (g_checkpoint && t.uid_len > 0) {
+            t.ckpt_on = 1;
+            checkpoint_get(t.uid, t.uid_len, &t.ckpt);
+            if (t.ckpt.steps) {
+                out_printf("Checkpoint: resuming (recorded:%s%s%s%s%s)\n",
+                           (t.ckpt.steps & CKPT_KEY_PENDING) ? " key-pending" : "", (t.ckpt.steps & CKPT_KEY) ? " key" : "",
+                           (t.ckpt.steps & CKPT_SETTINGS) ? " settings" : "",
+                           (t.ckpt.steps & CKPT_NDEF) ? " ndef" : "",
+                           (t.ckpt.steps & CKPT_VERIFIED) ? " verified" : "");
+            }
+        } else if (g_checkpoint) {
+            out_printf("Checkpoint: no UID, running without checkpoints\n");
+        }
+    }
+    for (size_t i = 0; i < ops_count && ok; i++) {
+        switch (ops[i]) {
+            case TAG_OP_PROVISION: ok = tag_run_provision(&t); break;
+            case TAG_OP_ROTATE: ok = tag_run_rotate(&t); break;
+            case TAG_OP_SDM_SETUP: ok = tag_run_sdm_setup(&t); break;
+            case TAG_OP_COUNTER: tag_run_counter(&t); break;
+            case TAG_OP_ROTATE_PLAN: ok = tag_run_rotate_plan(&t); break;
+            case TAG_OP_SDM_VERIFY: ok = tag_run_sdm_verify(&t); break;
+            case TAG_OP_WRITE_DATA: ok = tag_run_data(&t, 1); break;
+            case TAG_OP_READ_DATA: ok = tag_run_data(&t, 0); break;
+        }
+        if (!t.reuse_session) ntag424_session_clear(t.sess);
+    }
+
+    if (t.reuse_session) {
+        out_printf("Ops: %zu operation(s), %u authentication(s)\n", ops_count, t.auth_count);
+    }
+    ntag424_session_free(t.sess);
+
+    // Structured output and audit rows go to the result stage.
+    if (g_result_slots) {
+        tag_result_t res;
+        res.has_report = g_output_format != OUTPUT_TEXT;
+        res.has_audit = g_audit != NULL;
+        if (res.has_report) {
+            t.report.fs = t.fs_info;
+            if (ok) t.report.flags |= TAG_OK;
+            res.report = t.report;
+        }
+        if (res.has_audit) tag_run_audit_row(&t, ok, &res.audit);
+        result_ring_push(&res);
+    }
+    return ok;
+}
+
+// --reader NAME: the reader with exactly this name, else the only one whose
+// name starts with it. Unlike the positional index this survives replugging.
+static char *find_reader_by_name(char *readers, const char *name) {
+    char *prefix_match = NULL;
+    size_t prefix_count = 0;
+    for (char *p = readers; *p; p += strlen(p) + 1) {
+        if (strcmp(p, name) == 0) return p;
+        if (strncmp(p, name, strlen(name)) == 0) {
+            prefix_match = p;
+            prefix_count++;
+        }
+    }
+    return prefix_count == 1 ? prefix_match : NULL;
+}
+
+static int connect_card(ntag424_context_t *ctx, const char *reader, ntag424_card_t **card) {
+    long rc = 0;
+    if (!ntag424_card_connect(ctx, reader, card, &rc)) {
+        fprintf(stderr, "SCardConnect failed: 0x%08lX\n", (unsigned long)rc);
+        return 0;
+    }
+    return 1;
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+// Loads a job file for multi-reader provisioning. Each non-empty line is
+// "KEY_PATH [URL]"; "-" as KEY_PATH keeps the command-line key settings.
+static int job_queue_load(job_queue_t *q, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        trim_whitespace(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (q->count == q->cap) {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            provision_job_t *jobs = (provision_job_t *)realloc(q->jobs, cap * sizeof(*jobs));
+            if (!jobs) {
+                fclose(f);
+                return 0;
+            }
+            q->jobs = jobs;
+            q->cap = cap;
+        }
+        provision_job_t *job = &q->jobs[q->count];
+        memset(job, 0, sizeof(*job));
+        char *sep = line;
+        while (*sep && !isspace((unsigned char)*sep)) sep++;
+        if (*sep) {
+            *sep++ = '\0';
+            trim_whitespace(sep);
+            snprintf(job->url, sizeof(job->url), "%s", sep);
+        }
+        if (strcmp(line, "-") != 0) {
+            size_t klen = strlen(line);
+            if (klen >= sizeof(job->key_path)) {
+                fclose(f);
+                return 0;
+            }
+            memcpy(job->key_path, line, klen + 1);
+        }
+        q->count++;
+    }
+    fclose(f);
+    q->enabled = 1;
+    return 1;
+}
+
+// Takes the next job. Returns 0 once a loaded job file is exhausted; without
+// a job file every tap gets an empty job (command-line settings only).
+static int job_queue_pop(job_queue_t *q, provision_job_t *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&q->lock);
+    int ok = 1;
+    if (q->enabled) {
+        if (q->next < q->count) {
+            *out = q->jobs[q->next++];
+        } else {
+            q->exhausted = 1;
+            ok = 0;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+// Runs the pipeline for one job on a connected card, disconnects it and
+// adds the result to the worker and queue statistics.
+static void serve_tap(reader_worker_t *w, ntag424_card_t *card, const provision_job_t *job) {
+    job_queue_t *q = w->queue;
+    tool_options_t job_opt = *w->opt;
+    if (job->key_path[0]) job_opt.provision_key_path = job->key_path;
+    if (job->url[0]) job_opt.sdm_base_url = job->url;
+
+    w->taps++;
+    double t0 = monotonic_ms();
+    fprintf(status_stream(), "=== [%s] Tap %lu ===\n", w->reader, w->taps);
+    int ok = run_tag_pipeline(card, &job_opt);
+    ntag424_card_disconnect(card);
+    if (!ok) w->failed++;
+
+    pthread_mutex_lock(&q->lock);
+    q->taps++;
+    if (!ok) q->failed++;
+    unsigned long total = q->taps;
+    pthread_mutex_unlock(&q->lock);
+    double now = monotonic_ms();
+    double rate = total * 1000.0 / (now - q->start_ms);
+    fprintf(status_stream(), "=== [%s] Tap %lu %s (%.1f ms) | aggregate %lu tag(s), %.2f tags/s ===\n",
+            w->reader, w->taps, ok ? "done" : "FAILED", now - t0, total, rate);
+    fflush(status_stream());
+}
+
+// Waits on SCardGetStatusChange for card-present events on one reader and
+// runs the pipeline once per tap. A card must be removed before it is
+// processed again. Stops on SIGINT/SIGTERM, when the job queue runs dry or
+// when the reader is unplugged (w->removed).
+static void watch_reader(reader_worker_t *w) {
+    job_queue_t *q = w->queue;
+    ntag424_reader_t *reader;
+    if (!ntag424_reader_open(w->ctx, w->reader, &reader)) {
+        fprintf(stderr, "Out of memory.\n");
+        return;
+    }
+
+    fprintf(status_stream(), "[%s] waiting for tags\n", w->reader);
+    fflush(status_stream());
+
+    while (!g_stop && !q->exhausted) {
+        long rc = 0;
+        int ev = ntag424_reader_wait_tap(reader, DAEMON_POLL_TIMEOUT_MS, &rc);
+        if (ev == NTAG424_WAIT_NONE) continue;
+        if (ev == NTAG424_WAIT_CANCELLED) break;
+        if (ev == NTAG424_WAIT_REMOVED) {
+            w->removed = 1;
+            break;
+        }
+        if (ev == NTAG424_WAIT_ERROR) {
+            fprintf(stderr, "[%s] SCardGetStatusChange failed: 0x%08lX\n", w->reader, (unsigned long)rc);
+            break;
+        }
+
+        provision_job_t job;
+        if (!job_queue_pop(q, &job)) break;
+        ntag424_card_t *card;
+        if (!connect_card(w->ctx, w->reader, &card)) continue;
+        serve_tap(w, card, &job);
+    }
+    ntag424_reader_close(reader);
+}
+
+static void *reader_thread(void *arg) {
+    reader_worker_t *w = (reader_worker_t *)arg;
+    long rc = 0;
+    if (!open_context(&w->ctx, &rc)) {
+        fprintf(stderr, "[%s] SCardEstablishContext failed: 0x%08lX\n", w->reader, (unsigned long)rc);
+        return NULL;
+    }
+    watch_reader(w);
+    ntag424_context_close(w->ctx);
+    return NULL;
+}
+
+static void print_run_summary(const job_queue_t *q) {
+    double elapsed_s = (monotonic_ms() - q->start_ms) / 1000.0;
+    double rate = elapsed_s > 0 ? q->taps / elapsed_s : 0.0;
+    fprintf(status_stream(), "Summary: %lu tap(s), %lu failed, %.1f s elapsed, %.2f tags/s\n",
+            q->taps, q->failed, elapsed_s, rate);
+    if (q->enabled) fprintf(status_stream(), "Summary: %zu of %zu job(s) dispatched\n", q->next, q->count);
+}
+
+// --emulate: runs the pipeline on opt->emulate_count in-memory tags in
+// factory state, spread over opt->emulate_threads workers with a context
+// each. UIDs are 04 followed by the tag number, so key databases, caches and
+// journals see distinct tags.
+typedef struct {
+    reader_worker_t w;
+    unsigned long *next;  // shared tag counter, under queue->lock
+} emu_worker_t;
+
+static void *emulate_thread(void *arg) {
+    emu_worker_t *ew = (emu_worker_t *)arg;
+    reader_worker_t *w = &ew->w;
+    job_queue_t *q = w->queue;
+    if (!open_emu_context(&w->ctx)) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    while (!g_stop && !q->exhausted) {
+        pthread_mutex_lock(&q->lock);
+        unsigned long n = *ew->next;
+        if (n < w->opt->emulate_count) (*ew->next)++;
+        pthread_mutex_unlock(&q->lock);
+        if (n >= w->opt->emulate_count) break;
+
+        provision_job_t job;
+        if (!job_queue_pop(q, &job)) break;
+        uint64_t tag = n;
+        uint8_t uid[7] = {0x04, (uint8_t)(tag >> 40), (uint8_t)(tag >> 32), (uint8_t)(tag >> 24),
+                          (uint8_t)(tag >> 16), (uint8_t)(tag >> 8), (uint8_t)tag};
+        ntag424_emu_t *emu = ntag424_emu_new(uid);
+        ntag424_card_t *card;
+        if (!emu || !ntag424_card_connect_emu(w->ctx, emu, &card)) {
+            fprintf(stderr, "Out of memory.\n");
+            ntag424_emu_free(emu);
+            break;
+        }
+        serve_tap(w, card, &job);
+        ntag424_emu_free(emu);
+    }
+    ntag424_context_close(w->ctx);
+    return NULL;
+}
+
+static int run_emulated(const tool_options_t *opt, job_queue_t *q) {
+    unsigned threads = opt->emulate_threads;
+    if ((unsigned long)threads > opt->emulate_count) threads = (unsigned)opt->emulate_count;
+    emu_worker_t *workers = (emu_worker_t *)calloc(threads, sizeof(*workers));
+    if (!workers) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    unsigned long next = 0;
+    fprintf(status_stream(), "Emulating %lu tag(s) on %u thread(s)\n", opt->emulate_count, threads);
+    q->start_ms = monotonic_ms();
+    for (unsigned i = 0; i < threads; i++) {
+        emu_worker_t *ew = &workers[i];
+        snprintf(ew->w.reader, sizeof(ew->w.reader), "emu %u", i);
+        ew->w.opt = opt;
+        ew->w.queue = q;
+        ew->next = &next;
+        ew->w.running = pthread_create(&ew->w.thread, NULL, emulate_thread, ew) == 0;
+        if (!ew->w.running) fprintf(stderr, "[%s] failed to start worker thread\n", ew->w.reader);
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        if (workers[i].w.running) pthread_join(workers[i].w.thread, NULL);
+    }
+    free(workers);
+    print_run_summary(q);
+    return q->failed == 0;
+}
+
+static void reader_returned_event(void *user, int event, const char *name) {
+    reader_worker_t *w = (reader_worker_t *)user;
+    if (event == NTAG424_READER_ADDED && strcmp(name, w->reader) == 0) w->removed = 0;
+}
+
+// Keeps the context open and serves taps on a single reader. An unplugged
+// reader is picked up again by name when it comes back.
+static int run_daemon(ntag424_context_t *ctx, const char *reader, const tool_options_t *opt,
+                      job_queue_t *q) {
+    reader_worker_t w;
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    snprintf(w.reader, sizeof(w.reader), "%s", reader);
+    w.opt = opt;
+    w.queue = q;
+
+    fprintf(status_stream(), "Daemon: serving %s (Ctrl-C to stop)\n", reader);
+    q->start_ms = monotonic_ms();
+    for (;;) {
+        watch_reader(&w);
+        if (!w.removed || g_stop) break;
+        fprintf(status_stream(), "Daemon: %s unplugged, waiting for it to return\n", reader);
+        fflush(status_stream());
+        ntag424_reader_monitor_t *mon;
+        if (!ntag424_reader_monitor_open(ctx, &mon)) {
+            fprintf(stderr, "Out of memory.\n");
+            break;
+        }
+        long rc = 0;
+        while (!g_stop && w.removed) {
+            if (ntag424_reader_monitor_poll(mon, DAEMON_POLL_TIMEOUT_MS, reader_returned_event, &w, &rc) <
+                NTAG424_WAIT_NONE) {
+                fprintf(stderr, "Daemon: reader monitor failed: 0x%08lX\n", (unsigned long)rc);
+                break;
+            }
+        }
+        ntag424_reader_monitor_close(mon);
+        if (w.removed) break;
+    }
+    print_run_summary(q);
+    return q->failed == 0;
+}
+
+// Workers of --all-readers, keyed by reader name so a reader that is
+// unplugged and plugged back in keeps its statistics.
+typedef struct {
+    reader_worker_t **workers;
+    size_t count;
+    size_t cap;
+    const tool_options_t *opt;
+    job_queue_t *queue;
+    int started;
+} reader_pool_t;
+
+static reader_worker_t *reader_pool_find(const reader_pool_t *pool, const char *name) {
+    for (size_t i = 0; i < pool->count; i++) {
+        if (strcmp(pool->workers[i]->reader, name) == 0) return pool->workers[i];
+    }
+    return NULL;
+}
+
+// Monitor callback: starts a worker for each new reader and joins the
+// worker of a removed one, which has stopped on NTAG424_WAIT_REMOVED.
+static void reader_pool_event(void *user, int event, const char *name) {
+    reader_pool_t *pool = (reader_pool_t *)user;
+    reader_worker_t *w = reader_pool_find(pool, name);
+    if (event == NTAG424_READER_REMOVED) {
+        if (w && w->running) {
+            pthread_join(w->thread, NULL);
+            w->running = 0;
+        }
+        fprintf(status_stream(), "Multi-reader: %s detached\n", name);
+        fflush(status_stream());
+        return;
+    }
+
+    if (!w) {
+        if (pool->count == pool->cap) {
+            size_t cap = pool->cap ? pool->cap * 2 : 8;
+            reader_worker_t **workers = (reader_worker_t **)realloc(pool->workers, cap * sizeof(*workers));
+            if (!workers) {
+                fprintf(stderr, "Out of memory.\n");
+                return;
+            }
+            pool->workers = workers;
+            pool->cap = cap;
+        }
+        w = (reader_worker_t *)calloc(1, sizeof(*w));
+        if (!w) {
+            fprintf(stderr, "Out of memory.\n");
+            return;
+        }
+        snprintf(w->reader, sizeof(w->reader), "%s", name);
+        w->opt = pool->opt;
+        w->queue = pool->queue;
+        pool->workers[pool->count++] = w;
+    } else if (w->running) {
+        return;
+    }
+    if (pool->started) {
+        fprintf(status_stream(), "Multi-reader: %s attached\n", name);
+        fflush(status_stream());
+    }
+    w->removed = 0;
+    if (pthread_create(&w->thread, NULL, reader_thread, w) != 0) {
+        fprintf(stderr, "[%s] failed to start worker thread\n", name);
+        return;
+    }
+    w->running = 1;
+}
+
+// Serves every attached reader with its own worker thread. Each worker owns
+// its PC/SC context and card handle and pulls jobs from the shared queue;
+// the calling thread watches for readers being plugged in and out.
+static int run_all_readers(ntag424_context_t *ctx, const tool_options_t *opt, job_queue_t *q) {
+    reader_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.opt = opt;
+    pool.queue = q;
+
+    ntag424_reader_monitor_t *mon;
+    if (!ntag424_reader_monitor_open(ctx, &mon)) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+    q->start_ms = monotonic_ms();
+    long rc = 0;
+    int ev = ntag424_reader_monitor_poll(mon, 0, reader_pool_event, &pool, &rc);
+    fprintf(status_stream(), "Multi-reader: %zu reader(s) (Ctrl-C to stop)\n", pool.count);
+    fflush(status_stream());
+    pool.started = 1;
+    while (ev >= NTAG424_WAIT_NONE && !g_stop && !q->exhausted) {
+        ev = ntag424_reader_monitor_poll(mon, DAEMON_POLL_TIMEOUT_MS, reader_pool_event, &pool, &rc);
+    }
+    if (ev == NTAG424_WAIT_ERROR) {
+        fprintf(stderr, "Multi-reader: reader monitor failed: 0x%08lX\n", (unsigned long)rc);
+    }
+    ntag424_reader_monitor_close(mon);
+
+    for (size_t i = 0; i < pool.count; i++) {
+        reader_worker_t *w = pool.workers[i];
+        if (w->running) pthread_join(w->thread, NULL);
+        fprintf(status_stream(), "  %s: %lu tap(s), %lu failed\n", w->reader, w->taps, w->failed);
+        free(w);
+    }
+    free(pool.workers);
+    print_run_summary(q);
+    return ev != NTAG424_WAIT_ERROR && q->failed == 0;
+}
+
+// Offline bulk verification of logged tap URLs, one per line ("-" reads
+// stdin). Only mismatches and malformed lines are printed.
+static int run_verify_urls(const tool_options_t *opt) {
+    const char *path = opt->verify_urls_path;
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open URL file: %s\n", path);
+        return 0;
+    }
+    ntag424_sdm_verifier_t *verifier = ntag424_sdm_verifier_new(opt->sdm_file_key);
+    if (verifier && opt->has_sdm_meta_key && !ntag424_sdm_verifier_set_meta_key(verifier, opt->sdm_meta_key)) {
+        ntag424_sdm_verifier_free(verifier);
+        verifier = NULL;
+    }
+    if (!verifier) {
+        if (f != stdin) fclose(f);
+        return 0;
+    }
+
+    enum { LINE_MAX_LEN = 1024 };
+    char *lines = (char *)malloc((size_t)SDM_VERIFY_BATCH * LINE_MAX_LEN);
+    ntag424_sdm_tap_t *taps = (ntag424_sdm_tap_t *)calloc(SDM_VERIFY_BATCH, sizeof(*taps));
+    if (!lines || !taps) {
+        fprintf(stderr, "Out of memory.\n");
+        free(lines);
+        free(taps);
+        ntag424_sdm_verifier_free(verifier);
+        if (f != stdin) fclose(f);
+        return 0;
+    }
+
+    unsigned long line_no = 0, total = 0, ok = 0, mismatch = 0, malformed = 0;
+    double t0 = monotonic_ms();
+    int eof = 0;
+    while (!eof) {
+        size_t n = 0;
+        while (n < SDM_VERIFY_BATCH) {
+            char *line = lines + n * LINE_MAX_LEN;
+            if (!fgets(line, LINE_MAX_LEN, f)) {
+                eof = 1;
+                break;
+            }
+            line_no++;
+            trim_whitespace(line);
+            if (line[0] == '\0' || line[0] == '#') continue;
+            if (!ntag424_sdm_parse_url_template(line, &opt->sdm_tpl, &taps[n])) {
+                malformed++;
+                printf("MALFORMED line %lu: %s\n", line_no, line);
+                continue;
+            }
+            n++;
+        }
+        ntag424_sdm_verify(verifier, taps, n);
+        for (size_t i = 0; i < n; i++) {
+            total++;
+            if (!taps[i].valid) {
+                // PICCData that the SDMMetaRead key does not decrypt.
+                malformed++;
+                printf("MALFORMED: %s\n", lines + i * LINE_MAX_LEN);
+            } else if (taps[i].match) {
+                ok++;
+            } else {
+                mismatch++;
+                printf("MISMATCH: %s\n", lines + i * LINE_MAX_LEN);
+            }
+        }
+    }
+
+    double elapsed_ms = monotonic_ms() - t0;
+    printf("Verified %lu URL(s): %lu ok, %lu mismatch, %lu malformed (%.1f ms, %.0f URLs/s)\n",
+           total, ok, mismatch, malformed, elapsed_ms,
+           elapsed_ms > 0 ? total * 1000.0 / elapsed_ms : 0.0);
+
+    free(lines);
+    free(taps);
+    ntag424_sdm_verifier_free(verifier);
+    if (f != stdin) fclose(f);
+    return mismatch == 0 && malformed == 0;
+}
+
+// End of a run: the --apdu-stats report and the --cache file.
+static void cli_report(const tool_options_t *opt) {
+    apdu_stats_report(opt->apdu_stats_path);
+    if (opt->cache_path && !tag_cache_save(opt->cache_path)) {
+        fprintf(stderr, "Failed to write tag cache: %s\n", opt->cache_path);
+    }
+}
+
+// Releases what main set up and returns status. Works on any exit path:
+// whatever was not opened yet is skipped.
+static int cli_cleanup(tool_options_t *opt, job_queue_t *queue, char *readers, ntag424_context_t *ctx, int status) {
+    ntag424_keydb_close(g_key_db);
+    g_key_db = NULL;
+    rotate_journal_close();
+    checkpoint_close();
+    result_stage_stop();
+    audit_close(opt->audit_csv_path);
+    if (queue) free(queue->jobs);
+    free(opt->write_data);
+    opt->write_data = NULL;
+    free(readers);
+    ntag424_context_close(ctx);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    long rc = 0;
+    int index = 0;
+    tool_options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.key_no = 0x00;
+    opt.counter_file_no = 0x02;
+    opt.data_file_no = 0x03;
+    opt.new_key_no = 0x01;
+    opt.sdm_key_no = 0x01;
+    opt.sdm_base_url = "https://example.com/tap";
+    ntag424_sdm_template_default(&opt.sdm_tpl);
+    opt.rotate_key_no = 0x01;
+    opt.emulate_threads = 4;
+
+    int argi = 1;
+    if (argi < argc && argv[argi][0] != '-') {
+        index = atoi(argv[argi++]);
+    }
+    if (argi < argc && argv[argi][0] != '-') {
+        if (!parse_hex_key(argv[argi], opt.key)) {
+            fprintf(stderr, "Key must be 32 hex chars (AES-128), e.g. 000000... \n");
+            return 2;
+        }
+        argi++;
+    }
+    if (argi < argc && argv[argi][0] != '-') {
+        opt.key_no = (uint8_t)strtoul(argv[argi++], NULL, 0);
+    }
+    if (argi < argc && argv[argi][0] != '-') {
+        opt.counter_file_no = (uint8_t)strtoul(argv[argi++], NULL, 0);
+    }
+    for (; argi < argc; argi++) {
+        if (strcmp(argv[argi], "--provision") == 0) {
+            opt.do_provision = 1;
+        } else if (strcmp(argv[argi], "--provision-key") == 0 && argi + 1 < argc) {
+            opt.provision_key_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--new-keyno") == 0 && argi + 1 < argc) {
+            opt.new_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--key-out") == 0 && argi + 1 < argc) {
+            opt.key_out_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--rotate-key") == 0) {
+            opt.do_rotate_key = 1;
+        } else if (strcmp(argv[argi], "--rotate-keyno") == 0 && argi + 1 < argc) {
+            opt.rotate_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--old-key") == 0 && argi + 1 < argc) {
+            opt.rotate_old_key_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--rotate-new-key") == 0 && argi + 1 < argc) {
+            opt.rotate_new_key_in_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--new-key-out") == 0 && argi + 1 < argc) {
+            opt.rotate_new_key_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--rotate-plan") == 0 && argi + 1 < argc) {
+            if (!parse_rotate_plan(argv[++argi], &opt)) {
+                fprintf(stderr, "--rotate-plan expects all or a comma separated list of key numbers 0..4.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--rotate-journal") == 0 && argi + 1 < argc) {
+            opt.rotate_journal_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--checkpoint") == 0 && argi + 1 < argc) {
+            opt.checkpoint_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-setup") == 0) {
+            opt.do_sdm_setup = 1;
+        } else if (strcmp(argv[argi], "--sdm-verify") == 0) {
+            opt.do_sdm_verify = 1;
+        } else if (strcmp(argv[argi], "--data-file") == 0 && argi + 1 < argc) {
+            opt.data_file_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--read-data") == 0) {
+            opt.do_read_data = 1;
+        } else if (strcmp(argv[argi], "--write-data") == 0 && argi + 1 < argc) {
+            opt.write_data_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-url") == 0 && argi + 1 < argc) {
+            opt.sdm_base_url = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-params") == 0 && argi + 1 < argc) {
+            if (!ntag424_sdm_template_parse(argv[++argi], &opt.sdm_tpl)) {
+                fprintf(stderr, "--sdm-params expects e.g. uid,ctr,mac or picc=e,enc,mac=m "
+                                "(mac required, picc excludes uid/ctr, enc before mac).\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--sdm-keyno") == 0 && argi + 1 < argc) {
+            opt.sdm_key_no = (uint8_t)strtoul(argv[++argi], NULL, 0);
+        } else if (strcmp(argv[argi], "--reader") == 0 && argi + 1 < argc) {
+            opt.reader_name = argv[++argi];
+        } else if (strcmp(argv[argi], "--daemon") == 0) {
+            opt.daemon = 1;
+        } else if (strcmp(argv[argi], "--all-readers") == 0) {
+            opt.all_readers = 1;
+            opt.daemon = 1;
+        } else if (strcmp(argv[argi], "--emulate") == 0 && argi + 1 < argc) {
+            opt.emulate_count = strtoul(argv[++argi], NULL, 0);
+            if (opt.emulate_count == 0) {
+                fprintf(stderr, "--emulate expects a tag count.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--emulate-threads") == 0 && argi + 1 < argc) {
+            opt.emulate_threads = (unsigned)strtoul(argv[++argi], NULL, 0);
+            if (opt.emulate_threads == 0 || opt.emulate_threads > 256) {
+                fprintf(stderr, "--emulate-threads expects 1..256.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc) {
+            opt.jobs_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--verify-urls") == 0 && argi + 1 < argc) {
+            opt.verify_urls_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-key") == 0 && argi + 1 < argc) {
+            opt.sdm_file_key_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-meta-key") == 0 && argi + 1 < argc) {
+            opt.sdm_meta_key_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sdm-enc-data") == 0 && argi + 1 < argc) {
+            opt.sdm_enc_data = argv[++argi];
+            if (strlen(opt.sdm_enc_data) > NTAG424_SDM_ENC_DATA_LEN) {
+                fprintf(stderr, "--sdm-enc-data takes at most %d bytes.\n", NTAG424_SDM_ENC_DATA_LEN);
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--format") == 0 && argi + 1 < argc) {
+            const char *fmt = argv[++argi];
+            if (strcmp(fmt, "text") == 0) {
+                g_output_format = OUTPUT_TEXT;
+            } else if (strcmp(fmt, "json") == 0) {
+                g_output_format = OUTPUT_JSON;
+            } else if (strcmp(fmt, "binary") == 0) {
+                g_output_format = OUTPUT_BINARY;
+            } else {
+                fprintf(stderr, "--format expects text, json or binary.\n");
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--apdu-stats") == 0) {
+            g_apdu_stats = 1;
+        } else if (strcmp(argv[argi], "--apdu-stats-csv") == 0 && argi + 1 < argc) {
+            g_apdu_stats = 1;
+            opt.apdu_stats_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--apdu-trace") == 0) {
+            g_apdu_trace = 1;
+        } else if (strcmp(argv[argi], "--ext-apdu") == 0) {
+            opt.ext_apdu = 1;
+        } else if (strcmp(argv[argi], "--rf-rate") == 0 && argi + 1 < argc) {
+            const char *rate = argv[++argi];
+            unsigned long kbps = strcmp(rate, "max") == 0 ? 848 : strtoul(rate, NULL, 10);
+            if (kbps != 106 && kbps != 212 && kbps != 424 && kbps != 848) {
+                fprintf(stderr, "--rf-rate expects 106, 212, 424, 848 or max.\n");
+                return 2;
+            }
+            opt.rf_divisor = (unsigned)(kbps / 106);
+        } else if (strcmp(argv[argi], "--counter-only") == 0) {
+            opt.counter_only = 1;
+        } else if (strcmp(argv[argi], "--audit-csv") == 0 && argi + 1 < argc) {
+            opt.audit_csv_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--cache") == 0 && argi + 1 < argc) {
+            opt.cache_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--key-db") == 0 && argi + 1 < argc) {
+            opt.key_db_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--div-key") == 0 && argi + 1 < argc) {
+            if (!read_key_file(argv[++argi], opt.div_master)) {
+                fprintf(stderr, "Failed to read diversification master key: %s\n", argv[argi]);
+                return 2;
+            }
+            opt.diversify = 1;
+        } else if (strcmp(argv[argi], "--div-sysid") == 0 && argi + 1 < argc) {
+            if (!parse_hex_bytes(argv[++argi], opt.div_sysid, sizeof(opt.div_sysid), &opt.div_sysid_len)) {
+                fprintf(stderr, "--div-sysid expects up to %zu bytes of hex.\n", sizeof(opt.div_sysid));
+                return 2;
+            }
+        } else if (strcmp(argv[argi], "--ops") == 0 && argi + 1 < argc) {
+            if (!parse_ops_list(argv[++argi], &opt)) {
+                fprintf(stderr, "--ops expects a comma separated list of provision, rotate, sdm-setup, counter, rotate-plan, "
+                                "sdm-verify, write-data, read-data (at most %d).\n", MAX_TAG_OPS);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[argi]);
+            fprintf(stderr, "Usage: %s [reader_index] [auth_key_hex] [auth_key_no] [file_no] "
+                            "[--provision] [--provision-key PATH] [--new-keyno N] [--key-out PATH] "
+                            "[--rotate-key] [--rotate-keyno N] [--old-key PATH] [--rotate-new-key PATH] [--new-key-out PATH] "
+                            "[--rotate-plan LIST] [--rotate-journal PATH] [--checkpoint PATH] "
+                            "[--sdm-setup] [--sdm-verify] [--write-data PATH] [--read-data] [--data-file N] [--sdm-url URL] [--sdm-params LIST] [--sdm-enc-data TEXT] [--sdm-keyno N] [--reader NAME] [--daemon] [--all-readers] [--emulate N] [--emulate-threads N] [--jobs PATH] "
+                            "[--verify-urls FILE|-] [--sdm-key PATH] [--sdm-meta-key PATH] [--ops LIST] [--counter-only] [--audit-csv PATH] [--cache PATH] [--key-db PATH] [--div-key PATH] [--div-sysid HEX] [--ext-apdu] [--rf-rate KBPS|max] [--format text|json|binary] [--apdu-stats] [--apdu-stats-csv PATH] [--apdu-trace]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (opt.do_provision && opt.do_rotate_key) {
+        fprintf(stderr, "Choose either --provision or --rotate-key (not both).\n");
+        return 2;
+    }
+    if (opt.ops_count > 0 && (opt.do_provision || opt.do_rotate_key || opt.do_sdm_setup || opt.do_sdm_verify ||
+                              opt.do_read_data)) {
+        fprintf(stderr, "--ops replaces --provision, --rotate-key, --sdm-setup, --sdm-verify and --read-data.\n");
+        return 2;
+    }
+    if (opt.rotate_plan_count > 0 && (opt.do_rotate_key || opt.rotate_new_key_in_path || opt.rotate_new_key_path)) {
+        fprintf(stderr, "--rotate-plan chooses its own new keys; drop --rotate-key, --rotate-new-key and --new-key-out.\n");
+        return 2;
+    }
+    if (opt.ops_count > 0 && (memchr(opt.ops, TAG_OP_ROTATE_PLAN, opt.ops_count) != NULL) != (opt.rotate_plan_count > 0)) {
+        fprintf(stderr, "--ops rotate-plan and --rotate-plan LIST go together.\n");
+        return 2;
+    }
+    if (opt.ops_count > 0 && (memchr(opt.ops, TAG_OP_WRITE_DATA, opt.ops_count) != NULL) != (opt.write_data_path != NULL)) {
+        fprintf(stderr, "--ops write-data and --write-data PATH go together.\n");
+        return 2;
+    }
+    if (opt.reader_name && opt.all_readers) {
+        fprintf(stderr, "--reader selects one reader; --all-readers serves every reader.\n");
+        return 2;
+    }
+    if (opt.emulate_count > 0 && (opt.daemon || opt.reader_name)) {
+        fprintf(stderr, "--emulate replaces the readers; drop --reader, --daemon and --all-readers.\n");
+        return 2;
+    }
+    if (opt.rotate_journal_path && opt.rotate_plan_count == 0) {
+        fprintf(stderr, "--rotate-journal requires --rotate-plan.\n");
+        return 2;
+    }
+    if (opt.checkpoint_path && !opt.do_provision && !opt.do_sdm_setup &&
+        !memchr(opt.ops, TAG_OP_PROVISION, opt.ops_count) && !memchr(opt.ops, TAG_OP_SDM_SETUP, opt.ops_count)) {
+        fprintf(stderr, "--checkpoint requires --provision or --sdm-setup (or those --ops).\n");
+        return 2;
+    }
+    if (opt.key_db_path && (opt.key_out_path || opt.rotate_new_key_path)) {
+        fprintf(stderr, "--key-db stores generated keys; drop --key-out and --new-key-out.\n");
+        return 2;
+    }
+    if (opt.counter_only && (opt.ops_count > 0 || opt.do_provision || opt.do_rotate_key || opt.do_sdm_setup ||
+                             opt.do_sdm_verify || opt.do_read_data || opt.write_data_path || opt.rotate_plan_count > 0)) {
+        fprintf(stderr, "--counter-only cannot be combined with --ops, --provision, --rotate-key, --rotate-plan, --sdm-setup, "
+                        "--sdm-verify, --read-data or --write-data.\n");
+        return 2;
+    }
+
+    if (opt.sdm_file_key_path) {
+        if (!read_key_file(opt.sdm_file_key_path, opt.sdm_file_key)) {
+            fprintf(stderr, "Failed to read SDM key file: %s\n", opt.sdm_file_key_path);
+            return 2;
+        }
+        opt.has_sdm_file_key = 1;
+    }
+    if (opt.sdm_meta_key_path) {
+        if (!read_key_file(opt.sdm_meta_key_path, opt.sdm_meta_key)) {
+            fprintf(stderr, "Failed to read SDM meta key file: %s\n", opt.sdm_meta_key_path);
+            return 2;
+        }
+        opt.has_sdm_meta_key = 1;
+    }
+    if (opt.write_data_path && !read_data_file(opt.write_data_path, &opt.write_data, &opt.write_data_len)) {
+        fprintf(stderr, "Failed to read --write-data file (1..%d bytes): %s\n", MAX_WRITE_DATA, opt.write_data_path);
+        return 2;
+    }
+    if (opt.verify_urls_path) {
+        if (!opt.has_sdm_file_key) {
+            fprintf(stderr, "--verify-urls requires --sdm-key PATH.\n");
+            return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+        }
+        return cli_cleanup(&opt, NULL, NULL, NULL, run_verify_urls(&opt) ? 0 : 1);
+    }
+
+    if (opt.cache_path && !tag_cache_load(opt.cache_path)) {
+        fprintf(stderr, "Failed to read tag cache: %s\n", opt.cache_path);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+    if (opt.key_db_path && !ntag424_keydb_open(opt.key_db_path, &g_key_db)) {
+        fprintf(stderr, "Failed to open key database: %s\n", opt.key_db_path);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+    if (opt.rotate_journal_path && !rotate_journal_open(opt.rotate_journal_path)) {
+        fprintf(stderr, "Failed to open rotation journal: %s\n", opt.rotate_journal_path);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+    if (opt.checkpoint_path && !checkpoint_open(opt.checkpoint_path)) {
+        fprintf(stderr, "Failed to open checkpoint file: %s\n", opt.checkpoint_path);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+    if (opt.audit_csv_path && !audit_open(opt.audit_csv_path)) {
+        fprintf(stderr, "Failed to open audit file: %s\n", opt.audit_csv_path);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+    if ((g_output_format != OUTPUT_TEXT || g_audit) && !result_stage_start()) {
+        fprintf(stderr, "Out of memory.\n");
+        return cli_cleanup(&opt, NULL, NULL, NULL, 2);
+    }
+
+    if (opt.emulate_count > 0) {
+        job_queue_t queue;
+        memset(&queue, 0, sizeof(queue));
+        pthread_mutex_init(&queue.lock, NULL);
+        if (opt.jobs_path && !job_queue_load(&queue, opt.jobs_path)) {
+            fprintf(stderr, "Failed to read job file: %s\n", opt.jobs_path);
+            return cli_cleanup(&opt, &queue, NULL, NULL, 2);
+        }
+        signal(SIGINT, handle_stop_signal);
+        signal(SIGTERM, handle_stop_signal);
+        int ok = run_emulated(&opt, &queue);
+        cli_report(&opt);
+        return cli_cleanup(&opt, &queue, NULL, NULL, ok ? 0 : 1);
+    }
+
+    ntag424_context_t *ctx;
+    if (!open_context(&ctx, &rc)) {
+        fprintf(stderr, "SCardEstablishContext failed: 0x%08lX\n", (unsigned long)rc);
+        return cli_cleanup(&opt, NULL, NULL, NULL, 1);
+    }
+
+    char *readers = NULL;
+    if (!opt.all_readers && !ntag424_context_list_readers(ctx, &readers, &rc)) {
+        fprintf(stderr, "No PC/SC readers found.\n");
+        return cli_cleanup(&opt, NULL, NULL, ctx, 1);
+    }
+
+    job_queue_t queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    if (opt.jobs_path) {
+        if (!opt.daemon) {
+            fprintf(stderr, "--jobs requires --daemon, --all-readers or --emulate.\n");
+            return cli_cleanup(&opt, &queue, readers, ctx, 2);
+        }
+        if (!job_queue_load(&queue, opt.jobs_path)) {
+            fprintf(stderr, "Failed to read job file: %s\n", opt.jobs_path);
+            return cli_cleanup(&opt, &queue, readers, ctx, 2);
+        }
+    }
+    if (opt.daemon) {
+        signal(SIGINT, handle_stop_signal);
+        signal(SIGTERM, handle_stop_signal);
+    }
+
+    if (opt.all_readers) {
+        int ok = run_all_readers(ctx, &opt, &queue);
+        cli_report(&opt);
+        return cli_cleanup(&opt, &queue, readers, ctx, ok ? 0 : 1);
+    }
+
+    char *selected = opt.reader_name ? find_reader_by_name(readers, opt.reader_name) : NULL;
+    char *p = readers;
+    int i = 0;
+    while (*p) {
+        if (!opt.reader_name && i == index) {
+            selected = p;
+            break;
+        }
+        p += strlen(p) + 1;
+        i++;
+    }
+
+    if (!selected && opt.reader_name) {
+        fprintf(stderr, "No reader named or starting with \"%s\" (or the prefix is ambiguous).\n", opt.reader_name);
+        return cli_cleanup(&opt, &queue, readers, ctx, 1);
+    }
+    if (!selected) {
+        fprintf(stderr, "Reader index out of range. Available: 0..%d\n", i - 1);
+        return cli_cleanup(&opt, &queue, readers, ctx, 1);
+    }
+
+    fprintf(status_stream(), "Using reader: %s\n", selected);
+
+    int status = 0;
+    if (opt.daemon) {
+        status = run_daemon(ctx, selected, &opt, &queue) ? 0 : 1;
+    } else {
+        ntag424_card_t *card;
+        if (!connect_card(ctx, selected, &card)) return cli_cleanup(&opt, &queue, readers, ctx, 1);
+        run_tag_pipeline(card, &opt);
+        ntag424_card_disconnect(card);
+    }
+    cli_report(&opt);
+    return cli_cleanup(&opt, &queue, readers, ctx, status);
+}
+